@@ -0,0 +1,871 @@
+/*
+ *  cache.c - Cache of tunes and rendered audio
+ *
+ *  SIDPlayer (C) Copyright 1996-2004 Christian Bauer
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+
+/*
+ *  Rendered audio is stored in one file per cache key, named after the
+ *  key. A file contains a header, the audio data from the start of the
+ *  song, and the machine state after that data, so a stream can be served
+ *  from the mapped file (i.e. from the page cache) without emulating
+ *  anything, and rendering can continue where the cached data ends.
+ *
+ *  Entries are written to a temporary file which is renamed when the
+ *  entry is finished, so readers only ever see complete entries. Opening
+ *  an entry touches its modification time; when the cache grows beyond
+ *  its size budget, the entries with the oldest modification time are
+ *  removed (files that are still mapped stay valid until they are closed).
+ *  The size of the cache is kept as a running total, so the directory is
+ *  only scanned when it is over budget, and never while holding the lock.
+ *
+ *  In front of the files there is a memory tier with its own size budget,
+ *  holding the data of PSID files (checked against their modification
+ *  time and size), the machine state of songs right after their init
+ *  routine ran, and the audio of recently finished entries with the state
+ *  after it. Its entries are kept in least recently used order and are
+ *  reference counted, so an evicted entry stays valid while it is open.
+ *  A song found in the memory tier starts without reading the PSID file
+ *  or running the init routine again.
+ */
+
+#include "sys.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+
+#include "cache.h"
+#include "prefs.h"
+#include "main.h"
+
+#define DEBUG 0
+#include "debug.h"
+
+
+// Magic number and version of cache files
+static const char CACHE_MAGIC[8] = "TSIDPCM1";
+
+// Version of the emulation, part of every cache key (must be increased
+// whenever a change of the emulation changes the rendered audio or the
+// saved machine state, so entries of older versions are no longer found)
+#define EMULATION_VERSION 4
+
+// Preferences items that affect the rendered audio
+static const char *key_prefs[] = {
+    "samplerate", "audio16bit", "stereo", "sidtype", "victype", "filters",
+    "dualsid", "audioeffect", "revdelay", "revfeedback", "volume",
+    "v1volume", "v2volume", "v3volume", "v4volume",
+    "v1pan", "v2pan", "v3pan", "v4pan", "dualsep", "speed", "skipsilence",
+    "loopmemory", NULL
+};
+
+// Header of cache file, followed by the audio data and the machine state
+typedef struct cache_header cache_header;
+struct cache_header {
+    char magic[8];
+    uint64 key;
+    uint64 data_length;            // Length of audio data (starts after header)
+    uint64 state_offset;        // Position and length of machine state
+    uint64 state_length;
+};
+
+// Types of memory tier entries
+enum {
+    MEM_TUNE,        // Data of PSID file
+    MEM_AUDIO        // Audio data followed by the machine state after it (no audio = state after init routine)
+};
+
+// Memory tier entry
+typedef struct mem_entry mem_entry;
+struct mem_entry {
+    mem_entry *hash_next;
+    mem_entry *prev, *next;        // Least recently used list, most recent first
+    int type;
+    uint64 key;                    // Cache key, or hash of path of PSID file
+    int refs;                    // Open cache entries, plus one while in the memory tier
+    size_t size;                // Memory used by entry
+    uint8 *data;
+    size_t length;                // Length of file data or audio data
+    size_t state_offset;        // Position of machine state in data (MEM_AUDIO)
+    char *path;                    // Path, modification time and size of PSID file (MEM_TUNE)
+    struct timespec mtime;
+    off_t file_size;
+    uint64 data_hash;            // Hash of magic number and file data (MEM_TUNE)
+};
+
+struct cache_entry {
+    cache_key key;
+    const uint8 *data;            // Audio data
+    size_t length;
+    const machine_state *state;    // Machine state after audio data
+    void *map;                    // Mapped file (NULL = memory tier entry)
+    size_t map_size;
+    mem_entry *mem;                // Memory tier entry (NULL = file)
+};
+
+struct cache_writer {
+    int fd;                        // Temporary file (-1 = memory tier only)
+    char *tmp_path;                // Name of temporary file
+    cache_key key;
+    uint64 length;                // Length of audio data written so far
+    bool error;                    // Flag: write error, discard file
+    uint8 *mem_data;            // Copy of audio data for memory tier (NULL = doesn't fit)
+    size_t mem_alloc;
+};
+
+// Cache directory (NULL = disabled) and size budget
+static char *cache_dir = NULL;
+static uint64 cache_max_size;
+
+// Memory tier: hash table and least recently used list of entries, size
+// budget (0 = disabled) and memory used
+#define MEM_HASH_SIZE 4096
+static mem_entry *mem_hash[MEM_HASH_SIZE];
+static mem_entry *mem_head = NULL, *mem_tail = NULL;
+static uint64 mem_max_size = 0, mem_size = 0;
+
+// Lock for cache size, temporary file numbering and the memory tier
+static pthread_mutex_t cache_lock = PTHREAD_MUTEX_INITIALIZER;
+static int tmp_count = 0;
+
+// Size of all entry files (recounted by every eviction scan) and flag:
+// eviction scan running
+static uint64 cache_size = 0;
+static bool evicting = false;
+
+// Prototypes
+static void evict();
+static void mem_remove(mem_entry *e);
+
+
+/*
+ *  64-bit FNV-1a hash
+ */
+
+#define HASH_INIT 0xcbf29ce484222325ULL
+
+static uint64 hash_data(uint64 h, const void *data, size_t length)
+{
+    const uint8 *p = data;
+    while (length--) {
+        h ^= *p++;
+        h *= 0x100000001b3ULL;
+    }
+    return h;
+}
+
+static uint64 hash_int(uint64 h, int32 x)
+{
+    return hash_data(h, &x, sizeof(x));
+}
+
+
+/*
+ *  Init/exit cache
+ */
+
+static bool has_suffix(const char *name, const char *suffix)
+{
+    size_t n = strlen(name), s = strlen(suffix);
+    return n > s && strcmp(name + n - s, suffix) == 0;
+}
+
+void CacheInit(const char *dir, uint64 max_size, uint64 mem_max)
+{
+    CacheExit();
+    mem_max_size = mem_max;
+    if (dir == NULL)
+        return;
+
+    mkdir(dir, 0777);
+    DIR *d = opendir(dir);
+    if (d == NULL) {
+        fprintf(stderr, "Couldn't open cache directory '%s', cache disabled\n", dir);
+        return;
+    }
+    cache_dir = strdup(dir);
+    cache_max_size = max_size;
+
+    // Remove temporary files left over from a crash
+    struct dirent *de;
+    while ((de = readdir(d)) != NULL)
+        if (has_suffix(de->d_name, ".tmp")) {
+            char path[1024];
+            snprintf(path, sizeof(path), "%s/%s", cache_dir, de->d_name);
+            unlink(path);
+        }
+    closedir(d);
+    evict();
+}
+
+void CacheExit()
+{
+    free(cache_dir);
+    cache_dir = NULL;
+
+    pthread_mutex_lock(&cache_lock);
+    while (mem_head)
+        mem_remove(mem_head);
+    mem_max_size = 0;
+    pthread_mutex_unlock(&cache_lock);
+}
+
+
+/*
+ *  Memory tier (cache_lock must be held)
+ */
+
+// Largest audio data of an entry in the memory tier (as for files, 1/8 of the budget)
+static uint64 mem_max_length()
+{
+    return mem_max_size / 8;
+}
+
+static mem_entry **mem_bucket(uint64 key)
+{
+    return &mem_hash[(key ^ (key >> 32)) % MEM_HASH_SIZE];
+}
+
+static void mem_unlink_lru(mem_entry *e)
+{
+    if (e->prev)
+        e->prev->next = e->next;
+    else
+        mem_head = e->next;
+    if (e->next)
+        e->next->prev = e->prev;
+    else
+        mem_tail = e->prev;
+}
+
+static void mem_link_lru(mem_entry *e)
+{
+    e->prev = NULL;
+    e->next = mem_head;
+    if (mem_head)
+        mem_head->prev = e;
+    else
+        mem_tail = e;
+    mem_head = e;
+}
+
+static void mem_unref(mem_entry *e)
+{
+    if (--e->refs == 0) {
+        free(e->data);
+        free(e->path);
+        free(e);
+    }
+}
+
+// Find entry and mark it as most recently used, returns NULL if not present
+static mem_entry *mem_find(int type, uint64 key, const char *path)
+{
+    mem_entry *e;
+    for (e = *mem_bucket(key); e; e = e->hash_next)
+        if (e->type == type && e->key == key && (path == NULL || strcmp(e->path, path) == 0)) {
+            mem_unlink_lru(e);
+            mem_link_lru(e);
+            return e;
+        }
+    return NULL;
+}
+
+// Remove entry from memory tier (it is freed when it's no longer open)
+static void mem_remove(mem_entry *e)
+{
+    mem_entry **p = mem_bucket(e->key);
+    while (*p != e)
+        p = &(*p)->hash_next;
+    *p = e->hash_next;
+    mem_unlink_lru(e);
+    mem_size -= e->size;
+    mem_unref(e);
+}
+
+// Add new entry (replacing an entry with the same key), then remove least
+// recently used entries until the memory tier fits into its budget (the
+// new entry always stays)
+static void mem_insert(mem_entry *e)
+{
+    mem_entry *old;
+    for (old = *mem_bucket(e->key); old; old = old->hash_next)
+        if (old->type == e->type && old->key == e->key && (e->path == NULL || strcmp(old->path, e->path) == 0)) {
+            mem_remove(old);
+            break;
+        }
+
+    e->refs = 1;
+    e->size += sizeof(mem_entry);
+    mem_entry **bucket = mem_bucket(e->key);
+    e->hash_next = *bucket;
+    *bucket = e;
+    mem_link_lru(e);
+    mem_size += e->size;
+
+    while (mem_size > mem_max_size && mem_tail != e) {
+        D(bug("memory cache entry %016llx evicted\n", (unsigned long long)mem_tail->key));
+        mem_remove(mem_tail);
+    }
+}
+
+// Get entry of PSID file on disk, reading the file if it isn't cached or
+// has changed, returns NULL if it is not a PSID file or can't be cached
+// (unlike the other functions, this one must be called without holding
+// cache_lock, so the file is never read under the lock; the caller gets a
+// reference which it releases with mem_unref())
+static mem_entry *mem_get_tune(const char *file)
+{
+    struct stat st;
+    if (mem_max_size == 0 || stat(file, &st) < 0 || !S_ISREG(st.st_mode))
+        return NULL;
+
+    uint64 key = hash_data(HASH_INIT, file, strlen(file));
+    pthread_mutex_lock(&cache_lock);
+    mem_entry *e = mem_find(MEM_TUNE, key, file);
+    if (e && e->file_size == st.st_size && e->mtime.tv_sec == st.st_mtim.tv_sec && e->mtime.tv_nsec == st.st_mtim.tv_nsec)
+        e->refs++;
+    else
+        e = NULL;
+    pthread_mutex_unlock(&cache_lock);
+    if (e)
+        return e;
+
+    size_t length;
+    uint8 *data = ReadPSIDFile(file, &length);
+    int songs, default_song;
+    char name[33], author[33], copyright[33];
+    if (data == NULL || !GetPSIDInfo(data, length, &songs, &default_song, name, author, copyright)) {
+        free(data);
+        return NULL;
+    }
+    e = calloc(1, sizeof(mem_entry));
+    if (e == NULL || (e->path = strdup(file)) == NULL) {
+        free(e);
+        free(data);
+        return NULL;
+    }
+    uint8 *p = realloc(data, length ? length : 1);
+    e->data = p ? p : data;
+    e->type = MEM_TUNE;
+    e->key = key;
+    e->length = length;
+    e->size = length + strlen(file) + 1;
+    e->mtime = st.st_mtim;
+    e->file_size = st.st_size;
+    e->data_hash = hash_data(hash_data(HASH_INIT, CACHE_MAGIC, sizeof(CACHE_MAGIC)), e->data, length);
+
+    // Replaces the stale entry, or one inserted by another thread meanwhile
+    pthread_mutex_lock(&cache_lock);
+    mem_insert(e);
+    e->refs++;
+    pthread_mutex_unlock(&cache_lock);
+    return e;
+}
+
+// Add audio data (of length bytes, in a buffer of at least length bytes
+// that is taken over) and machine state after it, unless there is a
+// longer entry with the same key
+static void mem_put_audio(cache_key key, uint8 *data, size_t length, const machine_state *state)
+{
+    mem_entry *old = mem_find(MEM_AUDIO, key, NULL);
+    size_t state_length = MachineStateSize();
+    size_t state_offset = (length + 7) & ~(size_t)7;
+    mem_entry *e = NULL;
+    uint8 *p = NULL;
+    if ((old == NULL || old->length < length) && length <= mem_max_length()) {
+        e = calloc(1, sizeof(mem_entry));
+        p = realloc(data, state_offset + state_length);
+    }
+    if (e == NULL || p == NULL) {
+        free(e);
+        free(p ? p : data);
+        return;
+    }
+    memcpy(p + state_offset, state, state_length);
+    e->type = MEM_AUDIO;
+    e->key = key;
+    e->data = p;
+    e->length = length;
+    e->state_offset = state_offset;
+    e->size = state_offset + state_length;
+    mem_insert(e);
+    D(bug("memory cache entry %016llx stored, %llu bytes\n", (unsigned long long)key, (unsigned long long)length));
+}
+
+
+/*
+ *  Compute cache key
+ */
+
+bool CacheMakeKey(const char *file, int song, cache_key *key)
+{
+    if (cache_dir == NULL && mem_max_size == 0)
+        return false;
+
+    // Hash file data (cached in memory tier for files on disk)
+    uint64 h = hash_data(HASH_INIT, CACHE_MAGIC, sizeof(CACHE_MAGIC));
+    int songs, default_song;
+    char name[33], author[33], copyright[33];
+    size_t length;
+    const uint8 *packed = FindPackedPSIDFile(file, &length);
+    if (packed) {
+        if (!GetPSIDInfo(packed, length, &songs, &default_song, name, author, copyright))
+            return false;
+        h = hash_data(h, packed, length);
+    } else {
+        mem_entry *e = mem_get_tune(file);
+        if (e) {
+            h = e->data_hash;
+            pthread_mutex_lock(&cache_lock);
+            mem_unref(e);
+            pthread_mutex_unlock(&cache_lock);
+        } else {
+            uint8 *data = ReadPSIDFile(file, &length);
+            if (data == NULL || !GetPSIDInfo(data, length, &songs, &default_song, name, author, copyright)) {
+                free(data);
+                return false;
+            }
+            h = hash_data(h, data, length);
+            free(data);
+        }
+    }
+    h = hash_int(h, song);
+    h = hash_int(h, EMULATION_VERSION);
+    h = hash_int(h, MachineStateSize());    // Layout of saved state
+
+    const char **p;
+    for (p = key_prefs; *p; p++) {
+        const char *str = PrefsFindString(*p, 0);
+        if (str)
+            h = hash_data(h, str, strlen(str) + 1);
+        h = hash_int(h, PrefsFindBool(*p));
+        h = hash_int(h, PrefsFindInt32(*p));
+    }
+
+    *key = h;
+    return true;
+}
+
+
+/*
+ *  Load PSID file for playing from the memory tier
+ */
+
+bool CacheLoadPSIDFile(const char *file)
+{
+    size_t length;
+    if (FindPackedPSIDFile(file, &length) == NULL) {
+        mem_entry *e = mem_get_tune(file);
+        if (e) {
+            bool ok = LoadPSIDData(e->data, e->length);
+            pthread_mutex_lock(&cache_lock);
+            mem_unref(e);
+            pthread_mutex_unlock(&cache_lock);
+            return ok;
+        }
+    }
+    return LoadPSIDFile(file);
+}
+
+
+/*
+ *  Store machine state after init routine in memory tier
+ */
+
+void CachePutState(cache_key key, const machine_state *state)
+{
+    pthread_mutex_lock(&cache_lock);
+    if (mem_max_size && mem_find(MEM_AUDIO, key, NULL) == NULL)
+        mem_put_audio(key, NULL, 0, state);
+    pthread_mutex_unlock(&cache_lock);
+}
+
+
+/*
+ *  Open/close cache entry
+ */
+
+static void entry_path(char *path, size_t size, cache_key key)
+{
+    snprintf(path, size, "%s/%016llx.pcm", cache_dir, (unsigned long long)key);
+}
+
+static cache_entry *open_mem(mem_entry *m)
+{
+    cache_entry *e = calloc(1, sizeof(cache_entry));
+    if (e == NULL)
+        return NULL;
+    e->key = m->key;
+    e->data = m->data;
+    e->length = m->length;
+    e->state = (const machine_state *)(m->data + m->state_offset);
+    e->mem = m;
+    D(bug("memory cache hit %016llx, %llu bytes\n", (unsigned long long)m->key, (unsigned long long)m->length));
+    return e;
+}
+
+static cache_entry *open_file(cache_key key)
+{
+    char path[1024];
+    entry_path(path, sizeof(path), key);
+    int fd = open(path, O_RDONLY);
+    if (fd < 0)
+        return NULL;
+
+    struct stat st;
+    void *map = MAP_FAILED;
+    if (fstat(fd, &st) == 0 && st.st_size >= (off_t)sizeof(cache_header))
+        map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    if (map == MAP_FAILED) {
+        close(fd);
+        return NULL;
+    }
+    futimens(fd, NULL);        // Mark as recently used
+    close(fd);
+
+    // Check header
+    const cache_header *h = map;
+    if (memcmp(h->magic, CACHE_MAGIC, sizeof(CACHE_MAGIC)) || h->key != key
+     || h->state_length != MachineStateSize() || h->state_offset < sizeof(cache_header)
+     || h->data_length > h->state_offset - sizeof(cache_header)
+     || h->state_offset + h->state_length > (uint64)st.st_size) {
+        munmap(map, st.st_size);
+        return NULL;
+    }
+
+    cache_entry *e = calloc(1, sizeof(cache_entry));
+    if (e == NULL) {
+        munmap(map, st.st_size);
+        return NULL;
+    }
+    e->key = key;
+    e->data = (const uint8 *)map + sizeof(cache_header);
+    e->length = h->data_length;
+    e->state = (const machine_state *)((const uint8 *)map + h->state_offset);
+    e->map = map;
+    e->map_size = st.st_size;
+    D(bug("cache hit %016llx, %llu bytes\n", (unsigned long long)key, (unsigned long long)h->data_length));
+    return e;
+}
+
+cache_entry *CacheOpen(cache_key key)
+{
+    // Memory tier first, files are only checked for more than the state after the init routine
+    pthread_mutex_lock(&cache_lock);
+    mem_entry *m = mem_find(MEM_AUDIO, key, NULL);
+    if (m)
+        m->refs++;
+    pthread_mutex_unlock(&cache_lock);
+    cache_entry *e = NULL;
+    if (m && (m->length > 0 || cache_dir == NULL))
+        e = open_mem(m);
+    else if (cache_dir && (e = open_file(key)) == NULL && m)
+        e = open_mem(m);
+    if (m && (e == NULL || e->mem == NULL)) {
+        pthread_mutex_lock(&cache_lock);
+        mem_unref(m);
+        pthread_mutex_unlock(&cache_lock);
+    }
+    return e;
+}
+
+void CacheClose(cache_entry *e)
+{
+    if (e->mem) {
+        pthread_mutex_lock(&cache_lock);
+        mem_unref(e->mem);
+        pthread_mutex_unlock(&cache_lock);
+    } else
+        munmap(e->map, e->map_size);
+    free(e);
+}
+
+cache_key CacheEntryKey(const cache_entry *e)
+{
+    return e->key;
+}
+
+const uint8 *CacheEntryData(const cache_entry *e, size_t *length)
+{
+    *length = e->length;
+    return e->data;
+}
+
+const machine_state *CacheEntryState(const cache_entry *e)
+{
+    return e->state;
+}
+
+
+/*
+ *  Write cache entry
+ */
+
+cache_writer *CacheCreate(cache_key key, const uint8 *data, size_t length)
+{
+    if (cache_dir == NULL && mem_max_size == 0)
+        return NULL;
+
+    cache_writer *w = calloc(1, sizeof(cache_writer));
+    if (w == NULL)
+        return NULL;
+    w->key = key;
+    w->fd = -1;
+
+    if (cache_dir) {
+        pthread_mutex_lock(&cache_lock);
+        int n = tmp_count++;
+        pthread_mutex_unlock(&cache_lock);
+        size_t size = strlen(cache_dir) + 64;
+        w->tmp_path = malloc(size);
+        if (w->tmp_path)
+            snprintf(w->tmp_path, size, "%s/%016llx.%d.%d.tmp", cache_dir, (unsigned long long)key, (int)getpid(), n);
+        w->fd = w->tmp_path ? open(w->tmp_path, O_WRONLY | O_CREAT | O_TRUNC, 0666) : -1;
+        if (w->fd < 0) {
+            free(w->tmp_path);
+            w->tmp_path = NULL;
+        }
+
+        // The header is written when the entry is finished
+        else if (lseek(w->fd, sizeof(cache_header), SEEK_SET) < 0)
+            w->error = true;
+    }
+    if (mem_max_size) {
+        w->mem_alloc = 0x10000;
+        w->mem_data = malloc(w->mem_alloc);
+    }
+    if (w->fd < 0 && w->mem_data == NULL) {
+        free(w);
+        return NULL;
+    }
+
+    if (data)
+        CacheWrite(w, data, length);
+    return w;
+}
+
+bool CacheWrite(cache_writer *w, const uint8 *data, size_t length)
+{
+    // A single entry may use 1/8 of the cache, data that doesn't fit invalidates the entry
+    uint64 max_length = cache_max_size / 8;
+    if (w->fd >= 0 && w->length + length > max_length)
+        w->error = true;
+    if (w->mem_data && w->length + length > mem_max_length()) {
+        free(w->mem_data);
+        w->mem_data = NULL;
+    }
+
+    // Keep copy for memory tier
+    if (w->mem_data) {
+        if (w->length + length > w->mem_alloc) {
+            size_t alloc = w->mem_alloc;
+            while (w->length + length > alloc)
+                alloc *= 2;
+            uint8 *p = realloc(w->mem_data, alloc);
+            if (p == NULL) {
+                free(w->mem_data);
+                w->mem_data = NULL;
+            } else {
+                w->mem_data = p;
+                w->mem_alloc = alloc;
+            }
+        }
+        if (w->mem_data)
+            memcpy(w->mem_data + w->length, data, length);
+    }
+
+    const uint8 *p = data;
+    size_t left = (w->fd >= 0 && !w->error) ? length : 0;
+    while (left) {
+        ssize_t actual = write(w->fd, p, left);
+        if (actual < 0) {
+            w->error = true;
+            break;
+        }
+        p += actual;
+        left -= actual;
+    }
+    w->length += length;
+
+    // Full if the same amount of data doesn't fit again in either tier
+    bool file_fits = w->fd >= 0 && !w->error && w->length + length <= max_length;
+    bool mem_fits = w->mem_data && w->length + length <= mem_max_length();
+    return file_fits || mem_fits;
+}
+
+void CacheFinish(cache_writer *w, const machine_state *state)
+{
+    // Memory tier takes over the copy of the audio data
+    if (w->mem_data) {
+        pthread_mutex_lock(&cache_lock);
+        if (state && w->length > 0)
+            mem_put_audio(w->key, w->mem_data, w->length, state);
+        else
+            free(w->mem_data);
+        pthread_mutex_unlock(&cache_lock);
+    }
+    if (w->fd < 0) {
+        free(w);
+        return;
+    }
+
+    char path[1024];
+    entry_path(path, sizeof(path), w->key);
+
+    // Keep existing entry if it is at least as long
+    bool keep = state && !w->error && w->length > 0;
+    uint64 old_size = 0, new_size = 0;
+    if (keep) {
+        cache_header old;
+        struct stat st;
+        int fd = open(path, O_RDONLY);
+        if (fd >= 0) {
+            if (read(fd, &old, sizeof(old)) == sizeof(old) && memcmp(old.magic, CACHE_MAGIC, sizeof(CACHE_MAGIC)) == 0 && old.data_length >= w->length)
+                keep = false;
+            else if (fstat(fd, &st) == 0)
+                old_size = st.st_size;
+            close(fd);
+        }
+    }
+
+    if (keep) {
+        cache_header h;
+        memset(&h, 0, sizeof(h));
+        memcpy(h.magic, CACHE_MAGIC, sizeof(CACHE_MAGIC));
+        h.key = w->key;
+        h.data_length = w->length;
+        h.state_offset = (sizeof(cache_header) + w->length + 7) & ~7ULL;
+        h.state_length = MachineStateSize();
+        keep = pwrite(w->fd, state, h.state_length, h.state_offset) == (ssize_t)h.state_length
+            && pwrite(w->fd, &h, sizeof(h), 0) == sizeof(h);
+        new_size = h.state_offset + h.state_length;
+    }
+
+    close(w->fd);
+    if (keep && rename(w->tmp_path, path) == 0) {
+        D(bug("cache entry %016llx written, %llu bytes\n", (unsigned long long)w->key, (unsigned long long)w->length));
+
+        // The replaced entry may not be counted if it was written by another process
+        pthread_mutex_lock(&cache_lock);
+        cache_size = (cache_size > old_size ? cache_size - old_size : 0) + new_size;
+        bool over = cache_size > cache_max_size;
+        pthread_mutex_unlock(&cache_lock);
+        if (over)
+            evict();
+    } else
+        unlink(w->tmp_path);
+    free(w->tmp_path);
+    free(w);
+}
+
+
+/*
+ *  Remove least recently used entries until the cache fits into its size budget
+ */
+
+typedef struct {
+    char name[32];
+    uint64 size;
+    struct timespec mtime;
+} file_info;
+
+static int compare_mtime(const void *a, const void *b)
+{
+    const file_info *fa = a, *fb = b;
+    if (fa->mtime.tv_sec != fb->mtime.tv_sec)
+        return fa->mtime.tv_sec < fb->mtime.tv_sec ? -1 : 1;
+    if (fa->mtime.tv_nsec != fb->mtime.tv_nsec)
+        return fa->mtime.tv_nsec < fb->mtime.tv_nsec ? -1 : 1;
+    return 0;
+}
+
+// Scan the cache directory to recount its size, and remove the oldest
+// entries if it is over budget (only one thread scans at a time, the lock
+// is not held during the scan)
+static void evict()
+{
+    pthread_mutex_lock(&cache_lock);
+    bool busy = evicting;
+    evicting = true;
+    pthread_mutex_unlock(&cache_lock);
+    if (busy)
+        return;
+
+    DIR *d = opendir(cache_dir);
+    if (d == NULL) {
+        pthread_mutex_lock(&cache_lock);
+        evicting = false;
+        pthread_mutex_unlock(&cache_lock);
+        return;
+    }
+
+    // Collect entries
+    file_info *files = NULL;
+    int num_files = 0, max_files = 0;
+    uint64 total = 0;
+    struct dirent *de;
+    while ((de = readdir(d)) != NULL) {
+        if (!has_suffix(de->d_name, ".pcm") || strlen(de->d_name) >= sizeof(files->name))
+            continue;
+        char path[1024];
+        struct stat st;
+        snprintf(path, sizeof(path), "%s/%s", cache_dir, de->d_name);
+        if (stat(path, &st) < 0)
+            continue;
+        if (num_files == max_files) {
+            max_files = max_files ? max_files * 2 : 64;
+            file_info *p = realloc(files, max_files * sizeof(file_info));
+            if (p == NULL)
+                break;
+            files = p;
+        }
+        strcpy(files[num_files].name, de->d_name);
+        files[num_files].size = st.st_size;
+        files[num_files].mtime = st.st_mtim;
+        num_files++;
+        total += st.st_size;
+    }
+    closedir(d);
+
+    // Remove oldest entries
+    if (total > cache_max_size) {
+        qsort(files, num_files, sizeof(file_info), compare_mtime);
+        int i;
+        for (i=0; i<num_files && total > cache_max_size; i++) {
+            char path[1024];
+            snprintf(path, sizeof(path), "%s/%s", cache_dir, files[i].name);
+            if (unlink(path) == 0)
+                total -= files[i].size;
+            D(bug("cache entry %s evicted\n", files[i].name));
+        }
+    }
+    free(files);
+
+    pthread_mutex_lock(&cache_lock);
+    cache_size = total;
+    evicting = false;
+    pthread_mutex_unlock(&cache_lock);
+}
@@ -0,0 +1,93 @@
+/*
+ *  cache.h - On-disk cache of rendered audio
+ *
+ *  SIDPlayer (C) Copyright 1996-2004 Christian Bauer
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+
+#ifndef CACHE_H
+#define CACHE_H
+
+#include "types.h"
+#include "main.h"
+
+#include <stddef.h>
+
+
+/*
+ *  Definitions
+ */
+
+// Key of a cache entry (hash of the tune data, song number and all
+// preferences that affect the rendered audio)
+typedef uint64 cache_key;
+
+// Cache entry opened for reading
+typedef struct cache_entry cache_entry;
+
+// Cache entry being written
+typedef struct cache_writer cache_writer;
+
+
+/*
+ *  Functions
+ */
+
+// Init cache in given directory with size budget in bytes (NULL directory =
+// no files), and memory tier with size budget in bytes (0 = disabled)
+extern void CacheInit(const char *dir, uint64 max_size, uint64 mem_max);
+
+// Exit cache
+extern void CacheExit();
+
+// Compute cache key for song of PSID file with current preferences (song 0 =
+// default song), returns false if the cache is disabled or the file can't be
+// read or is not a PSID file
+extern bool CacheMakeKey(const char *file, int song, cache_key *key);
+
+// Load PSID file for playing, with the file data kept in the memory tier
+extern bool CacheLoadPSIDFile(const char *file);
+
+// Store machine state of song right after its init routine ran (before any
+// audio was rendered) in the memory tier, unless there is an entry already
+extern void CachePutState(cache_key key, const machine_state *state);
+
+// Open cache entry (mapped into memory), returns NULL if not present
+extern cache_entry *CacheOpen(cache_key key);
+
+// Close cache entry
+extern void CacheClose(cache_entry *e);
+
+// Get key of entry, rendered audio data of entry, and the machine state
+// after that data (to continue rendering)
+extern cache_key CacheEntryKey(const cache_entry *e);
+extern const uint8 *CacheEntryData(const cache_entry *e, size_t *length);
+extern const machine_state *CacheEntryState(const cache_entry *e);
+
+// Start writing new cache entry, beginning with the given audio data (may be NULL),
+// returns NULL on error
+extern cache_writer *CacheCreate(cache_key key, const uint8 *data, size_t length);
+
+// Append audio data to cache entry, returns false if the entry is full (i.e.
+// the same amount of data wouldn't fit again) or on error, then it has to be finished
+extern bool CacheWrite(cache_writer *w, const uint8 *data, size_t length);
+
+// Finish cache entry with the machine state after the written audio data
+// (NULL = discard entry), replacing a shorter entry with the same key
+extern void CacheFinish(cache_writer *w, const machine_state *state);
+
+#endif
@@ -20,7 +20,9 @@
 
 #include "sys.h"
 
+#include "cpu.h"
 #include "mem.h"
+#include "prefs.h"
 #include "sid.h"
 
 #define DEBUG 0
@@ -34,13 +36,40 @@ typedef void (*mem_write_func)(uint32, uint32, cycle_t, bool);
 static mem_read_func mem_read_table[256];       // Table of read/write functions for 256 pages
 static mem_write_func mem_write_table[256];
 
+// Number of memory writes that changed RAM and of I/O accesses, for
+// detecting infinite loops
+static uint32 mem_changes = 0;
+
+// Cycle of last read of a VIC raster or CIA timer register
+static cycle_t poll_cycle = 0;
+
+// Why the last CPUExecute() call stopped
+int cpu_stop_reason = CPU_STOP_RETURN;
+
 
 // Memory access function prototypes
 static uint32 ram_read(uint32 adr, cycle_t now);
 static void ram_write(uint32 adr, uint32 byte, cycle_t now, bool rmw);
+static uint32 vic_io_read(uint32 adr, cycle_t now);
+static uint32 sid_io_read(uint32 adr, cycle_t now);
+static void sid_io_write(uint32 adr, uint32 byte, cycle_t now, bool rmw);
+static uint32 cia_io_read(uint32 adr, cycle_t now);
 static void cia_write(uint32 adr, uint32 byte, cycle_t now, bool rmw);
 
 
+// Opcode macros (flag definitions are also needed for translated code)
+#include "cpu_macros.h"
+
+// Translation of frequently executed code to x86-64 machine code
+#if defined(__x86_64__) && defined(__linux__)
+#define CPU_JIT 1
+#endif
+
+#ifdef CPU_JIT
+#include "cpu_jit.h"
+#endif
+
+
 /*
  *  Init CPU emulation
  */
@@ -58,8 +87,13 @@ void CPUInit()
 {
     // Set up memory access tables
     set_memory_funcs(0x0000, 0xffff, ram_read, ram_write);
-    set_memory_funcs(0xd400, 0xd7ff, sid_read, sid_write);
-    set_memory_funcs(0xdc00, 0xdcff, ram_read, cia_write);
+    set_memory_funcs(0xd000, 0xd3ff, vic_io_read, ram_write);
+    set_memory_funcs(0xd400, 0xd7ff, sid_io_read, sid_io_write);
+    set_memory_funcs(0xdc00, 0xdcff, cia_io_read, cia_write);
+
+#ifdef CPU_JIT
+    jit_init();
+#endif
 }
 
 
@@ -69,6 +103,9 @@ void CPUInit()
 
 void CPUExit()
 {
+#ifdef CPU_JIT
+    jit_exit();
+#endif
 }
 
 
@@ -83,15 +120,64 @@ static uint32 ram_read(uint32 adr, cycle_t now)
 
 static void ram_write(uint32 adr, uint32 byte, cycle_t now, bool rmw)
 {
-    ram[adr] = byte;
+    if (ram[adr] != byte) {
+        ram[adr] = byte;
+        mem_changes++;
+#ifdef CPU_JIT
+        if (jit_code_map[adr])
+            jit_invalidate(adr);
+#endif
+    }
+}
+
+// VIC raster and CIA timer registers whose value depends on the cycle count
+static inline bool is_poll_register(uint16 adr)
+{
+    if ((adr & 0xfc00) == 0xd000)
+        return (adr & 0x3f) == 0x11 || (adr & 0x3f) == 0x12;
+    else if ((adr & 0xff00) == 0xdc00)
+        return (adr & 0x0f) == 0x04 || (adr & 0x0f) == 0x05 || (adr & 0x0f) == 0x0d;
+    else
+        return false;
+}
+
+static uint32 vic_io_read(uint32 adr, cycle_t now)
+{
+    if (is_poll_register(adr)) {
+        mem_changes++;
+        poll_cycle = now;
+    }
+    return vic_read(adr, now);
+}
+
+static uint32 sid_io_read(uint32 adr, cycle_t now)
+{
+    mem_changes++;
+    return sid_read(adr, now);
+}
+
+static void sid_io_write(uint32 adr, uint32 byte, cycle_t now, bool rmw)
+{
+    mem_changes++;
+    sid_write(adr, byte, now, rmw);
+}
+
+static uint32 cia_io_read(uint32 adr, cycle_t now)
+{
+    if (is_poll_register(adr)) {
+        mem_changes++;
+        poll_cycle = now;
+    }
+    return cia_read(adr, now);
 }
 
 static void cia_write(uint32 adr, uint32 byte, cycle_t now, bool rmw)
 {
+    mem_changes++;
     if (adr == 0xdc04)
-        cia_tl_write(byte);
+        cia_tl_write(byte, now);
     else if (adr == 0xdc05)
-        cia_th_write(byte);
+        cia_th_write(byte, now);
     else
         ram[adr] = byte;
 }
@@ -99,9 +185,112 @@ static void cia_write(uint32 adr, uint32 byte, cycle_t now, bool rmw)
 
 /*
  *  CPU emulation loop
+ *
+ *  Infinite loops (e.g. polling the raster line, which is not emulated)
+ *  are detected at every jump backwards: if the jump goes to the same
+ *  address as the previous one, with the same registers and flags, and
+ *  nothing in memory changed and no I/O register was accessed in between,
+ *  the CPU would repeat the same instructions forever.
  */
 
-void CPUExecute(uint16 startadr, uint8 init_ra, uint8 init_rx, uint8 init_ry, cycle_t max_cycles)
+static inline void ram_store(uint16 adr, uint8 byte)
+{
+    if (ram[adr] != byte) {
+        ram[adr] = byte;
+        mem_changes++;
+#ifdef CPU_JIT
+        if (jit_code_map[adr])
+            jit_invalidate(adr);
+#endif
+    }
+}
+
+/*
+ *  Polling loops of the form
+ *
+ *    loop: LDA/LDX/LDY/BIT poll_register
+ *          [CMP/CPX/CPY/AND #imm]
+ *          Bxx loop
+ *
+ *  only depend on the cycle count, so instead of executing them the clock
+ *  skips ahead to the iteration whose read makes the branch fall through.
+ *  That iteration is then executed normally. Returns the new cycle count
+ *  (max_cycles if the loop doesn't end in time).
+ */
+
+static bool poll_branch_taken(uint8 load, uint8 test, uint8 imm, uint8 branch, uint8 a, uint8 value)
+{
+    uint8 n, v = 0, z, c = 0;
+    if (load == 0x2c) {                    // BIT
+        n = value & 0x80;
+        v = value & 0x40;
+        z = (a & value) == 0;
+    } else if (test == 0x29) {            // AND
+        value &= imm;
+        n = value & 0x80;
+        z = value == 0;
+    } else if (test) {                    // CMP/CPX/CPY
+        n = (value - imm) & 0x80;
+        z = value == imm;
+        c = value >= imm;
+    } else {
+        n = value & 0x80;
+        z = value == 0;
+    }
+
+    bool flag;
+    switch (branch >> 6) {
+        case 0: flag = n; break;
+        case 1: flag = v; break;
+        case 2: flag = c; break;
+        default: flag = z; break;
+    }
+    return (branch & 0x20) ? flag : !flag;
+}
+
+static cycle_t skip_poll_loop(uint16 target, uint16 end, uint8 a, cycle_t now, cycle_t period, cycle_t max_cycles)
+{
+    const uint8 *p = ram + target;
+    uint8 load = p[0];
+    uint16 adr = p[1] | (p[2] << 8);
+    if ((load != 0xad && load != 0xae && load != 0xac && load != 0x2c) || !is_poll_register(adr))
+        return now;
+    p += 3;
+
+    // Optional compare/AND with immediate operand on the loaded register
+    uint8 test = 0, imm = 0;
+    if ((load == 0xad && (p[0] == 0xc9 || p[0] == 0x29)) || (load == 0xae && p[0] == 0xe0) || (load == 0xac && p[0] == 0xc0)) {
+        test = p[0];
+        imm = p[1];
+        p += 2;
+    }
+
+    // Followed by the branch back, which must test a flag set in the loop
+    uint8 branch = p[0];
+    if (p + 2 != ram + end || (branch & 0x1f) != 0x10)
+        return now;
+    if ((branch >> 6) == 1 && load != 0x2c)
+        return now;
+    if ((branch >> 6) == 2 && (test == 0 || test == 0x29))
+        return now;
+
+    // The read of the iteration starting at now + i * period happens at
+    // poll_cycle + (i + 1) * period
+    cycle_t read_ofs = poll_cycle + period - now;
+    uint32 i = 0;
+    for (;;) {
+        if (now + (uint64)i * period >= max_cycles)
+            return max_cycles;
+        cycle_t t = now + i * period + read_ofs;
+        uint8 value = (adr & 0xff00) == 0xdc00 ? cia_peek(adr, t) : vic_read(adr, t);
+        if (!poll_branch_taken(load, test, imm, branch, a, value))
+            return now + i * period;
+        cycle_t next = io_next_change(adr, t);
+        i += (next - t + period - 1) / period;
+    }
+}
+
+cycle_t CPUExecute(uint16 startadr, uint8 init_ra, uint8 init_rx, uint8 init_ry, cycle_t max_cycles)
 {
     // 6510 registers
     register uint8 a = init_ra, x = init_rx, y = init_ry;
@@ -117,6 +306,14 @@ void CPUExecute(uint16 startadr, uint8 init_ra, uint8 init_rx, uint8 init_ry, cy
     // Phi 2 cycle counter
     register cycle_t current_cycle = 0;
 
+    // Target, registers, memory changes and cycle of last jump backwards (for
+    // loop detection)
+    int loop_pc = -1;
+    uint64 loop_regs = 0;
+    uint32 loop_changes = 0;
+    cycle_t loop_cycle = 0;
+    bool quit = false;
+
 #define RA a
 #define RX x
 #define RY y
@@ -137,7 +334,7 @@ void CPUExecute(uint16 startadr, uint8 init_ra, uint8 init_rx, uint8 init_ry, cy
 #define write_byte_rmw(adr, byte) \
     mem_write_table[(adr) >> 8](adr, byte, current_cycle, true)
 #define write_zp(adr, byte) \
-    ram[adr] = (byte)
+    ram_store(adr, byte)
 
 #define read_idle(adr)
 #define read_idle_zp(adr)
@@ -151,28 +348,77 @@ void CPUExecute(uint16 startadr, uint8 init_ra, uint8 init_rx, uint8 init_ry, cy
 { \
     if (sp == 0) \
         quit = true; \
-    (ram + 0x100)[sp--] = (byte); \
+    ram_store(0x100 + sp--, byte); \
 }
 #define pop_byte \
     (sp == 0xff ? (quit = true, 0) : (ram + 0x100)[++sp])
 
 #define jump(adr) \
-    pc = ram + (adr)
+{ \
+    uint16 target = (adr); \
+    if (target < RPC) { \
+        uint64 regs = a | (x << 8) | (y << 16) | ((uint32)sp << 24) | ((uint64)n_flag << 32) | ((uint64)z_flag << 40) | ((uint64)pflags << 48); \
+        if (target == loop_pc && regs == loop_regs && mem_changes == loop_changes) { \
+            cpu_stop_reason = CPU_STOP_LOOP; \
+            quit = true; \
+        } else if (target == loop_pc && RPC - target <= 7 && poll_cycle > loop_cycle) \
+            current_cycle = skip_poll_loop(target, RPC, a, current_cycle, current_cycle - loop_cycle, max_cycles); \
+        loop_pc = target; \
+        loop_regs = regs; \
+        loop_changes = mem_changes; \
+        loop_cycle = current_cycle; \
+    } \
+    pc = ram + target; \
+    jit_count(target); \
+}
 #define inc_pc \
     pc++
 
 #define next_cycle \
     current_cycle++
 
-#include "cpu_macros.h"
+#ifndef CPU_JIT
+#define jit_count(adr)
+#endif
 
     // Jump to specified start address
-    jump(startadr);
-
-    // Main loop: execute opcodes until stack under-/overflow, RTI, illegal opcode, or max_cycles reached
-    bool quit = false;
+    pc = ram + startadr;
+    poll_cycle = 0;
+    cpu_stop_reason = CPU_STOP_RETURN;
+#ifdef CPU_JIT
+    jit_epoch++;
+    jit_count(startadr);
+#endif
+
+    // Main loop: execute opcodes until stack under-/overflow, RTI, illegal
+    // opcode, infinite loop, or max_cycles reached
     while (current_cycle < max_cycles && !quit) {
 
+#ifdef CPU_JIT
+        // Execute translated code if there is a block for this address
+        // which completes before max_cycles
+        jit_block *b = jit_blocks[RPC];
+        if (b)
+            b = jit_check(b);
+        if (b && !(pflags & PFLAG_D) && current_cycle + b->trans->max_cycles <= max_cycles) {
+            jit_regs r;
+            r.a = a; r.x = x; r.y = y;
+            r.cycle = current_cycle;
+            r.n_flag = n_flag; r.z_flag = z_flag; r.pflags = pflags;
+            r.page = b->start & 0xff00;
+            int kind = b->trans->func(&r, ram);
+            a = r.a; x = r.x; y = r.y;
+            current_cycle = r.cycle;
+            n_flag = r.n_flag; z_flag = r.z_flag; pflags = r.pflags;
+            pc = ram + r.pc;
+            if (kind == JIT_EXIT_JUMP) {
+                jump(r.target);
+            } else
+                jit_count(RPC);
+            continue;
+        }
+#endif
+
         // Fetch opcode
         uint8 opcode = read_opcode; inc_pc; next_cycle;
 
@@ -185,4 +431,7 @@ illegal_op:        quit = true;
                 break;
         }
     }
+    if (!quit)
+        cpu_stop_reason = CPU_STOP_CYCLES;
+    return current_cycle;
 }
@@ -24,6 +24,21 @@
 #include "types.h"
 
 
+/*
+ *  Definitions
+ */
+
+// Reasons for CPUExecute() to stop
+enum {
+    CPU_STOP_RETURN,    // Routine returned (or stack under-/overflow, RTI, illegal opcode)
+    CPU_STOP_LOOP,        // Infinite loop detected
+    CPU_STOP_CYCLES        // max_cycles reached
+};
+
+// Why the last CPUExecute() call stopped
+extern int cpu_stop_reason;
+
+
 /*
  *  Functions
  */
@@ -34,7 +49,7 @@ extern void CPUInit();
 // Exit CPU emulation
 extern void CPUExit();
 
-// CPU emulation loop
-extern void CPUExecute(uint16 startadr, uint8 init_ra, uint8 init_rx, uint8 init_ry, cycle_t max_cycles);
+// CPU emulation loop, returns number of cycles executed
+extern cycle_t CPUExecute(uint16 startadr, uint8 init_ra, uint8 init_rx, uint8 init_ry, cycle_t max_cycles);
 
 #endif
@@ -0,0 +1,1431 @@
+/*
+ *  cpu_jit.h - Translation of 6510 code to x86-64 machine code
+ *
+ *  SIDPlayer (C) Copyright 1996-2004 Christian Bauer
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+/*
+ *  This file is included by cpu.c. Code at addresses that are jumped to
+ *  often is translated to blocks of machine code. A block ends at the first
+ *  branch or JMP, or before the first instruction that is not translated
+ *  (stack, interrupt and decimal mode related instructions, JSR/RTS,
+ *  undocumented opcodes), which are left to the interpreter. Blocks keep
+ *  A/X/Y and the cycle counter in host registers, execute with exactly the
+ *  same cycle timing as the interpreter, and read and write the I/O pages
+ *  through the memory access functions.
+ *
+ *  Writes to RAM that hold translated code invalidate the blocks containing
+ *  it, and as RAM may be replaced between two calls of CPUExecute() (e.g.
+ *  when switching machine states), blocks are compared with RAM again at
+ *  their first use in every call.
+ *
+ *  Translations are shared by all code with the same bytes, so they survive
+ *  switching between machine states and are reused by other tunes with the
+ *  same player routines, even if these are relocated by whole pages:
+ *  absolute operands that point to RAM near the code are accessed relative
+ *  to the page of the block start at run time. Translations are looked up
+ *  by a hash of the code bytes (with those operands made relative) and the
+ *  relocation fingerprint (which operands are relative and the low byte of
+ *  the start address, which the page crossing cycles depend on).
+ */
+
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+
+
+/*
+ *  Definitions
+ */
+
+#define JIT_CODE_SIZE 0x400000        // Size of translated code buffer
+#define JIT_MAX_BLOCKS 8192            // Maximum number of translated blocks
+#define JIT_HASH_SIZE 4096            // Number of buckets in translation hash table
+#define JIT_RELOC_PAGES 0x20        // Maximum distance of relative operands from block start (pages)
+#define JIT_RELOC_MIN_PAGE 0x04        // First page of relative operands (below are zero page, stack and system area)
+#define JIT_MAX_INSNS 32            // Maximum number of 6510 instructions per block
+#define JIT_MAX_BYTES 96            // Maximum size of 6510 code per block
+#define JIT_BLOCK_SPACE 0x4000        // Code buffer space needed for translating a block
+#define JIT_THRESHOLD 8                // Number of jumps to an address before it is translated
+#define JIT_MAX_REWRITES 8            // Number of invalidations by writes before address is no longer translated
+#define JIT_MAX_STUBS (2 * JIT_MAX_INSNS)    // Maximum number of exits from the middle of a block
+
+// Register state passed to and from translated code
+typedef struct {
+    uint32 a, x, y;                    // 6510 registers
+    cycle_t cycle;                    // Cycle counter
+    uint8 n_flag, z_flag, pflags;    // Flags
+    uint8 pad;
+    uint32 page;                    // Address of page of block start
+    uint32 pc;                        // Address to continue at
+    uint32 target;                    // Jump target (JIT_EXIT_JUMP)
+} jit_regs;
+
+// How translated code was left
+enum {
+    JIT_EXIT_PC,        // Continue at pc
+    JIT_EXIT_JUMP        // Continue with jump() from pc to target
+};
+
+typedef int (*jit_func)(jit_regs *r, uint8 *mem);
+
+// Translation of 6510 code, shared by all addresses holding that code
+typedef struct jit_trans jit_trans;
+struct jit_trans {
+    jit_trans *next;                // Next translation in hash bucket
+    jit_func func;                    // Entry point of machine code
+    uint32 hash;                    // Hash of code and relocation fingerprint
+    uint16 len;                        // Size of 6510 code
+    uint16 max_cycles;                // Maximum number of cycles executed by block
+    uint8 start_lo;                    // Low byte of start address
+    uint8 code[JIT_MAX_BYTES];        // 6510 code with relative operand high bytes
+    uint8 reloc[JIT_MAX_BYTES];        // Flag: Byte is high byte of relative operand
+};
+
+// Translated block at an address
+typedef struct jit_block jit_block;
+struct jit_block {
+    jit_block *next_free;            // Next unused block descriptor
+    jit_trans *trans;                // Translation
+    uint16 start, len;                // 6510 code covered by block
+    uint32 epoch;                    // Value of jit_epoch when block was last compared with RAM
+    uint8 code[JIT_MAX_BYTES];        // Copy of 6510 code
+};
+
+static bool jit_enabled = false;
+static uint8 *jit_code = NULL;        // Translated code buffer
+static uint8 *jit_p;                // Current emit position in code buffer
+static jit_trans *jit_trans_pool;    // Translation descriptors
+static int jit_trans_used;
+static jit_trans *jit_hash[JIT_HASH_SIZE];    // Translations by hash
+static jit_block *jit_pool;            // Block descriptors
+static int jit_pool_used;
+static jit_block *jit_free_blocks;    // List of removed block descriptors
+static uint32 jit_epoch = 0;        // Incremented for every CPUExecute() call
+static bool jit_code_changed;        // Flag: Write invalidated a block
+
+static jit_block *jit_blocks[0x10000];    // Translated block for every start address
+static uint8 jit_heat[0x10000];            // Number of jumps to every address (255 = never translate)
+static uint8 jit_rewrites[0x10000];        // Number of invalidations of block at every address
+static uint8 jit_code_map[0x10000];        // Number of translated blocks covering every byte
+static uint8 jit_io_read_page[0x100];    // Flag: Page is not read as plain RAM
+static uint8 jit_io_write_page[0x100];    // Flag: Page is not written as plain RAM
+
+static void jit_invalidate(uint32 adr);
+
+
+/*
+ *  Memory access from translated code
+ */
+
+static uint32 jit_read(uint32 adr, cycle_t now)
+{
+    return mem_read_table[adr >> 8](adr, now);
+}
+
+// Returns true if write invalidated translated code
+static uint32 jit_write(uint32 adr, uint32 byte, cycle_t now, bool rmw)
+{
+    jit_code_changed = false;
+    mem_write_table[adr >> 8](adr, byte, now, rmw);
+    return jit_code_changed;
+}
+
+
+/*
+ *  x86-64 code emission
+ */
+
+// Host registers
+enum {
+    X86_RAX, X86_RCX, X86_RDX, X86_RBX, X86_RSP, X86_RBP, X86_RSI, X86_RDI,
+    X86_R8, X86_R9, X86_R10, X86_R11, X86_R12, X86_R13, X86_R14, X86_R15
+};
+
+#define H_RAM X86_RBX        // Base of 6510 RAM
+#define H_REGS X86_RBP        // jit_regs
+#define H_CYCLE X86_R12        // Cycle counter (without static cycles of current block position)
+#define H_A X86_R13            // 6510 registers
+#define H_X X86_R14
+#define H_Y X86_R15
+
+#define NO_INDEX -1
+
+// Condition codes
+enum {
+    CC_B = 2, CC_AE = 3, CC_E = 4, CC_NE = 5, CC_BE = 6, CC_A = 7
+};
+
+// Group 1 ALU operations (opcode for "op r/m32, r32" and /digit for immediates)
+enum {
+    ALU_ADD = 0, ALU_OR = 1, ALU_AND = 4, ALU_SUB = 5, ALU_XOR = 6, ALU_CMP = 7
+};
+
+static inline void emit8(uint8 b)
+{
+    *jit_p++ = b;
+}
+
+static inline void emit32(uint32 v)
+{
+    memcpy(jit_p, &v, 4);
+    jit_p += 4;
+}
+
+static inline void emit64(uint64 v)
+{
+    memcpy(jit_p, &v, 8);
+    jit_p += 8;
+}
+
+// Instruction with register operand "rm" (byte_op forces a REX prefix so
+// that registers 4..7 are SPL..DIL and not AH..BH)
+static void emit_rr(int w, bool byte_op, uint32 opcode, int oplen, int reg, int rm)
+{
+    uint8 rex = 0x40 | (w << 3) | ((reg & 8) >> 1) | ((rm & 8) >> 3);
+    if (rex != 0x40 || byte_op)
+        emit8(rex);
+    while (oplen--)
+        emit8(opcode >> (oplen * 8));
+    emit8(0xc0 | ((reg & 7) << 3) | (rm & 7));
+}
+
+// Instruction with memory operand [base + index + disp]
+static void emit_rm(int w, bool byte_op, uint32 opcode, int oplen, int reg, int base, int index, int32 disp)
+{
+    uint8 rex = 0x40 | (w << 3) | ((reg & 8) >> 1) | (index >= 0 ? (index & 8) >> 2 : 0) | ((base & 8) >> 3);
+    if (rex != 0x40 || byte_op)
+        emit8(rex);
+    while (oplen--)
+        emit8(opcode >> (oplen * 8));
+    if (index < 0 && (base & 7) != X86_RSP) {
+        emit8(0x80 | ((reg & 7) << 3) | (base & 7));
+    } else {
+        emit8(0x84 | ((reg & 7) << 3));
+        emit8(((index < 0 ? X86_RSP : index) & 7) << 3 | (base & 7));
+    }
+    emit32(disp);
+}
+
+static void emit_mov_ri(int reg, uint32 imm)
+{
+    if (reg & 8)
+        emit8(0x41);
+    emit8(0xb8 + (reg & 7));
+    emit32(imm);
+}
+
+static void emit_mov_rr(int dst, int src)
+{
+    emit_rr(0, false, 0x89, 1, src, dst);
+}
+
+static void emit_alu_rr(int alu, int dst, int src)
+{
+    emit_rr(0, false, alu * 8 + 1, 1, src, dst);
+}
+
+static void emit_alu_ri(int alu, int dst, uint32 imm)
+{
+    emit_rr(0, false, 0x81, 1, alu, dst);
+    emit32(imm);
+}
+
+static void emit_test_ri(int dst, uint32 imm)
+{
+    emit_rr(0, false, 0xf7, 1, 0, dst);
+    emit32(imm);
+}
+
+static void emit_shift_ri(bool left, int dst, uint8 count)
+{
+    emit_rr(0, false, 0xc1, 1, left ? 4 : 5, dst);
+    emit8(count);
+}
+
+static void emit_movzx_rr8(int dst, int src)
+{
+    emit_rr(0, true, 0x0fb6, 2, dst, src);
+}
+
+static void emit_movzx_rm8(int dst, int base, int index, int32 disp)
+{
+    emit_rm(0, false, 0x0fb6, 2, dst, base, index, disp);
+}
+
+static void emit_mov_m8r(int base, int index, int32 disp, int src)
+{
+    emit_rm(0, true, 0x88, 1, src, base, index, disp);
+}
+
+static void emit_lea(int dst, int base, int index, int32 disp)
+{
+    emit_rm(0, false, 0x8d, 1, dst, base, index, disp);
+}
+
+static void emit_setcc(int cc, int dst)
+{
+    emit_rr(0, true, 0x0f90 + cc, 2, 0, dst);
+}
+
+static void emit_mov_r64_imm(int reg, const void *ptr)
+{
+    emit8(0x48 | ((reg & 8) >> 3));
+    emit8(0xb8 + (reg & 7));
+    emit64((uint64)(uintptr_t)ptr);
+}
+
+static void emit_call(const void *func)
+{
+    emit_mov_r64_imm(X86_RAX, func);
+    emit8(0xff); emit8(0xd0);            // call rax
+}
+
+// Conditional/unconditional jump with 32 bit displacement, returns address
+// of displacement to be patched
+static uint8 *emit_jcc(int cc)
+{
+    emit8(0x0f); emit8(0x80 + cc);
+    emit32(0);
+    return jit_p - 4;
+}
+
+static uint8 *emit_jmp()
+{
+    emit8(0xe9);
+    emit32(0);
+    return jit_p - 4;
+}
+
+static void patch_jump(uint8 *disp, const uint8 *target)
+{
+    int32 rel = target - (disp + 4);
+    memcpy(disp, &rel, 4);
+}
+
+// Byte operations on jit_regs fields
+#define REG_OFS(field) ((int32)offsetof(jit_regs, field))
+
+static void emit_regs_and8(int32 ofs, uint8 imm)
+{
+    emit_rm(0, false, 0x80, 1, ALU_AND, H_REGS, NO_INDEX, ofs);
+    emit8(imm);
+}
+
+static void emit_regs_or8(int32 ofs, uint8 imm)
+{
+    emit_rm(0, false, 0x80, 1, ALU_OR, H_REGS, NO_INDEX, ofs);
+    emit8(imm);
+}
+
+static void emit_regs_test8(int32 ofs, uint8 imm)
+{
+    emit_rm(0, false, 0xf6, 1, 0, H_REGS, NO_INDEX, ofs);
+    emit8(imm);
+}
+
+
+/*
+ *  Block translation state
+ */
+
+// Exit from the middle of a block (after an instruction that wrote to code)
+typedef struct {
+    uint8 *disp;        // Jump to be patched
+    bool invalidate;    // Flag: Call jit_invalidate() with address in ECX
+    uint16 pc;            // Address of next instruction
+    int pending;        // Static cycles at the end of the instruction
+} jit_stub;
+
+static uint16 block_start;            // Start address at translation time
+static uint32 block_page;            // Page of block start at translation time
+static const uint8 *block_reloc;    // Relative operand flags of block
+static bool rel_operand;            // Flag: Absolute operand of current instruction is relative
+static bool nz_live;                // Flag: N/Z result of current instruction is used
+static int nz_reg;                    // Host register holding N/Z result of current instruction (-1 = none)
+static int carry_state;                // Carry flag if known (-1 = unknown)
+static int pending;                    // Cycles since H_CYCLE was last updated
+static int extra_cycles;            // Page crossing cycles that may have been added to H_CYCLE
+static int block_max_cycles;
+static uint8 *epilogue;
+static jit_stub stubs[JIT_MAX_STUBS];
+static int num_stubs, first_open_stub;
+
+// Add exit stub for jump at disp (finished at the end of the instruction)
+static void add_stub(uint8 *disp, bool invalidate)
+{
+    jit_stub *s = stubs + num_stubs++;
+    s->disp = disp;
+    s->invalidate = invalidate;
+}
+
+static void note_cycles()
+{
+    if (pending + extra_cycles > block_max_cycles)
+        block_max_cycles = pending + extra_cycles;
+}
+
+// Store address relative to block page in jit_regs field
+static void emit_store_rel_adr(int32 ofs, uint16 adr)
+{
+    emit_rm(0, false, 0x8b, 1, X86_RAX, H_REGS, NO_INDEX, REG_OFS(page));
+    emit_alu_ri(ALU_ADD, X86_RAX, adr - block_page);
+    emit_alu_ri(ALU_AND, X86_RAX, 0xffff);
+    emit_rm(0, false, 0x89, 1, X86_RAX, H_REGS, NO_INDEX, ofs);
+}
+
+// Leave block, continuing at pc (or with jump() to target, which is
+// absolute unless rel_target)
+static void emit_exit(int kind, uint16 pc, uint16 target, bool rel_target, int cycles)
+{
+    if (cycles)
+        emit_alu_ri(ALU_ADD, H_CYCLE, cycles);
+    emit_store_rel_adr(REG_OFS(pc), pc);
+    if (kind == JIT_EXIT_JUMP) {
+        if (rel_target)
+            emit_store_rel_adr(REG_OFS(target), target);
+        else {
+            emit_rm(0, false, 0xc7, 1, 0, H_REGS, NO_INDEX, REG_OFS(target));
+            emit32(target);
+        }
+    }
+    emit_mov_ri(X86_RAX, kind);
+    patch_jump(emit_jmp(), epilogue);
+}
+
+// Load address relative to block page into ECX
+static void emit_rel_adr(uint16 adr)
+{
+    emit_rm(0, false, 0x8b, 1, X86_RCX, H_REGS, NO_INDEX, REG_OFS(page));
+    emit_alu_ri(ALU_ADD, X86_RCX, adr - block_page);
+}
+
+// Set N and Z flags from byte register (unless overwritten before use)
+static void emit_set_nz(int reg)
+{
+    nz_reg = reg;
+    if (!nz_live)
+        return;
+    emit_mov_m8r(H_REGS, NO_INDEX, REG_OFS(n_flag), reg);
+    emit_mov_m8r(H_REGS, NO_INDEX, REG_OFS(z_flag), reg);
+}
+
+// Set status flag from condition code
+static void emit_set_flag(uint8 flag, int cc)
+{
+    emit_setcc(cc, X86_R8);
+    if (flag == PFLAG_V) {
+        emit_rr(0, true, 0xc0, 1, 4, X86_R8);        // shl r8b, 6
+        emit8(6);
+    }
+    emit_regs_and8(REG_OFS(pflags), ~flag);
+    emit_rm(0, true, 0x08, 1, X86_R8, H_REGS, NO_INDEX, REG_OFS(pflags));    // or [pflags], r8b
+}
+
+// Get carry flag into reg (0 or 1)
+static void emit_get_carry(int reg)
+{
+    emit_movzx_rm8(reg, H_REGS, NO_INDEX, REG_OFS(pflags));
+    emit_alu_ri(ALU_AND, reg, 1);
+}
+
+// Add dynamic page crossing cycle if reg >= 0x100
+static void emit_page_cross(int reg)
+{
+    emit_alu_ri(ALU_CMP, reg, 0x100);
+    uint8 *skip = emit_jcc(CC_B);
+    emit_rr(0, false, 0xff, 1, 0, H_CYCLE);        // inc r12d
+    patch_jump(skip, jit_p);
+    extra_cycles++;
+}
+
+// Flag: Indexed accesses with base address in page can only reach plain
+// RAM (reading or writing)
+static bool ram_pages(uint8 page, bool write)
+{
+    uint8 next = page + 1;
+    if (write)
+        return !jit_io_write_page[page] && !jit_io_write_page[next];
+    else
+        return !jit_io_read_page[page] && !jit_io_read_page[next];
+}
+
+// Read byte at address in ECX into EAX
+static void emit_read_dynamic()
+{
+    emit_mov_rr(X86_RAX, X86_RCX);
+    emit_shift_ri(false, X86_RAX, 8);
+    emit_mov_r64_imm(X86_RDX, jit_io_read_page);
+    emit_rm(0, false, 0x80, 1, ALU_CMP, X86_RDX, X86_RAX, 0); emit8(0);
+    uint8 *slow = emit_jcc(CC_NE);
+    emit_movzx_rm8(X86_RAX, H_RAM, X86_RCX, 0);
+    uint8 *done = emit_jmp();
+    patch_jump(slow, jit_p);
+    emit_mov_rr(X86_RDI, X86_RCX);
+    emit_lea(X86_RSI, H_CYCLE, NO_INDEX, pending);
+    emit_call(jit_read);
+    emit_movzx_rr8(X86_RAX, X86_RAX);
+    patch_jump(done, jit_p);
+}
+
+// Read byte at constant (or relative RAM) address into EAX
+static void emit_read_const(uint16 adr, bool rel)
+{
+    if (rel) {
+        emit_rm(0, false, 0x8b, 1, X86_RCX, H_REGS, NO_INDEX, REG_OFS(page));
+        emit_movzx_rm8(X86_RAX, H_RAM, X86_RCX, adr - block_page);
+    } else if (jit_io_read_page[adr >> 8]) {
+        emit_mov_ri(X86_RDI, adr);
+        emit_lea(X86_RSI, H_CYCLE, NO_INDEX, pending);
+        emit_call(mem_read_table[adr >> 8]);
+        emit_movzx_rr8(X86_RAX, X86_RAX);
+    } else
+        emit_movzx_rm8(X86_RAX, H_RAM, NO_INDEX, adr);
+}
+
+// Store EAX to RAM at address in ECX
+static void emit_store_ram()
+{
+    emit_movzx_rm8(X86_RDX, H_RAM, X86_RCX, 0);
+    emit_alu_rr(ALU_CMP, X86_RDX, X86_RAX);
+    uint8 *same = emit_jcc(CC_E);
+    emit_mov_m8r(H_RAM, X86_RCX, 0, X86_RAX);
+    emit_mov_r64_imm(X86_RDX, &mem_changes);
+    emit_rm(0, false, 0xff, 1, 0, X86_RDX, NO_INDEX, 0);        // inc dword [rdx]
+    emit_mov_r64_imm(X86_RDX, jit_code_map);
+    emit_rm(0, false, 0x80, 1, ALU_CMP, X86_RDX, X86_RCX, 0); emit8(0);
+    add_stub(emit_jcc(CC_NE), true);
+    patch_jump(same, jit_p);
+}
+
+// Write EAX through memory access function to address in ECX
+static void emit_write_call(bool rmw)
+{
+    emit_mov_rr(X86_RDI, X86_RCX);
+    emit_mov_rr(X86_RSI, X86_RAX);
+    emit_lea(X86_RDX, H_CYCLE, NO_INDEX, pending);
+    emit_mov_ri(X86_RCX, rmw);
+    emit_call(jit_write);
+    emit_rr(0, false, 0x85, 1, X86_RAX, X86_RAX);            // test eax, eax
+    add_stub(emit_jcc(CC_NE), false);
+}
+
+// Write EAX to address in ECX (inline if it is in RAM)
+static void emit_write_dynamic(bool rmw)
+{
+    emit_mov_rr(X86_RDX, X86_RCX);
+    emit_shift_ri(false, X86_RDX, 8);
+    emit_mov_r64_imm(X86_R8, jit_io_write_page);
+    emit_rm(0, false, 0x80, 1, ALU_CMP, X86_R8, X86_RDX, 0); emit8(0);
+    uint8 *slow = emit_jcc(CC_NE);
+    emit_store_ram();
+    uint8 *done = emit_jmp();
+    patch_jump(slow, jit_p);
+    emit_write_call(rmw);
+    patch_jump(done, jit_p);
+}
+
+// Write EAX to address in ECX with indexed base address in page
+static void emit_write_indexed(uint8 page, bool rmw)
+{
+    if (ram_pages(page, true))
+        emit_store_ram();
+    else if (mem_write_table[page] == sid_io_write && mem_write_table[(uint8)(page + 1)] == sid_io_write) {
+        emit_mov_rr(X86_RDI, X86_RCX);
+        emit_mov_rr(X86_RSI, X86_RAX);
+        emit_lea(X86_RDX, H_CYCLE, NO_INDEX, pending);
+        emit_mov_ri(X86_RCX, rmw);
+        emit_call(sid_io_write);
+    } else
+        emit_write_call(rmw);
+}
+
+// Write EAX to constant (or relative RAM) address
+static void emit_write_const(uint16 adr, bool rmw, bool rel)
+{
+    if (rel) {
+        emit_rel_adr(adr);
+        emit_store_ram();
+    } else if (mem_write_table[adr >> 8] == ram_write) {
+        emit_mov_ri(X86_RCX, adr);
+        emit_store_ram();
+    } else {
+        emit_mov_ri(X86_RDI, adr);
+        emit_mov_rr(X86_RSI, X86_RAX);
+        emit_lea(X86_RDX, H_CYCLE, NO_INDEX, pending);
+        emit_mov_ri(X86_RCX, rmw);
+        emit_call(mem_write_table[adr >> 8]);
+    }
+}
+
+
+/*
+ *  Instruction translation
+ */
+
+// Addressing modes
+enum {
+    AM_NONE, AM_IMP, AM_IMM, AM_ZP, AM_ZPX, AM_ZPY, AM_ABS, AM_ABSX, AM_ABSY, AM_INDX, AM_INDY, AM_REL
+};
+
+// Operations
+enum {
+    OP_NONE,
+    OP_LDA, OP_LDX, OP_LDY, OP_STA, OP_STX, OP_STY,
+    OP_ORA, OP_AND, OP_EOR, OP_ADC, OP_SBC, OP_CMP, OP_CPX, OP_CPY, OP_BIT,
+    OP_ASL, OP_LSR, OP_ROL, OP_ROR, OP_INC, OP_DEC,
+    OP_TAX, OP_TXA, OP_TAY, OP_TYA, OP_INX, OP_DEX, OP_INY, OP_DEY,
+    OP_CLC, OP_SEC, OP_CLV, OP_NOP,
+    OP_BPL, OP_BMI, OP_BVC, OP_BVS, OP_BCC, OP_BCS, OP_BNE, OP_BEQ, OP_JMP
+};
+
+typedef struct {
+    uint8 op, mode;
+} jit_insn;
+
+static jit_insn jit_insns[256];
+
+static const uint8 insn_len[] = {0, 1, 2, 2, 2, 2, 3, 3, 3, 2, 2, 2};
+
+static void def_insns(uint8 op, const uint8 *modes, const uint8 *opcodes, int n)
+{
+    while (n--) {
+        jit_insns[opcodes[n]].op = op;
+        jit_insns[opcodes[n]].mode = modes[n];
+    }
+}
+
+static void jit_init_insns()
+{
+    // Group 1 (ORA..SBC): (zp,X), zp, #imm, abs, (zp),Y, zp,X, abs,Y, abs,X
+    static const uint8 g1_modes[8] = {AM_INDX, AM_ZP, AM_IMM, AM_ABS, AM_INDY, AM_ZPX, AM_ABSY, AM_ABSX};
+    static const uint8 g1_ops[8] = {OP_ORA, OP_AND, OP_EOR, OP_ADC, OP_STA, OP_LDA, OP_CMP, OP_SBC};
+    int i, j;
+    for (i=0; i<8; i++)
+        for (j=0; j<8; j++) {
+            if (g1_ops[i] == OP_STA && g1_modes[j] == AM_IMM)
+                continue;
+            jit_insns[(i << 5) | (j << 2) | 1].op = g1_ops[i];
+            jit_insns[(i << 5) | (j << 2) | 1].mode = g1_modes[j];
+        }
+
+    // Shifts and INC/DEC: zp, abs, zp,X, abs,X
+    static const uint8 rmw_modes[4] = {AM_ZP, AM_ABS, AM_ZPX, AM_ABSX};
+    static const uint8 asl[4] = {0x06, 0x0e, 0x16, 0x1e}, rol[4] = {0x26, 0x2e, 0x36, 0x3e};
+    static const uint8 lsr[4] = {0x46, 0x4e, 0x56, 0x5e}, ror[4] = {0x66, 0x6e, 0x76, 0x7e};
+    static const uint8 dec[4] = {0xc6, 0xce, 0xd6, 0xde}, inc[4] = {0xe6, 0xee, 0xf6, 0xfe};
+    def_insns(OP_ASL, rmw_modes, asl, 4);
+    def_insns(OP_ROL, rmw_modes, rol, 4);
+    def_insns(OP_LSR, rmw_modes, lsr, 4);
+    def_insns(OP_ROR, rmw_modes, ror, 4);
+    def_insns(OP_DEC, rmw_modes, dec, 4);
+    def_insns(OP_INC, rmw_modes, inc, 4);
+
+    // X/Y loads, stores and compares
+    static const uint8 ldx_modes[5] = {AM_IMM, AM_ZP, AM_ZPY, AM_ABS, AM_ABSY}, ldx[5] = {0xa2, 0xa6, 0xb6, 0xae, 0xbe};
+    static const uint8 ldy_modes[5] = {AM_IMM, AM_ZP, AM_ZPX, AM_ABS, AM_ABSX}, ldy[5] = {0xa0, 0xa4, 0xb4, 0xac, 0xbc};
+    static const uint8 stx_modes[3] = {AM_ZP, AM_ZPY, AM_ABS}, stx[3] = {0x86, 0x96, 0x8e};
+    static const uint8 sty_modes[3] = {AM_ZP, AM_ZPX, AM_ABS}, sty[3] = {0x84, 0x94, 0x8c};
+    static const uint8 cp_modes[3] = {AM_IMM, AM_ZP, AM_ABS}, cpx[3] = {0xe0, 0xe4, 0xec}, cpy[3] = {0xc0, 0xc4, 0xcc};
+    static const uint8 bit_modes[2] = {AM_ZP, AM_ABS}, bit[2] = {0x24, 0x2c};
+    def_insns(OP_LDX, ldx_modes, ldx, 5);
+    def_insns(OP_LDY, ldy_modes, ldy, 5);
+    def_insns(OP_STX, stx_modes, stx, 3);
+    def_insns(OP_STY, sty_modes, sty, 3);
+    def_insns(OP_CPX, cp_modes, cpx, 3);
+    def_insns(OP_CPY, cp_modes, cpy, 3);
+    def_insns(OP_BIT, bit_modes, bit, 2);
+
+    // Implied, accumulator and branches
+    static const struct { uint8 opcode, op, mode; } single[] = {
+        {0x0a, OP_ASL, AM_IMP}, {0x2a, OP_ROL, AM_IMP}, {0x4a, OP_LSR, AM_IMP}, {0x6a, OP_ROR, AM_IMP},
+        {0xaa, OP_TAX, AM_IMP}, {0x8a, OP_TXA, AM_IMP}, {0xa8, OP_TAY, AM_IMP}, {0x98, OP_TYA, AM_IMP},
+        {0xe8, OP_INX, AM_IMP}, {0xca, OP_DEX, AM_IMP}, {0xc8, OP_INY, AM_IMP}, {0x88, OP_DEY, AM_IMP},
+        {0x18, OP_CLC, AM_IMP}, {0x38, OP_SEC, AM_IMP}, {0xb8, OP_CLV, AM_IMP}, {0xea, OP_NOP, AM_IMP},
+        {0x10, OP_BPL, AM_REL}, {0x30, OP_BMI, AM_REL}, {0x50, OP_BVC, AM_REL}, {0x70, OP_BVS, AM_REL},
+        {0x90, OP_BCC, AM_REL}, {0xb0, OP_BCS, AM_REL}, {0xd0, OP_BNE, AM_REL}, {0xf0, OP_BEQ, AM_REL},
+        {0x4c, OP_JMP, AM_ABS}
+    };
+    for (i=0; i<(int)(sizeof(single) / sizeof(single[0])); i++) {
+        jit_insns[single[i].opcode].op = single[i].op;
+        jit_insns[single[i].opcode].mode = single[i].mode;
+    }
+}
+
+// Compute operand address into ECX for dynamic modes (dynamic page crossing
+// cycle only if read), returns true if the address is constant
+static bool emit_operand_adr(int mode, const uint8 *p, bool read)
+{
+    uint8 zp = p[1];
+    switch (mode) {
+        case AM_ZP:
+        case AM_ABS:
+            return true;
+        case AM_ZPX:
+        case AM_ZPY:
+            emit_lea(X86_RCX, mode == AM_ZPX ? H_X : H_Y, NO_INDEX, zp);
+            emit_movzx_rr8(X86_RCX, X86_RCX);
+            pending++;                        // Idle read
+            return false;
+        case AM_ABSX:
+        case AM_ABSY:
+            emit_lea(X86_RCX, mode == AM_ABSX ? H_X : H_Y, NO_INDEX, p[1]);
+            if (read)
+                emit_page_cross(X86_RCX);
+            else
+                pending++;                    // Idle read
+            if (rel_operand) {
+                emit_rm(0, false, 0x03, 1, X86_RCX, H_REGS, NO_INDEX, REG_OFS(page));    // add ecx, [page]
+                emit_alu_ri(ALU_ADD, X86_RCX, (p[2] << 8) - block_page);
+            } else
+                emit_alu_ri(ALU_ADD, X86_RCX, p[2] << 8);
+            emit_alu_ri(ALU_AND, X86_RCX, 0xffff);
+            return false;
+        case AM_INDX:
+            emit_lea(X86_RDX, H_X, NO_INDEX, zp);
+            emit_movzx_rr8(X86_RCX, X86_RDX);
+            emit_movzx_rm8(X86_RCX, H_RAM, X86_RCX, 0);
+            emit_alu_ri(ALU_ADD, X86_RDX, 1);
+            emit_movzx_rr8(X86_RDX, X86_RDX);
+            emit_movzx_rm8(X86_RDX, H_RAM, X86_RDX, 0);
+            emit_shift_ri(true, X86_RDX, 8);
+            emit_alu_rr(ALU_OR, X86_RCX, X86_RDX);
+            pending += 3;                    // Idle read, two pointer reads
+            return false;
+        case AM_INDY:
+            emit_movzx_rm8(X86_RDX, H_RAM, NO_INDEX, zp);
+            emit_alu_rr(ALU_ADD, X86_RDX, H_Y);
+            emit_movzx_rm8(X86_RCX, H_RAM, NO_INDEX, (zp + 1) & 0xff);
+            emit_shift_ri(true, X86_RCX, 8);
+            emit_alu_rr(ALU_ADD, X86_RCX, X86_RDX);
+            emit_alu_ri(ALU_AND, X86_RCX, 0xffff);
+            pending += 2;                    // Two pointer reads
+            if (read)
+                emit_page_cross(X86_RDX);
+            else
+                pending++;                    // Idle read
+            return false;
+    }
+    return true;
+}
+
+// Read operand into EAX
+static void emit_read_operand(int mode, const uint8 *p)
+{
+    uint16 abs = p[1] | (p[2] << 8);
+    pending++;                                // Operand fetch
+    switch (mode) {
+        case AM_IMM:
+            emit_mov_ri(X86_RAX, p[1]);
+            return;
+        case AM_ZP:
+            emit_movzx_rm8(X86_RAX, H_RAM, NO_INDEX, p[1]);
+            pending++;
+            return;
+        case AM_ABS:
+            pending++;                        // High byte fetch
+            emit_read_const(abs, rel_operand);
+            pending++;
+            return;
+        case AM_ABSX:
+        case AM_ABSY:
+            pending++;
+            break;
+    }
+    emit_operand_adr(mode, p, true);
+    if (mode == AM_ZPX || mode == AM_ZPY || ((mode == AM_ABSX || mode == AM_ABSY) && ram_pages(p[2], false)))
+        emit_movzx_rm8(X86_RAX, H_RAM, X86_RCX, 0);
+    else
+        emit_read_dynamic();
+    pending++;
+}
+
+// Store EAX to operand
+static void emit_write_operand(int mode, const uint8 *p)
+{
+    uint16 abs = p[1] | (p[2] << 8);
+    pending++;                                // Operand fetch
+    switch (mode) {
+        case AM_ZP:
+            emit_mov_ri(X86_RCX, p[1]);
+            emit_store_ram();
+            break;
+        case AM_ABS:
+            pending++;
+            emit_write_const(abs, false, rel_operand);
+            break;
+        case AM_ZPX:
+        case AM_ZPY:
+            emit_operand_adr(mode, p, false);
+            emit_store_ram();
+            break;
+        case AM_ABSX:
+        case AM_ABSY:
+            pending++;
+            emit_operand_adr(mode, p, false);
+            emit_write_indexed(p[2], false);
+            break;
+        default:
+            emit_operand_adr(mode, p, false);
+            emit_write_dynamic(false);
+            break;
+    }
+    pending++;
+}
+
+// Shift or increment/decrement byte in register (result truncated to 8 bits)
+static void emit_rmw_op(int op, int reg)
+{
+    switch (op) {
+        case OP_ASL:
+            emit_test_ri(reg, 0x80);
+            emit_set_flag(PFLAG_C, CC_NE);
+            emit_alu_rr(ALU_ADD, reg, reg);
+            break;
+        case OP_LSR:
+            emit_test_ri(reg, 0x01);
+            emit_set_flag(PFLAG_C, CC_NE);
+            emit_shift_ri(false, reg, 1);
+            break;
+        case OP_ROL:
+            emit_get_carry(X86_R9);
+            emit_test_ri(reg, 0x80);
+            emit_set_flag(PFLAG_C, CC_NE);
+            emit_alu_rr(ALU_ADD, reg, reg);
+            emit_alu_rr(ALU_OR, reg, X86_R9);
+            break;
+        case OP_ROR:
+            emit_get_carry(X86_R9);
+            emit_shift_ri(true, X86_R9, 7);
+            emit_test_ri(reg, 0x01);
+            emit_set_flag(PFLAG_C, CC_NE);
+            emit_shift_ri(false, reg, 1);
+            emit_alu_rr(ALU_OR, reg, X86_R9);
+            break;
+        case OP_INC:
+            emit_alu_ri(ALU_ADD, reg, 1);
+            break;
+        case OP_DEC:
+            emit_alu_ri(ALU_SUB, reg, 1);
+            break;
+    }
+    emit_movzx_rr8(reg, reg);
+}
+
+static void emit_rmw(int op, int mode, const uint8 *p)
+{
+    uint16 abs = p[1] | (p[2] << 8);
+    pending++;                                // Operand fetch
+    switch (mode) {
+        case AM_ZP:
+        case AM_ZPX:
+            if (mode == AM_ZP)
+                emit_mov_ri(X86_RCX, p[1]);
+            else
+                emit_operand_adr(mode, p, false);
+            emit_movzx_rm8(X86_RAX, H_RAM, X86_RCX, 0);
+            pending++;
+            emit_rmw_op(op, X86_RAX);
+            emit_set_nz(X86_RAX);
+            pending++;
+            emit_store_ram();
+            break;
+        case AM_ABS:
+            pending++;
+            emit_read_const(abs, rel_operand);
+            pending++;
+            emit_rmw_op(op, X86_RAX);
+            emit_set_nz(X86_RAX);
+            pending++;
+            emit_write_const(abs, true, rel_operand);
+            nz_reg = -1;
+            break;
+        case AM_ABSX:
+            pending++;
+            emit_operand_adr(mode, p, false);
+            if (ram_pages(p[2], false) && ram_pages(p[2], true)) {
+                emit_movzx_rm8(X86_RAX, H_RAM, X86_RCX, 0);
+                pending++;
+                emit_rmw_op(op, X86_RAX);
+                emit_set_nz(X86_RAX);
+                pending++;
+                emit_store_ram();
+            } else {
+                emit_rm(0, false, 0x89, 1, X86_RCX, X86_RSP, NO_INDEX, 0);        // mov [rsp], ecx
+                emit_read_dynamic();
+                emit_rm(0, false, 0x8b, 1, X86_RCX, X86_RSP, NO_INDEX, 0);        // mov ecx, [rsp]
+                pending++;
+                emit_rmw_op(op, X86_RAX);
+                emit_set_nz(X86_RAX);
+                pending++;
+                emit_write_indexed(p[2], true);
+                nz_reg = -1;
+            }
+            break;
+    }
+    pending++;
+}
+
+// Compare register with EAX
+static void emit_compare(int reg)
+{
+    emit_mov_rr(X86_R10, reg);
+    emit_alu_rr(ALU_SUB, X86_R10, X86_RAX);
+    emit_set_nz(X86_R10);
+    emit_alu_ri(ALU_CMP, X86_R10, 0x100);
+    emit_set_flag(PFLAG_C, CC_B);
+}
+
+// Binary mode ADC/SBC with EAX (decimal mode is never translated)
+static void emit_adc(bool sbc)
+{
+    emit_mov_rr(X86_R10, H_A);
+    if (carry_state >= 0) {                // Carry known (e.g. CLC/ADC)
+        emit_alu_rr(sbc ? ALU_SUB : ALU_ADD, X86_R10, X86_RAX);
+        if (sbc && carry_state == 0)
+            emit_alu_ri(ALU_SUB, X86_R10, 1);
+        else if (!sbc && carry_state == 1)
+            emit_alu_ri(ALU_ADD, X86_R10, 1);
+    } else {
+        emit_get_carry(X86_R9);
+        if (sbc) {
+            emit_alu_ri(ALU_XOR, X86_R9, 1);
+            emit_alu_rr(ALU_SUB, X86_R10, X86_RAX);
+            emit_alu_rr(ALU_SUB, X86_R10, X86_R9);
+        } else {
+            emit_alu_rr(ALU_ADD, X86_R10, X86_RAX);
+            emit_alu_rr(ALU_ADD, X86_R10, X86_R9);
+        }
+    }
+
+    // V
+    emit_mov_rr(X86_R9, H_A);
+    emit_alu_rr(ALU_XOR, X86_R9, X86_RAX);
+    if (!sbc)
+        emit_rr(0, false, 0xf7, 1, 2, X86_R9);        // not r9d
+    emit_mov_rr(X86_R11, H_A);
+    emit_alu_rr(ALU_XOR, X86_R11, X86_R10);
+    emit_alu_rr(ALU_AND, X86_R9, X86_R11);
+    emit_test_ri(X86_R9, 0x80);
+    emit_set_flag(PFLAG_V, CC_NE);
+
+    // C
+    if (sbc) {
+        emit_alu_ri(ALU_CMP, X86_R10, 0x100);
+        emit_set_flag(PFLAG_C, CC_B);
+    } else {
+        emit_alu_ri(ALU_CMP, X86_R10, 0xff);
+        emit_set_flag(PFLAG_C, CC_A);
+    }
+
+    emit_movzx_rr8(H_A, X86_R10);
+    emit_set_nz(H_A);
+}
+
+// Instruction properties for finding N/Z results that are overwritten
+// before they are used (by a branch or after leaving the block)
+static bool writes_nz(const jit_insn *in)
+{
+    return (in->op >= OP_LDA && in->op <= OP_LDY) || (in->op >= OP_ORA && in->op <= OP_DEY);
+}
+
+static bool reads_nz(const jit_insn *in)
+{
+    return in->op == OP_BPL || in->op == OP_BMI || in->op == OP_BNE || in->op == OP_BEQ;
+}
+
+static bool may_exit(const jit_insn *in)
+{
+    return (in->op >= OP_STA && in->op <= OP_STY) || (in->op >= OP_ASL && in->op <= OP_DEC && in->mode != AM_IMP);
+}
+
+// Translate one instruction, returns false if it ends the block
+static bool emit_insn(uint16 pc, const jit_insn *in)
+{
+    const uint8 *p = ram + pc;
+    int op = in->op, mode = in->mode;
+    uint16 next = pc + insn_len[mode];
+
+    int prev_nz_reg = nz_reg;
+    nz_reg = -1;
+    rel_operand = insn_len[mode] == 3 && block_reloc[pc - block_start + 2];
+    pending++;                                // Opcode fetch
+    switch (op) {
+        case OP_LDA:
+        case OP_LDX:
+        case OP_LDY: {
+            int reg = op == OP_LDA ? H_A : (op == OP_LDX ? H_X : H_Y);
+            emit_read_operand(mode, p);
+            emit_mov_rr(reg, X86_RAX);
+            emit_set_nz(reg);
+            break;
+        }
+
+        case OP_STA:
+        case OP_STX:
+        case OP_STY:
+            emit_mov_rr(X86_RAX, op == OP_STA ? H_A : (op == OP_STX ? H_X : H_Y));
+            emit_write_operand(mode, p);
+            break;
+
+        case OP_ORA:
+        case OP_AND:
+        case OP_EOR:
+            emit_read_operand(mode, p);
+            emit_alu_rr(op == OP_ORA ? ALU_OR : (op == OP_AND ? ALU_AND : ALU_XOR), H_A, X86_RAX);
+            emit_set_nz(H_A);
+            break;
+
+        case OP_ADC:
+        case OP_SBC:
+            emit_read_operand(mode, p);
+            emit_adc(op == OP_SBC);
+            carry_state = -1;
+            break;
+
+        case OP_CMP:
+        case OP_CPX:
+        case OP_CPY:
+            emit_read_operand(mode, p);
+            emit_compare(op == OP_CMP ? H_A : (op == OP_CPX ? H_X : H_Y));
+            carry_state = -1;
+            break;
+
+        case OP_BIT:
+            emit_read_operand(mode, p);
+            if (nz_live) {
+                emit_mov_m8r(H_REGS, NO_INDEX, REG_OFS(n_flag), X86_RAX);
+                emit_mov_rr(X86_R10, H_A);
+                emit_alu_rr(ALU_AND, X86_R10, X86_RAX);
+                emit_mov_m8r(H_REGS, NO_INDEX, REG_OFS(z_flag), X86_R10);
+            }
+            emit_test_ri(X86_RAX, 0x40);
+            emit_set_flag(PFLAG_V, CC_NE);
+            break;
+
+        case OP_ASL:
+        case OP_LSR:
+        case OP_ROL:
+        case OP_ROR:
+        case OP_INC:
+        case OP_DEC:
+            if (mode == AM_IMP) {
+                emit_rmw_op(op, H_A);
+                emit_set_nz(H_A);
+                pending++;
+            } else
+                emit_rmw(op, mode, p);
+            if (op != OP_INC && op != OP_DEC)
+                carry_state = -1;
+            break;
+
+        case OP_TAX:
+        case OP_TXA:
+        case OP_TAY:
+        case OP_TYA: {
+            int dst = (op == OP_TAX) ? H_X : ((op == OP_TAY) ? H_Y : H_A);
+            int src = (op == OP_TXA) ? H_X : ((op == OP_TYA) ? H_Y : H_A);
+            emit_mov_rr(dst, src);
+            emit_set_nz(dst);
+            pending++;
+            break;
+        }
+
+        case OP_INX:
+        case OP_DEX:
+        case OP_INY:
+        case OP_DEY: {
+            int reg = (op == OP_INX || op == OP_DEX) ? H_X : H_Y;
+            emit_alu_ri((op == OP_INX || op == OP_INY) ? ALU_ADD : ALU_SUB, reg, 1);
+            emit_movzx_rr8(reg, reg);
+            emit_set_nz(reg);
+            pending++;
+            break;
+        }
+
+        case OP_CLC:
+            emit_regs_and8(REG_OFS(pflags), ~PFLAG_C);
+            carry_state = 0;
+            pending++;
+            break;
+        case OP_SEC:
+            emit_regs_or8(REG_OFS(pflags), PFLAG_C);
+            carry_state = 1;
+            pending++;
+            break;
+        case OP_CLV:
+            emit_regs_and8(REG_OFS(pflags), ~PFLAG_V);
+            pending++;
+            break;
+        case OP_NOP:
+            pending++;
+            break;
+
+        case OP_JMP:
+            pending += 2;
+            note_cycles();
+            emit_exit(JIT_EXIT_JUMP, next, p[1] | (p[2] << 8), rel_operand, pending);
+            return false;
+
+        default: {                            // Branches
+            uint16 target = next + (int8)p[1];
+            pending++;
+            note_cycles();
+            // Branches on the result of the previous instruction (e.g.
+            // DEX/BNE) test the host register
+            if ((op == OP_BNE || op == OP_BEQ) && prev_nz_reg >= 0)
+                emit_rr(0, true, 0x84, 1, prev_nz_reg, prev_nz_reg);    // test reg8, reg8
+            else if (op == OP_BNE || op == OP_BEQ)
+                emit_rm(0, false, 0x80, 1, ALU_CMP, H_REGS, NO_INDEX, REG_OFS(z_flag)), emit8(0);
+            else if ((op == OP_BPL || op == OP_BMI) && prev_nz_reg >= 0) {
+                emit_rr(0, true, 0xf6, 1, 0, prev_nz_reg);                // test reg8, 0x80
+                emit8(0x80);
+            } else if (op == OP_BPL || op == OP_BMI)
+                emit_regs_test8(REG_OFS(n_flag), 0x80);
+            else
+                emit_regs_test8(REG_OFS(pflags), (op == OP_BVC || op == OP_BVS) ? PFLAG_V : PFLAG_C);
+            bool taken_if_set = (op == OP_BMI || op == OP_BVS || op == OP_BCS || op == OP_BNE);
+            uint8 *taken = emit_jcc(taken_if_set ? CC_NE : CC_E);
+            emit_exit(JIT_EXIT_PC, next, 0, false, pending);
+            patch_jump(taken, jit_p);
+            pending += ((target ^ next) & 0xff00) ? 2 : 1;
+            note_cycles();
+            emit_exit(JIT_EXIT_JUMP, next, target, true, pending);
+            return false;
+        }
+    }
+    note_cycles();
+    return true;
+}
+
+
+/*
+ *  Block management
+ */
+
+// Remove all translated code
+static void jit_flush()
+{
+    memset(jit_blocks, 0, sizeof(jit_blocks));
+    memset(jit_heat, 0, sizeof(jit_heat));
+    memset(jit_code_map, 0, sizeof(jit_code_map));
+    memset(jit_hash, 0, sizeof(jit_hash));
+    jit_p = jit_code;
+    jit_trans_used = 0;
+    jit_pool_used = 0;
+    jit_free_blocks = NULL;
+}
+
+// Remove block (its translation stays, as it may be executing or be used
+// again for other addresses)
+static void jit_remove(jit_block *b)
+{
+    int i;
+    jit_blocks[b->start] = NULL;
+    for (i=0; i<b->len; i++)
+        jit_code_map[b->start + i]--;
+    b->next_free = jit_free_blocks;
+    jit_free_blocks = b;
+}
+
+// Invalidate all blocks containing the byte at adr
+static void jit_invalidate(uint32 adr)
+{
+    int start = (int)adr - (JIT_MAX_BYTES - 1);
+    if (start < 0)
+        start = 0;
+    for (; start <= (int)adr; start++) {
+        jit_block *b = jit_blocks[start];
+        if (b && adr < (uint32)(b->start + b->len)) {
+            jit_remove(b);
+            if (jit_rewrites[start] < JIT_MAX_REWRITES) {
+                jit_rewrites[start]++;
+                jit_heat[start] = 0;
+            } else
+                jit_heat[start] = 255;
+        }
+    }
+    jit_code_changed = true;
+}
+
+// Get extent of block at address and its code with the high bytes of
+// absolute operands that point to tune RAM near the start made relative to
+// the start page (flagged in reloc), returns size of code (0 = not
+// translatable)
+static int jit_scan(uint16 start, uint8 *code, uint8 *reloc)
+{
+    uint32 pc = start;
+    int n;
+    for (n=0; n<JIT_MAX_INSNS; n++) {
+        const jit_insn *in = jit_insns + ram[pc];
+        int len = insn_len[in->mode];
+        if (in->op == OP_NONE || pc + len - start > JIT_MAX_BYTES || pc + len > 0xffff)
+            break;
+        memcpy(code + pc - start, ram + pc, len);
+        memset(reloc + pc - start, 0, len);
+        if (len == 3) {
+            uint8 page = ram[pc + 2];
+            if (page >= JIT_RELOC_MIN_PAGE && ram_pages(page, false) && ram_pages(page, true)
+             && abs(page - (start >> 8)) < JIT_RELOC_PAGES) {
+                code[pc - start + 2] = page - (start >> 8);
+                reloc[pc - start + 2] = 1;
+            }
+        }
+        pc += len;
+        if (in->mode == AM_REL || in->op == OP_JMP)
+            break;
+    }
+    return pc - start;
+}
+
+static uint32 jit_key_hash(const uint8 *code, const uint8 *reloc, int len, uint8 start_lo)
+{
+    uint32 hash = 2166136261U ^ start_lo;
+    int i;
+    for (i=0; i<len; i++)
+        hash = (hash ^ (code[i] | (reloc[i] << 8))) * 16777619U;
+    return hash;
+}
+
+// Find translation of code
+static jit_trans *jit_find(uint32 hash, const uint8 *code, const uint8 *reloc, int len, uint8 start_lo)
+{
+    jit_trans *t;
+    for (t = jit_hash[hash % JIT_HASH_SIZE]; t; t = t->next)
+        if (t->hash == hash && t->len == len && t->start_lo == start_lo
+         && memcmp(t->code, code, len) == 0 && memcmp(t->reloc, reloc, len) == 0)
+            return t;
+    return NULL;
+}
+
+// Translate block at address
+static jit_trans *jit_translate(uint16 start, const uint8 *code, const uint8 *reloc, int len, uint32 hash)
+{
+    // Epilogue (exits jump back here)
+    epilogue = jit_p;
+    emit_rm(0, false, 0x89, 1, H_A, H_REGS, NO_INDEX, REG_OFS(a));
+    emit_rm(0, false, 0x89, 1, H_X, H_REGS, NO_INDEX, REG_OFS(x));
+    emit_rm(0, false, 0x89, 1, H_Y, H_REGS, NO_INDEX, REG_OFS(y));
+    emit_rm(0, false, 0x89, 1, H_CYCLE, H_REGS, NO_INDEX, REG_OFS(cycle));
+    emit8(0x48); emit8(0x83); emit8(0xc4); emit8(8);    // add rsp, 8
+    emit8(0x41); emit8(0x5f);                            // pop r15
+    emit8(0x41); emit8(0x5e);                            // pop r14
+    emit8(0x41); emit8(0x5d);                            // pop r13
+    emit8(0x41); emit8(0x5c);                            // pop r12
+    emit8(0x5d);                                        // pop rbp
+    emit8(0x5b);                                        // pop rbx
+    emit8(0xc3);                                        // ret
+
+    // Prologue
+    uint8 *entry = jit_p;
+    emit8(0x53);                                        // push rbx
+    emit8(0x55);                                        // push rbp
+    emit8(0x41); emit8(0x54);                            // push r12
+    emit8(0x41); emit8(0x55);                            // push r13
+    emit8(0x41); emit8(0x56);                            // push r14
+    emit8(0x41); emit8(0x57);                            // push r15
+    emit8(0x48); emit8(0x83); emit8(0xec); emit8(8);    // sub rsp, 8
+    emit_rr(1, false, 0x89, 1, X86_RDI, H_REGS);            // mov rbp, rdi
+    emit_rr(1, false, 0x89, 1, X86_RSI, H_RAM);                // mov rbx, rsi
+    emit_rm(0, false, 0x8b, 1, H_A, H_REGS, NO_INDEX, REG_OFS(a));
+    emit_rm(0, false, 0x8b, 1, H_X, H_REGS, NO_INDEX, REG_OFS(x));
+    emit_rm(0, false, 0x8b, 1, H_Y, H_REGS, NO_INDEX, REG_OFS(y));
+    emit_rm(0, false, 0x8b, 1, H_CYCLE, H_REGS, NO_INDEX, REG_OFS(cycle));
+
+    // Find unused N/Z results
+    uint16 insn_pc[JIT_MAX_INSNS];
+    bool nz_used[JIT_MAX_INSNS];
+    uint16 pc;
+    int n = 0, i;
+    for (pc = start; pc - start < len; pc += insn_len[jit_insns[ram[pc]].mode])
+        insn_pc[n++] = pc;
+    bool live = true;
+    for (i=n-1; i>=0; i--) {
+        const jit_insn *in = jit_insns + ram[insn_pc[i]];
+        if (may_exit(in))
+            live = true;
+        nz_used[i] = live;
+        if (writes_nz(in))
+            live = false;
+        if (reads_nz(in))
+            live = true;
+    }
+
+    // Instructions
+    bool cont = true;
+    block_start = start;
+    block_page = start & 0xff00;
+    block_reloc = reloc;
+    pending = extra_cycles = block_max_cycles = 0;
+    nz_reg = carry_state = -1;
+    num_stubs = 0;
+    for (i=0, pc=start; cont && i<n; i++) {
+        const jit_insn *in = jit_insns + ram[pc];
+        first_open_stub = num_stubs;
+        nz_live = nz_used[i];
+        cont = emit_insn(pc, in);
+        pc += insn_len[in->mode];
+        while (first_open_stub < num_stubs) {
+            stubs[first_open_stub].pc = pc;
+            stubs[first_open_stub].pending = pending;
+            first_open_stub++;
+        }
+    }
+    if (cont)
+        emit_exit(JIT_EXIT_PC, pc, 0, false, pending);
+
+    // Exits after writes to code
+    for (i=0; i<num_stubs; i++) {
+        patch_jump(stubs[i].disp, jit_p);
+        if (stubs[i].invalidate) {
+            emit_mov_rr(X86_RDI, X86_RCX);
+            emit_call(jit_invalidate);
+        }
+        emit_exit(JIT_EXIT_PC, stubs[i].pc, 0, false, stubs[i].pending);
+    }
+
+    jit_trans *t = jit_trans_pool + jit_trans_used++;
+    t->func = (jit_func)entry;
+    t->hash = hash;
+    t->len = len;
+    t->max_cycles = block_max_cycles;
+    t->start_lo = start & 0xff;
+    memcpy(t->code, code, len);
+    memcpy(t->reloc, reloc, len);
+    t->next = jit_hash[hash % JIT_HASH_SIZE];
+    jit_hash[hash % JIT_HASH_SIZE] = t;
+    return t;
+}
+
+// Set up block at address with existing translation of the code there or,
+// if translate is true, a new one, returns NULL if there is none
+static jit_block *jit_lookup(uint16 start, bool translate)
+{
+    uint8 code[JIT_MAX_BYTES], reloc[JIT_MAX_BYTES];
+
+    if ((jit_free_blocks == NULL && jit_pool_used == JIT_MAX_BLOCKS)
+     || (translate && (jit_trans_used == JIT_MAX_BLOCKS || jit_p + JIT_BLOCK_SPACE > jit_code + JIT_CODE_SIZE)))
+        jit_flush();
+
+    int len = jit_scan(start, code, reloc);
+    if (len == 0)
+        return NULL;
+    uint32 hash = jit_key_hash(code, reloc, len, start & 0xff);
+    jit_trans *t = jit_find(hash, code, reloc, len, start & 0xff);
+    if (t == NULL) {
+        if (!translate)
+            return NULL;
+        t = jit_translate(start, code, reloc, len, hash);
+    }
+
+    jit_block *b = jit_free_blocks;
+    if (b)
+        jit_free_blocks = b->next_free;
+    else
+        b = jit_pool + jit_pool_used++;
+    b->trans = t;
+    b->start = start;
+    b->len = len;
+    b->epoch = jit_epoch;
+    memcpy(b->code, ram + start, len);
+    int i;
+    for (i=0; i<len; i++)
+        jit_code_map[start + i]++;
+    jit_blocks[start] = b;
+    return b;
+}
+
+// Count jump to address, look for an existing translation at the first
+// jump and translate the code when it gets hot
+static inline void jit_count(uint16 adr)
+{
+    if (jit_enabled && jit_blocks[adr] == NULL && jit_heat[adr] < JIT_THRESHOLD) {
+        uint8 heat = ++jit_heat[adr];
+        if (heat == 1 || heat == JIT_THRESHOLD)
+            jit_lookup(adr, heat == JIT_THRESHOLD);
+    }
+}
+
+// Check that block still matches RAM in this CPUExecute() call, or switch
+// to an existing translation of the code now there, returns block to
+// execute or NULL
+static inline jit_block *jit_check(jit_block *b)
+{
+    if (b->epoch == jit_epoch)
+        return b;
+    if (memcmp(b->code, ram + b->start, b->len) == 0) {
+        b->epoch = jit_epoch;
+        return b;
+    }
+    uint16 start = b->start;
+    jit_remove(b);
+    b = jit_lookup(start, false);
+    if (b == NULL)
+        jit_heat[start] = 0;
+    return b;
+}
+
+
+/*
+ *  Init/exit
+ */
+
+static void jit_init()
+{
+    int i;
+    jit_enabled = PrefsFindBool("jit");
+    if (!jit_enabled)
+        return;
+
+    jit_code = mmap(NULL, JIT_CODE_SIZE, PROT_READ | PROT_WRITE | PROT_EXEC, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    jit_trans_pool = malloc(JIT_MAX_BLOCKS * sizeof(jit_trans));
+    jit_pool = malloc(JIT_MAX_BLOCKS * sizeof(jit_block));
+    if (jit_code == MAP_FAILED || jit_trans_pool == NULL || jit_pool == NULL) {
+        if (jit_code != MAP_FAILED)
+            munmap(jit_code, JIT_CODE_SIZE);
+        free(jit_trans_pool);
+        free(jit_pool);
+        jit_code = NULL;
+        jit_trans_pool = NULL;
+        jit_pool = NULL;
+        jit_enabled = false;
+        return;
+    }
+
+    jit_init_insns();
+    for (i=0; i<0x100; i++)
+        jit_io_read_page[i] = mem_read_table[i] != ram_read;
+    for (i=0; i<0x100; i++)
+        jit_io_write_page[i] = mem_write_table[i] != ram_write;
+    memset(jit_rewrites, 0, sizeof(jit_rewrites));
+    jit_flush();
+}
+
+static void jit_exit()
+{
+    // Blocks must not be used by CPUExecute() once the pools are freed
+    jit_flush();
+    if (jit_code)
+        munmap(jit_code, JIT_CODE_SIZE);
+    free(jit_trans_pool);
+    free(jit_pool);
+    jit_code = NULL;
+    jit_trans_pool = NULL;
+    jit_pool = NULL;
+    jit_enabled = false;
+}
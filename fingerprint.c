@@ -0,0 +1,207 @@
+/*
+ *  fingerprint.c - Tune fingerprints for duplicate detection
+ *
+ *  SIDPlayer (C) Copyright 1996-2004 Christian Bauer
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+
+/*
+ *  A fingerprint is computed from the register writes of the replay
+ *  routine, without rendering any audio. For every voice, the notes are
+ *  extracted (a rising gate bit, or a new pitch while the gate is set),
+ *  and every three successive notes of a voice make a pattern that
+ *  consists of the two pitch steps between them (in semitones), the
+ *  waveform classes of the notes, and the ratio of the two time steps.
+ *  Using only pitch steps and time ratios makes the patterns independent
+ *  of transposition (e.g. PAL/NTSC rips), of the tempo and of the start
+ *  offset.
+ *
+ *  The set of pattern hashes is reduced to a MinHash signature: for each
+ *  of the FINGERPRINT_HASHES hash functions, the minimum over all
+ *  patterns. The fraction of equal minimums of two signatures estimates
+ *  the fraction of patterns the songs share.
+ */
+
+#include "sys.h"
+
+#include <math.h>
+
+#include "fingerprint.h"
+
+#define DEBUG 0
+#include "debug.h"
+
+
+// Minimum number of patterns of a fingerprint
+#define MIN_PATTERNS 8
+
+// Note of a voice
+typedef struct note_t note_t;
+struct note_t {
+    int pitch;            // Semitones
+    int wave;            // Waveform class
+    uint32 frame;        // Start frame
+};
+
+// Waveform classes
+enum {
+    WAVE_CLASS_NONE,
+    WAVE_CLASS_TONE,    // Triangle, sawtooth, pulse and their combinations
+    WAVE_CLASS_NOISE
+};
+
+
+/*
+ *  Hash functions
+ */
+
+static uint32 mix32(uint32 x)
+{
+    x ^= x >> 16;
+    x *= 0x7feb352d;
+    x ^= x >> 15;
+    x *= 0x846ca68b;
+    x ^= x >> 16;
+    return x;
+}
+
+// Add pattern to MinHash signature
+static void add_pattern(fingerprint *fp, uint32 pattern)
+{
+    int i;
+    for (i=0; i<FINGERPRINT_HASHES; i++) {
+        uint32 h = mix32(pattern ^ mix32(i + 1));
+        if (h < fp->hash[i])
+            fp->hash[i] = h;
+    }
+}
+
+
+/*
+ *  Compute fingerprint of register stream
+ */
+
+static int wave_class(uint8 ctrl)
+{
+    if (ctrl & 0x80)
+        return WAVE_CLASS_NOISE;
+    else if (ctrl & 0x70)
+        return WAVE_CLASS_TONE;
+    else
+        return WAVE_CLASS_NONE;
+}
+
+// Time ratio of two note steps, quantized to quarter octaves
+static int time_ratio(uint32 dt1, uint32 dt2)
+{
+    int r = (int)floor(log2((double)dt2 / dt1) * 4.0 + 0.5);
+    if (r < -8)
+        r = -8;
+    if (r > 8)
+        r = 8;
+    return r;
+}
+
+bool FingerprintRegStream(const regstream *rs, fingerprint *fp)
+{
+    uint8 regs[0x19] = {0};
+    note_t notes[3][3];        // Last three notes of every voice, notes[v][2] is the newest
+    int num_notes[3] = {0, 0, 0};
+    uint32 num_patterns = 0;
+    int v, i;
+    for (i=0; i<FINGERPRINT_HASHES; i++)
+        fp->hash[i] = 0xffffffff;
+
+    uint32 frame, frames = RegStreamNumFrames(rs);
+    for (frame=0; frame<frames; frame++) {
+
+        // Apply writes of frame, remembering gate changes
+        uint8 gate_on = 0;
+        int count;
+        const reg_write *w = RegStreamFrame(rs, frame, &count);
+        for (i=0; i<count; i++, w++)
+            if (w->reg < 0x19) {
+                if (w->reg % 7 == 4 && w->reg < 0x15 && (w->value & 1) && !(regs[w->reg] & 1))
+                    gate_on |= 1 << (w->reg / 7);
+                regs[w->reg] = w->value;
+            }
+
+        // Find new notes
+        for (v=0; v<3; v++) {
+            uint8 *vr = regs + v * 7;
+            int wave = wave_class(vr[4]);
+            uint16 freq = vr[0] | (vr[1] << 8);
+            if (!(vr[4] & 1) || wave == WAVE_CLASS_NONE || freq == 0)
+                continue;
+            int pitch = wave == WAVE_CLASS_NOISE ? 0 : (int)floor(12.0 * log2(freq) + 0.5);
+            note_t *last = num_notes[v] ? &notes[v][2] : NULL;
+            if (!(gate_on & (1 << v)) && last && last->pitch == pitch && last->wave == wave)
+                continue;
+
+            notes[v][0] = notes[v][1];
+            notes[v][1] = notes[v][2];
+            notes[v][2].pitch = pitch;
+            notes[v][2].wave = wave;
+            notes[v][2].frame = frame;
+            if (++num_notes[v] < 3)
+                continue;
+
+            // Add pattern of last three notes
+            const note_t *n = notes[v];
+            if (n[1].frame == n[0].frame || n[2].frame == n[1].frame)
+                continue;
+            int step1 = n[1].pitch - n[0].pitch, step2 = n[2].pitch - n[1].pitch;
+            int ratio = time_ratio(n[1].frame - n[0].frame, n[2].frame - n[1].frame);
+            uint32 pattern = (uint32)(step1 & 0xff) | (uint32)(step2 & 0xff) << 8 | (uint32)(ratio & 0x1f) << 16
+                           | n[0].wave << 21 | n[1].wave << 23 | n[2].wave << 25;
+            add_pattern(fp, pattern);
+            num_patterns++;
+        }
+    }
+
+    D(bug("%u frames, %u patterns\n", frames, num_patterns));
+    return num_patterns >= MIN_PATTERNS;
+}
+
+
+/*
+ *  Compute fingerprint of song
+ */
+
+bool FingerprintSong(int song, fingerprint *fp)
+{
+    regstream *rs = RegStreamRecord(song, FINGERPRINT_SECONDS);
+    if (rs == NULL)
+        return false;
+    bool ok = FingerprintRegStream(rs, fp);
+    RegStreamDelete(rs);
+    return ok;
+}
+
+
+/*
+ *  Compare fingerprints
+ */
+
+double FingerprintSimilarity(const fingerprint *a, const fingerprint *b)
+{
+    int i, same = 0;
+    for (i=0; i<FINGERPRINT_HASHES; i++)
+        if (a->hash[i] == b->hash[i])
+            same++;
+    return (double)same / FINGERPRINT_HASHES;
+}
@@ -0,0 +1,61 @@
+/*
+ *  fingerprint.h - Tune fingerprints for duplicate detection
+ *
+ *  SIDPlayer (C) Copyright 1996-2004 Christian Bauer
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+
+#ifndef FINGERPRINT_H
+#define FINGERPRINT_H
+
+#include "types.h"
+#include "regstream.h"
+
+
+/*
+ *  Definitions
+ */
+
+// Number of hash values in a fingerprint
+#define FINGERPRINT_HASHES 16
+
+// Length of song that is fingerprinted (seconds)
+#define FINGERPRINT_SECONDS 60
+
+// Fingerprint of a song (MinHash signature of its note patterns)
+typedef struct fingerprint fingerprint;
+struct fingerprint {
+    uint32 hash[FINGERPRINT_HASHES];
+};
+
+
+/*
+ *  Functions
+ */
+
+// Compute fingerprint of register stream, returns false if it has too few
+// notes to be recognized
+extern bool FingerprintRegStream(const regstream *rs, fingerprint *fp);
+
+// Compute fingerprint of song (0..n) of loaded PSID file (6510 emulation only),
+// returns false if the song has too few notes to be recognized
+extern bool FingerprintSong(int song, fingerprint *fp);
+
+// Get similarity of two fingerprints (0..1, estimated fraction of shared note patterns)
+extern double FingerprintSimilarity(const fingerprint *a, const fingerprint *b);
+
+#endif
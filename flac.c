@@ -0,0 +1,637 @@
+/*
+ *  flac.c - Streaming FLAC encoder
+ *
+ *  SIDPlayer (C) Copyright 1996-2004 Christian Bauer
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+
+/*
+ *  The audio is split into blocks of BLOCK_FRAMES sample frames which are
+ *  encoded to one FLAC frame each (https://xiph.org/flac/format.html) as
+ *  soon as they are complete, so only one block is kept in memory. Every
+ *  channel (or the side and mid/left/right channel of a stereo pair) is
+ *  predicted with the fixed polynomial predictor of order 0..4 leaving the
+ *  smallest residual, which is Rice coded in partitions with their own
+ *  parameters.
+ */
+
+#include "sys.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#include "flac.h"
+
+
+// Number of sample frames in a block
+#define BLOCK_FRAMES 4096
+
+// Maximum number of channels
+#define MAX_CHANNELS 2
+
+// Maximum predictor order, Rice partition order and Rice parameter
+#define MAX_ORDER 4
+#define MAX_PARTITION_ORDER 6
+#define MAX_RICE_PARAM 14
+
+// Size of STREAMINFO metadata block (including its header)
+#define STREAMINFO_BYTES 38
+
+// Maximum size of an encoded frame (verbatim subframes with side channel)
+#define MAX_FRAME_BYTES (BLOCK_FRAMES * MAX_CHANNELS * 17 / 8 + 32)
+
+// Channel assignments of stereo frames
+enum {
+    CHANNELS_INDEPENDENT = 1,
+    CHANNELS_LEFT_SIDE = 8,
+    CHANNELS_RIGHT_SIDE = 9,
+    CHANNELS_MID_SIDE = 10
+};
+
+// MD5 hash of the audio data
+typedef struct md5_ctx md5_ctx;
+struct md5_ctx {
+    uint32 h[4];
+    uint64 length;        // Bytes hashed so far
+    uint8 buf[64];
+};
+
+// Buffer for writing bits (MSB first)
+typedef struct bit_writer bit_writer;
+struct bit_writer {
+    uint8 *buf;
+    size_t pos;            // Number of complete bytes
+    uint64 acc;            // Bits not yet stored
+    int fill;            // Number of bits in acc
+};
+
+struct flac_encoder {
+    FILE *f;
+    long header_pos;                        // File position of stream header (-1 = not seekable)
+    bool error;                                // Flag: write error
+
+    int freq;
+    int channels;
+
+    int32 samples[MAX_CHANNELS][BLOCK_FRAMES];    // Samples of current block
+    int32 mid[BLOCK_FRAMES], side[BLOCK_FRAMES];
+    int32 residual[BLOCK_FRAMES];
+    int fill;                                // Frames in current block so far
+
+    uint32 frame_number;                    // Number of next FLAC frame
+    uint64 total_frames;                    // Sample frames encoded so far
+    uint32 min_frame_bytes, max_frame_bytes;
+    md5_ctx md5;
+
+    uint8 out[MAX_FRAME_BYTES];                // Encoded frame
+};
+
+static uint32 md5_k[64];
+static const uint8 md5_r[64] = {
+    7, 12, 17, 22, 7, 12, 17, 22, 7, 12, 17, 22, 7, 12, 17, 22,
+    5, 9, 14, 20, 5, 9, 14, 20, 5, 9, 14, 20, 5, 9, 14, 20,
+    4, 11, 16, 23, 4, 11, 16, 23, 4, 11, 16, 23, 4, 11, 16, 23,
+    6, 10, 15, 21, 6, 10, 15, 21, 6, 10, 15, 21, 6, 10, 15, 21
+};
+
+static uint16 crc16_table[256];
+static bool tables_done = false;
+
+
+/*
+ *  MD5 (RFC 1321)
+ */
+
+static void md5_init(md5_ctx *m)
+{
+    m->h[0] = 0x67452301;
+    m->h[1] = 0xefcdab89;
+    m->h[2] = 0x98badcfe;
+    m->h[3] = 0x10325476;
+    m->length = 0;
+}
+
+static void md5_block(md5_ctx *m, const uint8 *p)
+{
+    uint32 w[16];
+    int i;
+    for (i=0; i<16; i++)
+        w[i] = p[i*4] | (p[i*4+1] << 8) | (p[i*4+2] << 16) | ((uint32)p[i*4+3] << 24);
+
+    uint32 a = m->h[0], b = m->h[1], c = m->h[2], d = m->h[3];
+    for (i=0; i<64; i++) {
+        uint32 f, g;
+        if (i < 16) {
+            f = (b & c) | (~b & d);
+            g = i;
+        } else if (i < 32) {
+            f = (d & b) | (~d & c);
+            g = (5 * i + 1) & 15;
+        } else if (i < 48) {
+            f = b ^ c ^ d;
+            g = (3 * i + 5) & 15;
+        } else {
+            f = c ^ (b | ~d);
+            g = (7 * i) & 15;
+        }
+        uint32 t = a + f + md5_k[i] + w[g];
+        a = d;
+        d = c;
+        c = b;
+        b += (t << md5_r[i]) | (t >> (32 - md5_r[i]));
+    }
+    m->h[0] += a;
+    m->h[1] += b;
+    m->h[2] += c;
+    m->h[3] += d;
+}
+
+static void md5_update(md5_ctx *m, const uint8 *data, size_t len)
+{
+    int used = m->length & 63;
+    m->length += len;
+    while (len) {
+        int n = 64 - used;
+        if (n > len)
+            n = len;
+        memcpy(m->buf + used, data, n);
+        used += n;
+        data += n;
+        len -= n;
+        if (used == 64) {
+            md5_block(m, m->buf);
+            used = 0;
+        }
+    }
+}
+
+static void md5_final(md5_ctx *m, uint8 *digest)
+{
+    uint64 bits = m->length * 8;
+    uint8 pad[72];
+    int i, n = 64 - ((m->length + 8) & 63);
+    memset(pad, 0, sizeof(pad));
+    pad[0] = 0x80;
+    for (i=0; i<8; i++)
+        pad[n + i] = bits >> (i * 8);
+    md5_update(m, pad, n + 8);
+    for (i=0; i<16; i++)
+        digest[i] = m->h[i / 4] >> ((i & 3) * 8);
+}
+
+
+/*
+ *  Write bits
+ */
+
+static void put_bits(bit_writer *bw, uint32 value, int bits)
+{
+    bw->acc = (bw->acc << bits) | (value & ((1ULL << bits) - 1));
+    bw->fill += bits;
+    while (bw->fill >= 8) {
+        bw->fill -= 8;
+        bw->buf[bw->pos++] = bw->acc >> bw->fill;
+    }
+}
+
+static void align_bits(bit_writer *bw)
+{
+    if (bw->fill)
+        put_bits(bw, 0, 8 - bw->fill);
+}
+
+// Write number in the UTF-8 like variable length code of frame headers
+static void put_utf8(bit_writer *bw, uint32 value)
+{
+    if (value < 0x80) {
+        put_bits(bw, value, 8);
+        return;
+    }
+    int i, len = 2;
+    while (value >= (1u << (5 * len + 1)))
+        len++;
+    put_bits(bw, ((0xff00 >> len) & 0xff) | (value >> (6 * (len - 1))), 8);
+    for (i=len-2; i>=0; i--)
+        put_bits(bw, 0x80 | ((value >> (6 * i)) & 0x3f), 8);
+}
+
+// Map residual to unsigned value (0, -1, 1, -2, ... -> 0, 1, 2, 3, ...)
+static inline uint32 zigzag(int32 r)
+{
+    return ((uint32)r << 1) ^ (r >> 31);
+}
+
+// Write Rice code of residual
+static inline void put_rice(bit_writer *bw, int32 r, int k)
+{
+    uint32 u = zigzag(r);
+    uint32 q = u >> k;
+    if (q + k < 32)
+        put_bits(bw, (1 << k) | (u & ((1 << k) - 1)), q + 1 + k);
+    else {
+        while (q >= 32) {
+            put_bits(bw, 0, 32);
+            q -= 32;
+        }
+        put_bits(bw, 0, q);
+        put_bits(bw, (1 << k) | (u & ((1 << k) - 1)), 1 + k);
+    }
+}
+
+
+/*
+ *  CRCs of frame header and frame
+ */
+
+static uint8 crc8(const uint8 *p, size_t len)
+{
+    uint8 crc = 0;
+    while (len--) {
+        int i;
+        crc ^= *p++;
+        for (i=0; i<8; i++)
+            crc = (crc & 0x80) ? (crc << 1) ^ 0x07 : crc << 1;
+    }
+    return crc;
+}
+
+static uint16 crc16(const uint8 *p, size_t len)
+{
+    uint16 crc = 0;
+    while (len--)
+        crc = (crc << 8) ^ crc16_table[(crc >> 8) ^ *p++];
+    return crc;
+}
+
+
+/*
+ *  Create encoder
+ */
+
+static void write_stream_info(flac_encoder *fe)
+{
+    uint8 buf[STREAMINFO_BYTES];
+    bit_writer bw = {buf, 0, 0, 0};
+    put_bits(&bw, 0x80, 8);                // Last metadata block, STREAMINFO
+    put_bits(&bw, STREAMINFO_BYTES - 4, 24);
+    put_bits(&bw, BLOCK_FRAMES, 16);    // Minimum block size
+    put_bits(&bw, BLOCK_FRAMES, 16);    // Maximum block size
+    put_bits(&bw, fe->min_frame_bytes, 24);
+    put_bits(&bw, fe->max_frame_bytes, 24);
+    put_bits(&bw, fe->freq, 20);
+    put_bits(&bw, fe->channels - 1, 3);
+    put_bits(&bw, 16 - 1, 5);            // Bits per sample
+    put_bits(&bw, fe->total_frames >> 32, 4);
+    put_bits(&bw, fe->total_frames, 32);
+    fwrite(buf, 1, bw.pos, fe->f);
+
+    // MD5 of audio data (unknown until the end)
+    uint8 digest[16];
+    memset(digest, 0, sizeof(digest));
+    if (fe->total_frames)
+        md5_final(&fe->md5, digest);
+    fwrite(digest, 1, sizeof(digest), fe->f);
+}
+
+flac_encoder *FlacNew(FILE *f, int freq, int channels)
+{
+    if (channels < 1 || channels > MAX_CHANNELS || freq <= 0 || freq >= (1 << 20))
+        return NULL;
+    flac_encoder *fe = calloc(1, sizeof(flac_encoder));
+    if (fe == NULL)
+        return NULL;
+    fe->f = f;
+    fe->freq = freq;
+    fe->channels = channels;
+    md5_init(&fe->md5);
+
+    if (!tables_done) {
+        int i, j;
+        for (i=0; i<64; i++)
+            md5_k[i] = (uint32)(fabs(sin(i + 1)) * 4294967296.0);
+        for (i=0; i<256; i++) {
+            uint16 crc = i << 8;
+            for (j=0; j<8; j++)
+                crc = (crc & 0x8000) ? (crc << 1) ^ 0x8005 : crc << 1;
+            crc16_table[i] = crc;
+        }
+        tables_done = true;
+    }
+
+    fe->header_pos = ftell(f);
+    fwrite("fLaC", 1, 4, f);
+    write_stream_info(fe);
+    fe->error = ferror(f);
+    return fe;
+}
+
+
+/*
+ *  Encode block
+ */
+
+// Estimate best Rice parameter and number of bits for residuals with
+// given sum of zigzag coded values
+static int rice_param(uint32 count, uint64 sum, uint64 *bits)
+{
+    int k, best_k = 0;
+    uint64 best = count + sum;
+    for (k=1; k<=MAX_RICE_PARAM; k++) {
+        uint64 b = (uint64)count * (k + 1) + (sum >> k);
+        if (b >= best)
+            break;
+        best = b;
+        best_k = k;
+    }
+    *bits = best;
+    return best_k;
+}
+
+// Find fixed predictor order with smallest residual, returns order and estimated number of bits
+static int best_order(const int32 *x, int n, int bits, uint64 *est)
+{
+    uint64 sum[MAX_ORDER + 1] = {0, 0, 0, 0, 0};
+    int i, order, best = 0;
+    if (n <= MAX_ORDER) {
+        *est = (uint64)n * bits;
+        return -1;
+    }
+    for (i=MAX_ORDER; i<n; i++) {
+        int32 e0 = x[i];
+        int32 e1 = e0 - x[i-1];
+        int32 e2 = e1 - (x[i-1] - x[i-2]);
+        int32 e3 = e2 - (x[i-1] - 2 * x[i-2] + x[i-3]);
+        int32 e4 = e3 - (x[i-1] - 3 * x[i-2] + 3 * x[i-3] - x[i-4]);
+        sum[0] += abs(e0);
+        sum[1] += abs(e1);
+        sum[2] += abs(e2);
+        sum[3] += abs(e3);
+        sum[4] += abs(e4);
+    }
+    for (order=1; order<=MAX_ORDER; order++)
+        if (sum[order] < sum[best])
+            best = order;
+    rice_param(n - best, sum[best] * 2, est);
+    *est += best * bits;
+    return best;
+}
+
+static void calc_residual(int32 *r, const int32 *x, int n, int order)
+{
+    int i;
+    switch (order) {
+        case 0:
+            for (i=0; i<n; i++)
+                r[i] = x[i];
+            break;
+        case 1:
+            for (i=1; i<n; i++)
+                r[i-1] = x[i] - x[i-1];
+            break;
+        case 2:
+            for (i=2; i<n; i++)
+                r[i-2] = x[i] - 2 * x[i-1] + x[i-2];
+            break;
+        case 3:
+            for (i=3; i<n; i++)
+                r[i-3] = x[i] - 3 * x[i-1] + 3 * x[i-2] - x[i-3];
+            break;
+        case 4:
+            for (i=4; i<n; i++)
+                r[i-4] = x[i] - 4 * x[i-1] + 6 * x[i-2] - 4 * x[i-3] + x[i-4];
+            break;
+    }
+}
+
+// Choose Rice partition order and parameters, returns exact number of bits
+// of the residual section
+static uint64 choose_partitions(const int32 *r, int n, int order, int *porder, int *params)
+{
+    uint64 sum[1 << MAX_PARTITION_ORDER];
+    uint32 count[1 << MAX_PARTITION_ORDER];
+    int level[1 << MAX_PARTITION_ORDER];
+    int i, j, p, max_p = 0;
+
+    while (max_p < MAX_PARTITION_ORDER && (n & (1 << max_p)) == 0 && (n >> (max_p + 1)) > order)
+        max_p++;
+
+    // Sums of partitions of highest order
+    int size = n >> max_p;
+    const int32 *q = r;
+    for (j=0; j<(1 << max_p); j++) {
+        int len = j ? size : size - order;
+        uint64 s = 0;
+        for (i=0; i<len; i++)
+            s += zigzag(q[i]);
+        sum[j] = s;
+        count[j] = len;
+        q += len;
+    }
+
+    // Evaluate partition orders from highest to lowest, merging neighbours
+    uint64 best = ~0ULL;
+    for (p=max_p; p>=0; p--) {
+        uint64 bits = 0, b;
+        for (j=0; j<(1 << p); j++) {
+            level[j] = rice_param(count[j], sum[j], &b);
+            bits += 4 + b;
+        }
+        if (bits < best) {
+            best = bits;
+            *porder = p;
+            memcpy(params, level, sizeof(int) << p);
+        }
+        for (j=0; j<(1 << p)/2; j++) {
+            sum[j] = sum[j*2] + sum[j*2+1];
+            count[j] = count[j*2] + count[j*2+1];
+        }
+    }
+
+    // Exact size (the estimate ignores the rounding of the quotients)
+    uint64 bits = 6;
+    size = n >> *porder;
+    q = r;
+    for (j=0; j<(1 << *porder); j++) {
+        int len = j ? size : size - order, k = params[j];
+        bits += 4 + (uint64)len * (k + 1);
+        for (i=0; i<len; i++)
+            bits += zigzag(q[i]) >> k;
+        q += len;
+    }
+    return bits;
+}
+
+static void encode_subframe(flac_encoder *fe, bit_writer *bw, const int32 *x, int n, int bits, int order)
+{
+    int i, j;
+
+    // Constant signal
+    for (i=1; i<n; i++)
+        if (x[i] != x[0])
+            break;
+    if (i == n) {
+        put_bits(bw, 0x00, 8);
+        put_bits(bw, x[0], bits);
+        return;
+    }
+
+    // Fixed predictor, unless the residual is larger than the samples
+    if (order >= 0) {
+        int porder = 0, params[1 << MAX_PARTITION_ORDER];
+        int32 *r = fe->residual;
+        calc_residual(r, x, n, order);
+        uint64 residual_bits = choose_partitions(r, n, order, &porder, params);
+        if (residual_bits + order * bits < (uint64)n * bits) {
+            put_bits(bw, (0x08 | order) << 1, 8);
+            for (i=0; i<order; i++)
+                put_bits(bw, x[i], bits);
+            put_bits(bw, 0, 2);                // Rice coding with 4-bit parameters
+            put_bits(bw, porder, 4);
+            int size = n >> porder;
+            for (j=0; j<(1 << porder); j++) {
+                int len = j ? size : size - order, k = params[j];
+                put_bits(bw, k, 4);
+                for (i=0; i<len; i++)
+                    put_rice(bw, *r++, k);
+            }
+            return;
+        }
+    }
+
+    // Verbatim
+    put_bits(bw, 0x02, 8);
+    for (i=0; i<n; i++)
+        put_bits(bw, x[i], bits);
+}
+
+static void encode_frame(flac_encoder *fe)
+{
+    int n = fe->fill;
+    int32 *left = fe->samples[0], *right = fe->samples[1];
+    bit_writer bw = {fe->out, 0, 0, 0};
+    int i;
+
+    // Choose stereo decorrelation with smallest estimated size
+    int assignment = fe->channels - 1;
+    const int32 *x0 = left, *x1 = right;
+    int bits0 = 16, bits1 = 16, order0, order1 = -1;
+    uint64 est_left, est_right, est_mid, est_side;
+    order0 = best_order(left, n, 16, &est_left);
+    if (fe->channels == 2) {
+        for (i=0; i<n; i++) {
+            fe->mid[i] = (left[i] + right[i]) >> 1;
+            fe->side[i] = left[i] - right[i];
+        }
+        int order_right = best_order(right, n, 16, &est_right);
+        int order_mid = best_order(fe->mid, n, 16, &est_mid);
+        int order_side = best_order(fe->side, n, 17, &est_side);
+        uint64 best = est_left + est_right;
+        order1 = order_right;
+        if (est_left + est_side < best) {
+            best = est_left + est_side;
+            assignment = CHANNELS_LEFT_SIDE;
+            x1 = fe->side; bits1 = 17; order1 = order_side;
+        }
+        if (est_right + est_side < best) {
+            best = est_right + est_side;
+            assignment = CHANNELS_RIGHT_SIDE;
+            x0 = fe->side; bits0 = 17; order0 = order_side;
+            x1 = right; bits1 = 16; order1 = order_right;
+        }
+        if (est_mid + est_side < best) {
+            assignment = CHANNELS_MID_SIDE;
+            x0 = fe->mid; bits0 = 16; order0 = order_mid;
+            x1 = fe->side; bits1 = 17; order1 = order_side;
+        }
+    }
+
+    // Frame header
+    put_bits(&bw, 0xfff8, 16);                // Sync code, fixed block size
+    put_bits(&bw, n == BLOCK_FRAMES ? 12 : 7, 4);
+    put_bits(&bw, 0, 4);                    // Sample rate from STREAMINFO
+    put_bits(&bw, assignment, 4);
+    put_bits(&bw, 4 << 1, 4);                // 16 bits per sample
+    put_utf8(&bw, fe->frame_number);
+    if (n != BLOCK_FRAMES)
+        put_bits(&bw, n - 1, 16);
+    put_bits(&bw, crc8(bw.buf, bw.pos), 8);
+
+    // Subframes and footer
+    encode_subframe(fe, &bw, x0, n, bits0, order0);
+    if (fe->channels == 2)
+        encode_subframe(fe, &bw, x1, n, bits1, order1);
+    align_bits(&bw);
+    put_bits(&bw, crc16(bw.buf, bw.pos), 16);
+
+    if (fwrite(bw.buf, 1, bw.pos, fe->f) != bw.pos)
+        fe->error = true;
+    if (fe->min_frame_bytes == 0 || bw.pos < fe->min_frame_bytes)
+        fe->min_frame_bytes = bw.pos;
+    if (bw.pos > fe->max_frame_bytes)
+        fe->max_frame_bytes = bw.pos;
+    fe->frame_number++;
+    fe->total_frames += n;
+    fe->fill = 0;
+}
+
+void FlacAddFrames(flac_encoder *fe, const int16 *data, int frames)
+{
+    // Hash audio data as little-endian samples
+    uint8 le[1024];
+    int i, len = frames * fe->channels, pos = 0;
+    while (pos < len) {
+        int n = len - pos;
+        if (n > sizeof(le) / 2)
+            n = sizeof(le) / 2;
+        for (i=0; i<n; i++) {
+            le[i*2] = data[pos + i];
+            le[i*2+1] = data[pos + i] >> 8;
+        }
+        md5_update(&fe->md5, le, n * 2);
+        pos += n;
+    }
+
+    while (frames--) {
+        fe->samples[0][fe->fill] = *data++;
+        if (fe->channels == 2)
+            fe->samples[1][fe->fill] = *data++;
+        if (++fe->fill == BLOCK_FRAMES)
+            encode_frame(fe);
+    }
+}
+
+
+/*
+ *  Finish stream and delete encoder
+ */
+
+bool FlacClose(flac_encoder *fe)
+{
+    if (fe->fill)
+        encode_frame(fe);
+
+    // Complete STREAMINFO with the length, frame sizes and MD5
+    if (fe->header_pos >= 0 && fseek(fe->f, fe->header_pos + 4, SEEK_SET) == 0) {
+        write_stream_info(fe);
+        fseek(fe->f, 0, SEEK_END);
+    }
+
+    bool ok = !fe->error && !ferror(fe->f);
+    free(fe);
+    return ok;
+}
@@ -0,0 +1,56 @@
+/*
+ *  flac.h - Streaming FLAC encoder
+ *
+ *  SIDPlayer (C) Copyright 1996-2004 Christian Bauer
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+
+#ifndef FLAC_H
+#define FLAC_H
+
+#include "types.h"
+
+#include <stdio.h>
+
+
+/*
+ *  Definitions
+ */
+
+// FLAC encoder writing one stream to a file
+typedef struct flac_encoder flac_encoder;
+
+
+/*
+ *  Functions
+ */
+
+// Create encoder for 16-bit audio with given sample rate and number of
+// channels (1 or 2) and write the stream header to the file, returns NULL
+// on error
+extern flac_encoder *FlacNew(FILE *f, int freq, int channels);
+
+// Encode block of interleaved 16-bit samples, complete frames are written
+// to the file immediately
+extern void FlacAddFrames(flac_encoder *fe, const int16 *data, int frames);
+
+// Write the remaining samples, complete the stream header if the file is
+// seekable and delete the encoder (the file is not closed), returns false
+// if there was a write error
+extern bool FlacClose(flac_encoder *fe);
+
+#endif
@@ -0,0 +1,556 @@
+/*
+ *  index.c - Collection index
+ *
+ *  SIDPlayer (C) Copyright 1996-2004 Christian Bauer
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+
+/*
+ *  The collection index is one file holding a header and an array of
+ *  fixed-size records, one per song of every indexed tune. The file is
+ *  mapped shared and records are modified in place; space for new records
+ *  is allocated in larger steps, and a new record is completely written
+ *  before the record count is increased, so other processes that have the
+ *  index mapped only ever see complete records. Writers lock the file.
+ *  Records are never deleted (records of removed files are only flagged),
+ *  so record numbers stay valid.
+ *
+ *  Records are found by path and song number with a hash table in memory
+ *  that is built when the index is opened, and extended with the records
+ *  added since the last lookup (by this or another process).
+ *
+ *  Besides the PSID header fields, a record holds the loudness of the
+ *  song as measured while it was rendered (see loudness.c), so playback
+ *  can apply a ReplayGain gain without analyzing the song again.
+ */
+
+#include "sys.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <math.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+
+#include "index.h"
+#include "main.h"
+#include "prefs.h"
+#include "sid.h"
+
+#define DEBUG 0
+#include "debug.h"
+
+
+// Magic number and version of index files
+static const char INDEX_MAGIC[8] = "TSIDIDX1";
+
+// Number of records space is allocated for at a time
+#define RECORD_ALLOC 1024
+
+// Header of index file, followed by the records
+typedef struct index_header index_header;
+struct index_header {
+    char magic[8];
+    uint32 record_size;            // sizeof(index_record), to catch incompatible builds
+    uint32 num_records;            // Number of valid records
+    uint32 max_records;            // Number of records space is allocated for
+    uint8 reserved[44];
+};
+
+struct collection_index {
+    int fd;
+    index_header *header;        // Mapped file
+    size_t map_size;
+
+    // Hash table of records by path and song number: first record of every
+    // bucket and next record of every record (record number + 1, 0 = end
+    // of chain), records below num_hashed are in the table
+    uint32 *buckets;
+    uint32 *chain;
+    uint32 num_buckets;            // Power of two
+    uint32 max_chain;            // Size of chain array
+    uint32 num_hashed;
+};
+
+// Prototypes
+static bool hash_records(collection_index *ci);
+
+
+/*
+ *  Map index file (again, if it grew)
+ */
+
+static bool map_index(collection_index *ci)
+{
+    struct stat st;
+    if (fstat(ci->fd, &st) < 0)
+        return false;
+    if (ci->header && (size_t)st.st_size == ci->map_size)
+        return true;
+
+    if (ci->header)
+        munmap(ci->header, ci->map_size);
+    ci->header = NULL;
+    void *map = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, ci->fd, 0);
+    if (map == MAP_FAILED)
+        return false;
+    ci->header = map;
+    ci->map_size = st.st_size;
+    return true;
+}
+
+static index_record *get_record(const collection_index *ci, uint32 n)
+{
+    return (index_record *)(ci->header + 1) + n;
+}
+
+
+/*
+ *  Open/close index file
+ */
+
+collection_index *IndexOpen(const char *file)
+{
+    collection_index *ci = calloc(1, sizeof(collection_index));
+    if (ci == NULL)
+        return NULL;
+    ci->fd = open(file, O_RDWR | O_CREAT, 0666);
+    if (ci->fd < 0) {
+        free(ci);
+        return NULL;
+    }
+
+    // Write header to new file
+    flock(ci->fd, LOCK_EX);
+    struct stat st;
+    if (fstat(ci->fd, &st) == 0 && st.st_size == 0) {
+        index_header h;
+        memset(&h, 0, sizeof(h));
+        memcpy(h.magic, INDEX_MAGIC, 8);
+        h.record_size = sizeof(index_record);
+        h.max_records = RECORD_ALLOC;
+        if (write(ci->fd, &h, sizeof(h)) != sizeof(h)
+         || ftruncate(ci->fd, sizeof(h) + (off_t)RECORD_ALLOC * sizeof(index_record)) < 0)
+            D(bug("couldn't create index file '%s'\n", file));
+    }
+    flock(ci->fd, LOCK_UN);
+
+    if (!map_index(ci) || ci->map_size < sizeof(index_header)
+     || memcmp(ci->header->magic, INDEX_MAGIC, 8) || ci->header->record_size != sizeof(index_record)) {
+        fprintf(stderr, "'%s' is not a collection index\n", file);
+        IndexClose(ci);
+        return NULL;
+    }
+    hash_records(ci);
+    return ci;
+}
+
+void IndexClose(collection_index *ci)
+{
+    if (ci == NULL)
+        return;
+    if (ci->header)
+        munmap(ci->header, ci->map_size);
+    close(ci->fd);
+    free(ci->buckets);
+    free(ci->chain);
+    free(ci);
+}
+
+
+/*
+ *  Access records
+ */
+
+uint32 IndexNumRecords(const collection_index *ci)
+{
+    uint32 num = ci->header->num_records;
+    uint32 mapped = (ci->map_size - sizeof(index_header)) / sizeof(index_record);
+    return num > mapped ? mapped : num;        // May have been grown by another process
+}
+
+const index_record *IndexRecord(const collection_index *ci, uint32 n)
+{
+    return get_record(ci, n);
+}
+
+// Hash of path and song number of record
+static uint32 record_hash(const char *path, uint32 song)
+{
+    uint32 h = 2166136261u;        // FNV-1a
+    int i;
+    for (i=0; i<INDEX_PATH_LENGTH && path[i]; i++)
+        h = (h ^ (uint8)path[i]) * 16777619;
+    return (h ^ song) * 16777619;
+}
+
+// Add records that are not yet in the hash table, returns false if out of memory
+static bool hash_records(collection_index *ci)
+{
+    uint32 n, num = IndexNumRecords(ci);
+    if (num == ci->num_hashed && ci->buckets)
+        return true;
+
+    if (num > ci->max_chain) {
+        uint32 max = ci->max_chain ? ci->max_chain : RECORD_ALLOC;
+        while (max < num)
+            max *= 2;
+        uint32 *chain = realloc(ci->chain, max * sizeof(uint32));
+        if (chain == NULL)
+            return false;
+        ci->chain = chain;
+        ci->max_chain = max;
+    }
+
+    // Grow table to at least one bucket per record, all records are hashed again
+    if (num > ci->num_buckets || ci->buckets == NULL) {
+        uint32 size = ci->num_buckets ? ci->num_buckets : RECORD_ALLOC;
+        while (size < num)
+            size *= 2;
+        uint32 *buckets = calloc(size, sizeof(uint32));
+        if (buckets == NULL)
+            return false;
+        free(ci->buckets);
+        ci->buckets = buckets;
+        ci->num_buckets = size;
+        ci->num_hashed = 0;
+    }
+
+    for (n=ci->num_hashed; n<num; n++) {
+        const index_record *r = get_record(ci, n);
+        uint32 *b = ci->buckets + (record_hash(r->path, r->song) & (ci->num_buckets - 1));
+        ci->chain[n] = *b;
+        *b = n + 1;
+    }
+    ci->num_hashed = num;
+    return true;
+}
+
+static index_record *find_record(collection_index *ci, const char *path, uint32 song)
+{
+    uint32 n;
+    if (!hash_records(ci)) {
+        uint32 num = IndexNumRecords(ci);
+        for (n=0; n<num; n++) {
+            index_record *r = get_record(ci, n);
+            if (r->song == song && strcmp(r->path, path) == 0)
+                return r;
+        }
+        return NULL;
+    }
+
+    for (n = ci->buckets[record_hash(path, song) & (ci->num_buckets - 1)]; n; n = ci->chain[n - 1]) {
+        index_record *r = get_record(ci, n - 1);
+        if (r->song == song && strcmp(r->path, path) == 0)
+            return r;
+    }
+    return NULL;
+}
+
+const index_record *IndexFind(collection_index *ci, const char *file, int song)
+{
+    char path[PATH_MAX];
+    int64 mtime;
+    uint64 size;
+    if (!GetPSIDFileInfo(file, path, &mtime, &size))
+        return NULL;
+    return find_record(ci, path, song);
+}
+
+
+/*
+ *  Add/replace records
+ */
+
+bool IndexMakeRecord(index_record *r, const char *path, int64 mtime, uint64 size, int song)
+{
+    memset(r, 0, sizeof(index_record));
+    if (strlen(path) >= INDEX_PATH_LENGTH)
+        return false;
+    strcpy(r->path, path);
+    memcpy(r->name, module_name, 32);
+    memcpy(r->author, author_name, 32);
+    memcpy(r->copyright, copyright_info, 32);
+    r->song = song;
+    r->mtime = mtime;
+    r->size = size;
+    return true;
+}
+
+bool IndexPut(collection_index *ci, const index_record *r)
+{
+    bool ok = false;
+    flock(ci->fd, LOCK_EX);
+    if (!map_index(ci))        // Another process may have added records
+        goto done;
+
+    index_record *dst = find_record(ci, r->path, r->song);
+    if (dst) {
+        memcpy(dst, r, sizeof(index_record));
+        ok = true;
+        goto done;
+    }
+
+    // Allocate more space
+    index_header *h = ci->header;
+    if (h->num_records == h->max_records) {
+        uint32 max = h->max_records + RECORD_ALLOC;
+        if (ftruncate(ci->fd, sizeof(index_header) + (off_t)max * sizeof(index_record)) < 0 || !map_index(ci))
+            goto done;
+        h = ci->header;
+        h->max_records = max;
+    }
+
+    // Write record before making it visible
+    memcpy(get_record(ci, h->num_records), r, sizeof(index_record));
+    __sync_synchronize();
+    h->num_records++;
+    ok = true;
+
+done:
+    flock(ci->fd, LOCK_UN);
+    return ok;
+}
+
+
+bool IndexRemovePath(collection_index *ci, const char *path)
+{
+    bool found = false;
+    size_t len = strlen(path);
+    flock(ci->fd, LOCK_EX);
+    if (map_index(ci)) {
+        uint32 n, num = IndexNumRecords(ci);
+        for (n=0; n<num; n++) {
+            index_record *r = get_record(ci, n);
+            if (strncmp(r->path, path, len) == 0 && (r->path[len] == 0 || r->path[len] == '/')) {
+                r->flags |= INDEX_REMOVED;
+                found = true;
+            }
+        }
+    }
+    flock(ci->fd, LOCK_UN);
+    return found;
+}
+
+
+/*
+ *  Loudness and gain
+ */
+
+bool IndexSetLoudness(index_record *r, const loudness_meter *lm, int32 volume)
+{
+    double loudness, peak;
+    if (volume <= 0 || !LoudnessGetResult(lm, &loudness, &peak))
+        return false;
+
+    // Values are stored for the default volume
+    double vol_db = 20.0 * log10(volume / 256.0);
+    r->loudness = loudness - vol_db;
+    r->peak = peak - vol_db;
+    r->gain = REPLAYGAIN_REFERENCE - r->loudness;
+    r->analyzed_time = LoudnessGetDuration(lm);
+    r->flags |= INDEX_ANALYZED;
+    return true;
+}
+
+int32 IndexGainVolume(const index_record *r, int32 volume)
+{
+    if (!(r->flags & INDEX_ANALYZED))
+        return volume;
+    double gain = r->gain;
+    if (r->peak + gain > 0.0)
+        gain = -r->peak;
+    double v = volume * pow(10.0, gain / 20.0);
+    if (v > 0x1000)        // Limit to +24dB
+        v = 0x1000;
+    return (int32)(v + 0.5);
+}
+
+
+/*
+ *  Add songs of PSID file, analyzing their loudness
+ */
+
+static bool add_loaded_file(collection_index *ci, const char *file, int seconds)
+{
+    int freq, bits, channels;
+    SIDGetAudioFormat(&freq, &bits, &channels);
+    int frame_bytes = channels * bits / 8;
+    int32 volume = PrefsFindInt32("volume");
+    static uint8 buf[4096 * 4];
+
+    char path[PATH_MAX];
+    int64 mtime;
+    uint64 size;
+    if (!GetPSIDFileInfo(file, path, &mtime, &size))
+        return false;
+
+    int song;
+    for (song=0; song<number_of_songs; song++) {
+        index_record r;
+        if (!IndexMakeRecord(&r, path, mtime, size, song + 1))
+            return false;
+
+        // Keep existing analysis of unchanged file
+        const index_record *old = find_record(ci, r.path, r.song);
+        bool unchanged = old && old->mtime == r.mtime && old->size == r.size;
+        bool removed = old && (old->flags & INDEX_REMOVED);
+        bool keep_loudness = unchanged && ((old->flags & INDEX_ANALYZED) ? old->analyzed_time >= seconds : seconds == 0);
+        bool keep_fp = unchanged && (old->flags & INDEX_FINGERPRINT);
+        if (keep_loudness && keep_fp && !removed)
+            continue;
+
+        if (keep_fp) {
+            r.fp = old->fp;
+            r.flags |= INDEX_FINGERPRINT;
+        } else if (FingerprintSong(song, &r.fp))
+            r.flags |= INDEX_FINGERPRINT;
+
+        if (keep_loudness && (old->flags & INDEX_ANALYZED)) {
+            r.loudness = old->loudness;
+            r.peak = old->peak;
+            r.gain = old->gain;
+            r.analyzed_time = old->analyzed_time;
+            r.flags |= INDEX_ANALYZED;
+        } else if (!keep_loudness && seconds > 0) {
+            SelectSong(song);
+            loudness_meter *lm = LoudnessNew(freq, channels);
+            if (lm) {
+                SIDSetLoudnessMeter(lm);
+                int64 frames = (int64)seconds * freq;
+                while (frames > 0) {
+                    int n = frames < 4096 ? frames : 4096;
+                    SIDCalcBuffer(buf, n * frame_bytes);
+                    frames -= n;
+                }
+                SIDSetLoudnessMeter(NULL);
+                IndexSetLoudness(&r, lm, volume);
+                LoudnessDelete(lm);
+            }
+        }
+
+        D(bug("%s song %d: %f LUFS, %f dBTP\n", r.path, r.song, r.loudness, r.peak));
+        if (!IndexPut(ci, &r))
+            return false;
+    }
+    return true;
+}
+
+bool IndexAddFile(collection_index *ci, const char *file, int seconds)
+{
+    if (!LoadPSIDFile(file))
+        return false;
+    return add_loaded_file(ci, file, seconds);
+}
+
+bool IndexAddData(collection_index *ci, const char *file, const uint8 *data, size_t size, int seconds)
+{
+    if (!LoadPSIDData(data, size))
+        return false;
+    return add_loaded_file(ci, file, seconds);
+}
+
+
+/*
+ *  Find duplicate songs: candidate pairs are songs that share a band of
+ *  two successive signature hashes (locality sensitive hashing), so only
+ *  songs with a good chance of being similar are compared
+ */
+
+#define BAND_HASHES 2
+
+typedef struct band_entry band_entry;
+struct band_entry {
+    uint64 key;
+    uint32 record;
+};
+
+static int compare_band_entries(const void *a, const void *b)
+{
+    const band_entry *x = a, *y = b;
+    if (x->key != y->key)
+        return x->key < y->key ? -1 : 1;
+    return x->record < y->record ? -1 : x->record > y->record;
+}
+
+static uint32 find_group(uint32 *group, uint32 n)
+{
+    while (group[n] != n) {
+        group[n] = group[group[n]];
+        n = group[n];
+    }
+    return n;
+}
+
+uint32 *IndexGroupDuplicates(const collection_index *ci, double threshold)
+{
+    uint32 num = IndexNumRecords(ci);
+    uint32 *group = malloc((num ? num : 1) * sizeof(uint32));
+    band_entry *entries = malloc((num ? num : 1) * sizeof(band_entry));
+    if (group == NULL || entries == NULL) {
+        free(group);
+        free(entries);
+        return NULL;
+    }
+    uint32 n, i, j;
+    for (n=0; n<num; n++)
+        group[n] = n;
+
+    int band;
+    for (band=0; band<FINGERPRINT_HASHES; band+=BAND_HASHES) {
+        uint32 num_entries = 0;
+        for (n=0; n<num; n++) {
+            const index_record *r = get_record(ci, n);
+            if ((r->flags & (INDEX_FINGERPRINT | INDEX_REMOVED)) == INDEX_FINGERPRINT) {
+                entries[num_entries].key = (uint64)r->fp.hash[band] << 32 | r->fp.hash[band + 1];
+                entries[num_entries].record = n;
+                num_entries++;
+            }
+        }
+        qsort(entries, num_entries, sizeof(band_entry), compare_band_entries);
+
+        // Compare songs in the same bucket
+        for (i=0; i<num_entries; i=j) {
+            for (j=i+1; j<num_entries && entries[j].key == entries[i].key; j++) ;
+            uint32 a, b;
+            for (a=i; a<j; a++)
+                for (b=a+1; b<j; b++) {
+                    uint32 x = entries[a].record, y = entries[b].record;
+                    if (find_group(group, x) == find_group(group, y))
+                        continue;
+                    if (FingerprintSimilarity(&get_record(ci, x)->fp, &get_record(ci, y)->fp) >= threshold) {
+                        x = find_group(group, x);
+                        y = find_group(group, y);
+                        if (x < y)
+                            group[y] = x;
+                        else
+                            group[x] = y;
+                    }
+                }
+        }
+    }
+    free(entries);
+
+    for (n=0; n<num; n++)
+        group[n] = find_group(group, n);
+    return group;
+}
@@ -0,0 +1,123 @@
+/*
+ *  index.h - Collection index
+ *
+ *  SIDPlayer (C) Copyright 1996-2004 Christian Bauer
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+
+#ifndef INDEX_H
+#define INDEX_H
+
+#include "types.h"
+#include "loudness.h"
+#include "fingerprint.h"
+
+#include <stddef.h>
+
+
+/*
+ *  Definitions
+ */
+
+// Maximum length of file path in index (including terminating 0)
+#define INDEX_PATH_LENGTH 256
+
+// Record of one song of a tune (the index file is an array of these in
+// native byte order, so it can be mapped and used directly)
+typedef struct index_record index_record;
+struct index_record {
+    char path[INDEX_PATH_LENGTH];    // Absolute path of file
+    char name[32];                    // PSID header fields (not 0-terminated if 32 chars long)
+    char author[32];
+    char copyright[32];
+    uint32 song;                    // Song number (1-based)
+    uint32 flags;                    // INDEX_* flags
+    int64 mtime;                    // Modification time and size of file when indexed
+    uint64 size;
+    float loudness;                    // Integrated loudness at volume 0x100 (LUFS)
+    float peak;                        // True peak at volume 0x100 (dBTP)
+    float gain;                        // ReplayGain 2.0 gain (dB)
+    float analyzed_time;            // Length of analyzed audio (seconds)
+    fingerprint fp;                    // Fingerprint of register writes
+    uint8 reserved[56];                // Reserved for later use (0)
+};
+
+// Record flags
+enum {
+    INDEX_ANALYZED = 1,                // Loudness/peak/gain are valid
+    INDEX_FINGERPRINT = 2,            // Fingerprint is valid
+    INDEX_REMOVED = 4                // File was removed from the collection
+};
+
+// Opened collection index
+typedef struct collection_index collection_index;
+
+
+/*
+ *  Functions
+ */
+
+// Open index file (created if it doesn't exist), returns NULL on error
+extern collection_index *IndexOpen(const char *file);
+
+// Close index file
+extern void IndexClose(collection_index *ci);
+
+// Get number of records and record by number
+extern uint32 IndexNumRecords(const collection_index *ci);
+extern const index_record *IndexRecord(const collection_index *ci, uint32 n);
+
+// Find record of song (1-based) of file (on disk, in the pack or in a zip
+// archive), returns NULL if not in index
+extern const index_record *IndexFind(collection_index *ci, const char *file, int song);
+
+// Set up new record for song (1-based) of PSID file with the given canonical
+// path, modification time and size (see GetPSIDFileInfo()), with the header
+// fields of the currently loaded tune, returns false if the path is too long
+extern bool IndexMakeRecord(index_record *r, const char *path, int64 mtime, uint64 size, int song);
+
+// Add or replace record (path and song of the record identify it), returns false on error
+extern bool IndexPut(collection_index *ci, const index_record *r);
+
+// Mark records of file, or of all files in directory, as removed (records
+// are never deleted, so record numbers stay valid), path must be absolute,
+// returns false if there were none
+extern bool IndexRemovePath(collection_index *ci, const char *path);
+
+// Add all songs of PSID file to index with their fingerprints, and analyze
+// loudness of each song by rendering it for the given time (0 = no
+// analysis), returns false if the file is not a PSID file
+extern bool IndexAddFile(collection_index *ci, const char *file, int seconds);
+
+// Same as IndexAddFile() for file data that has already been read
+extern bool IndexAddData(collection_index *ci, const char *file, const uint8 *data, size_t size, int seconds);
+
+// Store result of loudness meter in record (for audio rendered at the given
+// volume pref value), returns false if the audio was silent
+extern bool IndexSetLoudness(index_record *r, const loudness_meter *lm, int32 volume);
+
+// Get master volume pref value that plays song of record with its ReplayGain
+// gain, based on the given volume (limited so the true peak doesn't clip)
+extern int32 IndexGainVolume(const index_record *r, int32 volume);
+
+// Group records of songs whose fingerprints have at least the given
+// similarity, returns array with the group number of every record (the
+// number of the first record of the group), or NULL on error; the array
+// must be freed by the caller
+extern uint32 *IndexGroupDuplicates(const collection_index *ci, double threshold);
+
+#endif
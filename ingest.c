@@ -0,0 +1,655 @@
+/*
+ *  ingest.c - Batched reading of PSID files
+ *
+ *  SIDPlayer (C) Copyright 1996-2004 Christian Bauer
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+
+/*
+ *  Files are read ahead by io_uring or by a pool of threads, and passed to
+ *  the function in the order they were added by a worker thread, so the
+ *  caller of IngestAdd() (walking the directories) runs alongside the
+ *  function. The function is called by one thread at a time, as it usually
+ *  uses the emulator, of which there is only one.
+ */
+
+#include "sys.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#ifdef __linux__
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+#endif
+
+#include "ingest.h"
+#include "main.h"
+
+#define DEBUG 0
+#include "debug.h"
+
+
+/*
+ *  Definitions
+ */
+
+// Number of files that may be waiting to be passed to the function for
+// every file being read before IngestAdd() waits
+#define QUEUE_FACTOR 4
+
+// Largest number of threads reading files when io_uring is not available
+#define MAX_THREADS 64
+
+#if defined(__linux__) && defined(__NR_io_uring_setup) && defined(__NR_io_uring_register)
+#define USE_URING 1
+#endif
+
+// State of file
+enum {
+    REQ_QUEUED,        // Waiting to be read
+    REQ_OPENING,    // Being opened (io_uring)
+    REQ_READING,    // Being read
+    REQ_DONE        // Read (or failed)
+};
+
+// File to be read
+typedef struct ingest_request ingest_request;
+struct ingest_request {
+    ingest_request *next;    // Next file in the order they were added
+    char *file;
+    int state;
+    int fd;
+    uint8 *buf;                // Buffer owned by the request (NULL = none)
+    const uint8 *data;        // File data (NULL = couldn't be read)
+    size_t size;
+};
+
+#ifdef USE_URING
+// io_uring instance with its mapped submission and completion rings
+typedef struct uring {
+    int fd;
+    void *sq_map, *cq_map;
+    size_t sq_map_size, cq_map_size;
+    struct io_uring_sqe *sqes;
+    size_t sqes_size;
+    unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+    unsigned *cq_head, *cq_tail, *cq_mask;
+    struct io_uring_cqe *cqes;
+    unsigned to_submit;        // Number of entries queued since last submission
+} uring;
+#endif
+
+struct ingest {
+    ingest_func func;
+    void *arg;
+    int depth;                    // Maximum number of files being read
+
+    ingest_request *head, *tail;    // Files not yet passed to the function
+    ingest_request *next_start;        // First file waiting to be read (NULL = none)
+    int num_queued;                // Number of files waiting to be read
+    int num_reading;            // Number of files being read
+    int num_pending;            // Number of files not yet passed to the function
+    bool delivering;            // Flag: a thread is passing files to the function
+
+    uint8 **free_bufs;            // Buffers of files that were passed to the function
+    int num_free_bufs;
+
+#ifdef USE_URING
+    bool use_uring;                // Flag: files are read with io_uring (by the thread calling IngestAdd())
+    bool uring_failed;            // Error submitting to io_uring, files are read in deliver()
+    uring ring;
+#endif
+
+    // Worker threads passing the files to the function, and reading them if
+    // io_uring is not available (only one thread otherwise)
+    pthread_t *threads;
+    int num_threads;
+    bool threads_read;            // Flag: threads read the files
+    pthread_mutex_t lock;        // Protects everything but the io_uring
+    pthread_cond_t work_cond;    // Signalled when a file is added or was read, or the threads should quit
+    pthread_cond_t done_cond;    // Signalled when a file was passed to the function
+    bool quit;
+};
+
+
+/*
+ *  Buffers
+ */
+
+static uint8 *get_buffer(ingest *in)
+{
+    if (in->num_free_bufs)
+        return in->free_bufs[--in->num_free_bufs];
+    return malloc(MAX_PSID_FILE_SIZE);
+}
+
+static void put_buffer(ingest *in, uint8 *buf)
+{
+    if (buf && in->num_free_bufs < in->depth)
+        in->free_bufs[in->num_free_bufs++] = buf;
+    else
+        free(buf);
+}
+
+// Find next file waiting to be read
+static void advance_next_start(ingest *in)
+{
+    while (in->next_start && in->next_start->state != REQ_QUEUED)
+        in->next_start = in->next_start->next;
+}
+
+
+/*
+ *  io_uring, submitting opens and reads of up to depth files and reading
+ *  every file with as many reads as needed (files are closed directly);
+ *  the rings are only used by the thread calling IngestAdd(), the requests
+ *  are changed with the lock held
+ */
+
+#ifdef USE_URING
+static bool uring_init(uring *r, unsigned entries)
+{
+    struct io_uring_params p;
+    memset(&p, 0, sizeof(p));
+    memset(r, 0, sizeof(uring));
+    r->fd = syscall(__NR_io_uring_setup, entries, &p);
+    if (r->fd < 0)
+        return false;
+
+    r->sq_map_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    r->cq_map_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        if (r->cq_map_size > r->sq_map_size)
+            r->sq_map_size = r->cq_map_size;
+        r->cq_map_size = r->sq_map_size;
+    }
+    r->sq_map = mmap(NULL, r->sq_map_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQ_RING);
+    if (r->sq_map == MAP_FAILED)
+        goto fail_sq;
+    if (p.features & IORING_FEAT_SINGLE_MMAP)
+        r->cq_map = r->sq_map;
+    else {
+        r->cq_map = mmap(NULL, r->cq_map_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_CQ_RING);
+        if (r->cq_map == MAP_FAILED)
+            goto fail_cq;
+    }
+    r->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+    r->sqes = mmap(NULL, r->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQES);
+    if (r->sqes == MAP_FAILED)
+        goto fail_sqes;
+
+    uint8 *sq = r->sq_map, *cq = r->cq_map;
+    r->sq_head = (unsigned *)(sq + p.sq_off.head);
+    r->sq_tail = (unsigned *)(sq + p.sq_off.tail);
+    r->sq_mask = (unsigned *)(sq + p.sq_off.ring_mask);
+    r->sq_array = (unsigned *)(sq + p.sq_off.array);
+    r->cq_head = (unsigned *)(cq + p.cq_off.head);
+    r->cq_tail = (unsigned *)(cq + p.cq_off.tail);
+    r->cq_mask = (unsigned *)(cq + p.cq_off.ring_mask);
+    r->cqes = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+    return true;
+
+fail_sqes:
+    if (r->cq_map != r->sq_map)
+        munmap(r->cq_map, r->cq_map_size);
+fail_cq:
+    munmap(r->sq_map, r->sq_map_size);
+fail_sq:
+    close(r->fd);
+    return false;
+}
+
+// Check that the kernel supports opening and reading files with io_uring
+// (IORING_OP_OPENAT and IORING_OP_READ were added in Linux 5.6, probing
+// in 5.6, too)
+static bool uring_probe(uring *r)
+{
+    size_t size = sizeof(struct io_uring_probe) + IORING_OP_LAST * sizeof(struct io_uring_probe_op);
+    struct io_uring_probe *p = calloc(1, size);
+    if (p == NULL)
+        return false;
+    bool ok = syscall(__NR_io_uring_register, r->fd, IORING_REGISTER_PROBE, p, IORING_OP_LAST) == 0
+           && p->last_op >= IORING_OP_OPENAT && p->last_op >= IORING_OP_READ
+           && (p->ops[IORING_OP_OPENAT].flags & IO_URING_OP_SUPPORTED)
+           && (p->ops[IORING_OP_READ].flags & IO_URING_OP_SUPPORTED);
+    free(p);
+    return ok;
+}
+
+static void uring_exit(uring *r)
+{
+    munmap(r->sqes, r->sqes_size);
+    if (r->cq_map != r->sq_map)
+        munmap(r->cq_map, r->cq_map_size);
+    munmap(r->sq_map, r->sq_map_size);
+    close(r->fd);
+}
+
+// Get next submission queue entry (there is always room because every
+// file being read has at most one operation in flight)
+static struct io_uring_sqe *uring_get_sqe(uring *r, ingest_request *req)
+{
+    unsigned tail = *r->sq_tail;
+    unsigned index = tail & *r->sq_mask;
+    struct io_uring_sqe *sqe = &r->sqes[index];
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->user_data = (uintptr_t)req;
+    r->sq_array[index] = index;
+    __atomic_store_n(r->sq_tail, tail + 1, __ATOMIC_RELEASE);
+    r->to_submit++;
+    return sqe;
+}
+
+static void uring_prep_open(uring *r, ingest_request *req)
+{
+    struct io_uring_sqe *sqe = uring_get_sqe(r, req);
+    sqe->opcode = IORING_OP_OPENAT;
+    sqe->fd = AT_FDCWD;
+    sqe->addr = (uintptr_t)req->file;
+    sqe->open_flags = O_RDONLY | O_CLOEXEC;
+}
+
+static void uring_prep_read(uring *r, ingest_request *req)
+{
+    struct io_uring_sqe *sqe = uring_get_sqe(r, req);
+    sqe->opcode = IORING_OP_READ;
+    sqe->fd = req->fd;
+    sqe->addr = (uintptr_t)(req->buf + req->size);
+    sqe->len = MAX_PSID_FILE_SIZE - req->size;
+    sqe->off = req->size;
+}
+
+// Submit queued entries and wait for at least min_complete completions
+static bool uring_submit(uring *r, unsigned min_complete)
+{
+    while (r->to_submit || min_complete) {
+        int ret = syscall(__NR_io_uring_enter, r->fd, r->to_submit, min_complete, min_complete ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+        if (ret < 0) {
+            if (errno == EINTR)
+                continue;
+            if ((errno == EAGAIN || errno == EBUSY) && min_complete == 0) {
+                min_complete = 1;    // Out of resources, wait for completions
+                continue;
+            }
+            return false;
+        }
+        r->to_submit -= ret;
+        if (min_complete)
+            break;
+    }
+    return true;
+}
+
+// Give up on io_uring after an error, the files are then read in deliver()
+// (the buffers of files being read are abandoned as the kernel may still
+// write to them)
+static void uring_abandon(ingest *in)
+{
+    ingest_request *req;
+    for (req=in->head; req; req=req->next) {
+        if (req->state == REQ_OPENING || req->state == REQ_READING)
+            req->buf = NULL;
+        if (req->state != REQ_DONE) {
+            req->data = NULL;
+            req->state = REQ_DONE;
+        }
+    }
+    in->next_start = NULL;
+    in->num_queued = in->num_reading = 0;
+}
+
+// Open files waiting to be read
+static void uring_start(ingest *in)
+{
+    while (in->next_start && in->num_reading < in->depth) {
+        ingest_request *req = in->next_start;
+        req->buf = get_buffer(in);
+        in->num_queued--;
+        if (req->buf) {
+            req->state = REQ_OPENING;
+            in->num_reading++;
+            uring_prep_open(&in->ring, req);
+        } else
+            req->state = REQ_DONE;
+        advance_next_start(in);
+    }
+}
+
+static void uring_finish_request(ingest *in, ingest_request *req, bool ok)
+{
+    if (req->fd >= 0)
+        close(req->fd);
+    req->fd = -1;
+    req->data = ok ? req->buf : NULL;
+    req->state = REQ_DONE;
+    in->num_reading--;
+}
+
+// Handle completed operations
+static void uring_reap(ingest *in)
+{
+    uring *r = &in->ring;
+    unsigned head = *r->cq_head;
+    while (head != __atomic_load_n(r->cq_tail, __ATOMIC_ACQUIRE)) {
+        const struct io_uring_cqe *cqe = &r->cqes[head & *r->cq_mask];
+        ingest_request *req = (ingest_request *)(uintptr_t)cqe->user_data;
+        int res = cqe->res;
+        head++;
+
+        if (req->state == REQ_OPENING) {
+            if (res < 0)
+                uring_finish_request(in, req, false);
+            else {
+                req->fd = res;
+                req->state = REQ_READING;
+                uring_prep_read(r, req);
+            }
+        } else if (res < 0)
+            uring_finish_request(in, req, false);
+        else {
+            req->size += res;
+            if (res == 0 || req->size == MAX_PSID_FILE_SIZE)
+                uring_finish_request(in, req, true);
+            else
+                uring_prep_read(r, req);    // Short read
+        }
+    }
+    __atomic_store_n(r->cq_head, head, __ATOMIC_RELEASE);
+}
+#endif
+
+
+/*
+ *  Pass files that have been read to the function, in the order they were
+ *  added (and files that couldn't be read from disk, as they may be in a
+ *  zip archive); called by one worker thread at a time with the lock held,
+ *  which is released during the calls
+ */
+
+static void deliver(ingest *in)
+{
+    in->delivering = true;
+    while (in->head && in->head->state == REQ_DONE) {
+        ingest_request *req = in->head;
+        in->head = req->next;
+        if (in->head == NULL)
+            in->tail = NULL;
+        pthread_mutex_unlock(&in->lock);
+
+        if (req->data)
+            in->func(in->arg, req->file, req->data, req->size);
+        else {
+            size_t size;
+            uint8 *buf = ReadPSIDFile(req->file, &size);
+            in->func(in->arg, req->file, buf, buf ? size : 0);
+            free(buf);
+        }
+        free(req->file);
+
+        pthread_mutex_lock(&in->lock);
+        put_buffer(in, req->buf);
+        free(req);
+        in->num_pending--;
+        pthread_cond_broadcast(&in->done_cond);
+    }
+    in->delivering = false;
+}
+
+
+/*
+ *  Worker threads, every thread reads one file at a time (without io_uring)
+ *  or passes the files that have been read to the function
+ */
+
+// Read next file waiting to be read (lock must be held, it is released while reading)
+static void read_file(ingest *in)
+{
+    ingest_request *req = in->next_start;
+    req->state = REQ_READING;
+    req->buf = get_buffer(in);
+    in->num_queued--;
+    in->num_reading++;
+    advance_next_start(in);
+    pthread_mutex_unlock(&in->lock);
+
+    bool ok = false;
+    int fd = req->buf ? open(req->file, O_RDONLY | O_CLOEXEC) : -1;
+    if (fd >= 0) {
+        for (;;) {
+            ssize_t actual = read(fd, req->buf + req->size, MAX_PSID_FILE_SIZE - req->size);
+            if (actual < 0 && errno == EINTR)
+                continue;
+            if (actual <= 0) {
+                ok = actual == 0;
+                break;
+            }
+            req->size += actual;
+            if (req->size == MAX_PSID_FILE_SIZE) {
+                ok = true;
+                break;
+            }
+        }
+        close(fd);
+    }
+
+    pthread_mutex_lock(&in->lock);
+    req->data = ok ? req->buf : NULL;
+    req->state = REQ_DONE;
+    in->num_reading--;
+}
+
+static void *worker_thread(void *arg)
+{
+    ingest *in = arg;
+    pthread_mutex_lock(&in->lock);
+    for (;;) {
+        if (!in->delivering && in->head && in->head->state == REQ_DONE)
+            deliver(in);
+        else if (in->threads_read && in->next_start)
+            read_file(in);
+        else if (in->quit)
+            break;
+        else
+            pthread_cond_wait(&in->work_cond, &in->lock);
+    }
+    pthread_mutex_unlock(&in->lock);
+    return NULL;
+}
+
+
+/*
+ *  Create reader
+ */
+
+ingest *IngestNew(int depth, ingest_func func, void *arg)
+{
+    if (depth < 1)
+        depth = 1;
+    ingest *in = calloc(1, sizeof(ingest));
+    if (in == NULL)
+        return NULL;
+    in->func = func;
+    in->arg = arg;
+    in->depth = depth;
+    in->free_bufs = malloc(depth * sizeof(uint8 *));
+    if (in->free_bufs == NULL) {
+        free(in);
+        return NULL;
+    }
+    pthread_mutex_init(&in->lock, NULL);
+    pthread_cond_init(&in->work_cond, NULL);
+    pthread_cond_init(&in->done_cond, NULL);
+
+    int n = depth < MAX_THREADS ? depth : MAX_THREADS;
+    in->threads_read = true;
+#ifdef USE_URING
+    in->use_uring = uring_init(&in->ring, depth);
+    if (in->use_uring && !uring_probe(&in->ring)) {
+        D(bug("io_uring can't open and read files\n"));
+        uring_exit(&in->ring);
+        in->use_uring = false;
+    }
+    if (in->use_uring) {
+        in->threads_read = false;
+        n = 1;
+    }
+#endif
+
+    in->threads = malloc(n * sizeof(pthread_t));
+    if (in->threads) {
+        while (in->num_threads < n && pthread_create(&in->threads[in->num_threads], NULL, worker_thread, in) == 0)
+            in->num_threads++;
+    }
+    if (in->num_threads == 0) {
+        IngestFinish(in);
+        return NULL;
+    }
+    D(bug("Reading files with %s, %d threads\n", in->threads_read ? "threads" : "io_uring", in->num_threads));
+    return in;
+}
+
+
+/*
+ *  Start reading files (io_uring), and wait until a file was read or passed
+ *  to the function if wait is set
+ */
+
+static void process(ingest *in, bool wait)
+{
+    pthread_mutex_lock(&in->lock);
+#ifdef USE_URING
+    if (in->use_uring) {
+        if (!in->uring_failed) {
+            uring_start(in);
+            bool reading = in->num_reading > 0;
+            pthread_mutex_unlock(&in->lock);
+            bool ok = uring_submit(&in->ring, wait && reading ? 1 : 0);
+            pthread_mutex_lock(&in->lock);
+            if (ok) {
+                uring_reap(in);
+                if (reading)
+                    wait = false;
+            } else {
+                fprintf(stderr, "Couldn't submit reads (%s)\n", strerror(errno));
+                in->uring_failed = true;
+            }
+        }
+        if (in->uring_failed)
+            uring_abandon(in);
+        pthread_cond_broadcast(&in->work_cond);
+    }
+#endif
+
+    // Wait for the worker threads
+    if (wait && in->num_pending)
+        pthread_cond_wait(&in->done_cond, &in->lock);
+    pthread_mutex_unlock(&in->lock);
+}
+
+
+/*
+ *  Add file to be read
+ */
+
+static int num_pending(ingest *in)
+{
+    pthread_mutex_lock(&in->lock);
+    int n = in->num_pending;
+    pthread_mutex_unlock(&in->lock);
+    return n;
+}
+
+void IngestAdd(ingest *in, const char *file)
+{
+    ingest_request *req = calloc(1, sizeof(ingest_request));
+    if (req == NULL || (req->file = strdup(file)) == NULL) {
+        free(req);
+        while (num_pending(in))        // Keep order, and only one call at a time
+            process(in, true);
+        in->func(in->arg, file, NULL, 0);
+        return;
+    }
+    req->fd = -1;
+
+    // Files in the pack need not be read
+    req->data = FindPackedPSIDFile(file, &req->size);
+    if (req->data)
+        req->state = REQ_DONE;
+
+    pthread_mutex_lock(&in->lock);
+    if (in->tail)
+        in->tail->next = req;
+    else
+        in->head = req;
+    in->tail = req;
+    in->num_pending++;
+    if (req->state == REQ_QUEUED) {
+        in->num_queued++;
+        if (in->next_start == NULL)
+            in->next_start = req;
+    }
+    pthread_cond_broadcast(&in->work_cond);
+    pthread_mutex_unlock(&in->lock);
+
+    process(in, false);
+    while (num_pending(in) > in->depth * QUEUE_FACTOR)
+        process(in, true);
+}
+
+
+/*
+ *  Wait until all files have been read and passed to the function, and
+ *  delete reader
+ */
+
+void IngestFinish(ingest *in)
+{
+    if (in == NULL)
+        return;
+    while (num_pending(in))
+        process(in, true);
+
+    if (in->threads) {
+        pthread_mutex_lock(&in->lock);
+        in->quit = true;
+        pthread_cond_broadcast(&in->work_cond);
+        pthread_mutex_unlock(&in->lock);
+        int i;
+        for (i=0; i<in->num_threads; i++)
+            pthread_join(in->threads[i], NULL);
+        free(in->threads);
+    }
+#ifdef USE_URING
+    if (in->use_uring)
+        uring_exit(&in->ring);
+#endif
+
+    while (in->num_free_bufs)
+        free(in->free_bufs[--in->num_free_bufs]);
+    free(in->free_bufs);
+    pthread_mutex_destroy(&in->lock);
+    pthread_cond_destroy(&in->work_cond);
+    pthread_cond_destroy(&in->done_cond);
+    free(in);
+}
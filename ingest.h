@@ -0,0 +1,59 @@
+/*
+ *  ingest.h - Batched reading of PSID files
+ *
+ *  SIDPlayer (C) Copyright 1996-2004 Christian Bauer
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+
+#ifndef INGEST_H
+#define INGEST_H
+
+#include "types.h"
+
+#include <stddef.h>
+
+
+/*
+ *  Definitions
+ */
+
+// Reader of a batch of files
+typedef struct ingest ingest;
+
+// Function called with the data of every file, in the order the files were
+// added (data is NULL if the file couldn't be read, and only valid during
+// the call); it is called by a worker thread, but never by two threads at
+// the same time
+typedef void (*ingest_func)(void *arg, const char *file, const uint8 *data, size_t size);
+
+
+/*
+ *  Functions
+ */
+
+// Create reader that keeps up to depth files being read, returns NULL on error
+extern ingest *IngestNew(int depth, ingest_func func, void *arg);
+
+// Add file to be read (waits while too many files are waiting to be passed
+// to the function)
+extern void IngestAdd(ingest *in, const char *file);
+
+// Wait until all files have been read and passed to the function, and
+// delete reader
+extern void IngestFinish(ingest *in);
+
+#endif
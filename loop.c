@@ -0,0 +1,290 @@
+/*
+ *  loop.c - Loop detection for long-running playback
+ *
+ *  SIDPlayer (C) Copyright 1996-2004 Christian Bauer
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+
+/*
+ *  Most tunes loop forever after some time. After every replay, a
+ *  fingerprint of the machine state (see SIDLoopHash()) is recorded
+ *  together with the position in the stream. When the fingerprint of an
+ *  earlier replay comes up again and the following ones repeat as well,
+ *  the tune has looped, and the audio from then on is the audio rendered
+ *  since the matching replay, played over and over again.
+ *
+ *  The rendered audio is kept in a ring buffer, so only loops that are
+ *  shorter than the history can be found. Fingerprints are kept in a ring
+ *  of replay marks and indexed by an open hash table, which is rebuilt
+ *  from the ring from time to time to get rid of stale entries.
+ */
+
+#include "sys.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "loop.h"
+#include "sid.h"
+
+#define DEBUG 0
+#include "debug.h"
+
+
+// Minimum number of sample frames between replays for which marks are kept
+#define MIN_REPLAY_FRAMES 64
+
+// Maximum number of repeating replays to check before accepting a loop
+#define CONFIRM_MARKS 64
+
+// Replay mark
+typedef struct mark_t mark_t;
+struct mark_t {
+    uint64 hash;                // Fingerprint of machine state after replay
+    uint64 pos;                    // Stream position of replay (sample frames)
+};
+
+struct loop_detector {
+    int frame_bytes;
+    uint32 min_frames;
+
+    uint8 *history;                // Ring buffer of rendered audio
+    uint32 history_frames;
+    uint64 end;                    // Stream position after last rendered frame
+    uint64 block_pos;            // Stream position of block being rendered
+
+    mark_t *marks;                // Ring of replay marks
+    uint32 max_marks;
+    uint64 num_marks;            // Total number of marks recorded, mark n is at marks[n % max_marks]
+
+    uint64 *table;                // Hash table of mark numbers + 1 (0 = empty slot)
+    uint32 table_mask;
+    uint32 table_inserts;        // Number of inserts since last rebuild
+
+    uint64 period;                // Candidate loop length in marks (0 = none)
+    uint64 length;                // Candidate loop length in sample frames
+    uint32 confirmed;            // Number of repeated marks of candidate
+
+    bool active;                // Flag: loop found, playing from history
+    uint64 read_pos;            // Stream position of next frame to play from history
+};
+
+
+/*
+ *  Create/delete loop detector
+ */
+
+loop_detector *LoopNew(int frame_bytes, uint32 history_frames, uint32 min_frames)
+{
+    loop_detector *ld = calloc(1, sizeof(loop_detector));
+    if (ld == NULL)
+        return NULL;
+    ld->frame_bytes = frame_bytes;
+    ld->min_frames = min_frames;
+    ld->history_frames = history_frames;
+    ld->max_marks = history_frames / MIN_REPLAY_FRAMES + 1;
+    uint32 size = 1;
+    while (size < ld->max_marks * 2)
+        size <<= 1;
+    ld->table_mask = size - 1;
+
+    ld->history = malloc((size_t)history_frames * frame_bytes);
+    ld->marks = malloc(ld->max_marks * sizeof(mark_t));
+    ld->table = calloc(size, sizeof(uint64));
+    if (ld->history == NULL || ld->marks == NULL || ld->table == NULL) {
+        LoopDelete(ld);
+        return NULL;
+    }
+    return ld;
+}
+
+void LoopDelete(loop_detector *ld)
+{
+    if (ld == NULL)
+        return;
+    free(ld->history);
+    free(ld->marks);
+    free(ld->table);
+    free(ld);
+}
+
+
+/*
+ *  Mark handling
+ */
+
+static mark_t *get_mark(loop_detector *ld, uint64 n)
+{
+    return ld->marks + n % ld->max_marks;
+}
+
+// Check whether mark is still in the ring, and its audio in the history
+static bool mark_valid(loop_detector *ld, uint64 n)
+{
+    return n < ld->num_marks && ld->num_marks - n <= ld->max_marks
+        && get_mark(ld, n)->pos + ld->history_frames >= ld->end;
+}
+
+// Find latest mark with given fingerprint, returns false if not found
+static bool find_mark(loop_detector *ld, uint64 hash, uint64 *n)
+{
+    uint32 i;
+    for (i=hash & ld->table_mask; ld->table[i]; i=(i+1) & ld->table_mask) {
+        uint64 m = ld->table[i] - 1;
+        if (get_mark(ld, m)->hash == hash && mark_valid(ld, m)) {
+            *n = m;
+            return true;
+        }
+    }
+    return false;
+}
+
+// Enter mark into hash table (replacing older mark with the same fingerprint)
+static void insert_mark(loop_detector *ld, uint64 n)
+{
+    uint64 hash = get_mark(ld, n)->hash;
+    uint32 i;
+    for (i=hash & ld->table_mask; ld->table[i]; i=(i+1) & ld->table_mask) {
+        uint64 m = ld->table[i] - 1;
+        if (!mark_valid(ld, m) || get_mark(ld, m)->hash == hash)
+            break;
+    }
+    ld->table[i] = n + 1;
+    ld->table_inserts++;
+}
+
+// Rebuild hash table from valid marks
+static void rebuild_table(loop_detector *ld)
+{
+    memset(ld->table, 0, (size_t)(ld->table_mask + 1) * sizeof(uint64));
+    ld->table_inserts = 0;
+    uint64 n = ld->num_marks > ld->max_marks ? ld->num_marks - ld->max_marks : 0;
+    for (; n<ld->num_marks; n++)
+        if (mark_valid(ld, n))
+            insert_mark(ld, n);
+}
+
+// Replay hook: record mark and check for loop
+static void replay_hook(void *arg, int frame)
+{
+    loop_detector *ld = arg;
+    uint64 n = ld->num_marks;
+    mark_t *mark = get_mark(ld, n);
+    mark->hash = SIDLoopHash();
+    mark->pos = ld->block_pos + frame;
+    ld->num_marks++;
+
+    if (ld->period) {
+
+        // Check whether candidate loop continues
+        uint64 p = n - ld->period;
+        if (mark_valid(ld, p) && get_mark(ld, p)->hash == mark->hash && mark->pos - get_mark(ld, p)->pos == ld->length)
+            ld->confirmed++;
+        else {
+            D(bug("loop candidate of %llu frames failed\n", (unsigned long long)ld->length));
+            ld->period = 0;
+        }
+
+    } else {
+
+        // Look for earlier mark with same fingerprint
+        uint64 p;
+        if (find_mark(ld, mark->hash, &p)) {
+            uint64 length = mark->pos - get_mark(ld, p)->pos;
+            if (length >= ld->min_frames && length <= ld->history_frames / 2) {
+                ld->period = n - p;
+                ld->length = length;
+                ld->confirmed = 0;
+            }
+        }
+    }
+
+    if (ld->table_inserts > ld->max_marks)
+        rebuild_table(ld);
+    insert_mark(ld, n);
+}
+
+
+/*
+ *  Render audio data
+ */
+
+static void copy_frames(loop_detector *ld, uint8 *dst, uint64 pos, uint32 frames, bool to_history)
+{
+    while (frames) {
+        uint32 offset = pos % ld->history_frames;
+        uint32 chunk = ld->history_frames - offset;
+        if (chunk > frames)
+            chunk = frames;
+        uint8 *h = ld->history + (size_t)offset * ld->frame_bytes;
+        if (to_history)
+            memcpy(h, dst, (size_t)chunk * ld->frame_bytes);
+        else
+            memcpy(dst, h, (size_t)chunk * ld->frame_bytes);
+        dst += (size_t)chunk * ld->frame_bytes;
+        pos += chunk;
+        frames -= chunk;
+    }
+}
+
+void LoopCalcBuffer(loop_detector *ld, uint8 *buf, int count)
+{
+    uint32 frames = count / ld->frame_bytes;
+
+    // Play loop body from history
+    if (ld->active) {
+        while (frames) {
+            uint32 chunk = ld->end - ld->read_pos;
+            if (chunk > frames)
+                chunk = frames;
+            copy_frames(ld, buf, ld->read_pos, chunk, false);
+            buf += (size_t)chunk * ld->frame_bytes;
+            frames -= chunk;
+            ld->read_pos += chunk;
+            if (ld->read_pos == ld->end)
+                ld->read_pos -= ld->length;
+        }
+        return;
+    }
+
+    // Run emulator and record replays
+    ld->block_pos = ld->end;
+    SIDSetReplayHook(replay_hook, ld);
+    SIDCalcBuffer(buf, count);
+    SIDSetReplayHook(NULL, NULL);
+
+    // Append audio to history (only the last history_frames are needed)
+    uint32 keep = frames < ld->history_frames ? frames : ld->history_frames;
+    copy_frames(ld, buf + (size_t)(frames - keep) * ld->frame_bytes, ld->end + frames - keep, keep, true);
+    ld->end += frames;
+
+    // Loop confirmed? Then continue with the audio one loop length ago
+    if (ld->period && (ld->confirmed >= ld->period || ld->confirmed >= CONFIRM_MARKS) && ld->length <= ld->history_frames) {
+        D(bug("loop of %llu frames found at %llu\n", (unsigned long long)ld->length, (unsigned long long)ld->end));
+        ld->active = true;
+        ld->read_pos = ld->end - ld->length;
+        free(ld->marks);
+        free(ld->table);
+        ld->marks = NULL;
+        ld->table = NULL;
+    }
+}
+
+bool LoopActive(const loop_detector *ld)
+{
+    return ld->active;
+}
@@ -0,0 +1,60 @@
+/*
+ *  loop.h - Loop detection for long-running playback
+ *
+ *  SIDPlayer (C) Copyright 1996-2004 Christian Bauer
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+
+#ifndef LOOP_H
+#define LOOP_H
+
+#include "types.h"
+
+#include <stddef.h>
+
+
+/*
+ *  Definitions
+ */
+
+// Loop detector of one stream
+typedef struct loop_detector loop_detector;
+
+
+/*
+ *  Functions
+ */
+
+// Create loop detector for audio with given frame size (in bytes), keeping a
+// history of the given number of sample frames; only loops of at least
+// min_frames sample frames are accepted, returns NULL on error
+extern loop_detector *LoopNew(int frame_bytes, uint32 history_frames, uint32 min_frames);
+
+// Delete loop detector
+extern void LoopDelete(loop_detector *ld);
+
+// Render audio data (count bytes) of the stream, like SIDCalcBuffer(): as long
+// as no loop was found, the emulator (which must contain the context of the
+// stream) is run and the state is checked for repetition after every replay;
+// after that, the loop body is played from the history and the emulator is
+// not used anymore
+extern void LoopCalcBuffer(loop_detector *ld, uint8 *buf, int count);
+
+// Check whether loop was found (i.e. the emulator is not needed anymore)
+extern bool LoopActive(const loop_detector *ld);
+
+#endif
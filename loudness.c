@@ -0,0 +1,264 @@
+/*
+ *  loudness.c - Loudness analysis (EBU R128)
+ *
+ *  SIDPlayer (C) Copyright 1996-2004 Christian Bauer
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+
+/*
+ *  Integrated loudness according to ITU-R BS.1770-4 / EBU R128: the audio
+ *  is K-weighted (a high shelf followed by a high pass), the mean square of
+ *  every 400ms block (overlapping by 75%) is computed and summed over the
+ *  channels, and the blocks are gated, first at -70 LUFS, then at 10 LU
+ *  below the loudness of the blocks that passed the first gate.
+ *
+ *  The true peak is the maximum of the audio oversampled 4 times with a
+ *  windowed sinc interpolator.
+ */
+
+#include "sys.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#include "loudness.h"
+
+
+// Maximum number of channels
+#define MAX_CHANNELS 2
+
+// Length of gating blocks in steps (steps are 100ms)
+#define BLOCK_STEPS 4
+
+// Absolute and relative gate (LUFS/LU)
+#define ABSOLUTE_GATE -70.0
+#define RELATIVE_GATE -10.0
+
+// Oversampling factor and filter taps per phase of true peak interpolator
+#define TP_FACTOR 4
+#define TP_TAPS 12
+
+// Biquad filter
+typedef struct biquad_t biquad_t;
+struct biquad_t {
+    double b0, b1, b2, a1, a2;
+};
+
+struct loudness_meter {
+    int channels;
+
+    biquad_t shelf, highpass;                // K-weighting filters
+    double z[MAX_CHANNELS][4];                // Filter states (direct form II, 2 per filter)
+
+    int freq;
+    int step_frames;                        // Number of frames in 100ms step
+    int step_pos;                            // Frames in current step so far
+    double step_sum;                        // Sum of squares of current step
+    double steps[BLOCK_STEPS];                // Sums of squares of last steps
+    int num_steps;                            // Number of steps so far
+
+    double *blocks;                            // Mean squares of all gating blocks
+    size_t num_blocks, max_blocks;
+
+    float tp_coef[TP_FACTOR][TP_TAPS];        // True peak interpolator
+    float tp_hist[MAX_CHANNELS][TP_TAPS];    // Last input samples (ring)
+    int tp_pos;
+    double peak;                            // Maximum absolute (oversampled) sample value
+};
+
+
+/*
+ *  Create/delete loudness meter
+ */
+
+loudness_meter *LoudnessNew(int freq, int channels)
+{
+    if (channels < 1 || channels > MAX_CHANNELS)
+        return NULL;
+    loudness_meter *lm = calloc(1, sizeof(loudness_meter));
+    if (lm == NULL)
+        return NULL;
+    lm->channels = channels;
+    lm->freq = freq;
+
+    // K-weighting filters for given sample rate (stage 1: high shelf, stage 2: high pass)
+    double f0 = 1681.974450955533, g = 3.999843853973347, q = 0.7071752369554196;
+    double k = tan(M_PI * f0 / freq);
+    double vh = pow(10.0, g / 20.0);
+    double vb = pow(vh, 0.4996667741545416);
+    double a0 = 1.0 + k / q + k * k;
+    lm->shelf.b0 = (vh + vb * k / q + k * k) / a0;
+    lm->shelf.b1 = 2.0 * (k * k - vh) / a0;
+    lm->shelf.b2 = (vh - vb * k / q + k * k) / a0;
+    lm->shelf.a1 = 2.0 * (k * k - 1.0) / a0;
+    lm->shelf.a2 = (1.0 - k / q + k * k) / a0;
+
+    f0 = 38.13547087602444;
+    q = 0.5003270373238773;
+    k = tan(M_PI * f0 / freq);
+    a0 = 1.0 + k / q + k * k;
+    lm->highpass.b0 = 1.0;
+    lm->highpass.b1 = -2.0;
+    lm->highpass.b2 = 1.0;
+    lm->highpass.a1 = 2.0 * (k * k - 1.0) / a0;
+    lm->highpass.a2 = (1.0 - k / q + k * k) / a0;
+
+    lm->step_frames = freq / 10;
+
+    // Interpolator: phase p computes the value at 6 - p/4 samples before the newest one
+    int p, t;
+    for (p=0; p<TP_FACTOR; p++)
+        for (t=0; t<TP_TAPS; t++) {
+            double x = t - TP_TAPS / 2 + (double)p / TP_FACTOR;
+            double sinc = x == 0.0 ? 1.0 : sin(M_PI * x) / (M_PI * x);
+            double window = 0.5 * (1.0 + cos(M_PI * x / (TP_TAPS / 2)));
+            lm->tp_coef[p][t] = sinc * window;
+        }
+
+    return lm;
+}
+
+void LoudnessDelete(loudness_meter *lm)
+{
+    if (lm == NULL)
+        return;
+    free(lm->blocks);
+    free(lm);
+}
+
+
+/*
+ *  Analyze audio data
+ */
+
+static double biquad(const biquad_t *f, double *z, double x)
+{
+    double w = x - f->a1 * z[0] - f->a2 * z[1];
+    double y = f->b0 * w + f->b1 * z[0] + f->b2 * z[1];
+    z[1] = z[0];
+    z[0] = w;
+    return y;
+}
+
+// Record mean square of gating block ending with the current step
+static void add_block(loudness_meter *lm)
+{
+    if (lm->num_blocks == lm->max_blocks) {
+        size_t max = lm->max_blocks ? lm->max_blocks * 2 : 1024;
+        double *b = realloc(lm->blocks, max * sizeof(double));
+        if (b == NULL)
+            return;
+        lm->blocks = b;
+        lm->max_blocks = max;
+    }
+    double sum = 0;
+    int i;
+    for (i=0; i<BLOCK_STEPS; i++)
+        sum += lm->steps[i];
+    lm->blocks[lm->num_blocks++] = sum / (BLOCK_STEPS * lm->step_frames);
+}
+
+void LoudnessAddFrames(loudness_meter *lm, const int16 *data, int frames)
+{
+    int channels = lm->channels;
+    int i, c, p, t;
+    for (i=0; i<frames; i++) {
+        int pos = lm->tp_pos;
+        lm->tp_pos = (pos + 1) % TP_TAPS;
+        for (c=0; c<channels; c++) {
+            double x = data[i * channels + c] / 32768.0;
+
+            // K-weighted power
+            double y = biquad(&lm->shelf, lm->z[c], x);
+            y = biquad(&lm->highpass, lm->z[c] + 2, y);
+            lm->step_sum += y * y;
+
+            // True peak (the interpolator only overshoots the sample peak)
+            float *hist = lm->tp_hist[c];
+            hist[pos] = x;
+            if (fabs(x) > lm->peak)
+                lm->peak = fabs(x);
+            for (p=1; p<TP_FACTOR; p++) {
+                float sum = 0;
+                for (t=0; t<TP_TAPS; t++)
+                    sum += lm->tp_coef[p][t] * hist[(pos + TP_TAPS - t) % TP_TAPS];
+                if (fabsf(sum) > lm->peak)
+                    lm->peak = fabsf(sum);
+            }
+        }
+
+        // End of 100ms step?
+        if (++lm->step_pos == lm->step_frames) {
+            lm->steps[lm->num_steps % BLOCK_STEPS] = lm->step_sum;
+            lm->num_steps++;
+            lm->step_pos = 0;
+            lm->step_sum = 0;
+            if (lm->num_steps >= BLOCK_STEPS)
+                add_block(lm);
+        }
+    }
+}
+
+
+/*
+ *  Get analysis result
+ */
+
+double LoudnessGetDuration(const loudness_meter *lm)
+{
+    return ((double)lm->num_steps * lm->step_frames + lm->step_pos) / lm->freq;
+}
+
+static double block_loudness(double mean_square)
+{
+    return -0.691 + 10.0 * log10(mean_square);
+}
+
+bool LoudnessGetResult(const loudness_meter *lm, double *loudness, double *peak)
+{
+    *peak = lm->peak > 0 ? 20.0 * log10(lm->peak) : -HUGE_VAL;
+
+    // Absolute gate
+    double abs_threshold = pow(10.0, (ABSOLUTE_GATE + 0.691) / 10.0);
+    double sum = 0;
+    size_t n = 0, i;
+    for (i=0; i<lm->num_blocks; i++)
+        if (lm->blocks[i] > abs_threshold) {
+            sum += lm->blocks[i];
+            n++;
+        }
+    if (n == 0)
+        return false;
+
+    // Relative gate
+    double rel_threshold = pow(10.0, (block_loudness(sum / n) + RELATIVE_GATE + 0.691) / 10.0);
+    if (rel_threshold < abs_threshold)
+        rel_threshold = abs_threshold;
+    sum = 0;
+    n = 0;
+    for (i=0; i<lm->num_blocks; i++)
+        if (lm->blocks[i] > rel_threshold) {
+            sum += lm->blocks[i];
+            n++;
+        }
+    if (n == 0)
+        return false;
+
+    *loudness = block_loudness(sum / n);
+    return true;
+}
@@ -0,0 +1,60 @@
+/*
+ *  loudness.h - Loudness analysis (EBU R128)
+ *
+ *  SIDPlayer (C) Copyright 1996-2004 Christian Bauer
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+
+#ifndef LOUDNESS_H
+#define LOUDNESS_H
+
+#include "types.h"
+
+
+/*
+ *  Definitions
+ */
+
+// Loudness meter of one audio stream
+typedef struct loudness_meter loudness_meter;
+
+// Reference loudness of ReplayGain 2.0 (LUFS)
+#define REPLAYGAIN_REFERENCE -18.0
+
+
+/*
+ *  Functions
+ */
+
+// Create loudness meter for audio with given sample rate and number of
+// channels, returns NULL on error
+extern loudness_meter *LoudnessNew(int freq, int channels);
+
+// Delete loudness meter
+extern void LoudnessDelete(loudness_meter *lm);
+
+// Analyze block of interleaved 16-bit samples
+extern void LoudnessAddFrames(loudness_meter *lm, const int16 *data, int frames);
+
+// Get duration of audio analyzed so far (seconds)
+extern double LoudnessGetDuration(const loudness_meter *lm);
+
+// Get integrated loudness (LUFS) and true peak (dBTP) of the audio analyzed
+// so far, returns false if there was no audible audio
+extern bool LoudnessGetResult(const loudness_meter *lm, double *loudness, double *peak);
+
+#endif
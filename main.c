@@ -21,7 +21,18 @@
 #include "sys.h"
 
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
+#include <strings.h>
+#include <limits.h>
+#include <sys/stat.h>
+
+#ifdef __unix__
+#include <unistd.h>
+#include <signal.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#endif
 
 #include "main.h"
 #include "prefs.h"
@@ -29,6 +40,8 @@
 #include "cpu.h"
 #include "sid.h"
 #include "psid.h"
+#include "pack.h"
+#include "zip.h"
 
 
 // Global variables
@@ -41,6 +54,30 @@ char copyright_info[64];
 // Flag: PSID file loaded and ready
 static bool psid_loaded = false;
 
+// Pack that PSID files are loaded from if it contains them (NULL = none),
+// and its modification time
+static psid_pack *the_pack = NULL;
+static int64 pack_mtime;
+
+// Zip archives that PSID files were loaded from (opened on demand and kept
+// open, with their central directory)
+#define MAX_ARCHIVES 8
+static struct {
+    char *file;
+    zip_archive *zip;
+} archives[MAX_ARCHIVES];
+static int next_archive = 0;        // Entry to be replaced next
+
+// States after the init routine of every song computed in background
+// processes: shared mapping with a ready flag per song followed by the
+// states, and the processes still running
+#define MAX_PREPARE_PROCESSES 8
+static uint8 *prepared = NULL;
+static size_t prepared_size;
+static int prepared_songs;
+static pid_t prepare_pids[MAX_PREPARE_PROCESSES];
+static int num_prepare_pids = 0;
+
 // Data from PSID header
 static uint16 init_adr;                // C64 init routine address
 uint16 play_adr;                    // C64 replay routine address
@@ -49,16 +86,29 @@ static uint32 speed_flags;            // Speed flags (1 bit/song)
 
 
 
+// Prototypes
+static void stop_prepare();
+
+
 /*
  *  Init everything
  */
 
-void InitAll(int argc, char **argv)
+void InitAll(int *argc, char **argv)
 {
     PrefsInit(argc, argv);
     MemoryInit();
     SIDInit();
     CPUInit();
+
+    const char *pack_file = PrefsFindString("pack", 0);
+    if (pack_file) {
+        struct stat st;
+        if ((the_pack = PackOpen(pack_file)) == NULL)
+            fprintf(stderr, "Couldn't open pack '%s'\n", pack_file);
+        else if (stat(pack_file, &st) == 0)
+            pack_mtime = st.st_mtime;
+    }
 }
 
 
@@ -68,6 +118,16 @@ void InitAll(int argc, char **argv)
 
 void ExitAll()
 {
+    stop_prepare();
+    PackClose(the_pack);
+    the_pack = NULL;
+    int i;
+    for (i=0; i<MAX_ARCHIVES; i++) {
+        ZipClose(archives[i].zip);
+        free(archives[i].file);
+        archives[i].zip = NULL;
+        archives[i].file = NULL;
+    }
     CPUExit();
     SIDExit();
     MemoryExit();
@@ -75,6 +135,157 @@ void ExitAll()
 }
 
 
+/*
+ *  Get pack
+ */
+
+const psid_pack *GetPSIDPack()
+{
+    return the_pack;
+}
+
+
+/*
+ *  Find PSID file in pack, returns NULL if there is no pack or it doesn't
+ *  contain the file
+ */
+
+const uint8 *FindPackedPSIDFile(const char *file, size_t *size)
+{
+    if (the_pack == NULL)
+        return NULL;
+    const pack_entry *e = PackFind(the_pack, file);
+    if (e == NULL)
+        return NULL;
+    *size = e->length;
+    return PackEntryData(the_pack, e);
+}
+
+
+/*
+ *  Read PSID file from zip archive (if the path is "ARCHIVE.zip/PATH") or
+ *  disk into new buffer
+ */
+
+// Find end of archive name in path, returns NULL if the path is not in a zip archive
+static const char *archive_name_end(const char *file)
+{
+    const char *p;
+    for (p=file; *p; p++)
+        if (strncasecmp(p, ".zip/", 5) == 0)
+            return p + 4;
+    return NULL;
+}
+
+static zip_archive *open_archive(const char *file)
+{
+    int i;
+    for (i=0; i<MAX_ARCHIVES; i++)
+        if (archives[i].file && strcmp(archives[i].file, file) == 0)
+            return archives[i].zip;
+
+    zip_archive *zip = ZipOpen(file);
+    char *name = strdup(file);
+    if (zip == NULL || name == NULL) {
+        ZipClose(zip);
+        free(name);
+        return NULL;
+    }
+    i = next_archive;
+    next_archive = (next_archive + 1) % MAX_ARCHIVES;
+    ZipClose(archives[i].zip);
+    free(archives[i].file);
+    archives[i].zip = zip;
+    archives[i].file = name;
+    return zip;
+}
+
+uint8 *ReadPSIDFile(const char *file, size_t *size)
+{
+    // Extract file from zip archive
+    const char *end = archive_name_end(file);
+    if (end) {
+        char archive[PATH_MAX];
+        size_t len = end - file;
+        if (len < PATH_MAX) {
+            memcpy(archive, file, len);
+            archive[len] = 0;
+            zip_archive *zip = open_archive(archive);
+            if (zip) {
+                int n = ZipFind(zip, end + 1);
+                if (n < 0 || ZipEntrySize(zip, n) > MAX_PSID_FILE_SIZE)
+                    return NULL;
+                uint8 *buf = malloc(ZipEntrySize(zip, n) + 1);
+                if (buf && ZipExtract(zip, n, buf)) {
+                    *size = ZipEntrySize(zip, n);
+                    return buf;
+                }
+                free(buf);
+                return NULL;
+            }
+        }
+    }
+
+    // Read file from disk
+    FILE *f = fopen(file, "rb");
+    if (f == NULL)
+        return NULL;
+    uint8 *buf = malloc(MAX_PSID_FILE_SIZE);
+    if (buf)
+        *size = fread(buf, 1, MAX_PSID_FILE_SIZE, f);
+    fclose(f);
+    return buf;
+}
+
+
+/*
+ *  Get canonical path, modification time and size of PSID file: files in
+ *  the pack keep their path in the pack and have the time of the pack,
+ *  files in zip archives have the canonical path of the archive followed by
+ *  their path in it and the time of the archive
+ */
+
+bool GetPSIDFileInfo(const char *file, char *path, int64 *mtime, uint64 *size)
+{
+    struct stat st;
+    size_t length;
+    if (FindPackedPSIDFile(file, &length)) {
+        if (strlen(file) >= PATH_MAX)
+            return false;
+        strcpy(path, file);
+        *mtime = pack_mtime;
+        *size = length;
+        return true;
+    }
+
+    const char *end = archive_name_end(file);
+    if (end) {
+        char archive[PATH_MAX];
+        size_t len = end - file;
+        if (len >= PATH_MAX)
+            return false;
+        memcpy(archive, file, len);
+        archive[len] = 0;
+        zip_archive *zip = open_archive(archive);
+        int n = zip ? ZipFind(zip, end + 1) : -1;
+        if (n < 0 || realpath(archive, path) == NULL || stat(path, &st) < 0)
+            return false;
+        if (strlen(path) + strlen(end) >= PATH_MAX)
+            return false;
+        strcat(path, end);
+        *mtime = st.st_mtime;
+        *size = ZipEntrySize(zip, n);
+        return true;
+    }
+
+    if (realpath(file, path) == NULL || stat(path, &st) < 0)
+        return false;
+    *mtime = st.st_mtime;
+    *size = st.st_size;
+    return true;
+}
+
+
 /*
  *  Read PSID file header to buffer
  */
@@ -83,6 +294,20 @@ bool LoadPSIDHeader(const char *file, uint8 *p)
 {
     // Read header
     memset(p, 0, PSID_MAX_HEADER_LENGTH);
+    size_t size;
+    const uint8 *data = FindPackedPSIDFile(file, &size);
+    if (data) {
+        memcpy(p, data, size < PSID_MAX_HEADER_LENGTH ? size : PSID_MAX_HEADER_LENGTH);
+        return size >= PSID_MIN_HEADER_LENGTH;
+    }
+    if (archive_name_end(file)) {
+        uint8 *buf = ReadPSIDFile(file, &size);
+        if (buf == NULL)
+            return false;
+        memcpy(p, buf, size < PSID_MAX_HEADER_LENGTH ? size : PSID_MAX_HEADER_LENGTH);
+        free(buf);
+        return size >= PSID_MIN_HEADER_LENGTH;
+    }
     FILE *f = fopen(file, "rb");
     if (f == NULL)
         return false;
@@ -122,68 +347,87 @@ bool IsPSIDFile(const char *file)
 
 
 /*
- *  Load PSID file for playing
+ *  Check PSID file data and get number of songs, default song (0..n) and
+ *  header fields
  */
 
-bool LoadPSIDFile(const char *file)
+// Copy 32 character header field to 33 byte buffer, 0-terminated and
+// padded with zeroes (so the first 32 bytes can be copied as a whole)
+static void copy_psid_string(char *to, const uint8 *from)
 {
-    // Open file
-    FILE *f = fopen(file, "rb");
-    if (f == NULL)
+    memcpy(to, from, 32);
+    to[32] = 0;
+    size_t len = strlen(to);
+    memset(to + len, 0, 32 - len);
+}
+
+bool GetPSIDInfo(const uint8 *data, size_t size, int *songs, int *default_song, char *name, char *author, char *copyright)
+{
+    uint8 header[PSID_MAX_HEADER_LENGTH];
+    memset(header, 0, PSID_MAX_HEADER_LENGTH);
+    memcpy(header, data, size < PSID_MAX_HEADER_LENGTH ? size : PSID_MAX_HEADER_LENGTH);
+    if (size < PSID_MIN_HEADER_LENGTH || !IsPSIDHeader(header))
         return false;
 
+    *songs = read_psid_16(header, PSID_NUMBER);
+    if (*songs == 0)
+        *songs = 1;
+    *default_song = read_psid_16(header, PSID_DEFSONG);
+    if (*default_song)
+        (*default_song)--;
+    if (*default_song >= *songs)
+        *default_song = 0;
+
+    copy_psid_string(name, header + PSID_NAME);
+    copy_psid_string(author, header + PSID_AUTHOR);
+    copy_psid_string(copyright, header + PSID_COPYRIGHT);
+    return true;
+}
+
+
+/*
+ *  Load PSID file for playing (from the pack if it contains the file, or
+ *  from a zip archive)
+ */
+
+bool LoadPSIDData(const uint8 *data, size_t size)
+{
+    // States prepared for the previous tune are no longer valid
+    stop_prepare();
+
     // Clear C64 RAM
     MemoryClear();
     psid_loaded = false;
 
-    // Load and check header
-    uint8 header[PSID_MAX_HEADER_LENGTH];
-    memset(header, 0, PSID_MAX_HEADER_LENGTH);
-    size_t actual = fread(header, 1, PSID_MAX_HEADER_LENGTH, f);
-    if (actual < PSID_MIN_HEADER_LENGTH || !IsPSIDHeader(header)) {
-        fclose(f);
+    // Check header and extract data from it
+    if (!GetPSIDInfo(data, size, &number_of_songs, &current_song, module_name, author_name, copyright_info))
         return false;
-    }
 
-    // Extract data from header
-    number_of_songs = read_psid_16(header, PSID_NUMBER);
-    if (number_of_songs == 0)
-        number_of_songs = 1;
-    current_song = read_psid_16(header, PSID_DEFSONG);
-    if (current_song)
-        current_song--;
-    if (current_song >= number_of_songs)
-        current_song = 0;
-
-    init_adr = read_psid_16(header, PSID_INIT);
-    play_adr = read_psid_16(header, PSID_MAIN);
+    init_adr = read_psid_16(data, PSID_INIT);
+    play_adr = read_psid_16(data, PSID_MAIN);
     play_adr_from_irq_vec = (play_adr == 0);
 
-    speed_flags = read_psid_32(header, PSID_SPEED);
-
-    strncpy(module_name, (char *)(header + PSID_NAME), 32);
-    strncpy(author_name, (char *)(header + PSID_AUTHOR), 32);
-    strncpy(copyright_info, (char *)(header + PSID_COPYRIGHT), 32);
-    module_name[32] = 0;
-    author_name[32] = 0;
-    copyright_info[32] = 0;
+    speed_flags = read_psid_32(data, PSID_SPEED);
 
-    // Seek to start of module data
-    fseek(f, read_psid_16(header, PSID_LENGTH), SEEK_SET);
-
-    // Find load address
-    uint16 load_adr = read_psid_16(header, PSID_START);
+    // Find start of module data and load address
+    size_t pos = read_psid_16(data, PSID_LENGTH);
+    uint16 load_adr = read_psid_16(data, PSID_START);
     if (load_adr == 0) {    // Load address is at start of module data
-        uint8 lo = fgetc(f);
-        uint8 hi = fgetc(f);
+        uint8 lo = pos < size ? data[pos] : 0xff;
+        uint8 hi = pos + 1 < size ? data[pos + 1] : 0xff;
         load_adr = (hi << 8) | lo;
+        pos += 2;
     }
     if (init_adr == 0)        // Init routine address is equal to load address
         init_adr = load_adr;
 
     // Load module data to C64 RAM
-    fread(ram + load_adr, 1, RAM_SIZE - load_adr, f);
-    fclose(f);
+    if (pos < size) {
+        size_t length = size - pos;
+        if (length > RAM_SIZE - load_adr)
+            length = RAM_SIZE - load_adr;
+        memcpy(ram + load_adr, data + pos, length);
+    }
 
     // Select default song
     SelectSong(current_song);
@@ -193,6 +437,21 @@ bool LoadPSIDFile(const char *file)
     return true;
 }
 
+bool LoadPSIDFile(const char *file)
+{
+    size_t size;
+    const uint8 *data = FindPackedPSIDFile(file, &size);
+    if (data)
+        return LoadPSIDData(data, size);
+
+    uint8 *buf = ReadPSIDFile(file, &size);
+    if (buf == NULL)
+        return false;
+    bool ok = LoadPSIDData(buf, size);
+    free(buf);
+    return ok;
+}
+
 
 /*
  *  PSID file loaded and ready?
@@ -229,6 +488,141 @@ void SelectSong(int num)
 }
 
 
+/*
+ *  Compute the state after the init routine of every song of a PSID file
+ *  in background processes, so songs can be switched without running the
+ *  init routine. As there is only one emulator, every process is forked
+ *  from it, loads the file, and for each of its songs restores the state
+ *  after loading and selects the song, storing the resulting state in a
+ *  shared mapping. The songs following the current one are computed
+ *  first. Forking has to happen before audio output is started, as the
+ *  child processes use the emulator without the audio thread.
+ */
+
+#ifdef __unix__
+static size_t prepared_state_size()
+{
+    return (MachineStateSize() + 7) & ~(size_t)7;
+}
+
+static uint32 *prepared_flag(int song)
+{
+    return (uint32 *)prepared + song;
+}
+
+static machine_state *prepared_state(int song)
+{
+    size_t flags_size = (prepared_songs * sizeof(uint32) + 63) & ~(size_t)63;
+    return (machine_state *)(prepared + flags_size + song * prepared_state_size());
+}
+
+static void prepare_process(const char *file, int start, int first, int step)
+{
+    // Loading the file must neither kill the other processes nor unmap the
+    // shared mapping
+    uint8 *map = prepared;
+    prepared = NULL;
+    num_prepare_pids = 0;
+    machine_state *loaded = NewMachineState();
+    if (loaded == NULL || !LoadPSIDFile(file))
+        _exit(1);
+    prepared = map;
+    if (number_of_songs != prepared_songs)
+        _exit(1);
+    GetMachineState(loaded);
+    int i;
+    for (i=first; i<prepared_songs; i+=step) {
+        int song = (start + 1 + i) % prepared_songs;
+        SetMachineState(loaded);
+        SelectSong(song);
+        GetMachineState(prepared_state(song));
+        __atomic_store_n(prepared_flag(song), 1, __ATOMIC_RELEASE);
+    }
+    _exit(0);
+}
+#endif
+
+void PrepareSongs(const char *file)
+{
+    stop_prepare();
+#ifdef __unix__
+    if (number_of_songs < 2)
+        return;
+    prepared_songs = number_of_songs;
+    prepared_size = ((prepared_songs * sizeof(uint32) + 63) & ~(size_t)63) + prepared_songs * prepared_state_size();
+    prepared = mmap(NULL, prepared_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (prepared == MAP_FAILED) {
+        prepared = NULL;
+        return;
+    }
+
+    // One process per spare CPU
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    int n = cpus > 1 ? cpus - 1 : 1;
+    if (n > MAX_PREPARE_PROCESSES)
+        n = MAX_PREPARE_PROCESSES;
+    if (n > prepared_songs - 1)
+        n = prepared_songs - 1;
+    fflush(stdout);
+    fflush(stderr);
+    int i;
+    for (i=0; i<n; i++) {
+        pid_t pid = fork();
+        if (pid == 0)
+            prepare_process(file, current_song, i, n);
+        if (pid < 0)
+            break;
+        prepare_pids[num_prepare_pids++] = pid;
+    }
+#endif
+}
+
+// Stop background processes and discard their states
+static void stop_prepare()
+{
+#ifdef __unix__
+    int i;
+    for (i=0; i<num_prepare_pids; i++) {
+        kill(prepare_pids[i], SIGKILL);
+        waitpid(prepare_pids[i], NULL, 0);
+    }
+    num_prepare_pids = 0;
+    if (prepared)
+        munmap(prepared, prepared_size);
+    prepared = NULL;
+#endif
+}
+
+
+/*
+ *  Select song, restoring the state computed by PrepareSongs() if it is
+ *  ready (the song is then started from the state after loading the file,
+ *  instead of the current state)
+ */
+
+void SwitchSong(int num)
+{
+    if (num >= number_of_songs)
+        num = 0;
+#ifdef __unix__
+    // Reap finished background processes
+    int i = 0;
+    while (i < num_prepare_pids) {
+        if (waitpid(prepare_pids[i], NULL, WNOHANG) == prepare_pids[i])
+            prepare_pids[i] = prepare_pids[--num_prepare_pids];
+        else
+            i++;
+    }
+
+    if (prepared && number_of_songs == prepared_songs && __atomic_load_n(prepared_flag(num), __ATOMIC_ACQUIRE)) {
+        SetMachineState(prepared_state(num));
+        return;
+    }
+#endif
+    SelectSong(num);
+}
+
+
 /*
  *  Update play_adr from IRQ vector if necessary
  */
@@ -242,3 +636,73 @@ void UpdatePlayAdr()
             play_adr = (ram[0xffff] << 8) | ram[0xfffe];
     }
 }
+
+
+/*
+ *  Save/restore complete state of the emulated machine, so several tunes
+ *  can be played alternately by the single emulation
+ */
+
+struct machine_state {
+    bool psid_loaded;
+    uint16 init_adr, play_adr;
+    bool play_adr_from_irq_vec;
+    uint32 speed_flags;
+    int number_of_songs, current_song;
+    char module_name[64], author_name[64], copyright_info[64];
+    uint32 f_rand_seed;
+    uint8 ram[RAM_SIZE];
+    uint64 sid[];        // sid_state (SIDStateSize() bytes)
+};
+
+size_t MachineStateSize()
+{
+    return sizeof(machine_state) + SIDStateSize();
+}
+
+machine_state *NewMachineState()
+{
+    machine_state *s = malloc(MachineStateSize());
+    if (s)
+        memset(s, 0, MachineStateSize());
+    return s;
+}
+
+void DeleteMachineState(machine_state *s)
+{
+    free(s);
+}
+
+void GetMachineState(machine_state *s)
+{
+    s->psid_loaded = psid_loaded;
+    s->init_adr = init_adr;
+    s->play_adr = play_adr;
+    s->play_adr_from_irq_vec = play_adr_from_irq_vec;
+    s->speed_flags = speed_flags;
+    s->number_of_songs = number_of_songs;
+    s->current_song = current_song;
+    memcpy(s->module_name, module_name, sizeof(module_name));
+    memcpy(s->author_name, author_name, sizeof(author_name));
+    memcpy(s->copyright_info, copyright_info, sizeof(copyright_info));
+    s->f_rand_seed = f_rand_seed;
+    memcpy(s->ram, ram, RAM_SIZE);
+    SIDGetState((sid_state *)s->sid);
+}
+
+void SetMachineState(const machine_state *s)
+{
+    psid_loaded = s->psid_loaded;
+    init_adr = s->init_adr;
+    play_adr = s->play_adr;
+    play_adr_from_irq_vec = s->play_adr_from_irq_vec;
+    speed_flags = s->speed_flags;
+    number_of_songs = s->number_of_songs;
+    current_song = s->current_song;
+    memcpy(module_name, s->module_name, sizeof(module_name));
+    memcpy(author_name, s->author_name, sizeof(author_name));
+    memcpy(copyright_info, s->copyright_info, sizeof(copyright_info));
+    f_rand_seed = s->f_rand_seed;
+    memcpy(ram, s->ram, RAM_SIZE);
+    SIDSetState((const sid_state *)s->sid);
+}
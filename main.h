@@ -22,6 +22,9 @@
 #define MAIN_H
 
 #include "types.h"
+#include "pack.h"
+
+#include <stddef.h>
 
 
 /*
@@ -37,13 +40,19 @@ extern char module_name[64], author_name[64], copyright_info[64];
 // Total number of songs in module and currently played song number (0..n)
 extern int number_of_songs, current_song;
 
+// Saved state of the emulated machine (loaded tune, C64 RAM and SID chips)
+typedef struct machine_state machine_state;
+
+// Maximum size of PSID file (header length field, load address, C64 RAM)
+#define MAX_PSID_FILE_SIZE (0x10000 + 2 + 0x10000)
+
 
 /*
  *  Functions
  */
 
 // Init everything
-extern void InitAll(int argc, char **argv);
+extern void InitAll(int *argc, char **argv);
 
 // Exit everything
 extern void ExitAll();
@@ -57,21 +66,63 @@ extern bool IsPSIDHeader(const uint8 *p);
 // Check whether file is a PSID file
 extern bool IsPSIDFile(const char *file);
 
-// Load PSID file for playing
+// Check PSID file data and get number of songs, default song (0..n) and
+// header fields (buffers of at least 33 chars), returns false if it is not
+// a PSID file
+extern bool GetPSIDInfo(const uint8 *data, size_t size, int *songs, int *default_song, char *name, char *author, char *copyright);
+
+// Get pack given by the "pack" pref, returns NULL if there is none
+extern const psid_pack *GetPSIDPack();
+
+// Find PSID file in pack given by the "pack" pref, returns pointer to the
+// file data or NULL if it is not in the pack
+extern const uint8 *FindPackedPSIDFile(const char *file, size_t *size);
+
+// Read PSID file from zip archive (if the path is "ARCHIVE.zip/PATH") or
+// disk, returns new buffer (to be freed by the caller) or NULL on error
+extern uint8 *ReadPSIDFile(const char *file, size_t *size);
+
+// Get canonical path (buffer of PATH_MAX chars), modification time and size
+// of PSID file in the pack, a zip archive or on disk, returns false if it
+// can't be found
+extern bool GetPSIDFileInfo(const char *file, char *path, int64 *mtime, uint64 *size);
+
+// Load PSID file for playing (from the pack if it contains the file, or
+// from a zip archive)
 extern bool LoadPSIDFile(const char *file);
 
+// Load PSID file data (of at most size bytes) for playing
+extern bool LoadPSIDData(const uint8 *data, size_t size);
+
 // PSID file loaded and ready?
 extern bool IsPSIDLoaded();
 
 // Select song for playing
 extern void SelectSong(int num);
 
+// Compute the state after the init routine of every song of the loaded PSID
+// file in the background (must be called before audio output is started;
+// the states are discarded when another tune is loaded)
+extern void PrepareSongs(const char *file);
+
+// Select song for playing, from the state computed by PrepareSongs() if it
+// is ready
+extern void SwitchSong(int num);
+
 // Update play_adr if necessary
 extern void UpdatePlayAdr();
 
 // Adjust replay speed
 extern void AdjustSpeed(int percent);
 
+// Save/restore state of the emulated machine (the machine_state is a flat
+// structure of MachineStateSize() bytes)
+extern size_t MachineStateSize();
+extern machine_state *NewMachineState();
+extern void DeleteMachineState(machine_state *s);
+extern void GetMachineState(machine_state *s);
+extern void SetMachineState(const machine_state *s);
+
 // Show About window
 extern void AboutWindow();
 
@@ -26,15 +26,34 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <errno.h>
+#include <limits.h>
+#include <string.h>
+#include <strings.h>
+#include <ctype.h>
 
 #ifdef __unix__
 #include <unistd.h>
+#include <dirent.h>
+#include <signal.h>
+#include <poll.h>
+#include <sys/stat.h>
 #include <sys/time.h>
 #endif
 
+#ifdef __linux__
+#include <sys/inotify.h>
+#endif
+
 #include "main.h"
 #include "prefs.h"
 #include "sid.h"
+#include "server.h"
+#include "regstream.h"
+#include "index.h"
+#include "regdump.h"
+#include "search.h"
+#include "pack.h"
+#include "ingest.h"
 
 
 /*
@@ -96,6 +115,693 @@ void Delay_usec(uint32 usec)
 }
 
 
+/*
+ *  Add PSID files and directories to collection index, analyzing the
+ *  loudness of all songs
+ */
+
+#ifdef __linux__
+// inotify instance watching the directories for --watch (-1 = not watching),
+// and the absolute path of every watched directory by watch descriptor
+static int watch_fd = -1;
+static char **watch_dirs = NULL;
+static int num_watch_dirs = 0;
+
+static void watch_dir(const char *path)
+{
+    char abs_path[PATH_MAX];
+    if (realpath(path, abs_path) == NULL)
+        return;
+    int wd = inotify_add_watch(watch_fd, abs_path, IN_CLOSE_WRITE | IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO | IN_ONLYDIR);
+    if (wd < 0) {
+        fprintf(stderr, "Couldn't watch '%s'\n", path);
+        return;
+    }
+    if (wd >= num_watch_dirs) {
+        char **dirs = realloc(watch_dirs, (wd + 64) * sizeof(char *));
+        if (dirs == NULL)
+            return;
+        memset(dirs + num_watch_dirs, 0, (wd + 64 - num_watch_dirs) * sizeof(char *));
+        watch_dirs = dirs;
+        num_watch_dirs = wd + 64;
+    }
+    free(watch_dirs[wd]);
+    watch_dirs[wd] = strdup(abs_path);
+}
+#endif
+
+// Reader of the files found while scanning (NULL = each file is read when
+// it is found), and the loudness analysis time and result of the scan
+static ingest *scan_ingest = NULL;
+static int scan_seconds;
+static bool scan_ok;
+
+// Canonical paths of all files found while scanning, if requested by
+// setting scan_found_paths to an empty list
+static char **scan_found_paths = NULL;
+static int num_found_paths = 0, max_found_paths = 0;
+
+static void scan_file(void *arg, const char *file, const uint8 *data, size_t size)
+{
+    collection_index *ci = arg;
+    int songs, default_song;
+    char name[33], author[33], copyright[33];
+    if (data == NULL || !GetPSIDInfo(data, size, &songs, &default_song, name, author, copyright))
+        return;
+    if (!IndexAddData(ci, file, data, size, scan_seconds)) {
+        fprintf(stderr, "Couldn't add '%s' to index\n", file);
+        scan_ok = false;
+        return;
+    }
+    printf("%s\n", file);
+}
+
+static bool analyze_path(collection_index *ci, const char *path, int seconds)
+{
+    struct stat st;
+    if (stat(path, &st) < 0) {
+        fprintf(stderr, "Couldn't read '%s'\n", path);
+        return false;
+    }
+
+    // Directories are searched recursively
+    if (S_ISDIR(st.st_mode)) {
+#ifdef __linux__
+        if (watch_fd >= 0)
+            watch_dir(path);
+#endif
+        DIR *d = opendir(path);
+        if (d == NULL) {
+            fprintf(stderr, "Couldn't read '%s'\n", path);
+            return false;
+        }
+        bool ok = true;
+        struct dirent *de;
+        while ((de = readdir(d)) != NULL) {
+            if (de->d_name[0] == '.')
+                continue;
+            char sub[PATH_MAX];
+            snprintf(sub, sizeof(sub), "%s/%s", path, de->d_name);
+            if (!analyze_path(ci, sub, seconds))
+                ok = false;
+        }
+        closedir(d);
+        return ok;
+    }
+
+    if (!S_ISREG(st.st_mode))
+        return true;
+    char found[PATH_MAX];
+    if (scan_found_paths && realpath(path, found)) {
+        if (num_found_paths == max_found_paths) {
+            char **p = realloc(scan_found_paths, max_found_paths * 2 * sizeof(char *));
+            if (p) {
+                scan_found_paths = p;
+                max_found_paths *= 2;
+            }
+        }
+        if (num_found_paths < max_found_paths && (scan_found_paths[num_found_paths] = strdup(found)) != NULL)
+            num_found_paths++;
+    }
+    if (scan_ingest) {
+        IngestAdd(scan_ingest, path);
+        return true;
+    }
+    if (!IsPSIDFile(path))
+        return true;
+    if (!IndexAddFile(ci, path, seconds)) {
+        fprintf(stderr, "Couldn't add '%s' to index\n", path);
+        return false;
+    }
+    printf("%s\n", path);
+    return true;
+}
+
+// Add files and directories, reading the files in batches
+static bool scan_paths(collection_index *ci, int argc, char **argv, int seconds)
+{
+    scan_seconds = seconds;
+    scan_ok = true;
+    scan_ingest = IngestNew(PrefsFindInt32("readahead"), scan_file, ci);
+    int i;
+    for (i=1; i<argc; i++)
+        if (!analyze_path(ci, argv[i], seconds))
+            scan_ok = false;
+    IngestFinish(scan_ingest);
+    scan_ingest = NULL;
+    return scan_ok;
+}
+
+static int analyze_files(const char *index_file, int argc, char **argv)
+{
+    collection_index *ci = IndexOpen(index_file);
+    if (ci == NULL) {
+        fprintf(stderr, "Couldn't open index '%s'\n", index_file);
+        return 1;
+    }
+    int ret = scan_paths(ci, argc, argv, PrefsFindInt32("exportlength")) ? 0 : 1;
+
+    // Without files and directories, all files of the pack are added
+    const psid_pack *pack = GetPSIDPack();
+    if (argc == 1 && pack) {
+        uint32 n, num = PackNumEntries(pack);
+        for (n=0; n<num; n++) {
+            const pack_entry *e = PackEntry(pack, n);
+            scan_file(ci, PackEntryPath(pack, e), PackEntryData(pack, e), e->length);
+        }
+        if (!scan_ok)
+            ret = 1;
+    }
+    if (!SearchBuild(ci, index_file)) {
+        fprintf(stderr, "Couldn't write search index of '%s'\n", index_file);
+        ret = 1;
+    }
+    IndexClose(ci);
+    return ret;
+}
+
+
+/*
+ *  Keep collection index up to date: add the given files and directories,
+ *  then add PSID files when they are created, changed or moved into the
+ *  directories and mark them as removed when they are deleted or moved
+ *  away, until SIGINT/SIGTERM. Files that are gone when the directories
+ *  are scanned (at the start, and after events were lost) are marked as
+ *  removed as well. The search index is rebuilt when there were no more
+ *  changes for a second.
+ */
+
+#ifdef __linux__
+static volatile bool quit_watch = false;
+
+static void quit_watch_handler(int sig)
+{
+    quit_watch = true;
+}
+
+// Stop watching directory and its subdirectories (moved away)
+static void unwatch_dirs(const char *path)
+{
+    size_t len = strlen(path);
+    int wd;
+    for (wd=0; wd<num_watch_dirs; wd++) {
+        char *dir = watch_dirs[wd];
+        if (dir && strncmp(dir, path, len) == 0 && (dir[len] == 0 || dir[len] == '/')) {
+            inotify_rm_watch(watch_fd, wd);
+            free(dir);
+            watch_dirs[wd] = NULL;
+        }
+    }
+}
+
+static int compare_paths(const void *a, const void *b)
+{
+    return strcmp(*(char * const *)a, *(char * const *)b);
+}
+
+// Check whether file, or the archive holding it, was found by the scan
+static bool path_found(const char *path)
+{
+    char buf[PATH_MAX];
+    snprintf(buf, sizeof(buf), "%s", path);
+    for (;;) {
+        char *key = buf;
+        if (bsearch(&key, scan_found_paths, num_found_paths, sizeof(char *), compare_paths))
+            return true;
+        char *p = strrchr(buf, '/');
+        if (p == NULL || p == buf)
+            return false;
+        *p = 0;
+    }
+}
+
+// Scan files and directories, and mark the files below them that are in
+// the index but were not found as removed (after events were lost, or
+// changes made while not watching)
+static void rescan_paths(collection_index *ci, int argc, char **argv, char **roots, int seconds)
+{
+    max_found_paths = 1024;
+    num_found_paths = 0;
+    scan_found_paths = malloc(max_found_paths * sizeof(char *));
+    if (scan_found_paths == NULL) {
+        scan_paths(ci, argc, argv, seconds);
+        return;
+    }
+    bool ok = scan_paths(ci, argc, argv, seconds);
+    qsort(scan_found_paths, num_found_paths, sizeof(char *), compare_paths);
+
+    // A failed scan may have missed files that are still there
+    uint32 n, num = ok ? IndexNumRecords(ci) : 0;
+    int i;
+    for (n=0; n<num; n++) {
+        const index_record *r = IndexRecord(ci, n);
+        if (r->flags & INDEX_REMOVED)
+            continue;
+        for (i=1; i<argc; i++) {
+            size_t len = roots[i] ? strlen(roots[i]) : 0;
+            if (len && strncmp(r->path, roots[i], len) == 0 && (r->path[len] == 0 || r->path[len] == '/'))
+                break;
+        }
+        if (i == argc || path_found(r->path))
+            continue;
+        char path[INDEX_PATH_LENGTH];
+        memcpy(path, r->path, sizeof(path));
+        if (IndexRemovePath(ci, path))
+            printf("%s removed\n", path);
+    }
+
+    for (i=0; i<num_found_paths; i++)
+        free(scan_found_paths[i]);
+    free(scan_found_paths);
+    scan_found_paths = NULL;
+}
+
+static void watch_event(collection_index *ci, const struct inotify_event *e, int seconds)
+{
+    if (e->mask & IN_IGNORED) {        // Directory removed
+        if (e->wd < num_watch_dirs) {
+            free(watch_dirs[e->wd]);
+            watch_dirs[e->wd] = NULL;
+        }
+        return;
+    }
+    if (e->len == 0 || e->name[0] == '.' || e->wd >= num_watch_dirs || watch_dirs[e->wd] == NULL)
+        return;
+
+    char path[PATH_MAX];
+    snprintf(path, sizeof(path), "%s/%s", watch_dirs[e->wd], e->name);
+    if (e->mask & (IN_DELETE | IN_MOVED_FROM)) {
+        if (e->mask & IN_ISDIR)
+            unwatch_dirs(path);
+        if (IndexRemovePath(ci, path))
+            printf("%s removed\n", path);
+    } else if ((e->mask & (IN_CLOSE_WRITE | IN_MOVED_TO)) || (e->mask & (IN_CREATE | IN_ISDIR)) == (IN_CREATE | IN_ISDIR))
+        analyze_path(ci, path, seconds);
+}
+#endif
+
+static int watch_files(const char *index_file, int argc, char **argv)
+{
+#ifdef __linux__
+    collection_index *ci = IndexOpen(index_file);
+    if (ci == NULL) {
+        fprintf(stderr, "Couldn't open index '%s'\n", index_file);
+        return 1;
+    }
+    watch_fd = inotify_init1(IN_CLOEXEC);
+    if (watch_fd < 0) {
+        fprintf(stderr, "Couldn't watch for changes (%s)\n", strerror(errno));
+        IndexClose(ci);
+        return 1;
+    }
+    signal(SIGINT, quit_watch_handler);
+    signal(SIGTERM, quit_watch_handler);
+
+    // Canonical paths of the given files and directories (NULL = not found)
+    char **roots = calloc(argc, sizeof(char *));
+    int i;
+    for (i=1; i<argc && roots; i++)
+        roots[i] = realpath(argv[i], NULL);
+
+    // Catch up with changes made while not watching
+    int seconds = PrefsFindInt32("exportlength");
+    bool changed = true, rescan = true;
+    uint8 buf[16384] __attribute__((aligned(__alignof__(struct inotify_event))));
+
+    while (!quit_watch) {
+        if (rescan) {
+            if (roots)
+                rescan_paths(ci, argc, argv, roots, seconds);
+            else
+                scan_paths(ci, argc, argv, seconds);
+            rescan = false;
+        }
+
+        struct pollfd pfd = {watch_fd, POLLIN, 0};
+        int n = poll(&pfd, 1, changed ? 1000 : -1);
+        if (n < 0 && errno != EINTR)
+            break;
+        if (n == 0) {
+            if (!SearchBuild(ci, index_file))
+                fprintf(stderr, "Couldn't write search index of '%s'\n", index_file);
+            changed = false;
+            continue;
+        }
+        if (n < 0)
+            continue;
+
+        ssize_t len = read(watch_fd, buf, sizeof(buf));
+        uint8 *p = buf;
+        while (p < buf + len) {
+            const struct inotify_event *e = (const struct inotify_event *)p;
+            if (e->mask & IN_Q_OVERFLOW)
+                rescan = true;        // Events were lost
+            else
+                watch_event(ci, e, seconds);
+            changed = true;
+            p += sizeof(struct inotify_event) + e->len;
+        }
+        fflush(stdout);
+    }
+
+    if (changed && !SearchBuild(ci, index_file))
+        fprintf(stderr, "Couldn't write search index of '%s'\n", index_file);
+    for (i=1; i<argc && roots; i++)
+        free(roots[i]);
+    free(roots);
+    close(watch_fd);
+    IndexClose(ci);
+    return 0;
+#else
+    fprintf(stderr, "Watching for changes is not supported on this platform\n");
+    return 1;
+#endif
+}
+
+
+/*
+ *  Call function for songs of PSID files (all songs of every file, or
+ *  only the given song if the arguments are FILE SONG)
+ */
+
+typedef bool (*song_func)(const char *file, int song);
+
+static song_func process_func;
+static int process_ret;
+
+static void process_file(void *arg, const char *file, const uint8 *data, size_t size)
+{
+    if (data == NULL || !LoadPSIDData(data, size)) {
+        fprintf(stderr, "Couldn't load '%s' (not a PSID file?)\n", file);
+        process_ret = 1;
+        return;
+    }
+    int song;
+    for (song=0; song<number_of_songs; song++)
+        if (!process_func(file, song))
+            process_ret = 1;
+}
+
+static int process_songs(int argc, char **argv, song_func func)
+{
+    int i, song;
+    if (argc == 3 && isdigit(argv[2][0])) {
+        if (!LoadPSIDFile(argv[1])) {
+            fprintf(stderr, "Couldn't load '%s' (not a PSID file?)\n", argv[1]);
+            return 1;
+        }
+        song = atoi(argv[2]);
+        if (song < 1 || song > number_of_songs)
+            song = current_song + 1;
+        return func(argv[1], song - 1) ? 0 : 1;
+    }
+
+    // Read files in batches
+    ingest *in = IngestNew(PrefsFindInt32("readahead"), process_file, NULL);
+    if (in == NULL) {
+        fprintf(stderr, "Couldn't read files\n");
+        return 1;
+    }
+    process_func = func;
+    process_ret = 0;
+    for (i=1; i<argc; i++)
+        IngestAdd(in, argv[i]);
+    IngestFinish(in);
+    return process_ret;
+}
+
+// Create output file for song in directory, named after the PSID file
+static FILE *create_song_file(const char *dir, const char *file, int song, const char *ext, const char *mode)
+{
+    char path[PATH_MAX];
+    const char *base = strrchr(file, '/');
+    base = base ? base + 1 : file;
+    int len = strlen(base);
+    if (len > 4 && strcasecmp(base + len - 4, ".sid") == 0)
+        len -= 4;
+    snprintf(path, sizeof(path), "%s/%.*s-%d.%s", dir, len, base, song + 1, ext);
+    FILE *f = fopen(path, mode);
+    if (f == NULL)
+        fprintf(stderr, "Couldn't create '%s'\n", path);
+    return f;
+}
+
+
+/*
+ *  Dump SID registers of songs of PSID files
+ */
+
+static bool dump_binary;
+static const char *dump_dir;
+static uint32 dump_frames;
+
+static bool dump_song(const char *file, int song)
+{
+    FILE *f = stdout;
+    if (dump_dir) {
+        f = create_song_file(dump_dir, file, song, dump_binary ? "bin" : "txt", dump_binary ? "wb" : "w");
+        if (f == NULL)
+            return false;
+    } else if (!dump_binary)
+        printf("%s, song %d\n", file, song + 1);
+
+    bool ok = RegDumpSong(f, song, dump_frames, dump_binary);
+    if (dump_dir)
+        ok = (fclose(f) == 0) && ok;
+    if (!ok)
+        fprintf(stderr, "Couldn't write register dump of '%s'\n", file);
+    return ok;
+}
+
+static int dump_files(int argc, char **argv)
+{
+    const char *format = PrefsFindString("regdump", 0);
+    dump_binary = strcmp(format, "binary") == 0;
+    if (!dump_binary && strcmp(format, "text")) {
+        fprintf(stderr, "Register dump format must be 'text' or 'binary'\n");
+        return 1;
+    }
+    dump_dir = PrefsFindString("dumpdir", 0);
+    dump_frames = PrefsFindInt32("dumpframes");
+    return process_songs(argc, argv, dump_song);
+}
+
+
+/*
+ *  Render songs of PSID files to FLAC files, until the end of the export
+ *  length or the silence timeout
+ */
+
+static const char *render_dir;
+static bool tune_ended;
+
+static void render_silence_event(void *arg, int event, int frame)
+{
+    if (event == SID_TUNE_END)
+        tune_ended = true;
+}
+
+static bool render_song(const char *file, int song)
+{
+    FILE *f = create_song_file(render_dir, file, song, "flac", "wb");
+    if (f == NULL)
+        return false;
+    int freq, bits, channels;
+    SIDGetAudioFormat(&freq, &bits, &channels);
+    int frame_bytes = channels * bits / 8;
+    static uint8 buf[4096 * 4];
+
+    flac_encoder *fe = FlacNew(f, freq, channels);
+    if (fe == NULL) {
+        fclose(f);
+        return false;
+    }
+    SelectSong(song);
+    SIDAdjustSpeed(PrefsFindInt32("speed"));
+    tune_ended = false;
+    SIDSetSilenceHook(render_silence_event, NULL, (uint32)PrefsFindInt32("silencetimeout") * freq);
+    SIDSetEncoder(fe);
+    int64 frames = (int64)PrefsFindInt32("exportlength") * freq;
+    while (frames > 0 && !tune_ended) {
+        int n = frames < 4096 ? frames : 4096;
+        SIDCalcBuffer(buf, n * frame_bytes);
+        frames -= n;
+    }
+    SIDSetEncoder(NULL);
+    SIDSetSilenceHook(NULL, NULL, 0);
+
+    bool ok = FlacClose(fe);
+    ok = (fclose(f) == 0) && ok;
+    if (!ok)
+        fprintf(stderr, "Couldn't write FLAC file of '%s'\n", file);
+    return ok;
+}
+
+
+/*
+ *  Print songs of collection index whose header fields contain a string
+ *  (only the field given by a "name:", "author:" or "copyright:" prefix)
+ */
+
+static int print_search(const char *index_file, const char *query)
+{
+    static const struct {
+        const char *prefix;
+        int fields;
+    } prefixes[] = {
+        {"name:", SEARCH_NAME},
+        {"author:", SEARCH_AUTHOR},
+        {"copyright:", SEARCH_COPYRIGHT}
+    };
+    int i, fields = SEARCH_ALL;
+    for (i=0; i<3; i++) {
+        int len = strlen(prefixes[i].prefix);
+        if (strncasecmp(query, prefixes[i].prefix, len) == 0) {
+            fields = prefixes[i].fields;
+            query += len;
+            break;
+        }
+    }
+
+    collection_index *ci = IndexOpen(index_file);
+    if (ci == NULL) {
+        fprintf(stderr, "Couldn't open index '%s'\n", index_file);
+        return 1;
+    }
+    search_index *si = SearchOpen(index_file);
+    if (si == NULL) {
+        fprintf(stderr, "Couldn't open search index of '%s' (use --analyze to build it)\n", index_file);
+        IndexClose(ci);
+        return 1;
+    }
+
+    uint32 n, num;
+    uint32 *records = SearchFind(si, ci, query, fields, &num);
+    if (records) {
+        for (n=0; n<num; n++) {
+            const index_record *r = IndexRecord(ci, records[n]);
+            printf("%s %u: %.32s / %.32s / %.32s\n", r->path, r->song, r->name, r->author, r->copyright);
+        }
+        free(records);
+    }
+    SearchClose(si);
+    IndexClose(ci);
+    return records ? 0 : 1;
+}
+
+
+/*
+ *  Print groups of duplicate songs in collection index
+ */
+
+static int print_duplicates(const char *index_file)
+{
+    collection_index *ci = IndexOpen(index_file);
+    if (ci == NULL) {
+        fprintf(stderr, "Couldn't open index '%s'\n", index_file);
+        return 1;
+    }
+    uint32 *group = IndexGroupDuplicates(ci, PrefsFindInt32("duplicates") / 100.0);
+    if (group == NULL) {
+        IndexClose(ci);
+        return 1;
+    }
+
+    // Groups are numbered by their first record; sort records by group in
+    // one pass (counting sort, records stay in order within a group), after
+    // which group g ends at end[g] and starts where group g-1 ends
+    uint32 n, m, num = IndexNumRecords(ci);
+    uint32 *end = calloc(num + 1, sizeof(uint32));
+    uint32 *order = malloc((num + 1) * sizeof(uint32));
+    if (end == NULL || order == NULL) {
+        free(end);
+        free(order);
+        free(group);
+        IndexClose(ci);
+        return 1;
+    }
+    for (n=0; n<num; n++)
+        end[group[n] + 1]++;
+    for (n=0; n<num; n++)
+        end[n + 1] += end[n];
+    for (n=0; n<num; n++)
+        order[end[group[n]]++] = n;
+
+    for (n=0; n<num; n++) {
+        uint32 start = n ? end[n - 1] : 0;
+        if (group[n] != n || end[n] - start < 2)
+            continue;
+        for (m=start; m<end[n]; m++) {
+            const index_record *r = IndexRecord(ci, order[m]);
+            printf("%s %u\n", r->path, r->song);
+        }
+        printf("\n");
+    }
+    free(end);
+    free(order);
+    free(group);
+    IndexClose(ci);
+    return 0;
+}
+
+
+/*
+ *  Apply ReplayGain gain of song being played from collection index, or
+ *  analyze the song while it is played (audio must be locked)
+ */
+
+static collection_index *play_index = NULL;
+static index_record play_record;            // Record of song being analyzed
+static loudness_meter *play_meter = NULL;    // Meter analyzing song (NULL = none)
+static int32 play_volume;                    // Volume before applying gain
+
+static void start_song_index(const char *file)
+{
+    PrefsReplaceInt32("volume", play_volume);
+    char path[PATH_MAX];
+    int64 mtime;
+    uint64 size;
+    if (!GetPSIDFileInfo(file, path, &mtime, &size))
+        return;
+    const index_record *r = IndexFind(play_index, file, current_song + 1);
+    if (r && (r->flags & INDEX_ANALYZED)) {
+        if (PrefsFindBool("replaygain"))
+            PrefsReplaceInt32("volume", IndexGainVolume(r, play_volume));
+    } else if (IndexMakeRecord(&play_record, path, mtime, size, current_song + 1)) {
+        int freq, bits, channels;
+        SIDGetAudioFormat(&freq, &bits, &channels);
+        play_meter = LoudnessNew(freq, channels);
+        SIDSetLoudnessMeter(play_meter);
+    }
+}
+
+static void finish_song_index()
+{
+    if (play_meter) {
+        SIDSetLoudnessMeter(NULL);
+        if (IndexSetLoudness(&play_record, play_meter, play_volume))
+            IndexPut(play_index, &play_record);
+        LoudnessDelete(play_meter);
+        play_meter = NULL;
+    }
+}
+
+
+/*
+ *  Advance to next song when the current one has ended (called by the SID
+ *  emulation in the audio thread)
+ */
+
+static void silence_event(void *arg, int event, int frame)
+{
+    if (event == SID_TUNE_END) {
+        SDL_Event e;
+        e.type = SDL_USEREVENT;
+        SDL_PushEvent(&e);
+    }
+}
+
+
 /*
  *  Main program
  */
@@ -126,13 +832,13 @@ int main(int argc, char **argv)
         "For details, see the file COPYING.\n\n"
     );
 
-    // Initialize everything
-    if (SDL_Init(SDL_INIT_AUDIO) < 0) {
+    // Initialize everything (audio is only initialized for replay)
+    if (SDL_Init(0) < 0) {
         fprintf(stderr, "Couldn't initialize SDL (%s)\n", SDL_GetError());
         exit(1);
     }
     atexit(quit);
-    InitAll(argc, argv);
+    InitAll(&argc, argv);
     int32 speed = PrefsFindInt32("speed");
 
     // Parse non-option arguments
@@ -152,40 +858,166 @@ int main(int argc, char **argv)
                 song = atoi(argv[i]); // Second non-option argument is song number
         }
     }
+
+    // Run streaming server instead of playing a file?
+    const char *listen_adr = PrefsFindString("listen", 0);
+    if (listen_adr)
+        exit(ServerRun(listen_adr));
+
+    // Build pack of PSID files instead of playing?
+    const char *pack_file = PrefsFindString("mkpack", 0);
+    if (pack_file) {
+        if (!PackBuild(pack_file, argc - 1, argv + 1)) {
+            fprintf(stderr, "Couldn't write pack '%s'\n", pack_file);
+            exit(1);
+        }
+        exit(0);
+    }
+
+    // Add files to collection index instead of playing?
+    const char *index_file = PrefsFindString("index", 0);
+    if (PrefsFindBool("analyze")) {
+        if (index_file == NULL) {
+            fprintf(stderr, "Analyzing needs a collection index (--index)\n");
+            exit(1);
+        }
+        exit(analyze_files(index_file, argc, argv));
+    }
+
+    // Keep collection index up to date instead of playing?
+    if (PrefsFindBool("watch")) {
+        if (index_file == NULL) {
+            fprintf(stderr, "Watching needs a collection index (--index)\n");
+            exit(1);
+        }
+        exit(watch_files(index_file, argc, argv));
+    }
+
+    // Dump SID registers instead of playing?
+    if (PrefsFindString("regdump", 0))
+        exit(dump_files(argc, argv));
+
+    // Render songs to FLAC files instead of playing?
+    render_dir = PrefsFindString("flacdir", 0);
+    if (render_dir)
+        exit(process_songs(argc, argv, render_song));
+
+    // Search collection index instead of playing?
+    const char *query = PrefsFindString("search", 0);
+    if (query) {
+        if (index_file == NULL) {
+            fprintf(stderr, "Searching needs a collection index (--index)\n");
+            exit(1);
+        }
+        exit(print_search(index_file, query));
+    }
+
+    // Print duplicate songs of collection index instead of playing?
+    if (PrefsFindInt32("duplicates")) {
+        if (index_file == NULL) {
+            fprintf(stderr, "Finding duplicates needs a collection index (--index)\n");
+            exit(1);
+        }
+        exit(print_duplicates(index_file));
+    }
+
     if (file_name == NULL)
         usage(argv[0]);
 
-    // Load given PSID file
+    // Load given PSID file, or play register stream
+    regstream *rs = NULL;
     if (!LoadPSIDFile(file_name)) {
-        fprintf(stderr, "Couldn't load '%s' (not a PSID file?)\n", file_name);
-        exit(1);
+        rs = RegStreamLoad(file_name);
+        if (rs == NULL) {
+            fprintf(stderr, "Couldn't load '%s' (not a PSID file or register stream?)\n", file_name);
+            exit(1);
+        }
+        RegStreamGetInfo(rs, &song, module_name, author_name, copyright_info);
+        number_of_songs = song;
+        current_song = song - 1;
+        SIDPlayRegStream(rs);
     }
 
     // Select song
-    if (song > 0) {
+    if (song > 0 && rs == NULL) {
         if (song > number_of_songs)
             song = number_of_songs;
         SelectSong(song - 1);
     }
 
+    // Export register stream instead of playing?
+    const char *reg_file = PrefsFindString("regexport", 0);
+    if (reg_file && rs == NULL) {
+        if (!RegStreamExport(reg_file, current_song, PrefsFindInt32("exportlength"), PrefsFindBool("regcompress"))) {
+            fprintf(stderr, "Couldn't write register stream '%s'\n", reg_file);
+            exit(1);
+        }
+        exit(0);
+    }
+
     SIDAdjustSpeed(speed); // SelectSong and LoadPSIDFile() reset this to 100%
 
+    // Prepare the other songs for switching to them at the end of this one
+    if (rs == NULL)
+        PrepareSongs(file_name);
+
     // Print file information
     printf("Module Name: %s\n", module_name);
     printf("Author     : %s\n", author_name);
     printf("Copyright  : %s\n\n", copyright_info);
-    printf("Playing song %d/%d\n", current_song + 1, number_of_songs);
+    if (rs)
+        printf("Playing register stream of song %d\n", current_song + 1);
+    else
+        printf("Playing song %d/%d\n", current_song + 1, number_of_songs);
 
-    // Start replay and enter main loop
+    // Start replay
+    if (!SIDOpenAudio())
+        exit(1);
+    play_volume = PrefsFindInt32("volume");
+    if (index_file && rs == NULL)
+        play_index = IndexOpen(index_file);
+    if (play_index)
+        start_song_index(file_name);
+    int freq, bits, channels;
+    SIDGetAudioFormat(&freq, &bits, &channels);
+    uint32 silence_frames = (uint32)PrefsFindInt32("silencetimeout") * freq;
+    if (silence_frames)
+        SIDSetSilenceHook(silence_event, NULL, silence_frames);
     SDL_PauseAudio(false);
+
+    // Main loop
     while (true) {
         SDL_Event e;
         if (SDL_WaitEvent(&e)) {
             if (e.type == SDL_QUIT)
                 break;
+
+            // End of song, play next one
+            if (e.type == SDL_USEREVENT) {
+                if (rs || current_song + 1 >= number_of_songs)
+                    break;
+                SDL_LockAudio();
+                if (play_index)
+                    finish_song_index();
+                SwitchSong(current_song + 1);
+                SIDAdjustSpeed(speed);
+                SIDSetSilenceHook(silence_event, NULL, silence_frames);
+                if (play_index)
+                    start_song_index(file_name);
+                SDL_UnlockAudio();
+                printf("Playing song %d/%d\n", current_song + 1, number_of_songs);
+            }
         }
     }
 
+    // Store loudness of played audio in index
+    SDL_LockAudio();
+    if (play_index)
+        finish_song_index();
+    SDL_UnlockAudio();
+    IndexClose(play_index);
+
     ExitAll();
+    RegStreamDelete(rs);
     return 0;
 }
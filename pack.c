@@ -0,0 +1,376 @@
+/*
+ *  pack.c - Packed collection of PSID files
+ *
+ *  SIDPlayer (C) Copyright 1996-2004 Christian Bauer
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+
+/*
+ *  A pack is one file holding many PSID files, so a collection can be
+ *  scanned and played without opening every file. It starts with a header,
+ *  followed by the PSID files one after another, the index (an array of
+ *  pack_entry sorted by the hash of the path) and a string table with the
+ *  paths. The PSID header fields are not stored in the index, as they are
+ *  read from the mapped file data just as quickly. The pack is mapped
+ *  read-only and PSID files are loaded directly from the mapping, so all
+ *  processes playing from it share its pages.
+ */
+
+#include "sys.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+
+#include "pack.h"
+#include "main.h"
+
+
+// Magic number and version of pack files
+static const char PACK_MAGIC[8] = "TSIDPCK2";
+
+// Header of pack file
+typedef struct pack_header pack_header;
+struct pack_header {
+    char magic[8];
+    uint32 entry_size;            // sizeof(pack_entry), to catch incompatible builds
+    uint32 num_entries;
+    uint64 index_offset;        // Position of index
+    uint64 strings_offset;        // Position and size of string table
+    uint64 strings_size;
+    uint8 reserved[24];
+};
+
+struct psid_pack {
+    void *map;                    // Mapped file
+    size_t map_size;
+    const pack_header *header;
+    const pack_entry *entries;
+    const char *strings;
+};
+
+// Pack being built
+typedef struct pack_builder pack_builder;
+struct pack_builder {
+    FILE *f;
+    uint64 pos;                    // Size of pack so far
+    pack_entry *entries;
+    uint32 num_entries, max_entries;
+    char *strings;
+    size_t strings_size, max_strings;
+    uint8 buf[MAX_PSID_FILE_SIZE];    // Data of current file
+};
+
+// String table for sorting the index
+static const char *sort_strings;
+
+
+/*
+ *  64-bit FNV-1a hash of path
+ */
+
+static uint64 hash_path(const char *path)
+{
+    uint64 h = 0xcbf29ce484222325ULL;
+    while (*path) {
+        h ^= (uint8)*path++;
+        h *= 0x100000001b3ULL;
+    }
+    return h;
+}
+
+
+/*
+ *  Build pack
+ */
+
+static bool add_file(pack_builder *b, const char *file, const char *path)
+{
+    FILE *f = fopen(file, "rb");
+    if (f == NULL)
+        return false;
+    size_t length = fread(b->buf, 1, MAX_PSID_FILE_SIZE, f);
+    fclose(f);
+
+    int songs, default_song;
+    char name[64], author[64], copyright[64];
+    if (!GetPSIDInfo(b->buf, length, &songs, &default_song, name, author, copyright))
+        return true;        // Not a PSID file, ignored
+
+    if (b->num_entries == b->max_entries) {
+        uint32 max = b->max_entries * 2 + 1024;
+        pack_entry *e = realloc(b->entries, max * sizeof(pack_entry));
+        if (e == NULL)
+            return false;
+        b->entries = e;
+        b->max_entries = max;
+    }
+    size_t path_size = strlen(path) + 1;
+    if (b->strings_size + path_size > b->max_strings) {
+        size_t max = b->max_strings * 2 + path_size + 65536;
+        char *s = realloc(b->strings, max);
+        if (s == NULL)
+            return false;
+        b->strings = s;
+        b->max_strings = max;
+    }
+
+    pack_entry *e = b->entries + b->num_entries;
+    memset(e, 0, sizeof(pack_entry));
+    e->hash = hash_path(path);
+    e->offset = b->pos;
+    e->length = length;
+    e->path = b->strings_size;
+    memcpy(b->strings + b->strings_size, path, path_size);
+    b->strings_size += path_size;
+
+    if (fwrite(b->buf, 1, length, b->f) != length)
+        return false;
+    b->pos += length;
+    b->num_entries++;
+    return true;
+}
+
+// Add file or directory (recursively), path is the name in the pack
+static bool add_path(pack_builder *b, const char *file, const char *path)
+{
+    struct stat st;
+    if (stat(file, &st) < 0) {
+        fprintf(stderr, "Couldn't read '%s'\n", file);
+        return false;
+    }
+
+    if (S_ISDIR(st.st_mode)) {
+        DIR *d = opendir(file);
+        if (d == NULL) {
+            fprintf(stderr, "Couldn't read '%s'\n", file);
+            return false;
+        }
+        bool ok = true;
+        struct dirent *de;
+        while (ok && (de = readdir(d)) != NULL) {
+            if (de->d_name[0] == '.')
+                continue;
+            char sub_file[PATH_MAX], sub_path[PATH_MAX];
+            snprintf(sub_file, sizeof(sub_file), "%s/%s", file, de->d_name);
+            if (path[0])
+                snprintf(sub_path, sizeof(sub_path), "%s/%s", path, de->d_name);
+            else
+                snprintf(sub_path, sizeof(sub_path), "%s", de->d_name);
+            ok = add_path(b, sub_file, sub_path);
+        }
+        closedir(d);
+        return ok;
+    }
+
+    if (S_ISREG(st.st_mode) && !add_file(b, file, path)) {
+        fprintf(stderr, "Couldn't add '%s' to pack\n", file);
+        return false;
+    }
+    return true;
+}
+
+static int compare_entries(const void *a, const void *b)
+{
+    const pack_entry *x = a, *y = b;
+    if (x->hash != y->hash)
+        return x->hash < y->hash ? -1 : 1;
+    return strcmp(sort_strings + x->path, sort_strings + y->path);
+}
+
+bool PackBuild(const char *file, int num_paths, char **paths)
+{
+    pack_builder *b = calloc(1, sizeof(pack_builder));
+    char *tmp = malloc(strlen(file) + 16);
+    if (b == NULL || tmp == NULL) {
+        free(b);
+        free(tmp);
+        return false;
+    }
+    sprintf(tmp, "%s.%d", file, (int)getpid());
+    b->f = fopen(tmp, "wb");
+    bool ok = b->f != NULL;
+
+    // PSID files
+    pack_header h;
+    memset(&h, 0, sizeof(h));
+    if (ok)
+        ok = fwrite(&h, sizeof(h), 1, b->f) == 1;
+    b->pos = sizeof(h);
+    int i;
+    for (i=0; ok && i<num_paths; i++) {
+        const char *base = strrchr(paths[i], '/');
+        struct stat st;
+        if (stat(paths[i], &st) == 0 && S_ISDIR(st.st_mode))
+            base = "";
+        else
+            base = base ? base + 1 : paths[i];
+        ok = add_path(b, paths[i], base);
+    }
+
+    // Index and string table
+    if (ok) {
+        static const uint8 zero[8] = {0, 0, 0, 0, 0, 0, 0, 0};
+        int pad = (8 - (b->pos & 7)) & 7;
+        ok = fwrite(zero, 1, pad, b->f) == pad;
+        b->pos += pad;
+
+        sort_strings = b->strings;
+        if (b->num_entries)
+            qsort(b->entries, b->num_entries, sizeof(pack_entry), compare_entries);
+        memcpy(h.magic, PACK_MAGIC, 8);
+        h.entry_size = sizeof(pack_entry);
+        h.num_entries = b->num_entries;
+        h.index_offset = b->pos;
+        h.strings_offset = b->pos + (uint64)b->num_entries * sizeof(pack_entry);
+        h.strings_size = b->strings_size;
+        if (ok && b->num_entries)
+            ok = fwrite(b->entries, sizeof(pack_entry), b->num_entries, b->f) == b->num_entries;
+        if (ok && b->strings_size)
+            ok = fwrite(b->strings, 1, b->strings_size, b->f) == b->strings_size;
+        if (ok)
+            ok = fseek(b->f, 0, SEEK_SET) == 0 && fwrite(&h, sizeof(h), 1, b->f) == 1;
+    }
+
+    // Replace old pack
+    if (b->f)
+        ok = (fclose(b->f) == 0) && ok;
+    if (ok)
+        ok = rename(tmp, file) == 0;
+    if (!ok)
+        unlink(tmp);
+    free(b->entries);
+    free(b->strings);
+    free(b);
+    free(tmp);
+    return ok;
+}
+
+
+/*
+ *  Open/close pack
+ */
+
+// Check that the index is sorted, and that the file data and the
+// 0-terminated path of every entry lie within the pack
+static bool valid_entries(const psid_pack *p)
+{
+    const pack_header *h = p->header;
+    uint32 i;
+    for (i=0; i<h->num_entries; i++) {
+        const pack_entry *e = p->entries + i;
+        if (e->offset > p->map_size || e->length > p->map_size - e->offset || e->length > MAX_PSID_FILE_SIZE)
+            return false;
+        if (e->path >= h->strings_size || memchr(p->strings + e->path, 0, h->strings_size - e->path) == NULL)
+            return false;
+        if (i && e->hash < e[-1].hash)
+            return false;
+    }
+    return true;
+}
+
+psid_pack *PackOpen(const char *file)
+{
+    int fd = open(file, O_RDONLY);
+    if (fd < 0)
+        return NULL;
+    psid_pack *p = calloc(1, sizeof(psid_pack));
+    struct stat st;
+    if (p == NULL || fstat(fd, &st) < 0 || (size_t)st.st_size < sizeof(pack_header)) {
+        close(fd);
+        free(p);
+        return NULL;
+    }
+    p->map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (p->map == MAP_FAILED) {
+        free(p);
+        return NULL;
+    }
+    p->map_size = st.st_size;
+
+    const pack_header *h = p->header = p->map;
+    if (memcmp(h->magic, PACK_MAGIC, 8) || h->entry_size != sizeof(pack_entry)
+     || h->index_offset > p->map_size || (uint64)h->num_entries * sizeof(pack_entry) > p->map_size - h->index_offset
+     || h->strings_offset > p->map_size || h->strings_size > p->map_size - h->strings_offset) {
+        PackClose(p);
+        return NULL;
+    }
+    p->entries = (const pack_entry *)((const uint8 *)p->map + h->index_offset);
+    p->strings = (const char *)p->map + h->strings_offset;
+    if (!valid_entries(p)) {
+        PackClose(p);
+        return NULL;
+    }
+    return p;
+}
+
+void PackClose(psid_pack *p)
+{
+    if (p == NULL)
+        return;
+    munmap(p->map, p->map_size);
+    free(p);
+}
+
+
+/*
+ *  Access entries
+ */
+
+uint32 PackNumEntries(const psid_pack *p)
+{
+    return p->header->num_entries;
+}
+
+const pack_entry *PackEntry(const psid_pack *p, uint32 n)
+{
+    return p->entries + n;
+}
+
+const char *PackEntryPath(const psid_pack *p, const pack_entry *e)
+{
+    return p->strings + e->path;
+}
+
+const uint8 *PackEntryData(const psid_pack *p, const pack_entry *e)
+{
+    return (const uint8 *)p->map + e->offset;
+}
+
+const pack_entry *PackFind(const psid_pack *p, const char *path)
+{
+    uint64 hash = hash_path(path);
+    uint32 lo = 0, hi = p->header->num_entries;
+    while (lo < hi) {
+        uint32 mid = (lo + hi) / 2;
+        if (p->entries[mid].hash < hash)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    for (; lo < p->header->num_entries && p->entries[lo].hash == hash; lo++)
+        if (strcmp(p->strings + p->entries[lo].path, path) == 0)
+            return p->entries + lo;
+    return NULL;
+}
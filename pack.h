@@ -0,0 +1,77 @@
+/*
+ *  pack.h - Packed collection of PSID files
+ *
+ *  SIDPlayer (C) Copyright 1996-2004 Christian Bauer
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+
+#ifndef PACK_H
+#define PACK_H
+
+#include "types.h"
+
+#include <stddef.h>
+
+
+/*
+ *  Definitions
+ */
+
+// Opened pack file
+typedef struct psid_pack psid_pack;
+
+// Entry of the pack index: one PSID file (the index is an array of these,
+// sorted by hash, in native byte order)
+typedef struct pack_entry pack_entry;
+struct pack_entry {
+    uint64 hash;                    // Hash of path
+    uint64 offset;                    // Position of PSID file in pack
+    uint32 length;                    // Length of PSID file
+    uint32 path;                    // Position of path in string table
+};
+
+
+/*
+ *  Functions
+ */
+
+// Build pack of PSID files and directories (searched recursively), the
+// files are stored with their path relative to the given directory,
+// returns false on error
+extern bool PackBuild(const char *file, int num_paths, char **paths);
+
+// Open pack, returns NULL on error (also when an entry's file data or path
+// lies outside of the pack)
+extern psid_pack *PackOpen(const char *file);
+
+// Close pack
+extern void PackClose(psid_pack *p);
+
+// Get number of entries and entry by number
+extern uint32 PackNumEntries(const psid_pack *p);
+extern const pack_entry *PackEntry(const psid_pack *p, uint32 n);
+
+// Get path of entry
+extern const char *PackEntryPath(const psid_pack *p, const pack_entry *e);
+
+// Get PSID file data of entry (valid until the pack is closed)
+extern const uint8 *PackEntryData(const psid_pack *p, const pack_entry *e);
+
+// Find entry by path, returns NULL if the file is not in the pack
+extern const pack_entry *PackFind(const psid_pack *p, const char *path);
+
+#endif
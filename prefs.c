@@ -49,8 +49,9 @@ static prefs_desc *find_prefs_desc(const char *name, prefs_desc *list);
  *  Initialize preferences
  */
 
-void PrefsInit(int argc, char **argv)
+void PrefsInit(int *pargc, char **argv)
 {
+    int argc = *pargc;
     int i, j;
     
     // Set defaults
@@ -121,6 +122,7 @@ void PrefsInit(int argc, char **argv)
             argc -= k;
         }
     }
+    *pargc = argc;
 }
 
 
@@ -65,7 +65,7 @@ extern prefs_desc platform_prefs_items[];
  *  Functions
  */
 
-extern void PrefsInit(int argc, char **argv);
+extern void PrefsInit(int *argc, char **argv);
 extern void PrefsExit();
 
 extern void PrefsPrintUsage();
@@ -45,6 +45,33 @@ prefs_desc common_prefs_items[] = {
     {"v4pan", TYPE_INT32, false,        "panning sampled voice (-256..256 = left..right)"},
     {"dualsep", TYPE_INT32, false,      "dual SID stereo separation (0..256 = 0..100%)"},
     {"speed", TYPE_INT32, false,        "replay speed adjustment (percent)"},
+    {"jit", TYPE_BOOLEAN, false,        "translate frequently executed 6510 code to machine code (x86-64 Linux only)"},
+    {"skipsilence", TYPE_BOOLEAN, false, "only clock voices while all voices are silent (output unchanged)"},
+    {"silencetimeout", TYPE_INT32, false, "advance to next song after this many seconds of silence (0 = never)"},
+    {"pack", TYPE_STRING, false,        "pack file to load PSID files from (paths relative to the packed directories)"},
+    {"mkpack", TYPE_STRING, false,      "build pack file of PSID files/directories instead of playing"},
+    {"listen", TYPE_STRING, false,      "run as streaming server on [host:]port or UNIX socket path"},
+    {"renderthreads", TYPE_INT32, false, "number of render threads of streaming server"},
+    {"streambuffer", TYPE_INT32, false, "audio buffered per stream by streaming server in ms"},
+    {"maxload", TYPE_INT32, false,      "maximum render load of streaming server in percent (0 = unlimited)"},
+    {"cachedir", TYPE_STRING, false,    "directory for render cache of streaming server"},
+    {"cachesize", TYPE_INT32, false,    "size of render cache in MB"},
+    {"memcache", TYPE_INT32, false,     "size of in-memory cache of tunes, initialized songs and rendered audio of streaming server in MB (0 = off)"},
+    {"loopmemory", TYPE_INT32, false,   "audio history for loop detection of broadcast channels in MB (0 = off)"},
+    {"index", TYPE_STRING, false,       "collection index file"},
+    {"analyze", TYPE_BOOLEAN, false,    "add PSID files/directories (or all files of the pack) to collection index with loudness analysis instead of playing"},
+    {"watch", TYPE_BOOLEAN, false,      "keep collection index up to date with changes of PSID files/directories instead of playing"},
+    {"duplicates", TYPE_INT32, false,   "print songs of collection index with this fingerprint similarity in percent instead of playing (0 = off)"},
+    {"search", TYPE_STRING, false,      "print songs of collection index whose name, author or copyright contain this string instead of playing"},
+    {"replaygain", TYPE_BOOLEAN, false, "apply ReplayGain gain from collection index to volume"},
+    {"regexport", TYPE_STRING, false,   "export SID register stream of song to file instead of playing"},
+    {"regdump", TYPE_STRING, false,     "dump SID registers of every frame of songs as 'text' or 'binary' instead of playing"},
+    {"dumpdir", TYPE_STRING, false,     "directory for register dumps (default = standard output)"},
+    {"dumpframes", TYPE_INT32, false,   "number of frames of register dumps"},
+    {"flacdir", TYPE_STRING, false,     "render songs to FLAC files in this directory instead of playing"},
+    {"regcompress", TYPE_BOOLEAN, false, "entropy code exported register streams"},
+    {"exportlength", TYPE_INT32, false, "length of exported, analyzed or rendered songs in seconds"},
+    {"readahead", TYPE_INT32, false,    "number of files read at the same time when analyzing, dumping or rendering"},
     {NULL, TYPE_END, false}    // End of list
 };
 
@@ -76,4 +103,21 @@ void AddPrefsDefaults()
     PrefsAddInt32("v4pan", 0);
     PrefsAddInt32("dualsep", 0x80);
     PrefsAddInt32("speed", 100);
+    PrefsAddBool("jit", true);
+    PrefsAddBool("skipsilence", false);
+    PrefsAddInt32("silencetimeout", 0);
+    PrefsAddInt32("renderthreads", 2);
+    PrefsAddInt32("streambuffer", 1000);
+    PrefsAddInt32("maxload", 90);
+    PrefsAddInt32("cachesize", 256);
+    PrefsAddInt32("memcache", 64);
+    PrefsAddInt32("loopmemory", 32);
+    PrefsAddBool("analyze", false);
+    PrefsAddBool("watch", false);
+    PrefsAddInt32("duplicates", 0);
+    PrefsAddBool("replaygain", true);
+    PrefsAddInt32("dumpframes", 3000);
+    PrefsAddBool("regcompress", true);
+    PrefsAddInt32("exportlength", 180);
+    PrefsAddInt32("readahead", 256);
 }
@@ -0,0 +1,195 @@
+/*
+ *  regdump.c - Per-frame SID register dumps
+ *
+ *  SIDPlayer (C) Copyright 1996-2004 Christian Bauer
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+
+/*
+ *  The text format follows SIDdump: one line per frame with the frequency,
+ *  note, waveform, ADSR and pulse width of every voice, and the filter
+ *  cutoff, resonance/routing, type and volume. Values that didn't change
+ *  since the previous frame are shown as dots.
+ *
+ *  The binary format has a 124 byte header (like register stream files)
+ *
+ *    0  "TSIDRD"
+ *    6  version (1)
+ *    8  song number (1-based, 16 bit little-endian)
+ *   12  6510 clock frequency (32 bit)
+ *   16  number of frames (32 bit)
+ *   20  number of registers per frame (32 bit)
+ *   28  name, author, copyright (32 bytes each)
+ *
+ *  followed by one column per register holding its value after every frame.
+ */
+
+#include "sys.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#include "regdump.h"
+#include "main.h"
+#include "sid.h"
+
+#define DEBUG 0
+#include "debug.h"
+
+
+// Magic number and version of binary dump files
+static const char RD_MAGIC[6] = "TSIDRD";
+#define RD_VERSION 1
+#define RD_HEADER_LENGTH 124
+
+// Note names
+static const char note_names[12][3] = {
+    "C-", "C#", "D-", "D#", "E-", "F-", "F#", "G-", "G#", "A-", "A#", "B-"
+};
+
+// Filter types
+static const char filter_types[8][4] = {
+    "Off", "Low", "Bnd", "L+B", "Hi ", "L+H", "B+H", "LBH"
+};
+
+
+/*
+ *  Write text line of one frame
+ */
+
+static void put_le16(uint8 *p, uint16 x)
+{
+    p[0] = x; p[1] = x >> 8;
+}
+
+static void put_le32(uint8 *p, uint32 x)
+{
+    p[0] = x; p[1] = x >> 8; p[2] = x >> 16; p[3] = x >> 24;
+}
+
+// Get note number (0 = C-0) of SID frequency value, -1 = out of range
+static int freq_note(uint16 freq, double clock)
+{
+    if (freq == 0)
+        return -1;
+    double hz = freq * clock / 16777216.0;
+    int note = (int)floor(12.0 * log2(hz / 440.0) + 0.5) + 57;
+    return note >= 0 && note < 96 ? note : -1;
+}
+
+static void write_line(FILE *f, uint32 frame, const uint8 *r, const uint8 *prev, double clock)
+{
+    int v;
+    fprintf(f, "|%6u |", frame);
+    for (v=0; v<3; v++) {
+        const uint8 *vr = r + v * 7, *pv = prev ? prev + v * 7 : NULL;
+        uint16 freq = vr[0] | (vr[1] << 8);
+        if (pv == NULL || vr[0] != pv[0] || vr[1] != pv[1]) {
+            int note = freq_note(freq, clock);
+            if (note >= 0)
+                fprintf(f, " %04X  %s%d %02X", freq, note_names[note % 12], note / 12, note | 0x80);
+            else
+                fprintf(f, " %04X  ... ..", freq);
+        } else
+            fprintf(f, " ....  ... ..");
+        if (pv == NULL || vr[4] != pv[4])
+            fprintf(f, "  %02X", vr[4]);
+        else
+            fprintf(f, "  ..");
+        if (pv == NULL || vr[5] != pv[5] || vr[6] != pv[6])
+            fprintf(f, " %02X%02X", vr[5], vr[6]);
+        else
+            fprintf(f, " ....");
+        if (pv == NULL || vr[2] != pv[2] || (vr[3] & 0x0f) != (pv[3] & 0x0f))
+            fprintf(f, " %03X |", vr[2] | ((vr[3] & 0x0f) << 8));
+        else
+            fprintf(f, " ... |");
+    }
+    if (prev == NULL || r[0x15] != prev[0x15] || r[0x16] != prev[0x16])
+        fprintf(f, " %04X", (r[0x15] & 7) | (r[0x16] << 3));
+    else
+        fprintf(f, " ....");
+    if (prev == NULL || r[0x17] != prev[0x17])
+        fprintf(f, " %02X", r[0x17]);
+    else
+        fprintf(f, " ..");
+    if (prev == NULL || (r[0x18] & 0x70) != (prev[0x18] & 0x70))
+        fprintf(f, " %s", filter_types[(r[0x18] >> 4) & 7]);
+    else
+        fprintf(f, " ...");
+    if (prev == NULL || (r[0x18] & 0x0f) != (prev[0x18] & 0x0f))
+        fprintf(f, " %X |\n", r[0x18] & 0x0f);
+    else
+        fprintf(f, " . |\n");
+}
+
+
+/*
+ *  Dump registers of song
+ */
+
+bool RegDumpSong(FILE *f, int song, uint32 frames, bool binary)
+{
+    SelectSong(song);
+    double clock = SIDCyclesPerSecond();
+
+    if (binary) {
+
+        // Collect registers in columns
+        uint8 *columns = malloc((size_t)frames * REGDUMP_REGS);
+        if (columns == NULL)
+            return false;
+        uint32 frame;
+        int i;
+        for (frame=0; frame<frames; frame++) {
+            uint8 r[REGDUMP_REGS];
+            SIDExecuteFrame();
+            SIDGetRegisters(r);
+            for (i=0; i<REGDUMP_REGS; i++)
+                columns[(size_t)i * frames + frame] = r[i];
+        }
+
+        uint8 h[RD_HEADER_LENGTH];
+        memset(h, 0, sizeof(h));
+        memcpy(h, RD_MAGIC, sizeof(RD_MAGIC));
+        h[6] = RD_VERSION;
+        put_le16(h + 8, song + 1);
+        put_le32(h + 12, SIDCyclesPerSecond());
+        put_le32(h + 16, frames);
+        put_le32(h + 20, REGDUMP_REGS);
+        memcpy(h + 28, module_name, 32);
+        memcpy(h + 60, author_name, 32);
+        memcpy(h + 92, copyright_info, 32);
+        bool ok = fwrite(h, 1, sizeof(h), f) == sizeof(h)
+               && fwrite(columns, REGDUMP_REGS, frames, f) == frames;
+        free(columns);
+        return ok;
+    }
+
+    fprintf(f, "| Frame | Freq Note/Abs WF ADSR Pul | Freq Note/Abs WF ADSR Pul | Freq Note/Abs WF ADSR Pul | FCut RC Typ V |\n");
+    fprintf(f, "+-------+---------------------------+---------------------------+---------------------------+---------------+\n");
+    uint8 r[REGDUMP_REGS], prev[REGDUMP_REGS];
+    uint32 frame;
+    for (frame=0; frame<frames; frame++) {
+        SIDExecuteFrame();
+        SIDGetRegisters(r);
+        write_line(f, frame, r, frame ? prev : NULL, clock);
+        memcpy(prev, r, REGDUMP_REGS);
+    }
+    return !ferror(f);
+}
@@ -0,0 +1,48 @@
+/*
+ *  regdump.h - Per-frame SID register dumps
+ *
+ *  SIDPlayer (C) Copyright 1996-2004 Christian Bauer
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+
+#ifndef REGDUMP_H
+#define REGDUMP_H
+
+#include "types.h"
+
+#include <stdio.h>
+
+
+/*
+ *  Definitions
+ */
+
+// Number of SID registers in a dump
+#define REGDUMP_REGS 25
+
+
+/*
+ *  Functions
+ */
+
+// Run song (0..n) of the loaded PSID file for the given number of replay
+// frames (6510 emulation only) and write the SID registers after every
+// frame to the file, as a SIDdump-style text table or as a binary file
+// with one column of values per register, returns false on error
+extern bool RegDumpSong(FILE *f, int song, uint32 frames, bool binary);
+
+#endif
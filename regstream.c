@@ -0,0 +1,663 @@
+/*
+ *  regstream.c - SID register streams
+ *
+ *  SIDPlayer (C) Copyright 1996-2004 Christian Bauer
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+
+/*
+ *  A register stream file stores the writes to the SID registers and the
+ *  CIA timer of every replay frame, recorded with 6510 emulation only. As
+ *  the sound emulation only depends on these writes, replaying them
+ *  produces the same sound as running the tune.
+ *
+ *  File format (all numbers little-endian):
+ *
+ *     0  "TSIDRS", version (1 byte), flags (1 byte, bit 0 = entropy coded)
+ *     8  song number (16 bit, 1-based), reserved (16 bit)
+ *    12  C64 cycles per second
+ *    16  number of frames
+ *    20  number of writes
+ *    24  length of frame data
+ *    28  module name, author name, copyright info (32 bytes each)
+ *   124  frame data
+ *
+ *  Writes to the pseudo registers REG_RAM_* carry the C64 RAM contents
+ *  that are read by the sound emulation when playing samples or Galway
+ *  noise. They are recorded when voice 4 is started, and only the bytes
+ *  that are not already in the player's RAM are stored.
+ *
+ *  Frame data consists of, for every frame, the number of writes followed
+ *  by the writes, each one being the cycle difference to the previous
+ *  write (frames start at cycle 0), the register, and the difference of
+ *  the value to the previous value written to that register. Numbers are
+ *  stored as variable length integers (7 bits per byte, LSB first). When
+ *  entropy coded, every byte is coded with an adaptive range coder, with
+ *  separate models for counts, cycles, registers (depending on the
+ *  previous register in the frame) and values (depending on the register).
+ */
+
+#include "sys.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+
+#include "regstream.h"
+#include "main.h"
+#include "sid.h"
+
+#define DEBUG 0
+#include "debug.h"
+
+
+// Magic number and version of register stream files
+static const char RS_MAGIC[6] = "TSIDRS";
+#define RS_VERSION 1
+
+// File header
+#define RS_HEADER_LENGTH 124
+#define RS_FLAG_COMPRESSED 1
+
+// Maximum number of writes accepted when loading
+#define MAX_WRITES (1 << 26)
+
+struct regstream {
+    int song;                    // Song number (1-based)
+    uint32 clock;                // C64 cycles per second
+    char name[33], author[33], copyright[33];
+
+    uint32 num_frames;
+    uint32 *frame_start;        // Index of first write of every frame (num_frames + 1 entries)
+    uint32 max_frames;
+
+    reg_write *writes;
+    uint32 num_writes;
+    uint32 max_writes;
+
+    uint8 *ram;                    // RAM contents of player when recording (allocated on first use)
+    uint16 ram_adr;                // Address for next REG_RAM_DATA write of player
+
+    bool error;                    // Flag: out of memory while recording, frames or writes are missing
+};
+
+
+/*
+ *  Create/delete register stream
+ */
+
+regstream *RegStreamNew()
+{
+    regstream *rs = calloc(1, sizeof(regstream));
+    if (rs == NULL)
+        return NULL;
+    rs->frame_start = malloc(sizeof(uint32));
+    if (rs->frame_start == NULL) {
+        free(rs);
+        return NULL;
+    }
+    rs->frame_start[0] = 0;
+    return rs;
+}
+
+void RegStreamDelete(regstream *rs)
+{
+    if (rs == NULL)
+        return;
+    free(rs->frame_start);
+    free(rs->writes);
+    free(rs->ram);
+    free(rs);
+}
+
+
+/*
+ *  Add frames and writes
+ */
+
+void RegStreamNextFrame(regstream *rs)
+{
+    if (rs->error)
+        return;
+
+    if (rs->num_frames + 1 >= rs->max_frames) {
+        uint32 max = rs->max_frames ? rs->max_frames * 2 : 1024;
+        uint32 *p = realloc(rs->frame_start, (max + 1) * sizeof(uint32));
+        if (p == NULL) {
+            rs->error = true;
+            return;
+        }
+        rs->frame_start = p;
+        rs->max_frames = max;
+    }
+    rs->num_frames++;
+    rs->frame_start[rs->num_frames] = rs->num_writes;
+}
+
+void RegStreamAddWrite(regstream *rs, uint8 reg, uint8 value, cycle_t cycle)
+{
+    // Writes before the first frame belong to frame 0
+    if (rs->num_frames == 0)
+        RegStreamNextFrame(rs);
+
+    // Once data is missing, the stream is useless
+    if (rs->error)
+        return;
+
+    if (rs->num_writes == rs->max_writes) {
+        uint32 max = rs->max_writes ? rs->max_writes * 2 : 4096;
+        reg_write *p = realloc(rs->writes, max * sizeof(reg_write));
+        if (p == NULL) {
+            rs->error = true;
+            return;
+        }
+        rs->writes = p;
+        rs->max_writes = max;
+    }
+
+    // Cycles are ascending within a frame
+    uint32 first = rs->frame_start[rs->num_frames - 1];
+    if (rs->num_writes > first && cycle < rs->writes[rs->num_writes - 1].cycle)
+        cycle = rs->writes[rs->num_writes - 1].cycle;
+
+    reg_write *w = rs->writes + rs->num_writes++;
+    w->cycle = cycle;
+    w->reg = reg;
+    w->value = value;
+    rs->frame_start[rs->num_frames] = rs->num_writes;
+}
+
+
+void RegStreamAddRAM(regstream *rs, uint16 adr, const uint8 *data, int length, cycle_t cycle)
+{
+    if (rs->error)
+        return;
+
+    if (rs->ram == NULL) {
+        rs->ram = calloc(1, 0x10000);
+        if (rs->ram == NULL) {
+            rs->error = true;
+            return;
+        }
+    }
+
+    int i;
+    for (i=0; i<length; i++, adr++) {
+        if (rs->ram[adr] == data[i])
+            continue;
+        if (rs->ram_adr != adr) {
+            RegStreamAddWrite(rs, REG_RAM_ADR_LO, adr & 0xff, cycle);
+            RegStreamAddWrite(rs, REG_RAM_ADR_HI, adr >> 8, cycle);
+        }
+        RegStreamAddWrite(rs, REG_RAM_DATA, data[i], cycle);
+        rs->ram[adr] = data[i];
+        rs->ram_adr = adr + 1;
+    }
+}
+
+
+/*
+ *  Access stream
+ */
+
+void RegStreamGetInfo(const regstream *rs, int *song, char *name, char *author, char *copyright)
+{
+    *song = rs->song;
+    strcpy(name, rs->name);
+    strcpy(author, rs->author);
+    strcpy(copyright, rs->copyright);
+}
+
+bool RegStreamError(const regstream *rs)
+{
+    return rs->error;
+}
+
+uint32 RegStreamNumFrames(const regstream *rs)
+{
+    return rs->num_frames;
+}
+
+const reg_write *RegStreamFrame(const regstream *rs, uint32 frame, int *count)
+{
+    if (frame >= rs->num_frames) {
+        *count = 0;
+        return NULL;
+    }
+    *count = rs->frame_start[frame + 1] - rs->frame_start[frame];
+    return rs->writes + rs->frame_start[frame];
+}
+
+
+/*
+ *  Adaptive range coder (carry-less, after D. Subbotin)
+ */
+
+#define RC_TOP (1U << 24)
+#define RC_BOT (1U << 16)
+
+// Symbol statistics of one context
+typedef struct model_t model_t;
+struct model_t {
+    uint16 freq[256];
+    uint32 total;
+};
+
+// Contexts
+enum {
+    CTX_COUNT,
+    CTX_CYCLE,
+    CTX_REG,                    // + previous register (0xff = none)
+    CTX_VALUE = CTX_REG + 256,    // + register
+    NUM_CONTEXTS = CTX_VALUE + 256
+};
+
+// Coder state, also used for uncoded data
+typedef struct coder_t coder_t;
+struct coder_t {
+    bool compress;
+    model_t *models;
+    uint32 low, range, code;
+
+    uint8 *buf;                    // Output data (growing) or input data
+    size_t pos, size;
+    bool error;                    // Flag: out of memory or end of input
+};
+
+static void model_init(coder_t *c)
+{
+    int i, j;
+    for (i=0; i<NUM_CONTEXTS; i++) {
+        for (j=0; j<256; j++)
+            c->models[i].freq[j] = 1;
+        c->models[i].total = 256;
+    }
+}
+
+static void model_update(model_t *m, int sym)
+{
+    m->freq[sym] += 32;
+    m->total += 32;
+    if (m->total > RC_BOT - 32) {
+        int i;
+        m->total = 0;
+        for (i=0; i<256; i++) {
+            m->freq[i] = (m->freq[i] + 1) / 2;
+            m->total += m->freq[i];
+        }
+    }
+}
+
+static void out_byte(coder_t *c, uint8 byte)
+{
+    if (c->pos == c->size) {
+        size_t size = c->size ? c->size * 2 : 65536;
+        uint8 *p = realloc(c->buf, size);
+        if (p == NULL) {
+            c->error = true;
+            return;
+        }
+        c->buf = p;
+        c->size = size;
+    }
+    c->buf[c->pos++] = byte;
+}
+
+static uint8 in_byte(coder_t *c)
+{
+    if (c->pos < c->size)
+        return c->buf[c->pos++];
+    c->error = true;
+    return 0;
+}
+
+static void rc_encode(coder_t *c, uint32 cum, uint32 freq, uint32 total)
+{
+    c->range /= total;
+    c->low += cum * c->range;
+    c->range *= freq;
+    while ((c->low ^ (c->low + c->range)) < RC_TOP || (c->range < RC_BOT && ((c->range = -c->low & (RC_BOT - 1)), 1))) {
+        out_byte(c, c->low >> 24);
+        c->low <<= 8;
+        c->range <<= 8;
+    }
+}
+
+static void rc_flush(coder_t *c)
+{
+    int i;
+    for (i=0; i<4; i++) {
+        out_byte(c, c->low >> 24);
+        c->low <<= 8;
+    }
+}
+
+static void rc_start_decode(coder_t *c)
+{
+    int i;
+    c->low = 0;
+    c->range = 0xffffffff;
+    c->code = 0;
+    for (i=0; i<4; i++)
+        c->code = (c->code << 8) | in_byte(c);
+}
+
+static uint32 rc_get_freq(coder_t *c, uint32 total)
+{
+    c->range /= total;
+    uint32 v = (c->code - c->low) / c->range;
+    return v < total ? v : total - 1;
+}
+
+static void rc_decode(coder_t *c, uint32 cum, uint32 freq)
+{
+    c->low += cum * c->range;
+    c->range *= freq;
+    while ((c->low ^ (c->low + c->range)) < RC_TOP || (c->range < RC_BOT && ((c->range = -c->low & (RC_BOT - 1)), 1))) {
+        c->code = (c->code << 8) | in_byte(c);
+        c->low <<= 8;
+        c->range <<= 8;
+    }
+}
+
+// Write/read one byte in given context
+static void put_symbol(coder_t *c, int ctx, uint8 sym)
+{
+    if (!c->compress) {
+        out_byte(c, sym);
+        return;
+    }
+    model_t *m = c->models + ctx;
+    uint32 cum = 0;
+    int i;
+    for (i=0; i<sym; i++)
+        cum += m->freq[i];
+    rc_encode(c, cum, m->freq[sym], m->total);
+    model_update(m, sym);
+}
+
+static uint8 get_symbol(coder_t *c, int ctx)
+{
+    if (!c->compress)
+        return in_byte(c);
+    model_t *m = c->models + ctx;
+    uint32 target = rc_get_freq(c, m->total);
+    uint32 cum = 0;
+    int sym;
+    for (sym=0; sym<255; sym++) {
+        if (cum + m->freq[sym] > target)
+            break;
+        cum += m->freq[sym];
+    }
+    rc_decode(c, cum, m->freq[sym]);
+    model_update(m, sym);
+    return sym;
+}
+
+// Write/read variable length integer
+static void put_varint(coder_t *c, int ctx, uint32 x)
+{
+    while (x >= 0x80) {
+        put_symbol(c, ctx, (x & 0x7f) | 0x80);
+        x >>= 7;
+    }
+    put_symbol(c, ctx, x);
+}
+
+static uint32 get_varint(coder_t *c, int ctx)
+{
+    uint32 x = 0;
+    int shift;
+    for (shift=0; shift<32; shift+=7) {
+        uint8 b = get_symbol(c, ctx);
+        x |= (uint32)(b & 0x7f) << shift;
+        if (!(b & 0x80))
+            break;
+    }
+    return x;
+}
+
+
+/*
+ *  Save register stream file
+ */
+
+static void put_le16(uint8 *p, uint16 x)
+{
+    p[0] = x; p[1] = x >> 8;
+}
+
+static void put_le32(uint8 *p, uint32 x)
+{
+    p[0] = x; p[1] = x >> 8; p[2] = x >> 16; p[3] = x >> 24;
+}
+
+static uint32 get_le32(const uint8 *p)
+{
+    return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32)p[3] << 24);
+}
+
+bool RegStreamSave(const regstream *rs, const char *file, bool compress)
+{
+    // Don't save incomplete stream
+    if (rs->error)
+        return false;
+
+    coder_t c;
+    memset(&c, 0, sizeof(c));
+    c.compress = compress;
+    if (compress) {
+        c.models = malloc(NUM_CONTEXTS * sizeof(model_t));
+        if (c.models == NULL)
+            return false;
+        model_init(&c);
+        c.range = 0xffffffff;
+    }
+
+    // Encode frames
+    uint8 last_value[256];
+    memset(last_value, 0, sizeof(last_value));
+    uint32 f, i;
+    for (f=0; f<rs->num_frames; f++) {
+        uint32 first = rs->frame_start[f], end = rs->frame_start[f + 1];
+        put_varint(&c, CTX_COUNT, end - first);
+        uint32 cycle = 0;
+        uint8 prev_reg = 0xff;
+        for (i=first; i<end; i++) {
+            const reg_write *w = rs->writes + i;
+            put_varint(&c, CTX_CYCLE, w->cycle - cycle);
+            put_symbol(&c, CTX_REG + prev_reg, w->reg);
+            put_symbol(&c, CTX_VALUE + w->reg, w->value - last_value[w->reg]);
+            cycle = w->cycle;
+            prev_reg = w->reg;
+            last_value[w->reg] = w->value;
+        }
+    }
+    if (compress)
+        rc_flush(&c);
+    free(c.models);
+
+    // Write header and data
+    uint8 h[RS_HEADER_LENGTH];
+    memset(h, 0, sizeof(h));
+    memcpy(h, RS_MAGIC, sizeof(RS_MAGIC));
+    h[6] = RS_VERSION;
+    h[7] = compress ? RS_FLAG_COMPRESSED : 0;
+    put_le16(h + 8, rs->song);
+    put_le32(h + 12, rs->clock);
+    put_le32(h + 16, rs->num_frames);
+    put_le32(h + 20, rs->num_writes);
+    put_le32(h + 24, c.pos);
+    memcpy(h + 28, rs->name, 32);
+    memcpy(h + 60, rs->author, 32);
+    memcpy(h + 92, rs->copyright, 32);
+
+    bool ok = !c.error;
+    FILE *fp = ok ? fopen(file, "wb") : NULL;
+    if (fp) {
+        ok = fwrite(h, 1, sizeof(h), fp) == sizeof(h) && fwrite(c.buf, 1, c.pos, fp) == c.pos;
+        ok = (fclose(fp) == 0) && ok;
+    } else
+        ok = false;
+    free(c.buf);
+    return ok;
+}
+
+
+/*
+ *  Load register stream file
+ */
+
+regstream *RegStreamLoad(const char *file)
+{
+    FILE *fp = fopen(file, "rb");
+    if (fp == NULL)
+        return NULL;
+
+    uint8 h[RS_HEADER_LENGTH];
+    if (fread(h, 1, sizeof(h), fp) != sizeof(h) || memcmp(h, RS_MAGIC, sizeof(RS_MAGIC)) || h[6] != RS_VERSION) {
+        fclose(fp);
+        return NULL;
+    }
+    uint32 num_frames = get_le32(h + 16);
+    uint32 num_writes = get_le32(h + 20);
+    uint32 length = get_le32(h + 24);
+
+    // Frame data must be in the file
+    struct stat st;
+    if (fstat(fileno(fp), &st) < 0 || (off_t)length > st.st_size - (off_t)sizeof(h)) {
+        fclose(fp);
+        return NULL;
+    }
+
+    coder_t c;
+    memset(&c, 0, sizeof(c));
+    c.compress = h[7] & RS_FLAG_COMPRESSED;
+    c.buf = malloc(length ? length : 1);
+    c.size = length;
+    regstream *rs = RegStreamNew();
+    bool ok = c.buf && rs && num_writes <= MAX_WRITES && num_frames <= MAX_WRITES
+           && fread(c.buf, 1, length, fp) == length;
+    fclose(fp);
+
+    if (ok) {
+        rs->song = h[8] | (h[9] << 8);
+        rs->clock = get_le32(h + 12);
+        memcpy(rs->name, h + 28, 32);
+        memcpy(rs->author, h + 60, 32);
+        memcpy(rs->copyright, h + 92, 32);
+        uint32 *frame_start = realloc(rs->frame_start, (num_frames + 1) * sizeof(uint32));
+        if (frame_start) {
+            rs->frame_start = frame_start;
+            rs->max_frames = num_frames;
+        }
+        rs->writes = malloc((num_writes ? num_writes : 1) * sizeof(reg_write));
+        rs->max_writes = num_writes;
+        ok = frame_start && rs->writes;
+    }
+    if (ok && c.compress) {
+        c.models = malloc(NUM_CONTEXTS * sizeof(model_t));
+        ok = c.models != NULL;
+        if (ok) {
+            model_init(&c);
+            rc_start_decode(&c);
+        }
+    }
+
+    // Decode frames
+    uint8 last_value[256];
+    memset(last_value, 0, sizeof(last_value));
+    uint32 f, i;
+    for (f=0; ok && f<num_frames; f++) {
+        uint32 count = get_varint(&c, CTX_COUNT);
+        if (count > num_writes - rs->num_writes) {
+            ok = false;
+            break;
+        }
+        uint32 cycle = 0;
+        uint8 prev_reg = 0xff;
+        for (i=0; i<count; i++) {
+            reg_write *w = rs->writes + rs->num_writes++;
+            cycle += get_varint(&c, CTX_CYCLE);
+            w->cycle = cycle;
+            w->reg = get_symbol(&c, CTX_REG + prev_reg);
+            w->value = last_value[w->reg] + get_symbol(&c, CTX_VALUE + w->reg);
+            prev_reg = w->reg;
+            last_value[w->reg] = w->value;
+        }
+        rs->num_frames++;
+        rs->frame_start[rs->num_frames] = rs->num_writes;
+        ok = !c.error;
+    }
+    free(c.models);
+    free(c.buf);
+
+    if (!ok || rs->num_writes != num_writes) {
+        RegStreamDelete(rs);
+        return NULL;
+    }
+    return rs;
+}
+
+
+/*
+ *  Record register stream of song
+ */
+
+regstream *RegStreamRecord(int song, int seconds)
+{
+    regstream *rs = RegStreamNew();
+    if (rs == NULL)
+        return NULL;
+    rs->song = song + 1;
+    rs->clock = SIDCyclesPerSecond();
+    memcpy(rs->name, module_name, 32);
+    memcpy(rs->author, author_name, 32);
+    memcpy(rs->copyright, copyright_info, 32);
+
+    // Frame 0 is the init routine, then the replay routine is run for the given time
+    SIDSetCapture(rs);
+    RegStreamNextFrame(rs);
+    SelectSong(song);
+    uint64 total = (uint64)seconds * rs->clock;
+    uint64 t = 0;
+    while (t < total) {
+        RegStreamNextFrame(rs);
+        t += SIDExecuteFrame();
+    }
+    SIDSetCapture(NULL);
+
+    // Discard incomplete stream
+    if (rs->error) {
+        RegStreamDelete(rs);
+        return NULL;
+    }
+
+    D(bug("%u frames, %u writes\n", rs->num_frames, rs->num_writes));
+    return rs;
+}
+
+bool RegStreamExport(const char *file, int song, int seconds, bool compress)
+{
+    regstream *rs = RegStreamRecord(song, seconds);
+    if (rs == NULL)
+        return false;
+    bool ok = RegStreamSave(rs, file, compress);
+    RegStreamDelete(rs);
+    return ok;
+}
@@ -0,0 +1,99 @@
+/*
+ *  regstream.h - SID register streams
+ *
+ *  SIDPlayer (C) Copyright 1996-2004 Christian Bauer
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+
+#ifndef REGSTREAM_H
+#define REGSTREAM_H
+
+#include "types.h"
+
+
+/*
+ *  Definitions
+ */
+
+// Pseudo registers for writes to the CIA timer A latch (changes replay
+// frequency), and for C64 RAM contents read by the sound emulation (sample
+// and Galway noise tone list data; data bytes are stored at consecutive
+// addresses starting at the address set with REG_RAM_ADR_*)
+enum {
+    REG_CIA_TL = 0x80,
+    REG_CIA_TH = 0x81,
+    REG_RAM_ADR_LO = 0x82,
+    REG_RAM_ADR_HI = 0x83,
+    REG_RAM_DATA = 0x84
+};
+
+// One register write
+typedef struct reg_write reg_write;
+struct reg_write {
+    uint32 cycle;                // Cycle in frame
+    uint8 reg;                    // SID register (0x00..0x7f) or REG_*
+    uint8 value;
+};
+
+// Register stream: the writes to the SID registers and the CIA timer of
+// every replay frame of a song (frame 0 is the init routine), and the RAM
+// contents needed for playing them (the player starts with cleared RAM)
+typedef struct regstream regstream;
+
+
+/*
+ *  Functions
+ */
+
+// Create/delete empty register stream
+extern regstream *RegStreamNew();
+extern void RegStreamDelete(regstream *rs);
+
+// Start new frame in register stream, add write to current frame (when
+// out of memory, the data is dropped and the stream's error flag is set)
+extern void RegStreamNextFrame(regstream *rs);
+extern void RegStreamAddWrite(regstream *rs, uint8 reg, uint8 value, cycle_t cycle);
+
+// Add RAM contents to current frame (only the bytes that differ from what
+// the player already has are stored)
+extern void RegStreamAddRAM(regstream *rs, uint16 adr, const uint8 *data, int length, cycle_t cycle);
+
+// Get song number (1-based), module name, author name and copyright info
+// (the strings are copied to 64 byte buffers)
+extern void RegStreamGetInfo(const regstream *rs, int *song, char *name, char *author, char *copyright);
+
+// Check whether data was dropped from stream (it must not be used then)
+extern bool RegStreamError(const regstream *rs);
+
+// Get number of frames, get writes of frame
+extern uint32 RegStreamNumFrames(const regstream *rs);
+extern const reg_write *RegStreamFrame(const regstream *rs, uint32 frame, int *count);
+
+// Load/save register stream file (optionally entropy coded), returns NULL/false
+// on error (a stream with error flag is not saved)
+extern regstream *RegStreamLoad(const char *file);
+extern bool RegStreamSave(const regstream *rs, const char *file, bool compress);
+
+// Record register stream of song (0..n) of the loaded PSID file for the given
+// number of seconds (6510 emulation only), returns NULL on error (also when
+// out of memory while recording)
+extern regstream *RegStreamRecord(int song, int seconds);
+
+// Record register stream and save it to file, returns false on error
+extern bool RegStreamExport(const char *file, int song, int seconds, bool compress);
+
+#endif
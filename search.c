@@ -0,0 +1,450 @@
+/*
+ *  search.c - Trigram search index over tune metadata
+ *
+ *  SIDPlayer (C) Copyright 1996-2004 Christian Bauer
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+
+/*
+ *  The search index is an inverted index of the trigrams (three successive
+ *  characters, ignoring case) of the name, author and copyright fields of
+ *  the records of a collection index. The file holds a header, a table of
+ *  all trigrams sorted by key and, for every trigram, the ascending list of
+ *  the numbers of the records whose field contains it. It is mapped
+ *  read-only and used directly: a query looks up the lists of its trigrams
+ *  by binary search, intersects them and compares the few remaining records
+ *  with the query string. Records added to the collection index after the
+ *  search index was built are compared directly.
+ *
+ *  The file is replaced atomically when it is rebuilt, so processes that
+ *  have the old one mapped are not disturbed.
+ */
+
+#include "sys.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+
+#include "search.h"
+
+
+// Magic number and version of search index files
+static const char SEARCH_MAGIC[8] = "TSIDTRI1";
+
+// Suffix of search index file name
+#define SEARCH_SUFFIX ".tri"
+
+// Number of searchable fields and their length in index records
+#define NUM_FIELDS 3
+#define FIELD_LENGTH 32
+
+// Header of search index file, followed by the trigram table and the postings
+typedef struct search_header search_header;
+struct search_header {
+    char magic[8];
+    uint32 num_records;            // Number of records of collection index when built
+    uint32 num_keys;            // Number of trigrams
+    uint32 num_postings;        // Total length of record lists
+    uint8 reserved[44];
+};
+
+// Entry of trigram table
+typedef struct trigram_entry trigram_entry;
+struct trigram_entry {
+    uint32 key;                    // Field number << 24 | three lower case characters
+    uint32 first;                // Index of first record number in postings
+    uint32 count;                // Number of records
+};
+
+struct search_index {
+    void *map;                    // Mapped file
+    size_t map_size;
+    const search_header *header;
+    const trigram_entry *keys;
+    const uint32 *postings;
+};
+
+// Trigram of record while building
+typedef struct posting posting;
+struct posting {
+    uint32 key;
+    uint32 record;
+};
+
+
+/*
+ *  Fields and trigrams
+ */
+
+// Get field of record as lower case 0-terminated string
+static void get_field(char *s, const index_record *r, int field)
+{
+    const char *src = field == 0 ? r->name : (field == 1 ? r->author : r->copyright);
+    int i;
+    for (i=0; i<FIELD_LENGTH && src[i]; i++)
+        s[i] = tolower((uint8)src[i]);
+    s[i] = 0;
+}
+
+static uint32 trigram_key(int field, const char *s)
+{
+    return (field << 24) | ((uint8)s[0] << 16) | ((uint8)s[1] << 8) | (uint8)s[2];
+}
+
+static bool field_contains(const index_record *r, int field, const char *query)
+{
+    if (r->flags & INDEX_REMOVED)
+        return false;
+    char s[FIELD_LENGTH + 1];
+    get_field(s, r, field);
+    return strstr(s, query) != NULL;
+}
+
+static char *search_file_name(const char *index_file)
+{
+    char *name = malloc(strlen(index_file) + strlen(SEARCH_SUFFIX) + 1);
+    if (name) {
+        strcpy(name, index_file);
+        strcat(name, SEARCH_SUFFIX);
+    }
+    return name;
+}
+
+
+/*
+ *  Build search index
+ */
+
+static int compare_postings(const void *a, const void *b)
+{
+    const posting *x = a, *y = b;
+    if (x->key != y->key)
+        return x->key < y->key ? -1 : 1;
+    return x->record < y->record ? -1 : x->record > y->record;
+}
+
+static bool write_search_index(FILE *f, uint32 num_records, const posting *p, size_t num_postings)
+{
+    size_t i, num_keys = 0;
+    for (i=0; i<num_postings; i++)
+        if (i == 0 || p[i].key != p[i-1].key)
+            num_keys++;
+
+    search_header h;
+    memset(&h, 0, sizeof(h));
+    memcpy(h.magic, SEARCH_MAGIC, 8);
+    h.num_records = num_records;
+    h.num_keys = num_keys;
+    h.num_postings = num_postings;
+    if (fwrite(&h, sizeof(h), 1, f) != 1)
+        return false;
+
+    // Trigram table
+    for (i=0; i<num_postings; ) {
+        trigram_entry e;
+        e.key = p[i].key;
+        e.first = i;
+        while (i < num_postings && p[i].key == e.key)
+            i++;
+        e.count = i - e.first;
+        if (fwrite(&e, sizeof(e), 1, f) != 1)
+            return false;
+    }
+
+    // Record lists
+    for (i=0; i<num_postings; i++)
+        if (fwrite(&p[i].record, sizeof(uint32), 1, f) != 1)
+            return false;
+    return true;
+}
+
+bool SearchBuild(const collection_index *ci, const char *index_file)
+{
+    uint32 n, num = IndexNumRecords(ci);
+    posting *p = NULL;
+    size_t num_postings = 0, max_postings = 0;
+
+    // Collect distinct trigrams of every field of every record
+    for (n=0; n<num; n++) {
+        const index_record *r = IndexRecord(ci, n);
+        if (r->flags & INDEX_REMOVED)
+            continue;
+        int field;
+        for (field=0; field<NUM_FIELDS; field++) {
+            char s[FIELD_LENGTH + 1];
+            get_field(s, r, field);
+            int i, len = strlen(s);
+            if (num_postings + FIELD_LENGTH > max_postings) {
+                max_postings = max_postings * 2 + 4096;
+                posting *q = realloc(p, max_postings * sizeof(posting));
+                if (q == NULL) {
+                    free(p);
+                    return false;
+                }
+                p = q;
+            }
+            size_t j, start = num_postings;
+            for (i=0; i+3<=len; i++) {
+                uint32 key = trigram_key(field, s + i);
+                for (j=start; j<num_postings; j++)
+                    if (p[j].key == key)
+                        break;
+                if (j == num_postings) {
+                    p[num_postings].key = key;
+                    p[num_postings].record = n;
+                    num_postings++;
+                }
+            }
+        }
+    }
+    if (num_postings)
+        qsort(p, num_postings, sizeof(posting), compare_postings);
+
+    // Write to temporary file and replace old index with it
+    char *file = search_file_name(index_file);
+    char *tmp = malloc(strlen(index_file) + 32);
+    bool ok = false;
+    if (file && tmp) {
+        sprintf(tmp, "%s%s.%d", index_file, SEARCH_SUFFIX, (int)getpid());
+        FILE *f = fopen(tmp, "wb");
+        if (f) {
+            ok = write_search_index(f, num, p, num_postings);
+            ok = (fclose(f) == 0) && ok;
+            if (ok)
+                ok = rename(tmp, file) == 0;
+            if (!ok)
+                unlink(tmp);
+        }
+    }
+    free(tmp);
+    free(file);
+    free(p);
+    return ok;
+}
+
+
+/*
+ *  Open/close search index
+ */
+
+// Check that the trigram table is sorted and that every record list lies
+// within the postings
+static bool valid_keys(const search_index *si)
+{
+    const search_header *h = si->header;
+    uint32 i;
+    for (i=0; i<h->num_keys; i++) {
+        const trigram_entry *e = si->keys + i;
+        if (e->first > h->num_postings || e->count > h->num_postings - e->first)
+            return false;
+        if (i && e->key <= e[-1].key)
+            return false;
+    }
+    return true;
+}
+
+search_index *SearchOpen(const char *index_file)
+{
+    char *file = search_file_name(index_file);
+    if (file == NULL)
+        return NULL;
+    int fd = open(file, O_RDONLY);
+    free(file);
+    if (fd < 0)
+        return NULL;
+
+    search_index *si = calloc(1, sizeof(search_index));
+    struct stat st;
+    if (si == NULL || fstat(fd, &st) < 0 || (size_t)st.st_size < sizeof(search_header))
+        goto error;
+    si->map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    if (si->map == MAP_FAILED) {
+        si->map = NULL;
+        goto error;
+    }
+    si->map_size = st.st_size;
+    close(fd);
+
+    const search_header *h = si->header = si->map;
+    if (memcmp(h->magic, SEARCH_MAGIC, 8)
+     || si->map_size < sizeof(search_header) + (size_t)h->num_keys * sizeof(trigram_entry) + (size_t)h->num_postings * sizeof(uint32)) {
+        SearchClose(si);
+        return NULL;
+    }
+    si->keys = (const trigram_entry *)(h + 1);
+    si->postings = (const uint32 *)(si->keys + h->num_keys);
+    if (!valid_keys(si)) {
+        SearchClose(si);
+        return NULL;
+    }
+    return si;
+
+error:
+    close(fd);
+    free(si);
+    return NULL;
+}
+
+void SearchClose(search_index *si)
+{
+    if (si == NULL)
+        return;
+    if (si->map)
+        munmap(si->map, si->map_size);
+    free(si);
+}
+
+
+/*
+ *  Find records
+ */
+
+static const trigram_entry *find_key(const search_index *si, uint32 key)
+{
+    uint32 lo = 0, hi = si->header->num_keys;
+    while (lo < hi) {
+        uint32 mid = (lo + hi) / 2;
+        if (si->keys[mid].key < key)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    if (lo < si->header->num_keys && si->keys[lo].key == key)
+        return si->keys + lo;
+    return NULL;
+}
+
+static bool list_contains(const search_index *si, const trigram_entry *e, uint32 record)
+{
+    const uint32 *list = si->postings + e->first;
+    uint32 lo = 0, hi = e->count;
+    while (lo < hi) {
+        uint32 mid = (lo + hi) / 2;
+        if (list[mid] < record)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return lo < e->count && list[lo] == record;
+}
+
+static bool add_result(uint32 **result, uint32 *num, uint32 *max, uint32 record)
+{
+    if (*num == *max) {
+        uint32 *r = realloc(*result, (*max * 2 + 64) * sizeof(uint32));
+        if (r == NULL)
+            return false;
+        *result = r;
+        *max = *max * 2 + 64;
+    }
+    (*result)[(*num)++] = record;
+    return true;
+}
+
+static int compare_records(const void *a, const void *b)
+{
+    uint32 x = *(const uint32 *)a, y = *(const uint32 *)b;
+    return x < y ? -1 : x > y;
+}
+
+uint32 *SearchFind(const search_index *si, const collection_index *ci, const char *query, int fields, uint32 *num)
+{
+    uint32 *result = malloc(64 * sizeof(uint32));
+    uint32 max = 64, n, total = IndexNumRecords(ci);
+    uint32 indexed = si->header->num_records < total ? si->header->num_records : total;
+    *num = 0;
+    if (result == NULL)
+        return NULL;
+
+    // Longer queries can't match
+    char q[FIELD_LENGTH + 1];
+    int i, len = strlen(query);
+    if (len > FIELD_LENGTH)
+        return result;
+    for (i=0; i<=len; i++)
+        q[i] = tolower((uint8)query[i]);
+
+    int field;
+    for (field=0; field<NUM_FIELDS; field++) {
+        if (!(fields & (1 << field)))
+            continue;
+
+        if (len >= 3) {
+
+            // Look up record lists of all trigrams of query, the shortest one
+            // gives the candidates
+            const trigram_entry *lists[FIELD_LENGTH];
+            int num_lists = 0, shortest = 0;
+            for (i=0; i+3<=len; i++) {
+                const trigram_entry *e = find_key(si, trigram_key(field, q + i));
+                if (e == NULL)
+                    break;
+                if (num_lists == 0 || e->count < lists[shortest]->count)
+                    shortest = num_lists;
+                lists[num_lists++] = e;
+            }
+            if (i+3 <= len)
+                num_lists = 0;        // Trigram not in index, no matches
+
+            if (num_lists) {
+                const trigram_entry *e = lists[shortest];
+                uint32 k;
+                for (k=0; k<e->count; k++) {
+                    uint32 record = si->postings[e->first + k];
+                    if (record >= indexed)
+                        break;
+                    for (i=0; i<num_lists; i++)
+                        if (i != shortest && !list_contains(si, lists[i], record))
+                            break;
+                    if (i == num_lists && field_contains(IndexRecord(ci, record), field, q))
+                        if (!add_result(&result, num, &max, record))
+                            goto error;
+                }
+            }
+        } else {
+            for (n=0; n<indexed; n++)
+                if (field_contains(IndexRecord(ci, n), field, q))
+                    if (!add_result(&result, num, &max, n))
+                        goto error;
+        }
+
+        // Records not in search index yet
+        for (n=indexed; n<total; n++)
+            if (field_contains(IndexRecord(ci, n), field, q))
+                if (!add_result(&result, num, &max, n))
+                    goto error;
+    }
+
+    // Sort and remove records found in several fields
+    qsort(result, *num, sizeof(uint32), compare_records);
+    uint32 k = 0;
+    for (n=0; n<*num; n++)
+        if (k == 0 || result[n] != result[k-1])
+            result[k++] = result[n];
+    *num = k;
+    return result;
+
+error:
+    free(result);
+    return NULL;
+}
@@ -0,0 +1,67 @@
+/*
+ *  search.h - Trigram search index over tune metadata
+ *
+ *  SIDPlayer (C) Copyright 1996-2004 Christian Bauer
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+
+#ifndef SEARCH_H
+#define SEARCH_H
+
+#include "types.h"
+#include "index.h"
+
+
+/*
+ *  Definitions
+ */
+
+// Search index of a collection index (stored next to the collection index
+// file, with the suffix ".tri")
+typedef struct search_index search_index;
+
+// PSID header fields to search (bit mask)
+enum {
+    SEARCH_NAME = 1,
+    SEARCH_AUTHOR = 2,
+    SEARCH_COPYRIGHT = 4,
+    SEARCH_ALL = 7
+};
+
+
+/*
+ *  Functions
+ */
+
+// Build search index of the records of the collection index stored in the
+// given file, returns false on error
+extern bool SearchBuild(const collection_index *ci, const char *index_file);
+
+// Open search index of collection index file, returns NULL on error (also
+// when the file is corrupt)
+extern search_index *SearchOpen(const char *index_file);
+
+// Close search index
+extern void SearchClose(search_index *si);
+
+// Find records of collection index whose fields contain the query string
+// (ignoring case), returns array of record numbers in ascending order (the
+// number of records is stored in *num), or NULL on error; the array must be
+// freed by the caller
+extern uint32 *SearchFind(const search_index *si, const collection_index *ci, const char *query, int fields, uint32 *num);
+
+#endif
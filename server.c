@@ -0,0 +1,1570 @@
+/*
+ *  server.c - Streaming server for local clients
+ *
+ *  SIDPlayer (C) Copyright 1996-2004 Christian Bauer
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+/*
+ *  Protocol: the client sends one request line
+ *
+ *    FILE [SONG [FORMAT]]
+ *
+ *  with SONG being the 1-based song number (0 or missing = default song)
+ *  and FORMAT being "pcm" (raw samples) or "wav" (default). The server
+ *  answers with an endless audio stream in the format selected by the
+ *  samplerate/audio16bit/stereo preferences, or with a line "ERROR ..."
+ *  if the request can't be handled.
+ *
+ *  A request line of the form "BROADCAST FILE [SONG [FORMAT]]" joins the
+ *  broadcast channel of that song instead (which is started if it isn't
+ *  running yet). A channel is rendered once in real time into a ring of
+ *  reference counted chunks, and every listener is served from this ring
+ *  at its own read position, without copying the data. Listeners that
+ *  fall behind the ring are skipped ahead to the live position, so the
+ *  renderer never waits for a slow client.
+ *
+ *  One thread handles all socket I/O with epoll. Each stream has its own
+ *  emulator context (a saved machine_state) and an output buffer. A pool
+ *  of render threads keeps every buffer between the low and high
+ *  watermark. As there is only one emulator, rendering itself is
+ *  serialized, and the context of a stream is only swapped in when a
+ *  different stream than the last one is rendered.
+ *
+ *  Render jobs are scheduled earliest deadline first: the stream whose
+ *  buffered audio runs out first (assuming real-time playback) gets the
+ *  next block. The time needed to render one block is measured for every
+ *  stream, and new streams are refused when the sum of all streams would
+ *  need more than "maxload" percent of the emulator's time.
+ *
+ *  Instead of a PSID file, a register stream file (see regstream.c) can be
+ *  requested, which is played without running the 6510 (and not cached).
+ *
+ *  If a render cache directory is set, the audio of every stream is also
+ *  written to the cache (see cache.c). A stream of a cached song is sent
+ *  straight from the mapped cache file and only starts emulating when it
+ *  reaches the end of the cached data. When a stream is closed, its cache
+ *  entry is finished by a render thread, so the event loop never waits for
+ *  the emulator or the file system. The memory tier of the cache
+ *  ("memcache") also keeps the PSID files, the state of songs after their
+ *  init routine and recently rendered audio, so a repeated request starts
+ *  without loading the file or running the init routine.
+ *
+ *  Broadcast channels also watch their tune for looping (see loop.c).
+ *  Once the tune has looped, the audio of the loop is repeated from the
+ *  "loopmemory" history, the channel needs no more emulator time, and
+ *  its cache entry ends with the first pass of the loop.
+ */
+
+#include "sys.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <errno.h>
+#include <signal.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <sys/un.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+
+#include "server.h"
+#include "cache.h"
+#include "loop.h"
+#include "main.h"
+#include "regstream.h"
+#include "prefs.h"
+#include "sid.h"
+
+#define DEBUG 0
+#include "debug.h"
+
+
+// Output formats
+enum {
+    FORMAT_PCM,
+    FORMAT_WAV
+};
+
+// Size of one render block in sample frames
+#define RENDER_FRAMES 4096
+
+// Maximum length of request line
+#define MAX_REQUEST_LENGTH 1024
+
+// Maximum number of events handled per epoll_wait() call
+#define MAX_EVENTS 64
+
+// Length of WAV header
+#define WAV_HEADER_LENGTH 44
+
+// Size of output buffer of broadcast listeners (only for WAV header or error message)
+#define SMALL_BUFFER_SIZE (MAX_REQUEST_LENGTH + 64)
+
+// Maximum number of chunks sent to a broadcast listener in one call
+#define MAX_IOV 16
+
+// Cost estimate for unknown tunes (fraction of emulator time for real-time rendering)
+#define DEFAULT_LOAD 0.02
+
+// Minimum length of loops repeated by broadcast channels (seconds)
+#define MIN_LOOP_SECONDS 2
+
+// Render cost of a stream
+typedef struct cost_t cost_t;
+struct cost_t {
+    bool measured;                // Flag: values were measured (otherwise estimated)
+    double load;                // Fraction of emulator time needed for real-time rendering
+    double cycles;                // 6510 cycles executed per second of audio
+    uint32 loops, overruns;        // Replay routine calls stopped in infinite loop/at cycle budget
+};
+
+// Reference counted chunk of rendered audio data (block_bytes long)
+typedef struct chunk_t chunk_t;
+struct chunk_t {
+    chunk_t *next_free;            // Next chunk in free list
+    int refs;                    // Number of references
+    uint8 data[];
+};
+
+// Structure for one broadcast channel
+typedef struct channel_t channel_t;
+struct channel_t {
+    channel_t *next;            // Next channel in list of all channels
+    channel_t *next_job;        // Next channel in render queue
+
+    char *file;                    // File and song number (0 = default) being played
+    int song;
+
+    bool queued;                // Flag: channel is in render queue or being rendered
+    bool closed;                // Flag: no more listeners, delete channel after rendering
+    int listeners;                // Number of listening clients
+
+    machine_state *state;        // Emulator context of this channel (NULL = tune not yet loaded or played from cache)
+    uint64 start_time;            // Time at which chunk 0 was due (usecs)
+    cost_t cost;                // Render cost
+
+    cache_entry *cache;            // Cache entry the channel is played from (NULL = none)
+    cache_writer *cache_writer;    // Cache entry the rendered audio is written to (NULL = none)
+    regstream *regs;            // Register stream being played (NULL = none)
+    loop_detector *loop;        // Loop detector of emulated audio (NULL = none)
+
+    chunk_t **ring;                // Ring of ring_size chunks, chunk number n is at ring[n % ring_size]
+    uint64 first_seq;            // Number of oldest chunk in ring
+    uint64 next_seq;            // Number of next chunk to be rendered
+};
+
+// Structure for one client connection
+typedef struct client_t client_t;
+struct client_t {
+    client_t *next;                // Next client in list of all clients
+    client_t *next_job;            // Next client in render queue
+
+    int fd;                        // Socket
+    bool streaming;                // Flag: request received, stream started
+    bool queued;                // Flag: client is in render queue or being rendered
+    bool closed;                // Flag: connection closed, delete client after rendering
+    bool finished;                // Flag: close connection when buffer is drained
+
+    char request[MAX_REQUEST_LENGTH];    // Request line
+    int request_length;
+
+    char *file;                    // Requested file, song number (0 = default) and format
+    int song;
+    int format;
+
+    machine_state *state;        // Emulator context of this stream (NULL = tune not yet loaded or played from cache)
+    cost_t cost;                // Render cost
+
+    cache_entry *cache;            // Cache entry the stream is played from (NULL = none)
+    size_t cache_pos;            // Position of next byte to send from cache entry
+    cache_writer *cache_writer;    // Cache entry the rendered audio is written to (NULL = none)
+    regstream *regs;            // Register stream being played (NULL = none)
+
+    uint8 *buf;                    // Output ring buffer (for broadcast listeners only the data before the stream)
+    int buf_size;                // Size of buffer
+    int buf_read;                // Read position in buffer
+    int buf_fill;                // Number of valid bytes in buffer
+
+    channel_t *channel;            // Broadcast channel (NULL = private stream)
+    uint64 seq;                    // Number of next chunk to send to broadcast listener
+    int seq_offset;                // Offset in that chunk
+    int skips;                    // Number of times the listener was skipped ahead
+};
+
+// Emulator context and cache entries of a deleted stream, released by a render thread
+typedef struct retired_t retired_t;
+struct retired_t {
+    retired_t *next;            // Next context in list of retired contexts
+    machine_state *state;
+    cache_entry *cache;
+    cache_writer *cache_writer;
+    regstream *regs;
+};
+
+// All clients and channels, render queues
+static client_t *clients = NULL;
+static client_t *job_head = NULL, *job_tail = NULL;
+static channel_t *channels = NULL;
+static channel_t *channel_job_head = NULL, *channel_job_tail = NULL;
+
+// Contexts of deleted streams waiting to be released
+static retired_t *retired = NULL;
+
+// Unused chunks
+static chunk_t *free_chunks = NULL;
+
+// Lock for client structures and render queue
+static pthread_mutex_t server_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t job_cond = PTHREAD_COND_INITIALIZER;
+
+// Lock for the emulator, and context currently in the emulator (saved lazily)
+static pthread_mutex_t emu_lock = PTHREAD_MUTEX_INITIALIZER;
+static machine_state *emu_state = NULL;
+
+// epoll descriptor, eventfd for waking up the event loop
+static int epoll_fd = -1;
+static int wake_fd = -1;
+
+// Audio format, sizes of render block and output buffer, watermarks (in bytes)
+static int sample_freq, sample_bits, sample_channels;
+static int frame_bytes, block_bytes;
+static int buf_size, low_water, high_water;
+
+// Duration of one chunk (usecs), chunks rendered ahead of time by channels, ring size
+static uint64 chunk_time;
+static int lead_chunks, ring_size;
+
+// Bytes per second of audio
+static int byte_rate;
+
+// Maximum total load of all streams (0 = unlimited)
+static double max_load;
+
+// Speed adjustment from preferences (SelectSong() resets it)
+static int32 speed;
+
+// Audio history of loop detectors of broadcast channels (sample frames, 0 = no loop detection)
+static uint32 loop_frames;
+
+// Flag: quit server
+static volatile bool quit_server = false;
+
+// Prototypes
+static void queue_job(client_t *c);
+static void queue_channel_job(channel_t *ch);
+static void retire_context(machine_state *state, cache_entry *entry, cache_writer *writer, regstream *regs);
+
+
+/*
+ *  Signal handler for SIGINT/SIGTERM
+ */
+
+static void quit_handler(int sig)
+{
+    quit_server = true;
+}
+
+
+/*
+ *  Create listening socket for "[host:]port" or UNIX socket path
+ */
+
+static int open_listen_socket(const char *address)
+{
+    int fd;
+
+    if (strchr(address, '/')) {
+
+        // UNIX socket
+        struct sockaddr_un sa;
+        if (strlen(address) >= sizeof(sa.sun_path)) {
+            fprintf(stderr, "Socket path '%s' too long\n", address);
+            return -1;
+        }
+        memset(&sa, 0, sizeof(sa));
+        sa.sun_family = AF_UNIX;
+        strcpy(sa.sun_path, address);
+        unlink(address);
+        fd = socket(AF_UNIX, SOCK_STREAM, 0);
+        if (fd < 0 || bind(fd, (struct sockaddr *)&sa, sizeof(sa)) < 0) {
+            fprintf(stderr, "Couldn't bind to '%s' (%s)\n", address, strerror(errno));
+            if (fd >= 0)
+                close(fd);
+            return -1;
+        }
+
+    } else {
+
+        // TCP socket, host defaults to localhost
+        char host[256];
+        const char *port = strrchr(address, ':');
+        if (port) {
+            int len = port - address;
+            if (len >= (int)sizeof(host))
+                len = sizeof(host) - 1;
+            memcpy(host, address, len);
+            host[len] = 0;
+            port++;
+        } else {
+            strcpy(host, "localhost");
+            port = address;
+        }
+
+        struct addrinfo hints, *res, *ai;
+        memset(&hints, 0, sizeof(hints));
+        hints.ai_family = AF_UNSPEC;
+        hints.ai_socktype = SOCK_STREAM;
+        hints.ai_flags = AI_PASSIVE;
+        int err = getaddrinfo(host[0] ? host : NULL, port, &hints, &res);
+        if (err) {
+            fprintf(stderr, "Couldn't resolve '%s' (%s)\n", address, gai_strerror(err));
+            return -1;
+        }
+        fd = -1;
+        for (ai = res; ai; ai = ai->ai_next) {
+            fd = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+            if (fd < 0)
+                continue;
+            int on = 1;
+            setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+            if (bind(fd, ai->ai_addr, ai->ai_addrlen) == 0)
+                break;
+            close(fd);
+            fd = -1;
+        }
+        freeaddrinfo(res);
+        if (fd < 0) {
+            fprintf(stderr, "Couldn't bind to '%s' (%s)\n", address, strerror(errno));
+            return -1;
+        }
+    }
+
+    if (listen(fd, 64) < 0) {
+        fprintf(stderr, "Couldn't listen on '%s' (%s)\n", address, strerror(errno));
+        close(fd);
+        return -1;
+    }
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+    return fd;
+}
+
+
+/*
+ *  Client output buffer handling (server_lock must be held)
+ */
+
+static void buffer_put(client_t *c, const uint8 *data, int length)
+{
+    while (length > 0) {
+        int pos = (c->buf_read + c->buf_fill) % c->buf_size;
+        int chunk = c->buf_size - pos;
+        if (chunk > length)
+            chunk = length;
+        if (chunk > c->buf_size - c->buf_fill)
+            chunk = c->buf_size - c->buf_fill;
+        if (chunk == 0)
+            break;
+        memcpy(c->buf + pos, data, chunk);
+        c->buf_fill += chunk;
+        data += chunk;
+        length -= chunk;
+    }
+}
+
+static void put_le16(uint8 *p, uint16 x)
+{
+    p[0] = x; p[1] = x >> 8;
+}
+
+static void put_le32(uint8 *p, uint32 x)
+{
+    p[0] = x; p[1] = x >> 8; p[2] = x >> 16; p[3] = x >> 24;
+}
+
+static void buffer_put_wav_header(client_t *c)
+{
+    // Stream of unknown length, so the sizes are set to the maximum
+    uint8 h[WAV_HEADER_LENGTH];
+    memcpy(h, "RIFF", 4);
+    put_le32(h + 4, 0xffffffff);
+    memcpy(h + 8, "WAVEfmt ", 8);
+    put_le32(h + 16, 16);
+    put_le16(h + 20, 1);                // PCM
+    put_le16(h + 22, sample_channels);
+    put_le32(h + 24, sample_freq);
+    put_le32(h + 28, sample_freq * frame_bytes);
+    put_le16(h + 32, frame_bytes);
+    put_le16(h + 34, sample_bits);
+    memcpy(h + 36, "data", 4);
+    put_le32(h + 40, 0xffffffff);
+    buffer_put(c, h, WAV_HEADER_LENGTH);
+}
+
+static void buffer_put_error(client_t *c, const char *msg)
+{
+    char line[MAX_REQUEST_LENGTH + 64];
+    snprintf(line, sizeof(line), "ERROR %s\n", msg);
+    buffer_put(c, (const uint8 *)line, strlen(line));
+    c->finished = true;
+}
+
+
+/*
+ *  Enable/disable write events for client socket (server_lock must be held)
+ */
+
+// Check whether there is cached audio left to send to client
+static bool cache_pending(client_t *c)
+{
+    size_t length = 0;
+    if (c->cache)
+        CacheEntryData(c->cache, &length);
+    return c->cache_pos < length;
+}
+
+static void update_events(client_t *c)
+{
+    bool pending = c->buf_fill || cache_pending(c) || (c->channel && !c->finished && c->seq < c->channel->next_seq);
+    struct epoll_event ev;
+    memset(&ev, 0, sizeof(ev));
+    ev.events = EPOLLIN | (pending ? EPOLLOUT : 0);
+    ev.data.ptr = c;
+    epoll_ctl(epoll_fd, EPOLL_CTL_MOD, c->fd, &ev);
+}
+
+
+/*
+ *  Delete client structure (server_lock must be held)
+ */
+
+// Report replay routine calls of stream that were stopped
+static void report_stops(const char *file, int song, const cost_t *cost)
+{
+    if (cost->loops || cost->overruns)
+        fprintf(stderr, "'%s' song %d: replay routine stopped %u times in infinite loop, %u times at cycle budget\n", file, song, cost->loops, cost->overruns);
+}
+
+static void delete_client(client_t *c)
+{
+    client_t **p;
+    for (p = &clients; *p; p = &(*p)->next)
+        if (*p == c) {
+            *p = c->next;
+            break;
+        }
+
+    if (c->file)
+        report_stops(c->file, c->song, &c->cost);
+    retire_context(c->state, c->cache, c->cache_writer, c->regs);
+    free(c->file);
+    free(c->buf);
+    free(c);
+}
+
+static void close_channel(channel_t *ch);
+
+static void close_client(client_t *c)
+{
+    D(bug("closing client %d\n", c->fd));
+    epoll_ctl(epoll_fd, EPOLL_CTL_DEL, c->fd, NULL);
+    close(c->fd);
+    c->fd = -1;
+    c->closed = true;
+    if (c->channel && --c->channel->listeners == 0)
+        close_channel(c->channel);
+    c->channel = NULL;
+    if (!c->queued)
+        delete_client(c);
+}
+
+
+/*
+ *  Chunk handling (server_lock must be held)
+ */
+
+static chunk_t *chunk_alloc()
+{
+    chunk_t *k = free_chunks;
+    if (k)
+        free_chunks = k->next_free;
+    else {
+        k = malloc(sizeof(chunk_t) + block_bytes);
+        if (k == NULL)
+            return NULL;
+    }
+    k->refs = 1;
+    return k;
+}
+
+static void chunk_unref(chunk_t *k)
+{
+    if (--k->refs == 0) {
+        k->next_free = free_chunks;
+        free_chunks = k;
+    }
+}
+
+
+/*
+ *  Broadcast channel handling (server_lock must be held)
+ */
+
+// Find running channel of song, returns NULL if there is none
+static channel_t *find_channel(const char *file, int song)
+{
+    channel_t *ch;
+    for (ch = channels; ch; ch = ch->next)
+        if (ch->song == song && strcmp(ch->file, file) == 0)
+            return ch;
+    return NULL;
+}
+
+// Start new channel with initial cost estimate, returns NULL on error
+static channel_t *start_channel(const char *file, int song, const cost_t *cost)
+{
+    channel_t *ch = calloc(1, sizeof(channel_t));
+    if (ch == NULL)
+        return NULL;
+    ch->file = strdup(file);
+    ch->song = song;
+    ch->cost = *cost;
+    ch->ring = calloc(ring_size, sizeof(chunk_t *));
+    if (ch->file == NULL || ch->ring == NULL) {
+        free(ch->file);
+        free(ch->ring);
+        free(ch);
+        return NULL;
+    }
+    ch->next = channels;
+    channels = ch;
+    queue_channel_job(ch);    // Loads the tune
+    D(bug("starting channel '%s' song %d\n", file, song));
+    return ch;
+}
+
+// Position at which a listener starts, or continues after falling behind
+static uint64 live_seq(channel_t *ch)
+{
+    if (ch->next_seq - ch->first_seq > (uint64)lead_chunks)
+        return ch->next_seq - lead_chunks;
+    else
+        return ch->first_seq;
+}
+
+static void delete_channel(channel_t *ch)
+{
+    uint64 seq;
+    for (seq = ch->first_seq; seq < ch->next_seq; seq++)
+        chunk_unref(ch->ring[seq % ring_size]);
+    report_stops(ch->file, ch->song, &ch->cost);
+    retire_context(ch->state, ch->cache, ch->cache_writer, ch->regs);
+    LoopDelete(ch->loop);
+    free(ch->ring);
+    free(ch->file);
+    free(ch);
+}
+
+static void close_channel(channel_t *ch)
+{
+    D(bug("closing channel '%s' song %d\n", ch->file, ch->song));
+    channel_t **p;
+    for (p = &channels; *p; p = &(*p)->next)
+        if (*p == ch) {
+            *p = ch->next;
+            break;
+        }
+    ch->closed = true;
+    if (!ch->queued)
+        delete_channel(ch);
+}
+
+// Append new chunk to ring, dropping the oldest one if the ring is full
+static void channel_put(channel_t *ch, chunk_t *k)
+{
+    if (ch->next_seq - ch->first_seq == (uint64)ring_size) {
+        chunk_unref(ch->ring[ch->first_seq % ring_size]);
+        ch->first_seq++;
+    }
+    ch->ring[ch->next_seq % ring_size] = k;
+    ch->next_seq++;
+
+    client_t *c;
+    for (c = clients; c; c = c->next)
+        if (c->channel == ch)
+            update_events(c);
+}
+
+// Time at which next chunk of channel must be rendered
+static uint64 channel_due_time(channel_t *ch)
+{
+    if (ch->next_seq < (uint64)lead_chunks)
+        return ch->start_time;
+    return ch->start_time + (ch->next_seq - lead_chunks) * chunk_time;
+}
+
+// Queue render jobs for all channels that are due, returns epoll timeout until next one in ms
+static int schedule_channels()
+{
+    uint64 now = GetTicks_usec();
+    int timeout = -1;
+    channel_t *ch;
+    for (ch = channels; ch; ch = ch->next) {
+        if ((ch->state == NULL && ch->cache == NULL) || ch->queued)
+            continue;
+        uint64 due = channel_due_time(ch);
+        if (due <= now)
+            queue_channel_job(ch);
+        else {
+            int ms = (due - now + 999) / 1000;
+            if (timeout < 0 || ms < timeout)
+                timeout = ms;
+        }
+    }
+    return timeout;
+}
+
+
+/*
+ *  Render thread
+ */
+
+// Update cost of stream with measurement of one rendered block (server_lock must be held)
+static void update_cost(cost_t *cost, uint64 usecs, uint64 cycles, const uint32 *stops)
+{
+    cost->loops = stops[0];
+    cost->overruns = stops[1];
+    double load = (double)usecs / chunk_time;
+    double cps = (double)cycles * 1000000 / chunk_time;
+    if (cost->measured) {
+        cost->load += (load - cost->load) / 8;
+        cost->cycles += (cps - cost->cycles) / 8;
+    } else {
+        cost->load = load;
+        cost->cycles = cps;
+        cost->measured = true;
+    }
+}
+
+// Render one block of context with its register stream (NULL = none) into
+// buffer (through loop detector if given), returns time needed, 6510 cycles
+// executed and the replay routine calls stopped in an infinite loop or at
+// the cycle budget so far (emu_lock must be held)
+static void switch_state(machine_state *state, const regstream *regs);
+
+static void render_block(machine_state *state, const regstream *regs, loop_detector *loop, uint8 *buf, uint64 *usecs, uint64 *cycles, uint32 *stops)
+{
+    uint64 start_time = GetTicks_usec();
+    uint64 start_cycles = SIDReplayCycles();
+    switch_state(state, regs);
+    if (loop)
+        LoopCalcBuffer(loop, buf, block_bytes);
+    else
+        SIDCalcBuffer(buf, block_bytes);
+    *usecs = GetTicks_usec() - start_time;
+    *cycles = SIDReplayCycles() - start_cycles;
+    SIDGetReplayStops(&stops[0], &stops[1]);
+}
+
+// Make context (with its register stream, NULL = none) the current one in
+// the emulator (emu_lock must be held)
+static void switch_state(machine_state *state, const regstream *regs)
+{
+    if (emu_state == state)
+        return;
+    if (emu_state)
+        GetMachineState(emu_state);
+    SetMachineState(state);
+    SIDResumeRegStream(regs);
+    emu_state = state;
+}
+
+// Load PSID file or register stream into new context (emu_lock must be held),
+// returns NULL on error
+static machine_state *load_tune(const char *file, int song, regstream **regs)
+{
+    machine_state *s = NewMachineState();
+    if (s == NULL)
+        return NULL;
+
+    if (emu_state)
+        GetMachineState(emu_state);
+    emu_state = NULL;
+
+    if (CacheLoadPSIDFile(file)) {
+        if (song > 0)
+            SelectSong(song > number_of_songs ? number_of_songs - 1 : song - 1);
+    } else if ((*regs = RegStreamLoad(file)) != NULL)
+        SIDPlayRegStream(*regs);
+    else {
+        DeleteMachineState(s);
+        return NULL;
+    }
+    SIDAdjustSpeed(speed);
+
+    emu_state = s;
+    return s;
+}
+
+// Start stream of tune (emu_lock must be held): from the render cache if
+// possible, otherwise the tune is loaded into a new context whose audio is
+// written to the cache, returns false on error
+static bool open_tune(const char *file, int song, machine_state **state, regstream **regs, cache_entry **entry, cache_writer **writer)
+{
+    cache_key key;
+    bool cacheable = CacheMakeKey(file, song, &key);
+    if (cacheable && (*entry = CacheOpen(key)) != NULL)
+        return true;
+
+    if ((*state = load_tune(file, song, regs)) == NULL)
+        return false;
+    if (cacheable) {
+        GetMachineState(*state);    // state is current after loading
+        CachePutState(key, *state);
+        *writer = CacheCreate(key, NULL, 0);
+    }
+    return true;
+}
+
+// Continue stream after the end of the cached audio with the saved state,
+// and write a longer cache entry (emu_lock must be held), returns false on error
+static bool resume_tune(machine_state **state, cache_entry **entry, cache_writer **writer)
+{
+    size_t length;
+    const uint8 *data = CacheEntryData(*entry, &length);
+    *state = NewMachineState();
+    if (*state == NULL)
+        return false;
+    memcpy(*state, CacheEntryState(*entry), MachineStateSize());
+    *writer = CacheCreate(CacheEntryKey(*entry), data, length);
+    CacheClose(*entry);
+    *entry = NULL;
+    return true;
+}
+
+// Append rendered block to cache entry, finish the entry when it's full (emu_lock must be held)
+static void cache_block(machine_state *state, const uint8 *block, cache_writer **writer)
+{
+    if (*writer && !CacheWrite(*writer, block, block_bytes)) {
+        GetMachineState(state);        // state is current after rendering
+        CacheFinish(*writer, state);
+        *writer = NULL;
+    }
+}
+
+// Release context of deleted stream, finishing its cache entry (called
+// without server_lock held, as this writes files)
+static void release_context(retired_t *r)
+{
+    pthread_mutex_lock(&emu_lock);
+    if (r->state && emu_state == r->state) {
+        if (r->cache_writer)
+            GetMachineState(r->state);
+        emu_state = NULL;
+    }
+    pthread_mutex_unlock(&emu_lock);
+
+    if (r->cache)
+        CacheClose(r->cache);
+    if (r->cache_writer)
+        CacheFinish(r->cache_writer, r->state);
+    DeleteMachineState(r->state);
+    RegStreamDelete(r->regs);
+    free(r);
+}
+
+// Wake up event loop to reschedule channels
+static void wake_event_loop()
+{
+    uint64 one = 1;
+    if (write(wake_fd, &one, sizeof(one)) < 0)
+        D(bug("couldn't wake up event loop\n"));
+}
+
+// Render next chunk of broadcast channel (called with server_lock held)
+static void render_channel(channel_t *ch)
+{
+    bool load = (ch->state == NULL && ch->cache == NULL);
+    chunk_t *k = load ? NULL : chunk_alloc();
+    machine_state *state = ch->state;
+    cache_entry *entry = ch->cache;
+    uint64 pos = ch->next_seq * block_bytes;
+    pthread_mutex_unlock(&server_lock);
+
+    bool ok = true, rendered = false, looped = false;
+    uint64 usecs = 0, cycles = 0;
+    uint32 stops[2] = {0, 0};
+    if (k && ch->loop && LoopActive(ch->loop)) {
+
+        // Tune has looped, repeat audio without emulating
+        LoopCalcBuffer(ch->loop, k->data, block_bytes);
+        looped = true;
+
+    } else {
+        pthread_mutex_lock(&emu_lock);
+        if (load)
+            ok = open_tune(ch->file, ch->song, &state, &ch->regs, &entry, &ch->cache_writer);
+        else if (k) {
+            size_t length = 0;
+            const uint8 *data = entry ? CacheEntryData(entry, &length) : NULL;
+            if (pos + block_bytes <= length)
+                memcpy(k->data, data + pos, block_bytes);
+            else {
+                if (entry)
+                    ok = resume_tune(&state, &entry, &ch->cache_writer);
+                if (ok && ch->loop == NULL && loop_frames)
+                    ch->loop = LoopNew(frame_bytes, loop_frames, sample_freq * MIN_LOOP_SECONDS);
+                if (ok) {
+                    render_block(state, ch->regs, ch->loop, k->data, &usecs, &cycles, stops);
+                    cache_block(state, k->data, &ch->cache_writer);
+                    rendered = true;
+
+                    // The cache entry is complete when the loop has been found
+                    if (ch->loop && LoopActive(ch->loop) && ch->cache_writer) {
+                        GetMachineState(state);
+                        CacheFinish(ch->cache_writer, state);
+                        ch->cache_writer = NULL;
+                    }
+                }
+            }
+        }
+        pthread_mutex_unlock(&emu_lock);
+    }
+
+    pthread_mutex_lock(&server_lock);
+    ch->queued = false;
+    ch->state = state;
+    ch->cache = entry;
+    if (rendered)
+        update_cost(&ch->cost, usecs, cycles, stops);
+    else if ((load && entry) || looped)
+        ch->cost.load = 0;        // Played from cache or loop, no emulation needed
+    if (k && !ok) {
+        chunk_unref(k);
+        k = NULL;
+    }
+    if (ch->closed) {
+        if (k)
+            chunk_unref(k);
+        delete_channel(ch);
+        return;
+    }
+
+    client_t *c;
+    if (load) {
+        if (!ok) {
+
+            // Finish all listeners and remove the channel, so the next
+            // request of the file starts a new one
+            fprintf(stderr, "Couldn't load '%s' (not a PSID file or register stream?)\n", ch->file);
+            for (c = clients; c; c = c->next)
+                if (c->channel == ch) {
+                    c->channel = NULL;
+                    buffer_put_error(c, "Couldn't load file");
+                    update_events(c);
+                }
+            close_channel(ch);
+            return;
+        }
+        ch->start_time = GetTicks_usec();
+
+        // Listeners that joined while the tune was loading get their header now
+        for (c = clients; c; c = c->next)
+            if (c->channel == ch && c->format == FORMAT_WAV) {
+                buffer_put_wav_header(c);
+                update_events(c);
+            }
+    } else if (k)
+        channel_put(ch, k);
+
+    // The event loop doesn't schedule channels while they are queued
+    wake_event_loop();
+}
+
+// Time at which the buffered audio of a stream runs out (server_lock must be held)
+static uint64 client_deadline(client_t *c, uint64 now)
+{
+    if (c->state == NULL)
+        return now;
+    return now + (uint64)c->buf_fill * 1000000 / byte_rate;
+}
+
+static uint64 channel_deadline(channel_t *ch, uint64 now)
+{
+    if (ch->state == NULL && ch->cache == NULL)
+        return now;
+    return ch->start_time + ch->next_seq * chunk_time;
+}
+
+// Remove job with earliest deadline from render queues (server_lock must be held),
+// returns false if there is no job
+static bool next_job(client_t **pc, channel_t **pch)
+{
+    uint64 now = GetTicks_usec();
+    uint64 best = 0;
+    client_t *c, *prev_c = NULL, *best_c = NULL, *best_prev_c = NULL;
+    channel_t *ch, *prev_ch = NULL, *best_ch = NULL, *best_prev_ch = NULL;
+
+    for (c = job_head; c; prev_c = c, c = c->next_job) {
+        uint64 d = client_deadline(c, now);
+        if (best_c == NULL || d < best) {
+            best = d;
+            best_c = c;
+            best_prev_c = prev_c;
+        }
+    }
+    for (ch = channel_job_head; ch; prev_ch = ch, ch = ch->next_job) {
+        uint64 d = channel_deadline(ch, now);
+        if ((best_c == NULL && best_ch == NULL) || d < best) {
+            best = d;
+            best_ch = ch;
+            best_prev_ch = prev_ch;
+        }
+    }
+
+    *pc = NULL;
+    *pch = NULL;
+    if (best_ch) {
+        if (best_prev_ch)
+            best_prev_ch->next_job = best_ch->next_job;
+        else
+            channel_job_head = best_ch->next_job;
+        if (channel_job_tail == best_ch)
+            channel_job_tail = best_prev_ch;
+        *pch = best_ch;
+    } else if (best_c) {
+        if (best_prev_c)
+            best_prev_c->next_job = best_c->next_job;
+        else
+            job_head = best_c->next_job;
+        if (job_tail == best_c)
+            job_tail = best_prev_c;
+        *pc = best_c;
+    } else
+        return false;
+    return true;
+}
+
+static void *render_thread(void *arg)
+{
+    uint8 *block = malloc(block_bytes);
+
+    pthread_mutex_lock(&server_lock);
+    while (!quit_server) {
+
+        // Release contexts of deleted streams first
+        if (retired) {
+            retired_t *r = retired;
+            retired = r->next;
+            pthread_mutex_unlock(&server_lock);
+            release_context(r);
+            pthread_mutex_lock(&server_lock);
+            continue;
+        }
+
+        // Get job with earliest deadline
+        client_t *c;
+        channel_t *ch;
+        if (!next_job(&c, &ch)) {
+            pthread_cond_wait(&job_cond, &server_lock);
+            continue;
+        }
+        if (ch) {
+            render_channel(ch);
+            continue;
+        }
+        if (c->closed) {
+            delete_client(c);
+            continue;
+        }
+        bool load = (c->state == NULL && c->cache == NULL);
+        machine_state *state = c->state;
+        cache_entry *entry = c->cache;
+
+        // A cache entry is closed when continuing after its audio (which
+        // has all been sent), so the event loop must not use it any more
+        if (!load)
+            c->cache = NULL;
+        pthread_mutex_unlock(&server_lock);
+
+        // Load tune (or continue after cached audio) or render one block
+        bool ok = true;
+        uint64 usecs = 0, cycles = 0;
+        uint32 stops[2] = {0, 0};
+        pthread_mutex_lock(&emu_lock);
+        if (load)
+            ok = open_tune(c->file, c->song, &state, &c->regs, &entry, &c->cache_writer);
+        else {
+            if (entry)
+                ok = resume_tune(&state, &entry, &c->cache_writer);
+            if (ok) {
+                render_block(state, c->regs, NULL, block, &usecs, &cycles, stops);
+                cache_block(state, block, &c->cache_writer);
+            }
+        }
+        pthread_mutex_unlock(&emu_lock);
+
+        pthread_mutex_lock(&server_lock);
+        c->queued = false;
+        c->state = state;
+        c->cache = entry;
+        if (!load && ok)
+            update_cost(&c->cost, usecs, cycles, stops);
+        else if (load && entry)
+            c->cost.load = 0;        // Played from cache, no emulation needed
+        if (c->closed) {
+            delete_client(c);
+            continue;
+        }
+        if (!ok) {
+            fprintf(stderr, "Couldn't load '%s' (not a PSID file or register stream?)\n", c->file);
+            buffer_put_error(c, "Couldn't load file");
+        } else if (load) {
+            D(bug("client %d playing '%s' song %d%s\n", c->fd, c->file, c->song, entry ? " from cache" : ""));
+            if (c->format == FORMAT_WAV)
+                buffer_put_wav_header(c);
+        } else
+            buffer_put(c, block, block_bytes);
+
+        // Keep buffer filled up to the high watermark (cached audio is sent first)
+        if (!c->finished && !cache_pending(c) && c->buf_fill < high_water)
+            queue_job(c);
+        update_events(c);
+    }
+    pthread_mutex_unlock(&server_lock);
+
+    free(block);
+    return NULL;
+}
+
+// Hand context of deleted stream to a render thread (server_lock must be
+// held), so the event loop never waits for the emulator or the cache
+static void retire_context(machine_state *state, cache_entry *entry, cache_writer *writer, regstream *regs)
+{
+    if (state == NULL && entry == NULL && writer == NULL && regs == NULL)
+        return;
+    retired_t *r = malloc(sizeof(retired_t));
+    if (r == NULL) {
+        fprintf(stderr, "Couldn't finish cache entry (out of memory)\n");
+        if (entry)
+            CacheClose(entry);
+        if (writer)
+            CacheFinish(writer, NULL);
+        pthread_mutex_lock(&emu_lock);
+        if (state && emu_state == state)
+            emu_state = NULL;
+        pthread_mutex_unlock(&emu_lock);
+        DeleteMachineState(state);
+        RegStreamDelete(regs);
+        return;
+    }
+    r->state = state;
+    r->cache = entry;
+    r->cache_writer = writer;
+    r->regs = regs;
+    r->next = retired;
+    retired = r;
+    pthread_cond_signal(&job_cond);
+}
+
+// Append client to render queue (server_lock must be held)
+static void queue_job(client_t *c)
+{
+    if (c->queued)
+        return;
+    c->queued = true;
+    c->next_job = NULL;
+    if (job_tail)
+        job_tail->next_job = c;
+    else
+        job_head = c;
+    job_tail = c;
+    pthread_cond_signal(&job_cond);
+}
+
+// Append channel to render queue (server_lock must be held)
+static void queue_channel_job(channel_t *ch)
+{
+    if (ch->queued)
+        return;
+    ch->queued = true;
+    ch->next_job = NULL;
+    if (channel_job_tail)
+        channel_job_tail->next_job = ch;
+    else
+        channel_job_head = ch;
+    channel_job_tail = ch;
+    pthread_cond_signal(&job_cond);
+}
+
+
+/*
+ *  Parse request line "[BROADCAST] FILE [SONG [FORMAT]]" (the file name may
+ *  contain spaces), returns false on error
+ */
+
+static bool parse_request(client_t *c, bool *broadcast)
+{
+    char *line = c->request;
+    int len = strlen(line);
+    while (len > 0 && isspace((unsigned char)line[len - 1]))
+        line[--len] = 0;
+    while (isspace((unsigned char)*line))
+        line++;
+
+    *broadcast = false;
+    if (strncmp(line, "BROADCAST ", 10) == 0) {
+        *broadcast = true;
+        line += 10;
+    }
+
+    c->song = 0;
+    c->format = FORMAT_WAV;
+
+    // Format
+    char *p = strrchr(line, ' ');
+    if (p && (strcmp(p + 1, "wav") == 0 || strcmp(p + 1, "pcm") == 0)) {
+        c->format = (strcmp(p + 1, "pcm") == 0) ? FORMAT_PCM : FORMAT_WAV;
+        *p = 0;
+        p = strrchr(line, ' ');
+    }
+
+    // Song number
+    if (p && p[1] && strspn(p + 1, "0123456789") == strlen(p + 1)) {
+        c->song = atoi(p + 1);
+        *p = 0;
+    }
+
+    if (line[0] == 0)
+        return false;
+    c->file = strdup(line);
+    return c->file != NULL;
+}
+
+
+/*
+ *  Socket events
+ */
+
+static void accept_clients(int listen_fd)
+{
+    while (true) {
+        int fd = accept(listen_fd, NULL, NULL);
+        if (fd < 0)
+            return;
+        fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+
+        client_t *c = calloc(1, sizeof(client_t));
+        if (c == NULL) {
+            close(fd);
+            continue;
+        }
+        c->fd = fd;
+
+        struct epoll_event ev;
+        memset(&ev, 0, sizeof(ev));
+        ev.events = EPOLLIN;
+        ev.data.ptr = c;
+        pthread_mutex_lock(&server_lock);
+        c->next = clients;
+        clients = c;
+        epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &ev);
+        pthread_mutex_unlock(&server_lock);
+        D(bug("client %d connected\n", fd));
+    }
+}
+
+/*
+ *  Admission control (server_lock must be held)
+ */
+
+// Sum of loads of all running streams
+static double total_load()
+{
+    double load = 0;
+    client_t *c;
+    channel_t *ch;
+    for (c = clients; c; c = c->next)
+        if (c->file && !c->channel && !c->finished)
+            load += c->cost.load;
+    for (ch = channels; ch; ch = ch->next)
+        load += ch->cost.load;
+    return load;
+}
+
+// Estimated load of a new stream of a file: same as other streams of that
+// file, or the average of all measured streams
+static double estimate_load(const char *file)
+{
+    double sum = 0;
+    int n = 0;
+    client_t *c;
+    channel_t *ch;
+    for (c = clients; c; c = c->next)
+        if (c->file && !c->channel && c->cost.measured) {
+            if (strcmp(c->file, file) == 0)
+                return c->cost.load;
+            sum += c->cost.load;
+            n++;
+        }
+    for (ch = channels; ch; ch = ch->next)
+        if (ch->cost.measured) {
+            if (strcmp(ch->file, file) == 0)
+                return ch->cost.load;
+            sum += ch->cost.load;
+            n++;
+        }
+    return n ? sum / n : DEFAULT_LOAD;
+}
+
+// Check whether a new stream can be rendered in real time, set its initial cost estimate
+static bool admit_stream(const char *file, cost_t *cost)
+{
+    // The cost of the new stream is cleared first, so the total load only
+    // contains the running streams even if the stream is already linked
+    memset(cost, 0, sizeof(cost_t));
+    double load = total_load();
+    cost->load = estimate_load(file);
+    if (max_load <= 0)
+        return true;
+    if (load + cost->load > max_load + 1e-9) {    // Allow for rounding of the summed loads
+        fprintf(stderr, "Refusing stream of '%s' (load %.1f%% + %.1f%% > %.1f%%)\n", file, load * 100, cost->load * 100, max_load * 100);
+        return false;
+    }
+    return true;
+}
+
+// Start stream after request line was received (server_lock must be held)
+static void start_stream(client_t *c)
+{
+    bool broadcast;
+    bool ok = parse_request(c, &broadcast);
+
+    // Broadcast listeners only get a small buffer for the data before the stream
+    c->buf_size = (ok && !broadcast) ? buf_size : SMALL_BUFFER_SIZE;
+    c->buf = malloc(c->buf_size);
+    if (c->buf == NULL) {
+        c->buf_size = 0;
+        c->finished = true;
+        return;
+    }
+
+    if (!ok) {
+        buffer_put_error(c, "Bad request");
+        update_events(c);
+    } else if (broadcast) {
+        c->channel = find_channel(c->file, c->song);
+        if (c->channel == NULL) {
+            cost_t cost;
+            if (!admit_stream(c->file, &cost)) {
+                buffer_put_error(c, "Server busy");
+                update_events(c);
+                return;
+            }
+            c->channel = start_channel(c->file, c->song, &cost);
+        }
+        if (c->channel == NULL) {
+            buffer_put_error(c, "Couldn't start channel");
+            update_events(c);
+            return;
+        }
+        c->channel->listeners++;
+        c->seq = live_seq(c->channel);
+
+        // The header is only sent once the tune is loaded, so a failed
+        // load is reported with an error line instead of the stream
+        bool loaded = c->channel->state || c->channel->cache;
+        if (loaded && c->format == FORMAT_WAV)
+            buffer_put_wav_header(c);
+        update_events(c);
+    } else if (!admit_stream(c->file, &c->cost)) {
+        buffer_put_error(c, "Server busy");
+        update_events(c);
+    } else
+        queue_job(c);    // Loads the tune
+}
+
+// Read from client socket (server_lock must be held), returns false if connection was closed
+static bool client_read(client_t *c)
+{
+    char tmp[256];
+    while (true) {
+        char *dest = tmp;
+        int max = sizeof(tmp);
+        if (!c->streaming) {
+            dest = c->request + c->request_length;
+            max = MAX_REQUEST_LENGTH - 1 - c->request_length;
+        }
+        ssize_t actual = recv(c->fd, dest, max, 0);
+        if (actual == 0)
+            return false;
+        if (actual < 0)
+            return errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR;
+        if (c->streaming)
+            continue;    // Ignore everything after the request line
+
+        c->request_length += actual;
+        c->request[c->request_length] = 0;
+        char *eol = strchr(c->request, '\n');
+        if (eol == NULL && c->request_length < MAX_REQUEST_LENGTH - 1)
+            continue;
+        if (eol)
+            *eol = 0;
+
+        c->streaming = true;
+        start_stream(c);
+    }
+}
+
+// Send chunks from channel ring to broadcast listener (server_lock must be held),
+// returns false if connection was closed
+static bool channel_write(client_t *c)
+{
+    channel_t *ch = c->channel;
+
+    // Skip ahead if the listener fell behind the ring
+    if (c->seq < ch->first_seq) {
+        D(bug("client %d skipped ahead by %d chunks\n", c->fd, (int)(live_seq(ch) - c->seq)));
+        c->seq = live_seq(ch);
+        c->seq_offset = 0;
+        c->skips++;
+    }
+
+    // Reference the chunks to be sent, so they can be sent without holding the lock
+    struct iovec iov[MAX_IOV];
+    chunk_t *held[MAX_IOV];
+    int n = 0;
+    uint64 seq;
+    for (seq = c->seq; seq < ch->next_seq && n < MAX_IOV; seq++, n++) {
+        int offset = (seq == c->seq) ? c->seq_offset : 0;
+        held[n] = ch->ring[seq % ring_size];
+        held[n]->refs++;
+        iov[n].iov_base = held[n]->data + offset;
+        iov[n].iov_len = block_bytes - offset;
+    }
+    if (n == 0)
+        return true;
+
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = iov;
+    msg.msg_iovlen = n;
+    pthread_mutex_unlock(&server_lock);
+    ssize_t actual = sendmsg(c->fd, &msg, MSG_NOSIGNAL);
+    pthread_mutex_lock(&server_lock);
+
+    int i;
+    for (i=0; i<n; i++)
+        chunk_unref(held[i]);
+
+    if (actual < 0)
+        return errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR;
+    uint64 pos = c->seq_offset + actual;
+    c->seq += pos / block_bytes;
+    c->seq_offset = pos % block_bytes;
+    return true;
+}
+
+// Send audio data from cache entry (server_lock must be held), returns false if connection was closed
+static bool cache_write(client_t *c)
+{
+    size_t length;
+    const uint8 *data = CacheEntryData(c->cache, &length);
+    while (c->cache_pos < length) {
+        ssize_t actual = send(c->fd, data + c->cache_pos, length - c->cache_pos, MSG_NOSIGNAL);
+        if (actual < 0)
+            return errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR;
+        c->cache_pos += actual;
+    }
+    return true;
+}
+
+// Write to client socket (server_lock must be held), returns false if connection was closed
+static bool client_write(client_t *c)
+{
+    while (c->buf_fill) {
+        int chunk = c->buf_size - c->buf_read;
+        if (chunk > c->buf_fill)
+            chunk = c->buf_fill;
+        ssize_t actual = send(c->fd, c->buf + c->buf_read, chunk, MSG_NOSIGNAL);
+        if (actual < 0) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)
+                break;
+            return false;
+        }
+        c->buf_read = (c->buf_read + actual) % c->buf_size;
+        c->buf_fill -= actual;
+    }
+
+    if (c->buf_fill == 0 && c->finished)
+        return false;
+    if (c->buf_fill == 0 && c->channel && !channel_write(c))
+        return false;
+    if (c->buf_fill == 0 && c->cache && !cache_write(c))
+        return false;
+    if (c->streaming && !c->channel && !c->finished && !cache_pending(c) && c->buf_fill < low_water)
+        queue_job(c);
+    update_events(c);
+    return true;
+}
+
+
+/*
+ *  Run streaming server
+ */
+
+int ServerRun(const char *address)
+{
+    int i;
+
+    // Get audio format and compute buffer sizes
+    SIDGetAudioFormat(&sample_freq, &sample_bits, &sample_channels);
+    frame_bytes = sample_channels * sample_bits / 8;
+    block_bytes = RENDER_FRAMES * frame_bytes;
+    int32 buffer_ms = PrefsFindInt32("streambuffer");
+    if (buffer_ms < 100)
+        buffer_ms = 100;
+    high_water = (int)((int64)sample_freq * buffer_ms / 1000) * frame_bytes;
+    low_water = high_water / 2;
+    buf_size = high_water + block_bytes + WAV_HEADER_LENGTH;
+    chunk_time = (uint64)RENDER_FRAMES * 1000000 / sample_freq;
+    lead_chunks = (buffer_ms * 1000 + chunk_time - 1) / chunk_time;
+    ring_size = lead_chunks * 2 + 1;
+    byte_rate = sample_freq * frame_bytes;
+    max_load = PrefsFindInt32("maxload") / 100.0;
+    speed = PrefsFindInt32("speed");
+    loop_frames = (uint32)(((uint64)PrefsFindInt32("loopmemory") << 20) / frame_bytes);
+    CacheInit(PrefsFindString("cachedir", 0), (uint64)PrefsFindInt32("cachesize") << 20, (uint64)PrefsFindInt32("memcache") << 20);
+
+    // Open sockets
+    int listen_fd = open_listen_socket(address);
+    if (listen_fd < 0)
+        return 1;
+    epoll_fd = epoll_create1(0);
+    if (epoll_fd < 0) {
+        fprintf(stderr, "Couldn't create epoll descriptor (%s)\n", strerror(errno));
+        close(listen_fd);
+        return 1;
+    }
+    struct epoll_event ev;
+    memset(&ev, 0, sizeof(ev));
+    ev.events = EPOLLIN;
+    ev.data.ptr = NULL;        // NULL marks the listening socket
+    epoll_ctl(epoll_fd, EPOLL_CTL_ADD, listen_fd, &ev);
+    wake_fd = eventfd(0, EFD_NONBLOCK);
+    ev.data.ptr = &wake_fd;
+    epoll_ctl(epoll_fd, EPOLL_CTL_ADD, wake_fd, &ev);
+
+    signal(SIGPIPE, SIG_IGN);
+    signal(SIGINT, quit_handler);
+    signal(SIGTERM, quit_handler);
+
+    // Start render threads
+    int num_threads = PrefsFindInt32("renderthreads");
+    if (num_threads < 1)
+        num_threads = 1;
+    pthread_t *threads = malloc(num_threads * sizeof(pthread_t));
+    for (i=0; i<num_threads; i++)
+        pthread_create(&threads[i], NULL, render_thread, NULL);
+
+    printf("Listening on %s (%d Hz, %d bit, %d channel(s), %d render thread(s))\n", address, sample_freq, sample_bits, sample_channels, num_threads);
+    fflush(stdout);
+
+    // Event loop
+    struct epoll_event events[MAX_EVENTS];
+    while (!quit_server) {
+        pthread_mutex_lock(&server_lock);
+        int timeout = schedule_channels();
+        pthread_mutex_unlock(&server_lock);
+
+        int n = epoll_wait(epoll_fd, events, MAX_EVENTS, timeout);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            fprintf(stderr, "epoll_wait() failed (%s)\n", strerror(errno));
+            break;
+        }
+        for (i=0; i<n; i++) {
+            client_t *c = events[i].data.ptr;
+            if (c == NULL) {
+                accept_clients(listen_fd);
+                continue;
+            }
+            if (events[i].data.ptr == &wake_fd) {
+                uint64 count;
+                if (read(wake_fd, &count, sizeof(count)) < 0)
+                    D(bug("wakeup event lost\n"));
+                continue;
+            }
+            pthread_mutex_lock(&server_lock);
+            bool ok = !(events[i].events & EPOLLERR);
+            if (ok && (events[i].events & (EPOLLIN | EPOLLHUP)))
+                ok = client_read(c);
+            if (ok && (events[i].events & EPOLLOUT))
+                ok = client_write(c);
+            if (!ok)
+                close_client(c);
+            pthread_mutex_unlock(&server_lock);
+        }
+    }
+
+    // Stop render threads and close all connections
+    pthread_mutex_lock(&server_lock);
+    quit_server = true;
+    pthread_cond_broadcast(&job_cond);
+    pthread_mutex_unlock(&server_lock);
+    for (i=0; i<num_threads; i++)
+        pthread_join(threads[i], NULL);
+    free(threads);
+
+    while (clients) {
+        client_t *c = clients;
+        close(c->fd);
+        c->queued = false;
+        delete_client(c);
+    }
+    job_head = job_tail = NULL;
+    while (channels) {
+        channel_t *ch = channels;
+        channels = ch->next;
+        delete_channel(ch);
+    }
+    channel_job_head = channel_job_tail = NULL;
+    while (retired) {
+        retired_t *r = retired;
+        retired = r->next;
+        release_context(r);
+    }
+    while (free_chunks) {
+        chunk_t *k = free_chunks;
+        free_chunks = k->next_free;
+        free(k);
+    }
+
+    CacheExit();
+    close(wake_fd);
+    close(epoll_fd);
+    close(listen_fd);
+    if (strchr(address, '/'))
+        unlink(address);
+    return 0;
+}
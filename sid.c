@@ -31,6 +31,9 @@
 
 #include "mem.h"
 #include "cpu.h"
+#include "regstream.h"
+#include "loudness.h"
+#include "flac.h"
 
 #define DEBUG 0
 #include "debug.h"
@@ -56,6 +59,9 @@ const fp16p16_t FP16P16_PI = dtofp16p16(3.14159265358979323846);
 // Desired and obtained audio formats
 static SDL_AudioSpec desired, obtained;
 
+// Flag: audio device opened (not the case when rendering for other outputs)
+static bool audio_open = false;
+
 // Flag: emulate SID filters
 static bool enable_filters = true;
 
@@ -92,6 +98,53 @@ const fp24p8_t NTSC_CLOCK = ftofp24p8(1022727.143);
 static uint16 cia_timer;        // CIA timer A latch
 static int replay_count;        // Counter for timing replay routine
 static int speed_adjust;        // Speed adjustment in percent
+static uint64 replay_cycles;    // Number of cycles executed by replay routine
+static uint64 replay_clock;        // C64 cycle at start of current replay period
+static cycle_t cia_icr_read;    // Cycle of last CIA ICR read in current replay period
+
+// VIC raster timing
+static int raster_cycles;        // Cycles per raster line
+static int raster_lines;        // Raster lines per frame
+
+// Replay routine calls stopped in an infinite loop or at the cycle budget
+// since the song was started
+static uint32 replay_loops, replay_overruns;
+
+// Cycle budget of the replay routine in replay periods (an overrunning
+// replay routine would delay the next interrupt on a real C64, so it can't
+// take much longer than one period there either)
+#define REPLAY_BUDGET_PERIODS 2
+
+// Register stream that guest writes are captured to (NULL = none)
+static regstream *capture_stream = NULL;
+
+// Function called after every replay (NULL = none)
+static sid_replay_func replay_hook = NULL;
+static void *replay_hook_arg;
+
+// Silence detection: the SIDs are silent when all voices have a zero
+// envelope level (or the volume is 0) and no sampled voice is playing.
+// This can only change by register writes, i.e. in the replay routine.
+// While silent, the voices keep running, but their output isn't mixed.
+static bool skip_silence;        // Flag: only clock voices and filter decay while silent
+static bool sids_silent;        // Flag: SIDs are silent until the next replay
+static uint32 silent_frames;    // Number of silent sample frames so far
+static sid_silence_func silence_hook = NULL;    // Function called on silence events (NULL = none)
+static void *silence_hook_arg;
+static uint32 silence_end_frames;    // Silent frames that make the end of a tune (0 = never)
+
+// Loudness meter and FLAC encoder fed with the output of calc_buffer()
+// (NULL = none), and block of output frames collected for them
+#define OUTPUT_BLOCK_FRAMES 512
+static loudness_meter *loudness = NULL;
+static flac_encoder *encoder = NULL;
+static int16 output_block[OUTPUT_BLOCK_FRAMES * 2];
+static int output_fill;
+
+// Register stream being played instead of running the replay routine (NULL = none)
+static const regstream *play_stream = NULL;
+static uint32 play_frame;        // Next frame to play
+static uint16 play_ram_adr;        // Address for next REG_RAM_DATA write
 
 // Clock frequency changed
 void SIDClockFreqChanged();
@@ -114,12 +167,12 @@ static inline ufp16p16_t CALC_RESONANCE_HP(float f)
 // f_rand() has to be predictable inside the main emulation)
 static uint32 noise_rand_seed = 1;
 
-inline static uint8 noise_rand()
+inline static uint8 noise_step(uint32 *seed)
 {
     // This is not the original SID noise algorithm (which is unefficient to
     // implement in software) but this sounds close enough
-    noise_rand_seed = noise_rand_seed * 1103515245 + 12345;
-    return noise_rand_seed >> 16;
+    *seed = *seed * 1103515245 + 12345;
+    return *seed >> 16;
 }
 
 // SID waveforms
@@ -239,6 +292,11 @@ struct osid_t {
     uint16 sm_volume;                    // Sample volume (0..2, 0=loudest)
     uint8 sm_rep_count;                    // Sample repeat counter (0xff=continous)
     bool sm_big_endian;                    // Flag: Sample is big-endian
+
+    voice_t v3_lazy[3];                    // Voices clocked up to the last read of voice 3 in the current replay call
+    fp24p8_t v3_lazy_clock;                // Cycle of v3_lazy within the replay call
+    uint32 v3_lazy_seed;                // Noise generator of v3_lazy
+    bool v3_lazy_valid;                    // Flag: v3_lazy has been set up in the current replay call
 };
 osid_t *sid1 = NULL, *sid2 = NULL;
 
@@ -467,17 +525,22 @@ static void calc_buffer(void *userdata, uint8 *buf, int count);
  *  Init SID emulation
  */
 
-void osid_init(osid_t *sid, int n)
+static void osid_link_voices(osid_t *sid)
 {
-    sid->sid_num = n;
-
-    // Link voices
     sid->voice[0].mod_by = &sid->voice[2];
     sid->voice[1].mod_by = &sid->voice[0];
     sid->voice[2].mod_by = &sid->voice[1];
     sid->voice[0].mod_to = &sid->voice[1];
     sid->voice[1].mod_to = &sid->voice[2];
     sid->voice[2].mod_to = &sid->voice[0];
+}
+
+void osid_init(osid_t *sid, int n)
+{
+    sid->sid_num = n;
+
+    // Link voices
+    osid_link_voices(sid);
 
     osid_reset(sid);
 }
@@ -526,31 +589,47 @@ static void prefs_sidtype_changed(const char *name, const char *from, const char
     set_sid_data();
 }
 
+static void close_audio()
+{
+    if (audio_open)
+        SDL_CloseAudio();
+}
+
+static void reopen_audio()
+{
+    if (audio_open) {
+        SDL_OpenAudio(&desired, &obtained);
+        SDL_PauseAudio(false);
+    }
+}
+
 static void prefs_samplerate_changed(const char *name, int32 from, int32 to)
 {
-    SDL_CloseAudio();
+    close_audio();
     desired.freq = obtained.freq = to;
     set_desired_samples(to);
-    SDL_OpenAudio(&desired, &obtained);
+    reopen_audio();
     SIDClockFreqChanged();
     set_rev_delay(PrefsFindInt32("revdelay"));
-    SDL_PauseAudio(false);
 }
 
 static void prefs_audio16bit_changed(const char *name, bool from, bool to)
 {
-    SDL_CloseAudio();
+    close_audio();
     desired.format = obtained.format = to ? AUDIO_S16SYS : AUDIO_U8;
-    SDL_OpenAudio(&desired, &obtained);
-    SDL_PauseAudio(false);
+    reopen_audio();
 }
 
 static void prefs_stereo_changed(const char *name, bool from, bool to)
 {
-    SDL_CloseAudio();
+    close_audio();
     desired.channels = obtained.channels = to ? 2 : 1;
-    SDL_OpenAudio(&desired, &obtained);
-    SDL_PauseAudio(false);
+    reopen_audio();
+}
+
+static void prefs_skipsilence_changed(const char *name, bool from, bool to)
+{
+    skip_silence = to;
 }
 
 static void prefs_filters_changed(const char *name, bool from, bool to)
@@ -651,19 +730,26 @@ static void prefs_dualsep_changed(const char *name, int32 from, int32 to)
     calc_gains();
 }
 
-static void set_cycles_per_second(const char *to)
+static void set_vic_type(const char *to)
 {
-    if (strncmp(to, "6569", 4) == 0)
+    if (strncmp(to, "6569", 4) == 0) {
         cycles_per_second = fp24p8toi(PAL_CLOCK);
-    else if (strcmp(to, "6567R5") == 0)
+        raster_cycles = 63;
+        raster_lines = 312;
+    } else if (strcmp(to, "6567R5") == 0) {
         cycles_per_second = fp24p8toi(NTSC_OLD_CLOCK);
-    else
+        raster_cycles = 64;
+        raster_lines = 262;
+    } else {
         cycles_per_second = fp24p8toi(NTSC_CLOCK);
+        raster_cycles = 65;
+        raster_lines = 263;
+    }
 }
 
 static void prefs_victype_changed(const char *name, const char *from, const char *to)
 {
-    set_cycles_per_second(to);
+    set_vic_type(to);
     SIDClockFreqChanged();
 }
 
@@ -691,14 +777,16 @@ void SIDInit()
     desired.channels = obtained.channels = PrefsFindBool("stereo") ? 2 : 1;
     enable_filters = PrefsFindBool("filters");
     dual_sid = PrefsFindBool("dualsid");
+    skip_silence = PrefsFindBool("skipsilence");
     PrefsSetCallbackString("sidtype", prefs_sidtype_changed);
     PrefsSetCallbackInt32("samplerate", prefs_samplerate_changed);
     PrefsSetCallbackBool("audio16bit", prefs_audio16bit_changed);
     PrefsSetCallbackBool("stereo", prefs_stereo_changed);
     PrefsSetCallbackBool("filters", prefs_filters_changed);
     PrefsSetCallbackBool("dualsid", prefs_dualsid_changed);
+    PrefsSetCallbackBool("skipsilence", prefs_skipsilence_changed);
 
-    set_cycles_per_second(PrefsFindString("victype", 0));
+    set_vic_type(PrefsFindString("victype", 0));
     speed_adjust = PrefsFindInt32("speed");
     PrefsSetCallbackString("victype", prefs_victype_changed);
     PrefsSetCallbackInt32("speed", prefs_speed_changed);
@@ -731,18 +819,11 @@ void SIDInit()
     PrefsSetCallbackInt32("dualsep", prefs_dualsep_changed);
     calc_gains();
 
-    // Set sample buffer size
+    // Set sample buffer size (the audio device is opened by SIDOpenAudio())
     set_desired_samples(desired.freq);
-
-    // Open audio device
     desired.callback = calc_buffer;
     desired.userdata = NULL;
 
-    if (SDL_OpenAudio(&desired, &obtained) < 0) {
-        fprintf(stderr, "Couldn't initialize audio (%s)\n", SDL_GetError());
-        exit(1);
-    }
-
     // Convert reverb delay to sample frame count
     set_rev_delay(PrefsFindInt32("revdelay"));
 
@@ -774,13 +855,45 @@ void SIDInit()
 
 void SIDExit()
 {
-    SDL_CloseAudio();
+    close_audio();
+    audio_open = false;
 
     if (sid1) free(sid1);
     if (sid2) free(sid2);
 }
 
 
+/*
+ *  Open audio device for replay (not needed when only rendering with SIDCalcBuffer())
+ */
+
+bool SIDOpenAudio()
+{
+    if (SDL_InitSubSystem(SDL_INIT_AUDIO) < 0 || SDL_OpenAudio(&desired, &obtained) < 0) {
+        fprintf(stderr, "Couldn't initialize audio (%s)\n", SDL_GetError());
+        return false;
+    }
+    audio_open = true;
+
+    // The device may not support the desired sample rate
+    SIDClockFreqChanged();
+    set_rev_delay(PrefsFindInt32("revdelay"));
+    return true;
+}
+
+
+/*
+ *  Get format of rendered audio data
+ */
+
+void SIDGetAudioFormat(int *freq, int *bits, int *channels)
+{
+    *freq = obtained.freq;
+    *bits = (obtained.format == AUDIO_U8 || obtained.format == AUDIO_S8) ? 8 : 16;
+    *channels = obtained.channels;
+}
+
+
 /*
  *  Reset SID emulation
  */
@@ -815,6 +928,8 @@ void osid_reset(osid_t *sid)
     sid->v4_state = V4_OFF;
     sid->v4_count = sid->v4_add = 0;
 
+    sid->v3_lazy_valid = false;
+
     sid->gn_adr = sid->gn_tone_length = 0;
     sid->gn_volume_add = 0;
     sid->gn_tone_counter = 0;
@@ -835,6 +950,87 @@ void SIDReset(cycle_t now)
 
     memset(work_buffer, 0, sizeof(work_buffer));
 
+    // Start new song with the same timing and noise for every replay
+    replay_count = 0;
+    replay_loops = replay_overruns = 0;
+    replay_clock = 0;
+    cia_icr_read = 0;
+    noise_rand_seed = 1;
+    play_stream = NULL;
+
+    SDL_UnlockAudio();
+}
+
+
+/*
+ *  Get/set emulation state (everything that belongs to the playing tune,
+ *  but not the settings derived from the preferences)
+ */
+
+struct sid_state {
+    osid_t sid[2];
+    uint16 cia_timer;
+    int replay_count;
+    uint32 replay_loops, replay_overruns;
+    uint64 replay_clock;
+    int speed_adjust;
+    uint32 noise_rand_seed;
+    int wb_read_offset, wb_write_offset;
+    uint32 play_frame;            // Position in register stream (the stream is set by SIDResumeRegStream())
+    uint16 play_ram_adr;
+    int16 work_buffer[WORK_BUFFER_SIZE];
+};
+
+size_t SIDStateSize()
+{
+    return sizeof(sid_state);
+}
+
+void SIDGetState(sid_state *s)
+{
+    SDL_LockAudio();
+    s->sid[0] = *sid1;
+    s->sid[1] = *sid2;
+    s->cia_timer = cia_timer;
+    s->replay_count = replay_count;
+    s->replay_loops = replay_loops;
+    s->replay_overruns = replay_overruns;
+    s->replay_clock = replay_clock;
+    s->speed_adjust = speed_adjust;
+    s->noise_rand_seed = noise_rand_seed;
+    s->wb_read_offset = wb_read_offset;
+    s->wb_write_offset = wb_write_offset;
+    s->play_frame = play_frame;
+    s->play_ram_adr = play_ram_adr;
+    memcpy(s->work_buffer, work_buffer, sizeof(work_buffer));
+    SDL_UnlockAudio();
+}
+
+static void osid_set_state(osid_t *sid, const osid_t *from)
+{
+    *sid = *from;
+    osid_link_voices(sid);
+    sid->v3_lazy_valid = false;
+}
+
+void SIDSetState(const sid_state *s)
+{
+    SDL_LockAudio();
+    osid_set_state(sid1, &s->sid[0]);
+    osid_set_state(sid2, &s->sid[1]);
+    cia_timer = s->cia_timer;
+    replay_count = s->replay_count;
+    replay_loops = s->replay_loops;
+    replay_overruns = s->replay_overruns;
+    replay_clock = s->replay_clock;
+    speed_adjust = s->speed_adjust;
+    noise_rand_seed = s->noise_rand_seed;
+    wb_read_offset = s->wb_read_offset;
+    wb_write_offset = s->wb_write_offset;
+    play_stream = NULL;
+    play_frame = s->play_frame;
+    play_ram_adr = s->play_ram_adr;
+    memcpy(work_buffer, s->work_buffer, sizeof(work_buffer));
     SDL_UnlockAudio();
 }
 
@@ -884,6 +1080,10 @@ void SIDClockFreqChanged()
 void SIDSetReplayFreq(int freq)
 {
     cia_timer = cycles_per_second / freq - 1;
+    if (capture_stream) {
+        RegStreamAddWrite(capture_stream, REG_CIA_TL, cia_timer & 0xff, 0);
+        RegStreamAddWrite(capture_stream, REG_CIA_TH, cia_timer >> 8, 0);
+    }
 }
 
 /*
@@ -899,14 +1099,77 @@ void SIDAdjustSpeed(int percent)
  *  Write to CIA timer A (changes replay frequency)
  */
 
-void cia_tl_write(uint8 byte)
+void cia_tl_write(uint8 byte, cycle_t now)
 {
     cia_timer = (cia_timer & 0xff00) | byte;
+    if (capture_stream)
+        RegStreamAddWrite(capture_stream, REG_CIA_TL, byte, now);
 }
 
-void cia_th_write(uint8 byte)
+void cia_th_write(uint8 byte, cycle_t now)
 {
     cia_timer = (cia_timer & 0x00ff) | (byte << 8);
+    if (capture_stream)
+        RegStreamAddWrite(capture_stream, REG_CIA_TH, byte, now);
+}
+
+
+/*
+ *  Read VIC raster and CIA timer A registers
+ *
+ *  The replay routine is called at the underflow of timer A, so the timer
+ *  counts down from the latch value starting at cycle 0 of every call, and
+ *  the ICR is acknowledged before the call. The raster position follows
+ *  from the C64 cycle of the start of the replay period. Other registers
+ *  read as RAM.
+ */
+
+uint32 vic_read(uint32 adr, cycle_t now)
+{
+    uint32 line = ((replay_clock + now) / raster_cycles) % raster_lines;
+    switch (adr & 0x3f) {
+        case 0x11:
+            return (ram[adr] & 0x7f) | ((line >> 1) & 0x80);
+        case 0x12:
+            return line & 0xff;
+        default:
+            return ram[adr];
+    }
+}
+
+uint32 cia_peek(uint32 adr, cycle_t now)
+{
+    uint32 period = cia_timer + 1;
+    switch (adr & 0x0f) {
+        case 0x04:
+            return (cia_timer - now % period) & 0xff;
+        case 0x05:
+            return (cia_timer - now % period) >> 8;
+        case 0x0d:    // Timer A underflow since last read (interrupt enabled)
+            return now / period > cia_icr_read / period ? 0x81 : 0x00;
+        default:
+            return ram[adr];
+    }
+}
+
+uint32 cia_read(uint32 adr, cycle_t now)
+{
+    uint32 byte = cia_peek(adr, now);
+    if ((adr & 0x0f) == 0x0d)
+        cia_icr_read = now;
+    return byte;
+}
+
+cycle_t io_next_change(uint32 adr, cycle_t now)
+{
+    if ((adr & 0xff00) == 0xdc00 && (adr & 0x0f) == 0x0d) {
+        uint32 period = cia_timer + 1;
+        return (now / period + 1) * period;
+    } else if ((adr & 0xfc00) == 0xd000) {
+        uint64 clock = replay_clock + now;
+        return now + raster_cycles - clock % raster_cycles;
+    } else
+        return now + 1;
 }
 
 
@@ -914,6 +1177,127 @@ void cia_th_write(uint8 byte)
  *  Fill audio buffer with SID sound
  */
 
+// Advance envelope generator of voice by one sample frame
+static inline void eg_step(voice_t *v)
+{
+    switch (v->eg_state) {
+        case EG_ATTACK:
+            v->eg_level += v->a_add;
+            if (v->eg_level > 0xffffff) {
+                v->eg_level = 0xffffff;
+                v->eg_state = EG_DECAY;
+            }
+            break;
+        case EG_DECAY:
+            if (v->eg_level <= v->s_level || v->eg_level > 0xffffff)
+                v->eg_level = v->s_level;
+            else {
+                v->eg_level -= v->d_sub >> eg_dr_shift[v->eg_level >> 16];
+                if (v->eg_level <= v->s_level || v->eg_level > 0xffffff)
+                    v->eg_level = v->s_level;
+            }
+            break;
+        case EG_RELEASE:
+            v->eg_level -= v->r_sub >> eg_dr_shift[v->eg_level >> 16];
+            if (v->eg_level > 0xffffff) {
+                v->eg_level = 0;
+                v->eg_state = EG_IDLE;
+            }
+            break;
+        case EG_IDLE:
+            v->eg_level = 0;
+            break;
+    }
+}
+
+// Clock envelope and waveform generator of voice by one sample frame
+static inline void voice_clock(voice_t *v, uint32 *seed)
+{
+    eg_step(v);
+
+    if (!v->test)
+        v->count += v->add;
+
+    if (v->sync && (v->count >= 0x1000000))
+        v->mod_to->count = 0;
+
+    v->count &= 0xffffff;
+
+    if (v->wave == WAVE_NOISE && v->count >= 0x100000) {
+        v->noise = noise_step(seed) << 8;
+        v->count &= 0xfffff;
+    }
+}
+
+// Run input of filtered voices through IIR filter
+static void calc_filter(osid_t *sid, int32 *left, int32 *right)
+{
+    //float xn = ((float) *left) * sid->f_ampl;
+    fp24p8_t xn = mulfp24p8(itofp24p8(*left), sid->f_ampl);
+    //float yn = xn + sid->d1 * sid->xn1_l + sid->d2 * sid->xn2_l - sid->g1 * sid->yn1_l - sid->g2 * sid->yn2_l;
+    fp24p8_t yn = xn + mulfp24p8(sid->d1, sid->xn1_l) + mulfp24p8(sid->d2, sid->xn2_l) - mulfp24p8(sid->g1, sid->yn1_l) - mulfp24p8(sid->g2, sid->yn2_l);
+    *left = fp24p8toi(yn);
+    sid->yn2_l = sid->yn1_l; sid->yn1_l = yn; sid->xn2_l = sid->xn1_l; sid->xn1_l = xn;
+
+    //xn = ((float) *right) * sid->f_ampl;
+    xn = mulfp24p8(itofp24p8(*right), sid->f_ampl);
+    //yn = xn + sid->d1 * sid->xn1_r + sid->d2 * sid->xn2_r - sid->g1 * sid->yn1_r - sid->g2 * sid->yn2_r;
+    yn = xn + mulfp24p8(sid->d1, sid->xn1_r) + mulfp24p8(sid->d2, sid->xn2_r) - mulfp24p8(sid->g1, sid->yn1_r) - mulfp24p8(sid->g2, sid->yn2_r);
+    *right = fp24p8toi(yn);
+    sid->yn2_r = sid->yn1_r; sid->yn1_r = yn; sid->xn2_r = sid->xn1_r; sid->xn1_r = xn;
+}
+
+// Get waveform generator output of voice
+static inline uint16 wave_output(const voice_t *v)
+{
+    uint16 output;
+    switch (v->wave) {
+        case WAVE_TRI:
+            if (v->ring)
+                output = tri_table[(v->count ^ (v->mod_by->count & 0x800000)) >> 11];
+            else
+                output = tri_table[v->count >> 11];
+            break;
+        case WAVE_SAW:
+            output = v->count >> 8;
+            break;
+        case WAVE_RECT:
+            if (v->count > (uint32)(v->pw << 12))
+                output = 0xffff;
+            else
+                output = 0;
+            break;
+        case WAVE_TRISAW:
+            output = tri_saw_table[v->count >> 16];
+            break;
+        case WAVE_TRIRECT:
+            if (v->count > (uint32)(v->pw << 12))
+                output = tri_rect_table[v->count >> 16];
+            else
+                output = 0;
+            break;
+        case WAVE_SAWRECT:
+            if (v->count > (uint32)(v->pw << 12))
+                output = saw_rect_table[v->count >> 16];
+            else
+                output = 0;
+            break;
+        case WAVE_TRISAWRECT:
+            if (v->count > (uint32)(v->pw << 12))
+                output = tri_saw_rect_table[v->count >> 16];
+            else
+                output = 0;
+            break;
+        case WAVE_NOISE:
+            output = v->noise;
+            break;
+        default:
+            output = 0x8000;
+            break;
+    }
+    return output;
+}
+
 static void calc_sid(osid_t *sid, int32 *sum_output_left, int32 *sum_output_right)
 {
     // Sampled voice (!! todo: gain/panning)
@@ -930,99 +1314,14 @@ static void calc_sid(osid_t *sid, int32 *sum_output_left, int32 *sum_output_righ
     int j;
     for (j=0; j<3; j++) {
         voice_t *v = sid->voice + j;
+        voice_clock(v, &noise_rand_seed);
 
         // Envelope generator
-        uint16 envelope;
-
-        switch (v->eg_state) {
-            case EG_ATTACK:
-                v->eg_level += v->a_add;
-                if (v->eg_level > 0xffffff) {
-                    v->eg_level = 0xffffff;
-                    v->eg_state = EG_DECAY;
-                }
-                break;
-            case EG_DECAY:
-                if (v->eg_level <= v->s_level || v->eg_level > 0xffffff)
-                    v->eg_level = v->s_level;
-                else {
-                    v->eg_level -= v->d_sub >> eg_dr_shift[v->eg_level >> 16];
-                    if (v->eg_level <= v->s_level || v->eg_level > 0xffffff)
-                        v->eg_level = v->s_level;
-                }
-                break;
-            case EG_RELEASE:
-                v->eg_level -= v->r_sub >> eg_dr_shift[v->eg_level >> 16];
-                if (v->eg_level > 0xffffff) {
-                    v->eg_level = 0;
-                    v->eg_state = EG_IDLE;
-                }
-                break;
-            case EG_IDLE:
-                v->eg_level = 0;
-                break;
-        }
-        envelope = (v->eg_level * master_volume) >> 20;
+        uint16 envelope = (v->eg_level * master_volume) >> 20;
 
         // Waveform generator
-        uint16 output;
-
-        if (!v->test)
-            v->count += v->add;
+        uint16 output = wave_output(v);
 
-        if (v->sync && (v->count >= 0x1000000))
-            v->mod_to->count = 0;
-
-        v->count &= 0xffffff;
-
-        switch (v->wave) {
-            case WAVE_TRI:
-                if (v->ring)
-                    output = tri_table[(v->count ^ (v->mod_by->count & 0x800000)) >> 11];
-                else
-                    output = tri_table[v->count >> 11];
-                break;
-            case WAVE_SAW:
-                output = v->count >> 8;
-                break;
-            case WAVE_RECT:
-                if (v->count > (uint32)(v->pw << 12))
-                    output = 0xffff;
-                else
-                    output = 0;
-                break;
-            case WAVE_TRISAW:
-                output = tri_saw_table[v->count >> 16];
-                break;
-            case WAVE_TRIRECT:
-                if (v->count > (uint32)(v->pw << 12))
-                    output = tri_rect_table[v->count >> 16];
-                else
-                    output = 0;
-                break;
-            case WAVE_SAWRECT:
-                if (v->count > (uint32)(v->pw << 12))
-                    output = saw_rect_table[v->count >> 16];
-                else
-                    output = 0;
-                break;
-            case WAVE_TRISAWRECT:
-                if (v->count > (uint32)(v->pw << 12))
-                    output = tri_saw_rect_table[v->count >> 16];
-                else
-                    output = 0;
-                break;
-            case WAVE_NOISE:
-                if (v->count >= 0x100000) {
-                    output = v->noise = noise_rand() << 8;
-                    v->count &= 0xfffff;
-                } else
-                    output = v->noise;
-                break;
-            default:
-                output = 0x8000;
-                break;
-        }
         int32 x = (int16)(output ^ 0x8000) * envelope;
         if (v->filter) {
             sum_output_filter_left += (x * v->left_gain) >> 4;
@@ -1086,30 +1385,119 @@ static void calc_sid(osid_t *sid, int32 *sum_output_left, int32 *sum_output_righ
     *sum_output_right += (v4_output * sid->v4_right_gain) >> 4;
 
     // Filter
-    if (enable_filters) {
-        //float xn = ((float) sum_output_filter_left) * sid->f_ampl;
-        fp24p8_t xn = mulfp24p8(itofp24p8(sum_output_filter_left), sid->f_ampl);
-        //float yn = xn + sid->d1 * sid->xn1_l + sid->d2 * sid->xn2_l - sid->g1 * sid->yn1_l - sid->g2 * sid->yn2_l;
-        fp24p8_t yn = xn + mulfp24p8(sid->d1, sid->xn1_l) + mulfp24p8(sid->d2, sid->xn2_l) - mulfp24p8(sid->g1, sid->yn1_l) - mulfp24p8(sid->g2, sid->yn2_l);
-        sum_output_filter_left = fp24p8toi(yn);
-        sid->yn2_l = sid->yn1_l; sid->yn1_l = yn; sid->xn2_l = sid->xn1_l; sid->xn1_l = xn;
-
-        //xn = ((float) sum_output_filter_right) * sid->f_ampl;
-        xn = mulfp24p8(itofp24p8(sum_output_filter_right), sid->f_ampl);
-        //yn = xn + sid->d1 * sid->xn1_r + sid->d2 * sid->xn2_r - sid->g1 * sid->yn1_r - sid->g2 * sid->yn2_r;
-        yn = xn + mulfp24p8(sid->d1, sid->xn1_r) + mulfp24p8(sid->d2, sid->xn2_r) - mulfp24p8(sid->g1, sid->yn1_r) - mulfp24p8(sid->g2, sid->yn2_r);
-        sum_output_filter_right = fp24p8toi(yn);
-        sid->yn2_r = sid->yn1_r; sid->yn1_r = yn; sid->xn2_r = sid->xn1_r; sid->xn1_r = xn;
-    }
+    if (enable_filters)
+        calc_filter(sid, &sum_output_filter_left, &sum_output_filter_right);
 
     // Add filtered and non-filtered output
     *sum_output_left += sum_output_filter_left;
     *sum_output_right += sum_output_filter_right;
 }
 
+// Advance SID by one sample frame while it is silent: the voices are only
+// clocked, as their output is zero, and the filter only runs until its
+// state has decayed (the output is the same as that of calc_sid())
+static void calc_sid_silent(osid_t *sid, int32 *sum_output_left, int32 *sum_output_right)
+{
+    int j;
+    for (j=0; j<3; j++)
+        voice_clock(sid->voice + j, &noise_rand_seed);
+
+    if (enable_filters && (sid->xn1_l | sid->xn2_l | sid->yn1_l | sid->yn2_l | sid->xn1_r | sid->xn2_r | sid->yn1_r | sid->yn2_r)) {
+        int32 left = 0, right = 0;
+        calc_filter(sid, &left, &right);
+        *sum_output_left += left;
+        *sum_output_right += right;
+    }
+}
+
+// Check whether SID produces no sound until the next register write
+static bool osid_silent(const osid_t *sid)
+{
+    if (sid->v4_state != V4_OFF)
+        return false;
+    if (sid->volume == 0)
+        return true;
+    int i;
+    for (i=0; i<3; i++) {
+        const voice_t *v = sid->voice + i;
+        if (v->eg_level || v->eg_state == EG_ATTACK)
+            return false;
+        if (v->eg_state == EG_DECAY && v->s_level > v->eg_level)    // Raised sustain level, set in next frame
+            return false;
+    }
+    return true;
+}
+
+// Update silence flag after replay, call hook on changes
+static void check_silence(int frame)
+{
+    bool silent = osid_silent(sid1) && (!dual_sid || osid_silent(sid2));
+    if (silent != sids_silent && silence_hook)
+        silence_hook(silence_hook_arg, silent ? SID_SILENCE_START : SID_SILENCE_END, frame);
+    sids_silent = silent;
+    if (!silent)
+        silent_frames = 0;
+}
+
+// Feed writes of next frame of register stream to the SID
+static void play_stream_frame()
+{
+    int count, i;
+    const reg_write *w = RegStreamFrame(play_stream, play_frame++, &count);
+    for (i=0; i<count; i++, w++) {
+        switch (w->reg) {
+            case REG_CIA_TL:
+                cia_timer = (cia_timer & 0xff00) | w->value;
+                break;
+            case REG_CIA_TH:
+                cia_timer = (cia_timer & 0x00ff) | (w->value << 8);
+                break;
+            case REG_RAM_ADR_LO:
+                play_ram_adr = (play_ram_adr & 0xff00) | w->value;
+                break;
+            case REG_RAM_ADR_HI:
+                play_ram_adr = (play_ram_adr & 0x00ff) | (w->value << 8);
+                break;
+            case REG_RAM_DATA:
+                ram[play_ram_adr++] = w->value;
+                break;
+            default:
+                if (w->reg < 0x80)
+                    osid_write(sid1, w->reg, w->value, w->cycle, false);
+                break;
+        }
+    }
+}
+
+static void flush_output_block()
+{
+    if (loudness)
+        LoudnessAddFrames(loudness, output_block, output_fill);
+    if (encoder)
+        FlacAddFrames(encoder, output_block, output_fill);
+    output_fill = 0;
+}
+
+// Execute 6510 replay routine with the cycle budget
+static void execute_replay()
+{
+    UpdatePlayAdr();
+    cia_icr_read = 0;
+    sid1->v3_lazy_valid = false;
+    if (sid2)
+        sid2->v3_lazy_valid = false;
+    replay_cycles += CPUExecute(play_adr, 0, 0, 0, (cycle_t)(cia_timer + 1) * REPLAY_BUDGET_PERIODS);
+    if (cpu_stop_reason == CPU_STOP_LOOP)
+        replay_loops++;
+    else if (cpu_stop_reason == CPU_STOP_CYCLES)
+        replay_overruns++;
+    replay_clock += cia_timer + 1;
+}
+
 static void calc_buffer(void *userdata, uint8 *buf, int count)
 {
     uint16 *buf16 = (uint16 *)buf;
+    int frames;
 
     int replay_limit = (obtained.freq * 100) / (cycles_per_second / (cia_timer + 1) * speed_adjust);
 
@@ -1120,22 +1508,42 @@ static void calc_buffer(void *userdata, uint8 *buf, int count)
         count >>= 1;
     if (is_16_bit)
         count >>= 1;
+    frames = count;
+
+    // The SID state may have been replaced since the last call
+    sids_silent = osid_silent(sid1) && (!dual_sid || osid_silent(sid2));
 
     // Main calculation loop
     while (count--) {
         int32 sum_output_left = 0, sum_output_right = 0;
 
-        // Execute 6510 play routine if due
+        // Execute 6510 play routine (or play next frame of register stream) if due
         if (++replay_count >= replay_limit) {
             replay_count = 0;
-            UpdatePlayAdr();
-            CPUExecute(play_adr, 0, 0, 0, 1000000);
+            if (play_stream)
+                play_stream_frame();
+            else {
+                execute_replay();
+            }
+            if (replay_hook)
+                replay_hook(replay_hook_arg, frames - count - 1);
+            check_silence(frames - count - 1);
         }
 
-        // Calculate output of voices from both SIDs
-        calc_sid(sid1, &sum_output_left, &sum_output_right);
-        if (dual_sid)
-            calc_sid(sid2, &sum_output_left, &sum_output_right);
+        // Calculate output of voices from both SIDs (unless they are silent)
+        if (sids_silent) {
+            if (++silent_frames == silence_end_frames && silence_hook)
+                silence_hook(silence_hook_arg, SID_TUNE_END, frames - count - 1);
+        }
+        if (sids_silent && skip_silence) {
+            calc_sid_silent(sid1, &sum_output_left, &sum_output_right);
+            if (dual_sid)
+                calc_sid_silent(sid2, &sum_output_left, &sum_output_right);
+        } else {
+            calc_sid(sid1, &sum_output_left, &sum_output_right);
+            if (dual_sid)
+                calc_sid(sid2, &sum_output_left, &sum_output_right);
+        }
 
         // Apply audio effects (post-processing)
         if (audio_effect) {
@@ -1169,6 +1577,17 @@ static void calc_buffer(void *userdata, uint8 *buf, int count)
         else if (sum_output_right < -32768)
             sum_output_right = -32768;
 
+        // Collect output for loudness meter and encoder
+        if (loudness || encoder) {
+            if (is_stereo) {
+                output_block[output_fill * 2] = sum_output_left;
+                output_block[output_fill * 2 + 1] = sum_output_right;
+            } else
+                output_block[output_fill] = (sum_output_left + sum_output_right) / 2;
+            if (++output_fill == OUTPUT_BLOCK_FRAMES)
+                flush_output_block();
+        }
+
         // Write to output buffer
         if (is_16_bit) {
             if (is_stereo) {
@@ -1184,6 +1603,9 @@ static void calc_buffer(void *userdata, uint8 *buf, int count)
                 *buf++ = ((sum_output_left + sum_output_right) >> 9) ^ 0x80;
         }
     }
+
+    if (output_fill)
+        flush_output_block();
 }
 
 void SIDCalcBuffer(uint8 *buf, int count)
@@ -1220,8 +1642,195 @@ void SIDExecute()
     replay_start_time = GetTicks_usec();
 
     // Execute 6510 play routine
-    UpdatePlayAdr();
-    CPUExecute(play_adr, 0, 0, 0, 1000000);
+    SIDExecuteFrame();
+}
+
+
+/*
+ *  Execute 6510 replay routine once without delay and sound output,
+ *  returns replay period in cycles
+ */
+
+cycle_t SIDExecuteFrame()
+{
+    execute_replay();
+    return cia_timer + 1;
+}
+
+
+/*
+ *  Get number of C64 cycles per second
+ */
+
+cycle_t SIDCyclesPerSecond()
+{
+    return cycles_per_second;
+}
+
+
+/*
+ *  Get values last written to the 25 registers of the (first) SID
+ */
+
+void SIDGetRegisters(uint8 *regs)
+{
+    memcpy(regs, sid1->regs, 25);
+}
+
+
+/*
+ *  Set function to be called after every replay in SIDCalcBuffer() (NULL = none)
+ */
+
+void SIDSetReplayHook(sid_replay_func func, void *arg)
+{
+    replay_hook = func;
+    replay_hook_arg = arg;
+}
+
+
+/*
+ *  Set function to be called on silence events in SIDCalcBuffer() (NULL = none)
+ */
+
+void SIDSetSilenceHook(sid_silence_func func, void *arg, uint32 end_frames)
+{
+    silence_hook = func;
+    silence_hook_arg = arg;
+    silence_end_frames = end_frames;
+    silent_frames = 0;
+}
+
+
+/*
+ *  Compute fingerprint of the state that determines the future sound: C64
+ *  RAM, SID registers and the voice state, with envelope levels and the
+ *  oscillator phases of audible voices quantized (so a loop splices without
+ *  a large jump in the waveforms). Filter and effect history and the noise
+ *  generator are not included, they don't repeat exactly when a tune loops.
+ */
+
+static uint64 hash_word(uint64 h, uint64 x)
+{
+    h = (h ^ x) * 0x9e3779b97f4a7c15ULL;
+    return h ^ (h >> 29);
+}
+
+static uint64 osid_loop_hash(uint64 h, const osid_t *sid)
+{
+    int i;
+    for (i=0; i<128; i+=8) {
+        uint64 x;
+        memcpy(&x, sid->regs + i, 8);
+        h = hash_word(h, x);
+    }
+    for (i=0; i<3; i++) {
+        const voice_t *v = sid->voice + i;
+        uint32 phase = (v->eg_level >> 16) ? v->count >> 21 : 0;
+        h = hash_word(h, v->eg_state | (v->eg_level >> 20) << 8 | phase << 16);
+    }
+    h = hash_word(h, sid->v4_state | (uint64)sid->sm_adr << 8 | (uint64)sid->gn_tone_counter << 40);
+    return h;
+}
+
+uint64 SIDLoopHash()
+{
+    uint64 h = 0;
+    int i;
+    for (i=0; i<RAM_SIZE; i+=8) {
+        uint64 x;
+        memcpy(&x, ram + i, 8);
+        h = hash_word(h, x);
+    }
+    h = osid_loop_hash(h, sid1);
+    h = osid_loop_hash(h, sid2);
+    h = hash_word(h, cia_timer);
+    if (play_stream)
+        h = hash_word(h, play_frame);
+    return h;
+}
+
+
+/*
+ *  Play register stream instead of running the 6510 replay routine (NULL = stop)
+ */
+
+void SIDPlayRegStream(const regstream *rs)
+{
+    SIDReset(0);
+    if (rs == NULL)
+        return;
+
+    SDL_LockAudio();
+    MemoryClear();
+    play_stream = rs;
+    play_frame = 0;
+    play_ram_adr = 0;
+    play_stream_frame();    // Init routine
+    SDL_UnlockAudio();
+}
+
+void SIDResumeRegStream(const regstream *rs)
+{
+    SDL_LockAudio();
+    play_stream = rs;
+    SDL_UnlockAudio();
+}
+
+
+/*
+ *  Capture guest writes to SID and CIA timer to register stream (NULL = stop capturing)
+ */
+
+void SIDSetCapture(regstream *rs)
+{
+    capture_stream = rs;
+}
+
+
+/*
+ *  Analyze loudness of rendered audio with meter (NULL = stop); the meter
+ *  must have the sample rate and number of channels of SIDGetAudioFormat()
+ */
+
+void SIDSetLoudnessMeter(loudness_meter *lm)
+{
+    loudness = lm;
+    output_fill = 0;
+}
+
+
+/*
+ *  Encode rendered audio with FLAC encoder (NULL = stop); the encoder must
+ *  have the sample rate and number of channels of SIDGetAudioFormat()
+ */
+
+void SIDSetEncoder(flac_encoder *fe)
+{
+    encoder = fe;
+    output_fill = 0;
+}
+
+
+/*
+ *  Get number of cycles executed by replay routine so far
+ */
+
+uint64 SIDReplayCycles()
+{
+    return replay_cycles;
+}
+
+
+/*
+ *  Get number of replay routine calls stopped in an infinite loop or at
+ *  the cycle budget since the song was started
+ */
+
+void SIDGetReplayStops(uint32 *loops, uint32 *overruns)
+{
+    *loops = replay_loops;
+    *overruns = replay_overruns;
 }
 
 
@@ -1380,6 +1989,40 @@ void osid_calc_gains(osid_t *sid, bool is_left_sid, bool is_right_sid)
  *  Read from SID register
  */
 
+/*
+ *  The waveform calculation runs asynchronously to the CPU, so for reading
+ *  the oscillator and EG of voice 3, a copy of the voices is set up at the
+ *  first read in every replay call and clocked like in calc_sid() (all three
+ *  voices, as voice 3 is synced and ring modulated by voice 2 which in turn
+ *  is synced by voice 1) up to the cycle of each read. Writes to voice
+ *  registers after that also go to the copy. The sound output is not
+ *  affected.
+ */
+
+static void osid_v3_catch_up(osid_t *sid, cycle_t now)
+{
+    voice_t *v = sid->v3_lazy;
+    int i;
+    if (!sid->v3_lazy_valid) {
+        for (i=0; i<3; i++) {
+            v[i] = sid->voice[i];
+            v[i].mod_by = v + (sid->voice[i].mod_by - sid->voice);
+            v[i].mod_to = v + (sid->voice[i].mod_to - sid->voice);
+        }
+        sid->v3_lazy_clock = 0;
+        sid->v3_lazy_seed = noise_rand_seed;
+        sid->v3_lazy_valid = true;
+    }
+
+    // Step by the same fractional number of cycles per sample frame as calc_sid()
+    fp24p8_t end = itofp24p8(now);
+    while (sid->v3_lazy_clock + sid_cycles_frac <= end) {
+        sid->v3_lazy_clock += sid_cycles_frac;
+        for (i=0; i<3; i++)
+            voice_clock(v + i, &sid->v3_lazy_seed);
+    }
+}
+
 uint32 osid_read(osid_t *sid, uint32 adr, cycle_t now)
 {
     D(bug("sid_read from %04x at cycle %d\n", adr, now));
@@ -1389,10 +2032,14 @@ uint32 osid_read(osid_t *sid, uint32 adr, cycle_t now)
         case 0x1a:
             sid->last_written_byte = 0;
             return 0xff;
-        case 0x1b:    // Voice 3 oscillator/EG readout
-        case 0x1c:
+        case 0x1b:    // Voice 3 oscillator readout
+            osid_v3_catch_up(sid, now);
+            sid->last_written_byte = 0;
+            return sid->v3_lazy[2].wave == WAVE_NONE ? 0 : wave_output(&sid->v3_lazy[2]) >> 8;
+        case 0x1c:    // Voice 3 EG readout
+            osid_v3_catch_up(sid, now);
             sid->last_written_byte = 0;
-            return f_rand();
+            return sid->v3_lazy[2].eg_level >> 16;
         default: {    // Write-only register: return last value written to SID
             uint8 ret = sid->last_written_byte;
             sid->last_written_byte = 0;
@@ -1411,6 +2058,22 @@ uint32 sid_read(uint32 adr, cycle_t now)
  *  Write to SID register
  */
 
+static void voice_ctrl_write(voice_t *v, uint8 byte)
+{
+    v->wave = (byte >> 4) & 0xf;
+    if ((byte & 1) != v->gate) {
+        if (byte & 1)    // Gate turned on
+            v->eg_state = EG_ATTACK;
+        else            // Gate turned off
+            if (v->eg_state != EG_IDLE)
+                v->eg_state = EG_RELEASE;
+    }
+    v->gate = byte & 1;
+    v->ring = byte & 4;
+    if ((v->test = byte & 8))
+        v->count = 0;
+}
+
 void osid_write(osid_t *sid, uint32 adr, uint32 byte, cycle_t now, bool rmw)
 {
     D(bug("sid_write %02x to %04x at cycle %d\n", byte, adr, now));
@@ -1422,6 +2085,10 @@ void osid_write(osid_t *sid, uint32 adr, uint32 byte, cycle_t now, bool rmw)
     sid->last_written_byte = sid->regs[adr] = byte;
     int v = adr/7;    // Voice number
 
+    // Clock voice copy up to the write
+    if (adr < 21 && sid->v3_lazy_valid)
+        osid_v3_catch_up(sid, now);
+
     switch (adr) {
         case 0:
         case 7:
@@ -1454,19 +2121,8 @@ void osid_write(osid_t *sid, uint32 adr, uint32 byte, cycle_t now, bool rmw)
         case 4:
         case 11:
         case 18:
-            sid->voice[v].wave = (byte >> 4) & 0xf;
-            if ((byte & 1) != sid->voice[v].gate) {
-                if (byte & 1)    // Gate turned on
-                    sid->voice[v].eg_state = EG_ATTACK;
-                else            // Gate turned off
-                    if (sid->voice[v].eg_state != EG_IDLE)
-                        sid->voice[v].eg_state = EG_RELEASE;
-            }
-            sid->voice[v].gate = byte & 1;
+            voice_ctrl_write(&sid->voice[v], byte);
             sid->voice[v].mod_by->sync = byte & 2;
-            sid->voice[v].ring = byte & 4;
-            if ((sid->voice[v].test = byte & 8))
-                sid->voice[v].count = 0;
             break;
 
         case 5:
@@ -1566,10 +2222,55 @@ void osid_write(osid_t *sid, uint32 adr, uint32 byte, cycle_t now, bool rmw)
             }
             break;
     }
+
+    // Apply write to voice copy (which was clocked up to now above)
+    if (adr < 21 && sid->v3_lazy_valid) {
+        voice_t *lazy = &sid->v3_lazy[v], *voice = &sid->voice[v];
+        if (adr % 7 == 4) {
+            voice_ctrl_write(lazy, byte);
+            lazy->mod_by->sync = byte & 2;
+        }
+        lazy->freq = voice->freq;
+        lazy->add = voice->add;
+        lazy->pw = voice->pw;
+        lazy->a_add = voice->a_add;
+        lazy->d_sub = voice->d_sub;
+        lazy->s_level = voice->s_level;
+        lazy->r_sub = voice->r_sub;
+    }
+}
+
+// Capture C64 RAM that voice 4 reads after being started by a write to register 0x1d
+static void capture_v4_ram(const osid_t *sid, uint8 byte, cycle_t now)
+{
+    uint32 start, end;
+    uint32 adr = (sid->regs[0x1f] << 8) | sid->regs[0x1e];
+    if (byte == 0 || byte == 0xfd)
+        return;
+    else if (byte < 0xfc) {        // Galway noise: tone list
+        start = adr;
+        end = adr + byte + 1;
+    } else {                    // Sample: nybbles from start (or repeat point) to end
+        uint32 sm_adr = adr << 1;
+        uint32 sm_end_adr = ((sid->regs[0x3e] << 8) | sid->regs[0x3d]) << 1;
+        uint32 sm_rep_adr = ((sid->regs[0x7f] << 8) | sid->regs[0x7e]) << 1;
+        if (sm_end_adr <= sm_adr)
+            sm_end_adr = sm_adr + 1;
+        start = (sm_rep_adr < sm_adr ? sm_rep_adr : sm_adr) >> 1;
+        end = ((sm_end_adr - 1) >> 1) + 1;
+    }
+    if (end > RAM_SIZE)
+        end = RAM_SIZE;
+    RegStreamAddRAM(capture_stream, start, ram + start, end - start, now);
 }
 
 void sid_write(uint32 adr, uint32 byte, cycle_t now, bool rmw)
 {
+    if (capture_stream) {
+        if ((adr & 0x7f) == 0x1d)
+            capture_v4_ram(sid1, byte, now);
+        RegStreamAddWrite(capture_stream, adr & 0x7f, byte, now);
+    }
     SDL_LockAudio();
     osid_write(sid1, adr & 0x7f, byte, now, rmw);
     SDL_UnlockAudio();
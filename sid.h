@@ -22,6 +22,34 @@
 #define SID_H
 
 #include "types.h"
+#include "regstream.h"
+#include "loudness.h"
+#include "flac.h"
+
+#include <stddef.h>
+
+
+/*
+ *  Definitions
+ */
+
+// Emulation state of the SID chips and the replay timer (see SIDGetState())
+typedef struct sid_state sid_state;
+
+// Function called after every replay, with the number of sample frames
+// computed before it by the current SIDCalcBuffer() call
+typedef void (*sid_replay_func)(void *arg, int frame);
+
+// Silence events
+enum {
+    SID_SILENCE_START,        // All voices became silent
+    SID_SILENCE_END,        // A voice started sounding again
+    SID_TUNE_END            // Silence lasted for the given time
+};
+
+// Function called on silence events, with the number of sample frames
+// computed before it by the current SIDCalcBuffer() call
+typedef void (*sid_silence_func)(void *arg, int event, int frame);
 
 
 /*
@@ -34,22 +62,87 @@ extern void SIDInit();
 // Exit SID emulation
 extern void SIDExit();
 
+// Open audio device for replay
+extern bool SIDOpenAudio();
+
+// Get format of rendered audio data (sample rate, bits per sample, number of channels)
+extern void SIDGetAudioFormat(int *freq, int *bits, int *channels);
+
 // Reset SID emulation
 extern void SIDReset(cycle_t now);
 
+// Get/set emulation state (the sid_state is a flat structure of SIDStateSize() bytes)
+extern size_t SIDStateSize();
+extern void SIDGetState(sid_state *s);
+extern void SIDSetState(const sid_state *s);
+
 // Fill audio buffer with SID sound
 extern void SIDCalcBuffer(uint8 *buf, int count);
 
 // Execute 6510 replay routine once
 extern void SIDExecute();
 
+// Execute 6510 replay routine once without delay and sound output, returns replay period in cycles
+extern cycle_t SIDExecuteFrame();
+
+// Get number of C64 cycles per second
+extern cycle_t SIDCyclesPerSecond();
+
+// Get values last written to the 25 registers of the (first) SID
+extern void SIDGetRegisters(uint8 *regs);
+
+// Set function to be called after every replay in SIDCalcBuffer() (NULL = none)
+extern void SIDSetReplayHook(sid_replay_func func, void *arg);
+
+// Set function to be called on silence events in SIDCalcBuffer() (NULL =
+// none), the end of the tune is reported after end_frames silent sample
+// frames (0 = never)
+extern void SIDSetSilenceHook(sid_silence_func func, void *arg, uint32 end_frames);
+
+// Compute fingerprint of the state that determines the future sound (for loop detection)
+extern uint64 SIDLoopHash();
+
+// Play register stream instead of running the 6510 replay routine (NULL = stop),
+// the stream must stay valid while it is played
+extern void SIDPlayRegStream(const regstream *rs);
+
+// Continue playing register stream at the position restored by SIDSetState()
+// (the state doesn't contain the stream, which only exists in this process)
+extern void SIDResumeRegStream(const regstream *rs);
+
+// Capture guest writes to SID and CIA timer to register stream (NULL = stop capturing)
+extern void SIDSetCapture(regstream *rs);
+
+// Analyze loudness of rendered audio with meter (NULL = stop)
+extern void SIDSetLoudnessMeter(loudness_meter *lm);
+
+// Encode rendered audio (16 bits, after clipping) with FLAC encoder (NULL = stop)
+extern void SIDSetEncoder(flac_encoder *fe);
+
+// Get number of cycles executed by replay routine so far
+extern uint64 SIDReplayCycles();
+
+// Get number of replay routine calls that were stopped in an infinite loop
+// or at the cycle budget (two replay periods) since the song was started
+extern void SIDGetReplayStops(uint32 *loops, uint32 *overruns);
+
 // Set replay frequency and speed adjustment
 extern void SIDSetReplayFreq(int freq);
 extern void SIDAdjustSpeed(int percent);
 
 // Write to CIA timer A (changes replay frequency)
-extern void cia_tl_write(uint8 byte);
-extern void cia_th_write(uint8 byte);
+extern void cia_tl_write(uint8 byte, cycle_t now);
+extern void cia_th_write(uint8 byte, cycle_t now);
+
+// Read from VIC/CIA register (raster position and timer A follow the cycle count)
+extern uint32 vic_read(uint32 adr, cycle_t now);
+extern uint32 cia_read(uint32 adr, cycle_t now);
+
+// Read from CIA register without side effects
+extern uint32 cia_peek(uint32 adr, cycle_t now);
+
+// Get cycle at which the value of a VIC/CIA register may next change
+extern cycle_t io_next_change(uint32 adr, cycle_t now);
 
 // Read from SID register
 extern uint32 sid_read(uint32 adr, cycle_t now);
@@ -0,0 +1,552 @@
+/*
+ *  flac_test.c - Test of the FLAC encoder
+ *
+ *  SIDPlayer (C) Copyright 1996-2004 Christian Bauer
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+/*
+ *  The encoded streams are decoded by a separate minimal decoder which
+ *  handles everything the format allows for 16-bit audio without LPC
+ *  subframes, checks the CRCs of every frame and the MD5 of the decoded
+ *  audio, and the decoded samples are compared with the input.
+ */
+
+#include "../sys.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#include "test.h"
+#include "../flac.h"
+
+
+// Sample rate of test signals
+#define TEST_FREQ 44100
+
+
+/*
+ *  MD5 (RFC 1321)
+ */
+
+typedef struct {
+    uint32 h[4];
+    uint8 buf[64];
+    uint64 length;
+} md5_t;
+
+static uint32 rol(uint32 x, int n)
+{
+    return (x << n) | (x >> (32 - n));
+}
+
+static void md5_block(md5_t *m, const uint8 *p)
+{
+    static const int r[4][4] = {{7, 12, 17, 22}, {5, 9, 14, 20}, {4, 11, 16, 23}, {6, 10, 15, 21}};
+    uint32 w[16], a = m->h[0], b = m->h[1], c = m->h[2], d = m->h[3];
+    int i;
+    for (i=0; i<16; i++)
+        w[i] = p[i*4] | (p[i*4+1] << 8) | (p[i*4+2] << 16) | ((uint32)p[i*4+3] << 24);
+    for (i=0; i<64; i++) {
+        uint32 f;
+        int g;
+        switch (i / 16) {
+            case 0: f = (b & c) | (~b & d); g = i; break;
+            case 1: f = (d & b) | (~d & c); g = (5 * i + 1) % 16; break;
+            case 2: f = b ^ c ^ d; g = (3 * i + 5) % 16; break;
+            default: f = c ^ (b | ~d); g = (7 * i) % 16; break;
+        }
+        uint32 k = (uint32)(fabs(sin(i + 1)) * 4294967296.0);
+        uint32 t = d;
+        d = c;
+        c = b;
+        b = b + rol(a + f + k + w[g], r[i / 16][i % 4]);
+        a = t;
+    }
+    m->h[0] += a; m->h[1] += b; m->h[2] += c; m->h[3] += d;
+}
+
+static void md5_init(md5_t *m)
+{
+    m->h[0] = 0x67452301; m->h[1] = 0xefcdab89; m->h[2] = 0x98badcfe; m->h[3] = 0x10325476;
+    m->length = 0;
+}
+
+static void md5_update(md5_t *m, const uint8 *p, size_t len)
+{
+    while (len--) {
+        m->buf[m->length++ % 64] = *p++;
+        if (m->length % 64 == 0)
+            md5_block(m, m->buf);
+    }
+}
+
+static void md5_final(md5_t *m, uint8 *digest)
+{
+    uint64 bits = m->length * 8;
+    uint8 pad = 0x80;
+    md5_update(m, &pad, 1);
+    pad = 0;
+    while (m->length % 64 != 56)
+        md5_update(m, &pad, 1);
+    int i;
+    for (i=0; i<8; i++) {
+        pad = bits >> (i * 8);
+        md5_update(m, &pad, 1);
+    }
+    for (i=0; i<16; i++)
+        digest[i] = m->h[i / 4] >> ((i % 4) * 8);
+}
+
+
+/*
+ *  Decoder
+ */
+
+typedef struct {
+    const uint8 *data;
+    size_t size;
+    size_t pos;            // Bit position
+    bool error;            // Read beyond end
+} bit_reader;
+
+static uint32 get_bits(bit_reader *br, int n)
+{
+    uint32 x = 0;
+    while (n--) {
+        if (br->pos >= br->size * 8) {
+            br->error = true;
+            return 0;
+        }
+        x = (x << 1) | ((br->data[br->pos >> 3] >> (7 - (br->pos & 7))) & 1);
+        br->pos++;
+    }
+    return x;
+}
+
+static int32 get_signed(bit_reader *br, int n)
+{
+    uint32 x = get_bits(br, n);
+    return n && (x & (1u << (n - 1))) ? (int32)(x - (1u << n) * (n < 32)) : (int32)x;
+}
+
+static uint32 get_unary(bit_reader *br)
+{
+    uint32 n = 0;
+    while (!br->error && get_bits(br, 1) == 0)
+        n++;
+    return n;
+}
+
+static uint8 calc_crc8(const uint8 *p, size_t len)
+{
+    uint8 crc = 0;
+    int i;
+    while (len--) {
+        crc ^= *p++;
+        for (i=0; i<8; i++)
+            crc = (crc & 0x80) ? (crc << 1) ^ 0x07 : crc << 1;
+    }
+    return crc;
+}
+
+static uint16 calc_crc16(const uint8 *p, size_t len)
+{
+    uint16 crc = 0;
+    int i;
+    while (len--) {
+        crc ^= *p++ << 8;
+        for (i=0; i<8; i++)
+            crc = (crc & 0x8000) ? (crc << 1) ^ 0x8005 : crc << 1;
+    }
+    return crc;
+}
+
+// Decode subframe of n samples with given sample size, returns false on error
+static bool decode_subframe(bit_reader *br, int32 *x, int n, int bits)
+{
+    int i, j;
+    if (get_bits(br, 1))
+        return false;
+    int type = get_bits(br, 6);
+    int wasted = 0;
+    if (get_bits(br, 1))
+        wasted = get_unary(br) + 1;
+    bits -= wasted;
+
+    if (type == 0) {                    // Constant
+        int32 v = get_signed(br, bits);
+        for (i=0; i<n; i++)
+            x[i] = v;
+    } else if (type == 1) {                // Verbatim
+        for (i=0; i<n; i++)
+            x[i] = get_signed(br, bits);
+    } else if (type >= 8 && type <= 12) {    // Fixed predictor
+        int order = type - 8;
+        if (order > n)
+            return false;
+        for (i=0; i<order; i++)
+            x[i] = get_signed(br, bits);
+
+        int method = get_bits(br, 2);
+        if (method > 1)
+            return false;
+        int param_bits = method ? 5 : 4, escape = (1 << param_bits) - 1;
+        int porder = get_bits(br, 4);
+        int size = n >> porder;
+        if ((size << porder) != n || size < order)
+            return false;
+        int32 *r = x + order;
+        for (j=0; j<(1 << porder); j++) {
+            int len = j ? size : size - order;
+            int k = get_bits(br, param_bits);
+            if (k == escape) {
+                int raw = get_bits(br, 5);
+                for (i=0; i<len; i++)
+                    *r++ = get_signed(br, raw);
+            } else {
+                for (i=0; i<len; i++) {
+                    uint32 z = (get_unary(br) << k) | get_bits(br, k);
+                    *r++ = (z >> 1) ^ -(int32)(z & 1);
+                }
+            }
+        }
+        for (i=order; i<n; i++) {
+            switch (order) {
+                case 1: x[i] += x[i-1]; break;
+                case 2: x[i] += 2 * x[i-1] - x[i-2]; break;
+                case 3: x[i] += 3 * x[i-1] - 3 * x[i-2] + x[i-3]; break;
+                case 4: x[i] += 4 * x[i-1] - 6 * x[i-2] + 4 * x[i-3] - x[i-4]; break;
+            }
+        }
+    } else
+        return false;
+
+    for (i=0; i<n; i++)
+        x[i] *= 1 << wasted;
+    return !br->error;
+}
+
+// Decoded stream
+typedef struct {
+    int freq, channels;
+    uint64 total_frames;
+    int16 *samples;                // Interleaved
+    int num_frames;                // Number of FLAC frames
+} decoded_stream;
+
+// Decode FLAC file of 16-bit audio, returns false on error
+static bool decode(const uint8 *data, size_t size, decoded_stream *ds)
+{
+    bit_reader br = {data, size, 0, false};
+    memset(ds, 0, sizeof(*ds));
+    if (size < 4 || memcmp(data, "fLaC", 4))
+        return false;
+    br.pos = 32;
+
+    // Metadata blocks
+    uint8 md5[16];
+    int min_block = 0, max_block = 0;
+    uint32 min_frame_bytes = 0, max_frame_bytes = 0;
+    bool last = false, have_info = false;
+    while (!last && !br.error) {
+        last = get_bits(&br, 1);
+        int type = get_bits(&br, 7);
+        uint32 length = get_bits(&br, 24);
+        size_t end = br.pos + length * 8;
+        if (type == 0) {
+            min_block = get_bits(&br, 16);
+            max_block = get_bits(&br, 16);
+            min_frame_bytes = get_bits(&br, 24);
+            max_frame_bytes = get_bits(&br, 24);
+            ds->freq = get_bits(&br, 20);
+            ds->channels = get_bits(&br, 3) + 1;
+            if (get_bits(&br, 5) != 15)
+                return false;
+            ds->total_frames = (uint64)get_bits(&br, 4) << 32;
+            ds->total_frames |= get_bits(&br, 32);
+            int i;
+            for (i=0; i<16; i++)
+                md5[i] = get_bits(&br, 8);
+            have_info = true;
+        }
+        br.pos = end;
+    }
+    if (br.error || !have_info || ds->channels > 2 || ds->total_frames > 0x10000000)
+        return false;
+
+    // Frames
+    int32 *x[2] = {NULL, NULL};
+    ds->samples = malloc((ds->total_frames ? ds->total_frames : 1) * ds->channels * sizeof(int16));
+    uint64 done = 0;
+    bool ok = ds->samples != NULL;
+    uint32 frame_min = 0, frame_max = 0;
+    while (ok && br.pos < size * 8) {
+        size_t start = br.pos / 8;
+        ok = get_bits(&br, 15) == 0x7ffc && get_bits(&br, 1) == 0;    // Fixed block size
+        int bs_code = get_bits(&br, 4);
+        int sr_code = get_bits(&br, 4);
+        int assignment = get_bits(&br, 4);
+        int ss_code = get_bits(&br, 3);
+        ok = ok && get_bits(&br, 1) == 0 && (ss_code == 0 || ss_code == 4);
+
+        // Frame number (UTF-8 coded)
+        uint32 c = get_bits(&br, 8), number;
+        int more = 0;
+        if (c < 0x80)
+            number = c;
+        else if (c >= 0xc0 && c < 0xe0) {
+            number = c & 0x1f; more = 1;
+        } else if (c >= 0xe0 && c < 0xf0) {
+            number = c & 0x0f; more = 2;
+        } else if (c >= 0xf0 && c < 0xf8) {
+            number = c & 0x07; more = 3;
+        } else {
+            number = 0; ok = false;
+        }
+        while (more--) {
+            c = get_bits(&br, 8);
+            ok = ok && (c & 0xc0) == 0x80;
+            number = (number << 6) | (c & 0x3f);
+        }
+        ok = ok && number == ds->num_frames;
+
+        int n;
+        if (bs_code == 1)
+            n = 192;
+        else if (bs_code >= 2 && bs_code <= 5)
+            n = 576 << (bs_code - 2);
+        else if (bs_code == 6)
+            n = get_bits(&br, 8) + 1;
+        else if (bs_code == 7)
+            n = get_bits(&br, 16) + 1;
+        else if (bs_code >= 8)
+            n = 256 << (bs_code - 8);
+        else {
+            n = 0; ok = false;
+        }
+        if (sr_code == 12)
+            get_bits(&br, 8);
+        else if (sr_code == 13 || sr_code == 14)
+            get_bits(&br, 16);
+        ok = ok && sr_code != 15;
+
+        // Header CRC
+        size_t header_end = br.pos / 8;
+        ok = ok && calc_crc8(data + start, header_end - start) == get_bits(&br, 8);
+
+        // Only the last block may be shorter than the minimum
+        ok = ok && n <= max_block && done + n <= ds->total_frames
+                && (n >= min_block || done + n == ds->total_frames);
+        if (!ok)
+            break;
+
+        // Subframes
+        int ch, i;
+        int channels = assignment < 8 ? assignment + 1 : 2;
+        ok = channels == ds->channels && assignment <= 10;
+        for (ch=0; ch<channels; ch++) {
+            x[ch] = realloc(x[ch], n * sizeof(int32));
+            int bits = 16;
+            if ((assignment == 8 && ch == 1) || (assignment == 9 && ch == 0) || (assignment == 10 && ch == 1))
+                bits = 17;
+            ok = ok && x[ch] && decode_subframe(&br, x[ch], n, bits);
+        }
+        if (!ok)
+            break;
+
+        // Footer CRC
+        br.pos = (br.pos + 7) & ~7;
+        size_t end = br.pos / 8;
+        ok = calc_crc16(data + start, end - start) == get_bits(&br, 16) && !br.error;
+        uint32 frame_bytes = end + 2 - start;
+        if (frame_min == 0 || frame_bytes < frame_min)
+            frame_min = frame_bytes;
+        if (frame_bytes > frame_max)
+            frame_max = frame_bytes;
+
+        // Undo stereo decorrelation
+        for (i=0; i<n; i++) {
+            int32 l = x[0][i], r = channels == 2 ? x[1][i] : 0;
+            switch (assignment) {
+                case 8: r = l - r; break;
+                case 9: l = l + r; break;
+                case 10: {
+                    int32 mid = l * 2 | (r & 1);
+                    l = (mid + r) >> 1;
+                    r = (mid - r) >> 1;
+                    break;
+                }
+            }
+            ok = ok && l >= -32768 && l <= 32767 && r >= -32768 && r <= 32767;
+            ds->samples[(done + i) * channels] = l;
+            if (channels == 2)
+                ds->samples[(done + i) * channels + 1] = r;
+        }
+        done += n;
+        ds->num_frames++;
+    }
+    free(x[0]);
+    free(x[1]);
+
+    // Length, frame sizes and MD5 of audio (zero for empty streams)
+    ok = ok && done == ds->total_frames && frame_min == min_frame_bytes && frame_max == max_frame_bytes;
+    if (ok && done == 0) {
+        static const uint8 zero[16];
+        ok = memcmp(md5, zero, 16) == 0;
+    } else if (ok) {
+        md5_t m;
+        uint8 digest[16];
+        uint64 i;
+        md5_init(&m);
+        for (i=0; i<done * ds->channels; i++) {
+            uint8 le[2] = {(uint8)ds->samples[i], (uint8)(ds->samples[i] >> 8)};
+            md5_update(&m, le, 2);
+        }
+        md5_final(&m, digest);
+        ok = memcmp(digest, md5, 16) == 0;
+    }
+    if (!ok) {
+        free(ds->samples);
+        ds->samples = NULL;
+    }
+    return ok;
+}
+
+
+/*
+ *  Tests
+ */
+
+// Signals
+enum {
+    SIG_SILENCE,        // Zero
+    SIG_SINE,            // Sine with different phase per channel
+    SIG_SIDE,            // Same sine in both channels with small difference
+    SIG_NOISE,            // Full scale white noise
+    SIG_MIXED            // Changes every 3000 frames between the above, and clipped square
+};
+
+static int16 signal_sample(int sig, int frame, int ch, uint32 *seed)
+{
+    switch (sig) {
+        case SIG_SILENCE:
+            return 0;
+        case SIG_SINE:
+            return lrint(20000.0 * sin(frame * 0.031 + ch * 1.3));
+        case SIG_SIDE:
+            return lrint(16000.0 * sin(frame * 0.013)) + ch * ((frame >> 4) & 3);
+        case SIG_NOISE:
+            *seed = *seed * 1103515245 + 12345;
+            return *seed >> 16;
+        default:
+            switch ((frame / 3000) % 5) {
+                case 0: return signal_sample(SIG_SINE, frame, ch, seed);
+                case 1: return signal_sample(SIG_NOISE, frame, ch, seed);
+                case 2: return (frame & 64) ? 32767 : -32768;
+                case 3: return signal_sample(SIG_SILENCE, frame, ch, seed);
+                default: return signal_sample(SIG_SIDE, frame, ch, seed);
+            }
+    }
+}
+
+// Encode signal (fed in blocks of varying size), decode it and compare
+static void round_trip(int sig, int channels, int frames)
+{
+    int16 *in = malloc((frames ? frames : 1) * channels * sizeof(int16));
+    uint32 seed = 1;
+    int i, ch;
+    for (i=0; i<frames; i++)
+        for (ch=0; ch<channels; ch++)
+            in[i * channels + ch] = signal_sample(sig, i, ch, &seed);
+
+    FILE *f = tmpfile();
+    CHECK(f != NULL);
+    if (f == NULL) {
+        free(in);
+        return;
+    }
+    flac_encoder *fe = FlacNew(f, TEST_FREQ, channels);
+    CHECK(fe != NULL);
+    int pos = 0, chunk = 1;
+    while (pos < frames) {
+        int n = frames - pos < chunk ? frames - pos : chunk;
+        FlacAddFrames(fe, in + pos * channels, n);
+        pos += n;
+        chunk = chunk * 3 + 7;
+    }
+    CHECK(FlacClose(fe));
+
+    long size = ftell(f);
+    uint8 *data = malloc(size);
+    rewind(f);
+    CHECK(fread(data, 1, size, f) == size);
+    fclose(f);
+
+    decoded_stream ds;
+    bool ok = decode(data, size, &ds);
+    if (!ok)
+        fprintf(stderr, "signal %d, %d channel(s), %d frames: stream doesn't decode\n", sig, channels, frames);
+    CHECK(ok);
+    if (ok) {
+        CHECK(ds.freq == TEST_FREQ && ds.channels == channels && ds.total_frames == frames);
+        CHECK(memcmp(ds.samples, in, frames * channels * sizeof(int16)) == 0);
+        CHECK(ds.num_frames == (frames + 4095) / 4096);
+    }
+
+    // Predictable signals are compressed
+    if (frames >= 4096 && (sig == SIG_SILENCE || sig == SIG_SINE || sig == SIG_SIDE))
+        CHECK(size < frames * channels);
+
+    free(ds.samples);
+    free(data);
+    free(in);
+}
+
+static void test_md5()
+{
+    static const uint8 abc_digest[16] = {
+        0x90, 0x01, 0x50, 0x98, 0x3c, 0xd2, 0x4f, 0xb0, 0xd6, 0x96, 0x3f, 0x7d, 0x28, 0xe1, 0x7f, 0x72
+    };
+    md5_t m;
+    uint8 digest[16];
+    md5_init(&m);
+    md5_update(&m, (const uint8 *)"abc", 3);
+    md5_final(&m, digest);
+    CHECK(memcmp(digest, abc_digest, 16) == 0);
+}
+
+static void test_round_trip()
+{
+    static const int lengths[] = {0, 1, 3, 4096, 4097, 44100};
+    int sig, channels, i;
+    for (sig=SIG_SILENCE; sig<=SIG_MIXED; sig++)
+        for (channels=1; channels<=2; channels++)
+            for (i=0; i<6; i++)
+                round_trip(sig, channels, lengths[i]);
+}
+
+int main(int argc, char **argv)
+{
+    TestInit(argv[0]);
+
+    test_md5();
+    test_round_trip();
+
+    return TestExit(argv[0]);
+}
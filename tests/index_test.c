@@ -0,0 +1,217 @@
+/*
+ *  index_test.c - Test of the collection index
+ *
+ *  SIDPlayer (C) Copyright 1996-2004 Christian Bauer
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#include "../sys.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+
+#include "test.h"
+#include "../index.h"
+#include "../main.h"
+#include "../search.h"
+
+
+// Number of files and songs per file of the test records
+#define TEST_FILES 3000
+#define TEST_SONGS 3
+
+static void make_record(index_record *r, int file, int song, float loudness)
+{
+    memset(r, 0, sizeof(index_record));
+    snprintf(r->path, sizeof(r->path), "/collection/dir%d/tune%d.sid", file % 37, file);
+    r->song = song;
+    r->loudness = loudness;
+}
+
+// Records are added once and replaced by records with the same path and song
+static void test_put(const char *file)
+{
+    collection_index *ci = IndexOpen(file);
+    collection_index *other = IndexOpen(file);
+    CHECK(ci != NULL && other != NULL);
+    if (ci == NULL || other == NULL)
+        return;
+
+    index_record r;
+    int i, song;
+    for (i=0; i<TEST_FILES; i++)
+        for (song=1; song<=TEST_SONGS; song++) {
+            make_record(&r, i, song, 1);
+            CHECK(IndexPut(ci, &r));
+        }
+    CHECK(IndexNumRecords(ci) == TEST_FILES * TEST_SONGS);
+
+    for (i=0; i<TEST_FILES; i++) {
+        make_record(&r, i, 2, 2);
+        CHECK(IndexPut(ci, &r));
+    }
+    CHECK(IndexNumRecords(ci) == TEST_FILES * TEST_SONGS);
+
+    // Records added by another process are found, too
+    make_record(&r, TEST_FILES - 1, 3, 3);
+    CHECK(IndexPut(other, &r));
+    make_record(&r, TEST_FILES, 1, 3);
+    CHECK(IndexPut(other, &r));
+    CHECK(IndexPut(ci, &r));
+    CHECK(IndexNumRecords(ci) == TEST_FILES * TEST_SONGS + 1);
+    CHECK(IndexNumRecords(other) == TEST_FILES * TEST_SONGS + 1);
+
+    uint32 n, num = IndexNumRecords(ci);
+    int replaced = 0;
+    for (n=0; n<num; n++) {
+        const index_record *p = IndexRecord(ci, n);
+        float expected = (p->song == 2) ? 2 : 1;
+        if ((p->song == 3 && strstr(p->path, "/tune2999.sid")) || strstr(p->path, "/tune3000.sid"))
+            expected = 3;
+        CHECK(p->loudness == expected);
+        if (p->loudness != 1)
+            replaced++;
+    }
+    CHECK(replaced == TEST_FILES + 2);
+
+    IndexClose(other);
+    IndexClose(ci);
+}
+
+// Records of files are found by their path
+static void test_find(const char *dir, const char *file)
+{
+    collection_index *ci = IndexOpen(file);
+    CHECK(ci != NULL);
+    if (ci == NULL)
+        return;
+
+    char tune[256];
+    snprintf(tune, sizeof(tune), "%s/tune.sid", dir);
+    CHECK(TestWriteSweepPSID(tune));
+    CHECK(IndexFind(ci, tune, 1) == NULL);
+
+    index_record r;
+    char path[PATH_MAX];
+    int64 mtime;
+    uint64 size;
+    CHECK(GetPSIDFileInfo(tune, path, &mtime, &size));
+    CHECK(IndexMakeRecord(&r, path, mtime, size, 1));
+    CHECK(IndexPut(ci, &r));
+    const index_record *p = IndexFind(ci, tune, 1);
+    CHECK(p != NULL && strcmp(p->path, r.path) == 0 && p->song == 1);
+    CHECK(IndexFind(ci, tune, 2) == NULL);
+    IndexClose(ci);
+
+    // Found again after opening the index
+    ci = IndexOpen(file);
+    CHECK(ci != NULL && IndexFind(ci, tune, 1) != NULL);
+    IndexClose(ci);
+}
+
+// Files in zip archives are indexed with the path of the archive
+static void test_archive(const char *dir, const char *file)
+{
+    collection_index *ci = IndexOpen(file);
+    CHECK(ci != NULL);
+    if (ci == NULL)
+        return;
+
+    char tune[256], zip[256], member[300];
+    snprintf(tune, sizeof(tune), "%s/zipped.sid", dir);
+    snprintf(zip, sizeof(zip), "%s/tunes.zip", dir);
+    snprintf(member, sizeof(member), "%s/tunes.zip/sub/zipped.sid", dir);
+    CHECK(TestWriteSweepPSID(tune));
+    size_t length;
+    uint8 *data = ReadPSIDFile(tune, &length);
+    CHECK(data != NULL && TestWriteZip(zip, "sub/zipped.sid", data, length));
+    free(data);
+
+    CHECK(IndexAddFile(ci, member, 0));
+    const index_record *p = IndexFind(ci, member, 1);
+    CHECK(p != NULL);
+    if (p) {
+        char path[PATH_MAX];
+        CHECK(realpath(zip, path) != NULL);
+        strcat(path, "/sub/zipped.sid");
+        CHECK(strcmp(p->path, path) == 0);
+        CHECK(p->size == length);
+    }
+    CHECK(IndexFind(ci, tune, 1) == NULL);
+    IndexClose(ci);
+}
+
+// Search index finds records by name, and corrupt search index files are
+// rejected when opened
+static void test_search(const char *dir)
+{
+    char file[256];
+    snprintf(file, sizeof(file), "%s/search.idx", dir);
+    collection_index *ci = IndexOpen(file);
+    CHECK(ci != NULL);
+    if (ci == NULL)
+        return;
+
+    index_record r;
+    int i;
+    for (i=0; i<100; i++) {
+        make_record(&r, i, 1, 1);
+        snprintf(r.name, sizeof(r.name), "Tune %d", i);
+        CHECK(IndexPut(ci, &r));
+    }
+    CHECK(SearchBuild(ci, file));
+
+    search_index *si = SearchOpen(file);
+    CHECK(si != NULL);
+    if (si) {
+        uint32 num;
+        uint32 *result = SearchFind(si, ci, "une 4", SEARCH_NAME, &num);
+        CHECK(result != NULL && num == 11 && result[0] == 4 && result[1] == 40);
+        free(result);
+        SearchClose(si);
+    }
+
+    // Record list of first trigram beyond end of postings
+    char tri[sizeof(file) + 8];
+    snprintf(tri, sizeof(tri), "%s.tri", file);
+    FILE *f = fopen(tri, "r+b");
+    CHECK(f != NULL);
+    if (f) {
+        uint32 count = 0x10000000;
+        CHECK(fseek(f, 64 + 8, SEEK_SET) == 0 && fwrite(&count, sizeof(count), 1, f) == 1);
+        fclose(f);
+        CHECK(SearchOpen(file) == NULL);
+    }
+    IndexClose(ci);
+}
+
+int main(int argc, char **argv)
+{
+    TestInit(argv[0]);
+
+    const char *dir = TestTempDir();
+    char file[256];
+    snprintf(file, sizeof(file), "%s/test.idx", dir);
+    test_put(file);
+    test_find(dir, file);
+    test_archive(dir, file);
+    test_search(dir);
+
+    TestRemoveDir(dir);
+    return TestExit(argv[0]);
+}
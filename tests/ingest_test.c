@@ -0,0 +1,135 @@
+/*
+ *  ingest_test.c - Test of batched reading of PSID files
+ *
+ *  SIDPlayer (C) Copyright 1996-2004 Christian Bauer
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#include "../sys.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include "test.h"
+#include "../ingest.h"
+
+
+// Number of test files, one in every MISSING_EVERY files is missing
+#define TEST_FILES 500
+#define MISSING_EVERY 50
+
+static char dir[256];
+static pthread_t main_thread;
+
+// State of the function called with the files
+static int next_file;            // Number of file expected next
+static int calls_running;        // Number of calls running at the same time
+static int bad_order, bad_data, bad_thread, overlaps;
+
+static void file_name(char *name, size_t size, int n)
+{
+    if (n == TEST_FILES)
+        snprintf(name, size, "%s/files.zip/zipped.txt", dir);
+    else
+        snprintf(name, size, "%s/file%d.txt", dir, n);
+}
+
+static void check_file(void *arg, const char *file, const uint8 *data, size_t size)
+{
+    if (__sync_add_and_fetch(&calls_running, 1) != 1)
+        overlaps++;
+    if (pthread_equal(pthread_self(), main_thread))
+        bad_thread++;
+
+    int n = next_file++;
+    char name[300], contents[64];
+    file_name(name, sizeof(name), n);
+    if (strcmp(file, name))
+        bad_order++;
+    snprintf(contents, sizeof(contents), "contents of file %d", n);
+    if (n % MISSING_EVERY == 1) {
+        if (data != NULL)
+            bad_data++;
+    } else if (data == NULL || size != strlen(contents) || memcmp(data, contents, size))
+        bad_data++;
+
+    if (n % 7 == 0)
+        usleep(200);        // Slow function, so the reads get ahead
+    __sync_sub_and_fetch(&calls_running, 1);
+}
+
+// Files are passed to the function in the order they were added, one at a
+// time, by another thread
+static void test_order(int depth)
+{
+    ingest *in = IngestNew(depth, check_file, NULL);
+    CHECK(in != NULL);
+    if (in == NULL)
+        return;
+    next_file = 0;
+    bad_order = bad_data = bad_thread = overlaps = 0;
+
+    int n;
+    for (n=0; n<=TEST_FILES; n++) {
+        char name[300];
+        file_name(name, sizeof(name), n);
+        IngestAdd(in, name);
+    }
+    IngestFinish(in);
+
+    CHECK(next_file == TEST_FILES + 1);
+    CHECK(bad_order == 0);
+    CHECK(bad_data == 0);
+    CHECK(bad_thread == 0);
+    CHECK(overlaps == 0);
+}
+
+int main(int argc, char **argv)
+{
+    TestInit(argv[0]);
+    main_thread = pthread_self();
+
+    snprintf(dir, sizeof(dir), "%s", TestTempDir());
+    int n;
+    for (n=0; n<TEST_FILES; n++) {
+        if (n % MISSING_EVERY == 1)
+            continue;
+        char name[300];
+        file_name(name, sizeof(name), n);
+        FILE *f = fopen(name, "w");
+        CHECK(f != NULL);
+        if (f) {
+            fprintf(f, "contents of file %d", n);
+            fclose(f);
+        }
+    }
+
+    // Last file is read from a zip archive
+    char zip[300], contents[64];
+    snprintf(zip, sizeof(zip), "%s/files.zip", dir);
+    snprintf(contents, sizeof(contents), "contents of file %d", TEST_FILES);
+    CHECK(TestWriteZip(zip, "zipped.txt", (const uint8 *)contents, strlen(contents)));
+
+    test_order(1);
+    test_order(8);
+    test_order(256);
+
+    TestRemoveDir(dir);
+    return TestExit(argv[0]);
+}
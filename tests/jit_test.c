@@ -0,0 +1,415 @@
+/*
+ *  jit_test.c - Comparison of translated 6510 code with the interpreter
+ *
+ *  SIDPlayer (C) Copyright 1996-2004 Christian Bauer
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+// The CPU emulation is included to get at the translator state
+#include "../cpu.c"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "test.h"
+#include "../main.h"
+#include "../regstream.h"
+
+
+// Number of generated tunes
+#define TEST_TUNES 24
+
+// Length of recorded register streams (seconds)
+#define TEST_SECONDS 2
+
+// Generated tunes: code at $1000, random data table at $2000..$21ff
+#define TUNE_ORG 0x1000
+#define TUNE_DATA 0x2000
+#define TUNE_SIZE 0x1200
+
+// Loop counter, and copies of A/X/Y/P at the end of the replay routine
+#define TUNE_COUNTER 0x0340
+#define TUNE_REGS 0x0341
+
+
+/*
+ *  Tune generator: the replay routine runs a random loop body 12 times,
+ *  with reads and writes of RAM, zero page, SID/CIA/VIC registers,
+ *  forward branches, decimal mode arithmetic, and stores into the immediate
+ *  operands of later instructions
+ */
+
+typedef struct {
+    uint8 b[20];
+    int len;
+    bool branch;        // Placeholder for forward branch
+} insn;
+
+static uint32 rand_state;
+
+static int rnd(int n)
+{
+    rand_state = rand_state * 1103515245 + 12345;
+    return (rand_state >> 16) % n;
+}
+
+static void put(insn *i, int byte)
+{
+    i->b[i->len++] = byte;
+}
+
+static void put_op(insn *i, int op, int adr, bool abs)
+{
+    put(i, op);
+    put(i, adr & 0xff);
+    if (abs)
+        put(i, adr >> 8);
+}
+
+// Group 1 addressing modes (bits 2..4 of opcode)
+enum { M_INDX, M_ZP, M_IMM, M_ABS, M_INDY, M_ZPX, M_ABSY, M_ABSX };
+
+static bool mode_abs(int mode)
+{
+    return mode == M_ABS || mode == M_ABSY || mode == M_ABSX;
+}
+
+static int read_adr(int mode)
+{
+    static const uint16 io[] = {0xdc04, 0xdc05, 0xdc0d, 0xd011, 0xd012, 0xd41b, 0xd41c};
+    switch (mode) {
+        case M_ZP:
+            return 0x10 + rnd(0x70);
+        case M_INDX:
+        case M_ZPX:
+            return 0x10 + rnd(0xf0);
+        case M_INDY:
+            return rnd(2) ? 0xfb : 0xfd;
+        case M_IMM:
+            return rnd(0x100);
+    }
+    int r = rnd(100);
+    if (r < 10)
+        return io[rnd(sizeof(io) / sizeof(io[0]))];
+    else if (r < 15)
+        return 0xd400 + rnd(0x1d);
+    return TUNE_DATA + rnd(0x100);
+}
+
+static int store_adr(int mode)
+{
+    if (!mode_abs(mode))
+        return mode == M_INDY ? (rnd(3) ? 0xfb : 0xfd) : 0x10 + rnd(0x70);
+    if (rnd(5) == 0)
+        return 0xd400 + rnd(0x19);
+    return TUNE_DATA + rnd(0x100);
+}
+
+static void gen_insn(insn *i)
+{
+    static const uint8 g1_ops[] = {0x00, 0x20, 0x40, 0x60, 0xa0, 0xc0, 0xe0};    // ORA AND EOR ADC LDA CMP SBC
+    static const uint8 sta_modes[] = {M_ZP, M_ABS, M_INDY, M_ZPX, M_ABSY, M_ABSX};
+    static const uint8 rmw_ops[] = {0x06, 0x26, 0x46, 0x66, 0xc6, 0xe6};        // ASL ROL LSR ROR DEC INC
+    static const uint8 implied[] = {0xaa, 0x8a, 0xa8, 0x98, 0xe8, 0xca, 0xc8, 0x88, 0x18, 0x38, 0xb8, 0xea};
+    static const uint8 branches[] = {0x10, 0x30, 0x50, 0x70, 0x90, 0xb0, 0xd0, 0xf0};
+
+    // Other loads, stores, compares: opcode, absolute flag, store flag
+    static const struct { uint8 op; bool abs, store; } xy_ops[] = {
+        {0xa2, false, false}, {0xa6, false, false}, {0xb6, false, false}, {0xae, true, false}, {0xbe, true, false},    // LDX
+        {0xa0, false, false}, {0xa4, false, false}, {0xb4, false, false}, {0xac, true, false}, {0xbc, true, false},    // LDY
+        {0x86, false, true}, {0x96, false, true}, {0x8e, true, true},                                                // STX
+        {0x84, false, true}, {0x94, false, true}, {0x8c, true, true},                                                // STY
+        {0xe0, false, false}, {0xe4, false, false}, {0xec, true, false},                                            // CPX
+        {0xc0, false, false}, {0xc4, false, false}, {0xcc, true, false},                                            // CPY
+        {0x24, false, false}, {0x2c, true, false}                                                                    // BIT
+    };
+
+    i->len = 0;
+    i->branch = false;
+
+    int r = rnd(100);
+    if (r < 35) {
+        int mode = rnd(8);
+        put_op(i, g1_ops[rnd(sizeof(g1_ops))] | mode << 2 | 1, read_adr(mode), mode_abs(mode));
+    } else if (r < 45) {
+        int mode = sta_modes[rnd(sizeof(sta_modes))];
+        put_op(i, 0x81 | mode << 2, store_adr(mode), mode_abs(mode));
+    } else if (r < 55) {
+        int k = rnd(sizeof(xy_ops) / sizeof(xy_ops[0]));
+        int mode = xy_ops[k].abs ? M_ABS : M_ZP;
+        int adr = xy_ops[k].store ? store_adr(mode) : read_adr(mode);
+        if ((xy_ops[k].op & 0x1f) == 0x00 || (xy_ops[k].op & 0x1f) == 0x02)
+            adr = rnd(0x100);    // Immediate
+        put_op(i, xy_ops[k].op, adr, xy_ops[k].abs);
+    } else if (r < 68) {
+        int op = rmw_ops[rnd(sizeof(rmw_ops))];
+        switch (rnd(5)) {
+            case 0:        // Accumulator, or INX/DEX/INY/DEY for DEC/INC
+                if (op == 0xc6 || op == 0xe6)
+                    put(i, implied[4 + rnd(4)]);
+                else
+                    put(i, op + 4);
+                break;
+            case 1:
+                put_op(i, op, 0x10 + rnd(0x70), false);
+                break;
+            case 2:
+                put_op(i, op + 0x10, 0x10 + rnd(0x70), false);
+                break;
+            default:
+                put_op(i, op + (rnd(2) ? 0x08 : 0x18), rnd(10) ? TUNE_DATA + rnd(0x100) : 0xd400 + rnd(0x19), true);
+                break;
+        }
+    } else if (r < 85) {
+        put(i, implied[rnd(sizeof(implied))]);
+    } else if (r < 88) {    // Decimal mode arithmetic
+        put(i, 0xf8);
+        put_op(i, 0x69, rnd(0x100), false);
+        put_op(i, 0xe5, 0x10 + rnd(0x70), false);
+        put(i, 0xd8);
+    } else if (r < 90) {    // Status register to SID
+        put(i, 0x08);
+        put(i, 0x68);
+        put_op(i, 0x8d, 0xd400 + rnd(0x19), true);
+    } else if (r < 95) {
+        int d = TUNE_DATA + rnd(0xf0);
+        switch (rnd(3)) {
+            case 0:        // 16 bit add
+                put(i, rnd(2) ? 0x18 : 0x38);
+                put_op(i, 0xad, d, true);
+                put_op(i, 0x6d, d + 1, true);
+                put_op(i, 0x8d, d + 2, true);
+                put_op(i, 0xad, d + 3, true);
+                put_op(i, 0x69, rnd(0x100), false);
+                put_op(i, 0x8d, d + 4, true);
+                break;
+            case 1:        // Table to SID
+                put_op(i, 0xb9, d, true);
+                put_op(i, 0x9d, 0xd400 + rnd(0x10), true);
+                break;
+            default:    // Indirect table
+                put_op(i, 0xb1, 0xfb, false);
+                put_op(i, 0x91, 0xfb, false);
+                put(i, 0xc8);
+                break;
+        }
+    } else {
+        put(i, branches[rnd(sizeof(branches))]);
+        put(i, 0);
+        i->branch = true;
+    }
+}
+
+// Generate tune into mem (TUNE_SIZE bytes loaded at TUNE_ORG), returns init address
+static uint16 gen_tune(uint32 seed, uint8 *mem)
+{
+    insn body[90];
+    uint16 starts[90];
+    int n, i, p = 0;
+
+    rand_state = seed;
+    memset(mem, 0, TUNE_SIZE);
+
+    // Volume, loop counter
+    static const uint8 head[] = {0xa9, 0x0f, 0x8d, 0x18, 0xd4, 0xa9, 12, 0x8d, TUNE_COUNTER & 0xff, TUNE_COUNTER >> 8};
+    memcpy(mem, head, sizeof(head));
+    p = sizeof(head);
+
+    // Loop starts near the end of a page, so the body crosses it
+    while (((TUNE_ORG + p) & 0xff) != 0xe0)
+        mem[p++] = 0xea;
+    uint16 loop = TUNE_ORG + p;
+
+    // Pointers for (zp),y to data table and SID
+    static const uint8 ptrs[] = {0xa9, 0x00, 0x85, 0xfb, 0xa9, TUNE_DATA >> 8, 0x85, 0xfc, 0xa9, 0x00, 0x85, 0xfd, 0xa9, 0xd4, 0x85, 0xfe};
+    memcpy(mem + p, ptrs, sizeof(ptrs));
+    p += sizeof(ptrs);
+
+    n = 40 + rnd(50);
+    uint16 adr = TUNE_ORG + p;
+    for (i=0; i<n; i++) {
+        gen_insn(body + i);
+        starts[i] = adr;
+        adr += body[i].len;
+    }
+
+    // Forward branches skip up to three instructions
+    for (i=0; i<n; i++) {
+        if (body[i].branch) {
+            int k, dist = 0;
+            int skip = rnd(4);
+            for (k=i+1; k<=i+skip && k<n; k++)
+                dist += body[k].len;
+            body[i].b[1] = dist;
+        }
+    }
+
+    // Some absolute stores and INC/DEC go to immediate operands
+    int imm[90], num_imm = 0;
+    for (i=0; i<n; i++)
+        if (body[i].len == 2 && !body[i].branch && (body[i].b[0] & 0x1f) == 0x09)
+            imm[num_imm++] = i;
+    for (i=0; i<n; i++) {
+        uint8 op = body[i].b[0];
+        if (num_imm && body[i].len == 3 && (op == 0x8d || op == 0xee || op == 0xce) && rnd(10) < 3) {
+            adr = starts[imm[rnd(num_imm)]] + 1;
+            body[i].b[1] = adr & 0xff;
+            body[i].b[2] = adr >> 8;
+        }
+    }
+
+    for (i=0; i<n; i++) {
+        memcpy(mem + p, body[i].b, body[i].len);
+        p += body[i].len;
+    }
+
+    // DEC counter, BNE loop
+    mem[p++] = 0xce; mem[p++] = TUNE_COUNTER & 0xff; mem[p++] = TUNE_COUNTER >> 8;
+    int back = loop - (TUNE_ORG + p + 2);
+    if (back < -128) {
+        mem[p++] = 0xf0; mem[p++] = 3;
+        mem[p++] = 0x4c; mem[p++] = loop & 0xff; mem[p++] = loop >> 8;
+    } else {
+        mem[p++] = 0xd0; mem[p++] = back & 0xff;
+    }
+
+    // Store A/X/Y/P, RTS
+    static const uint8 tail[] = {
+        0x8d, TUNE_REGS & 0xff, TUNE_REGS >> 8,
+        0x8e, (TUNE_REGS + 1) & 0xff, (TUNE_REGS + 1) >> 8,
+        0x8c, (TUNE_REGS + 2) & 0xff, (TUNE_REGS + 2) >> 8,
+        0x08, 0x68,
+        0x8d, (TUNE_REGS + 3) & 0xff, (TUNE_REGS + 3) >> 8,
+        0x60
+    };
+    memcpy(mem + p, tail, sizeof(tail));
+    p += sizeof(tail);
+
+    // Init routine is just RTS
+    uint16 init = TUNE_ORG + p;
+    mem[p++] = 0x60;
+
+    for (i=0; i<0x200; i++)
+        mem[TUNE_DATA - TUNE_ORG + i] = rnd(0x100);
+    return init;
+}
+
+
+/*
+ *  Comparison
+ */
+
+// Result of playing a tune with one engine
+typedef struct {
+    regstream *rs;
+    uint8 ram[RAM_SIZE];
+    int translations;
+} run_result;
+
+// Play song 0 of file with the interpreter or the translator
+static void run(const char *file, bool jit, run_result *res)
+{
+    CPUExit();
+    PrefsReplaceBool("jit", jit);
+    CPUInit();
+
+    CHECK(LoadPSIDFile(file));
+    res->rs = RegStreamRecord(0, TEST_SECONDS);
+    CHECK(res->rs != NULL);
+    memcpy(res->ram, ram, RAM_SIZE);
+#ifdef CPU_JIT
+    res->translations = jit_trans_used;
+#else
+    res->translations = 0;
+#endif
+}
+
+// Compare SID writes (with their cycles), RAM and the registers stored in RAM
+static bool same_result(const run_result *a, const run_result *b)
+{
+    if (a->rs == NULL || b->rs == NULL)
+        return false;
+    uint32 f, num_frames = RegStreamNumFrames(a->rs);
+    if (RegStreamNumFrames(b->rs) != num_frames)
+        return false;
+    for (f=0; f<num_frames; f++) {
+        int i, count_a, count_b;
+        const reg_write *wa = RegStreamFrame(a->rs, f, &count_a);
+        const reg_write *wb = RegStreamFrame(b->rs, f, &count_b);
+        if (count_a != count_b)
+            return false;
+        for (i=0; i<count_a; i++)
+            if (wa[i].cycle != wb[i].cycle || wa[i].reg != wb[i].reg || wa[i].value != wb[i].value)
+                return false;
+    }
+    return memcmp(a->ram, b->ram, RAM_SIZE) == 0;
+}
+
+// Both engines give the same result for a tune
+static void compare_engines(const char *file, bool expect_translation)
+{
+    static run_result interp, jit;
+    run(file, false, &interp);
+    run(file, true, &jit);
+
+    bool same = same_result(&interp, &jit);
+    if (!same)
+        fprintf(stderr, "%s: interpreter and translated code differ\n", file);
+    CHECK(same);
+#ifdef CPU_JIT
+    if (expect_translation)
+        CHECK(jit.translations > 0);
+#endif
+
+    if (interp.rs)
+        RegStreamDelete(interp.rs);
+    if (jit.rs)
+        RegStreamDelete(jit.rs);
+}
+
+static void test_sweep(const char *dir)
+{
+    char file[256];
+    snprintf(file, sizeof(file), "%s/sweep.sid", dir);
+    CHECK(TestWriteSweepPSID(file));
+    compare_engines(file, false);
+}
+
+static void test_generated(const char *dir)
+{
+    static uint8 mem[TUNE_SIZE];
+    char file[256];
+    int i;
+    for (i=0; i<TEST_TUNES; i++) {
+        snprintf(file, sizeof(file), "%s/gen%d.sid", dir, i);
+        uint16 init = gen_tune(i + 1, mem);
+        CHECK(TestWritePSID(file, TUNE_ORG, init, TUNE_ORG, 1, mem, TUNE_SIZE));
+        compare_engines(file, true);
+    }
+}
+
+int main(int argc, char **argv)
+{
+    TestInit(argv[0]);
+
+    const char *dir = TestTempDir();
+    test_sweep(dir);
+    test_generated(dir);
+
+    TestRemoveDir(dir);
+    return TestExit(argv[0]);
+}
@@ -0,0 +1,121 @@
+/*
+ *  loudness_test.c - Test of the loudness meter
+ *
+ *  SIDPlayer (C) Copyright 1996-2004 Christian Bauer
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#include "../sys.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <math.h>
+
+#include "test.h"
+#include "../loudness.h"
+
+
+// Length of test signals (seconds)
+#define TEST_SECONDS 10
+
+// Tolerance of measured loudness and peak (LU/dB)
+#define TOLERANCE 0.1
+
+// Add seconds of 1 kHz sine with given level (dBFS, -HUGE_VAL for silence)
+// to all channels of meter
+static void add_sine(loudness_meter *lm, int freq, int channels, int seconds, double level)
+{
+    int frames = freq * seconds;
+    int16 *buf = malloc(frames * channels * sizeof(int16));
+    double ampl = level == -HUGE_VAL ? 0 : 32767.0 * pow(10.0, level / 20.0);
+    int i, c;
+    for (i=0; i<frames; i++) {
+        int16 x = lrint(ampl * sin(2 * M_PI * 1000.0 * i / freq));
+        for (c=0; c<channels; c++)
+            buf[i * channels + c] = x;
+    }
+    LoudnessAddFrames(lm, buf, frames);
+    free(buf);
+}
+
+// Measure loudness and true peak of sine, returns false on no result
+static bool measure(int freq, int channels, double level, double *loudness, double *peak)
+{
+    loudness_meter *lm = LoudnessNew(freq, channels);
+    CHECK(lm != NULL);
+    if (lm == NULL)
+        return false;
+    add_sine(lm, freq, channels, TEST_SECONDS, level);
+    CHECK(fabs(LoudnessGetDuration(lm) - TEST_SECONDS) < 0.01);
+    bool ok = LoudnessGetResult(lm, loudness, peak);
+    LoudnessDelete(lm);
+    return ok;
+}
+
+// A 1 kHz sine in one channel measures 3.01 LU below its level (BS.1770),
+// the same sine in two channels as much as its level
+static void test_sine()
+{
+    static const int freqs[] = {44100, 48000};
+    int i;
+    for (i=0; i<2; i++) {
+        double loudness, peak;
+        CHECK(measure(freqs[i], 2, -20.0, &loudness, &peak));
+        CHECK(fabs(loudness - -20.0) < TOLERANCE);
+        CHECK(fabs(peak - -20.0) < TOLERANCE);
+
+        CHECK(measure(freqs[i], 1, -20.0, &loudness, &peak));
+        CHECK(fabs(loudness - -23.01) < TOLERANCE);
+
+        CHECK(measure(freqs[i], 2, -6.0, &loudness, &peak));
+        CHECK(fabs(loudness - -6.0) < TOLERANCE);
+        CHECK(fabs(peak - -6.0) < TOLERANCE);
+    }
+}
+
+// Silence gives no result, and is left out by the absolute gate; audio
+// 20 LU below the rest is left out by the relative gate. The 3 overlapping
+// blocks at each transition partly hold the -20 dBFS sine and pass the
+// gates, so 97 full and 6 partial blocks give -20 + 10 * log10(100.015 / 103)
+#define TRANSITION_LOUDNESS -20.13
+
+static void test_gating()
+{
+    double loudness, peak;
+    CHECK(!measure(48000, 2, -HUGE_VAL, &loudness, &peak));
+
+    loudness_meter *lm = LoudnessNew(48000, 2);
+    CHECK(lm != NULL);
+    if (lm == NULL)
+        return;
+    add_sine(lm, 48000, 2, TEST_SECONDS, -HUGE_VAL);
+    add_sine(lm, 48000, 2, TEST_SECONDS, -20.0);
+    add_sine(lm, 48000, 2, TEST_SECONDS, -40.0);
+    CHECK(LoudnessGetResult(lm, &loudness, &peak));
+    CHECK(fabs(loudness - TRANSITION_LOUDNESS) < TOLERANCE);
+    CHECK(fabs(LoudnessGetDuration(lm) - 3 * TEST_SECONDS) < 0.01);
+    LoudnessDelete(lm);
+}
+
+int main(int argc, char **argv)
+{
+    TestInit(argv[0]);
+
+    test_sine();
+    test_gating();
+
+    return TestExit(argv[0]);
+}
@@ -0,0 +1,148 @@
+/*
+ *  pack_test.c - Test of packs of PSID files
+ *
+ *  SIDPlayer (C) Copyright 1996-2004 Christian Bauer
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#include "../sys.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "test.h"
+#include "../main.h"
+#include "../pack.h"
+
+
+// Position of index offset in pack header, size of pack header
+#define INDEX_OFFSET_POS 16
+#define HEADER_SIZE 64
+
+// Build pack of directory with two PSID files and another file
+static bool build_pack(const char *dir, const char *pack)
+{
+    char tunes[256], file[300];
+    snprintf(tunes, sizeof(tunes), "%s/tunes", dir);
+    mkdir(tunes, 0755);
+    snprintf(file, sizeof(file), "%s/a.sid", tunes);
+    if (!TestWriteSweepPSID(file))
+        return false;
+    snprintf(file, sizeof(file), "%s/sub", tunes);
+    mkdir(file, 0755);
+    snprintf(file, sizeof(file), "%s/sub/b.sid", tunes);
+    if (!TestWriteSweepPSID(file))
+        return false;
+    snprintf(file, sizeof(file), "%s/readme.txt", tunes);
+    FILE *f = fopen(file, "w");
+    if (f == NULL)
+        return false;
+    fputs("not a tune\n", f);
+    fclose(f);
+
+    char *paths[] = {tunes};
+    return PackBuild(pack, 1, paths);
+}
+
+// Overwrite bytes of field of first index entry in pack
+static bool patch_entry(const char *pack, int field_pos, const void *data, size_t length)
+{
+    FILE *f = fopen(pack, "r+b");
+    if (f == NULL)
+        return false;
+    uint64 index_offset;
+    bool ok = fseek(f, INDEX_OFFSET_POS, SEEK_SET) == 0 && fread(&index_offset, sizeof(index_offset), 1, f) == 1
+           && fseek(f, index_offset + field_pos, SEEK_SET) == 0 && fwrite(data, 1, length, f) == length;
+    return fclose(f) == 0 && ok;
+}
+
+// Files are found by their path relative to the packed directory
+static void test_find(const char *dir, const char *pack)
+{
+    CHECK(build_pack(dir, pack));
+    psid_pack *p = PackOpen(pack);
+    CHECK(p != NULL);
+    if (p == NULL)
+        return;
+
+    CHECK(PackNumEntries(p) == 2);
+    char file[300];
+    snprintf(file, sizeof(file), "%s/tunes/sub/b.sid", dir);
+    size_t length;
+    uint8 *data = ReadPSIDFile(file, &length);
+    CHECK(data != NULL);
+    const pack_entry *e = PackFind(p, "sub/b.sid");
+    CHECK(e != NULL);
+    if (data && e) {
+        CHECK(e->length == length && memcmp(PackEntryData(p, e), data, length) == 0);
+        CHECK(strcmp(PackEntryPath(p, e), "sub/b.sid") == 0);
+    }
+    free(data);
+    CHECK(PackFind(p, "a.sid") != NULL);
+    CHECK(PackFind(p, "readme.txt") == NULL);
+    CHECK(PackFind(p, "b.sid") == NULL);
+
+    uint32 n;
+    for (n=0; n<PackNumEntries(p); n++) {
+        e = PackEntry(p, n);
+        CHECK(PackFind(p, PackEntryPath(p, e)) == e);
+    }
+    PackClose(p);
+}
+
+// Packs with file data or paths of entries outside of the pack are rejected
+static void test_corrupt(const char *dir, const char *pack)
+{
+    uint64 offset = 0x7fffffff;
+    CHECK(build_pack(dir, pack) && patch_entry(pack, 8, &offset, sizeof(offset)));
+    CHECK(PackOpen(pack) == NULL);
+
+    uint32 length = 0xfffff000;
+    CHECK(build_pack(dir, pack) && patch_entry(pack, 16, &length, sizeof(length)));
+    CHECK(PackOpen(pack) == NULL);
+
+    uint32 path = 0x10000;
+    CHECK(build_pack(dir, pack) && patch_entry(pack, 20, &path, sizeof(path)));
+    CHECK(PackOpen(pack) == NULL);
+
+    // Last path in string table without terminating 0
+    struct stat st;
+    CHECK(build_pack(dir, pack) && stat(pack, &st) == 0 && truncate(pack, st.st_size - 1) == 0);
+    CHECK(PackOpen(pack) == NULL);
+
+    // Unchanged pack is accepted again
+    CHECK(build_pack(dir, pack));
+    psid_pack *p = PackOpen(pack);
+    CHECK(p != NULL);
+    PackClose(p);
+}
+
+int main(int argc, char **argv)
+{
+    TestInit(argv[0]);
+
+    const char *dir = TestTempDir();
+    char pack[256];
+    snprintf(pack, sizeof(pack), "%s/test.pack", dir);
+    test_find(dir, pack);
+    test_corrupt(dir, pack);
+
+    TestRemoveDir(dir);
+    return TestExit(argv[0]);
+}
@@ -0,0 +1,124 @@
+/*
+ *  regdump_test.c - Test of register dumps
+ *
+ *  SIDPlayer (C) Copyright 1996-2004 Christian Bauer
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#include "../sys.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "test.h"
+#include "../main.h"
+#include "../regdump.h"
+
+
+// Number of dumped frames
+#define TEST_FRAMES 50
+
+// Size of binary dump header
+#define HEADER_SIZE 124
+
+// Dump song 0 of tune to temporary file, returns file positioned at start
+static FILE *dump(const char *file, bool binary)
+{
+    CHECK(LoadPSIDFile(file));
+    FILE *f = tmpfile();
+    CHECK(f != NULL);
+    if (f == NULL)
+        return NULL;
+    CHECK(RegDumpSong(f, 0, TEST_FRAMES, binary));
+    rewind(f);
+    return f;
+}
+
+// The sweep tune sets up voice 1 in the init routine, and the replay
+// routine writes the frame number (1-based) to the frequency high byte
+static void test_text(const char *file)
+{
+    FILE *f = dump(file, false);
+    if (f == NULL)
+        return;
+
+    static const char *expected[] = {
+        "| Frame | Freq Note/Abs WF ADSR Pul | Freq Note/Abs WF ADSR Pul | Freq Note/Abs WF ADSR Pul | FCut RC Typ V |\n",
+        "+-------+---------------------------+---------------------------+---------------------------+---------------+\n",
+        "|     0 | 0111  C-0 80  21 09F0 000 | 0000  ... ..  00 0000 000 | 0000  ... ..  00 0000 000 | 0000 00 Off F |\n",
+        "|     1 | 0211  B-0 8B  .. .... ... | ....  ... ..  .. .... ... | ....  ... ..  .. .... ... | .... .. ... . |\n"
+    };
+    char line[256];
+    int i;
+    for (i=0; i<4; i++) {
+        CHECK(fgets(line, sizeof(line), f) != NULL);
+        CHECK(strcmp(line, expected[i]) == 0);
+    }
+
+    // One line per frame
+    int lines = 4;
+    while (fgets(line, sizeof(line), f))
+        lines++;
+    CHECK(lines == TEST_FRAMES + 2);
+    fclose(f);
+}
+
+static void test_binary(const char *file)
+{
+    FILE *f = dump(file, true);
+    if (f == NULL)
+        return;
+
+    uint8 h[HEADER_SIZE];
+    static uint8 columns[REGDUMP_REGS][TEST_FRAMES];
+    CHECK(fread(h, 1, sizeof(h), f) == sizeof(h));
+    CHECK(fread(columns, 1, sizeof(columns), f) == sizeof(columns));
+    CHECK(fgetc(f) == EOF);
+    fclose(f);
+
+    CHECK(memcmp(h, "TSIDRD", 6) == 0);
+    CHECK(h[6] == 1);
+    CHECK(h[8] == 1 && h[9] == 0);
+    CHECK((h[16] | h[17] << 8) == TEST_FRAMES && h[18] == 0 && h[19] == 0);
+    CHECK(h[20] == REGDUMP_REGS && h[21] == 0);
+    CHECK(strcmp((char *)h + 28, "Test") == 0);
+
+    int frame;
+    for (frame=0; frame<TEST_FRAMES; frame++) {
+        CHECK(columns[0x00][frame] == 0x11);
+        CHECK(columns[0x01][frame] == frame + 1);
+        CHECK(columns[0x04][frame] == 0x21);
+        CHECK(columns[0x05][frame] == 0x09);
+        CHECK(columns[0x06][frame] == 0xf0);
+        CHECK(columns[0x18][frame] == 0x0f);
+    }
+}
+
+int main(int argc, char **argv)
+{
+    TestInit(argv[0]);
+
+    const char *dir = TestTempDir();
+    char file[256];
+    snprintf(file, sizeof(file), "%s/sweep.sid", dir);
+    CHECK(TestWriteSweepPSID(file));
+    test_text(file);
+    test_binary(file);
+
+    TestRemoveDir(dir);
+    return TestExit(argv[0]);
+}
@@ -0,0 +1,395 @@
+/*
+ *  server_test.c - Test of the streaming server with local clients
+ *
+ *  SIDPlayer (C) Copyright 1996-2004 Christian Bauer
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+// The server is included to get at its internals
+#include "../server.c"
+
+#include <dirent.h>
+#include <sys/time.h>
+#include <sys/stat.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "test.h"
+
+
+// Number of render blocks compared with the direct rendering
+#define TEST_BLOCKS 8
+
+// Address and port of server
+static char server_address[32];
+static int server_port;
+
+// Tune played by the tests, and its audio rendered without the server
+static char tune_file[256];
+static uint8 *reference;
+static int reference_bytes;
+
+// Register stream exported from the tune, and its audio
+static char reg_file[256];
+static uint8 *reg_reference;
+
+
+/*
+ *  Client side
+ */
+
+// Connect to server and send request line, returns socket or -1 on error
+static int connect_request(const char *request)
+{
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (fd < 0)
+        return -1;
+    struct timeval tv = {5, 0};
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+
+    struct sockaddr_in sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sin_family = AF_INET;
+    sa.sin_port = htons(server_port);
+    sa.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    int tries;
+    for (tries = 0; connect(fd, (struct sockaddr *)&sa, sizeof(sa)) < 0; tries++) {
+        if (tries == 100) {
+            close(fd);
+            return -1;
+        }
+        close(fd);
+        Delay_usec(20000);        // Server not yet listening
+        fd = socket(AF_INET, SOCK_STREAM, 0);
+        setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+    }
+
+    char line[MAX_REQUEST_LENGTH];
+    snprintf(line, sizeof(line), "%s\n", request);
+    if (send(fd, line, strlen(line), 0) != (ssize_t)strlen(line)) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+// Receive up to length bytes, returns number of bytes received before the
+// connection was closed or the timeout expired
+static int receive(int fd, uint8 *buf, int length)
+{
+    int total = 0;
+    while (total < length) {
+        ssize_t actual = recv(fd, buf + total, length - total, 0);
+        if (actual <= 0)
+            break;
+        total += actual;
+    }
+    return total;
+}
+
+
+/*
+ *  Server side
+ */
+
+static void *server_thread(void *arg)
+{
+    return (void *)(intptr_t)ServerRun(server_address);
+}
+
+static pthread_t start_server()
+{
+    pthread_t t;
+    quit_server = false;
+    pthread_create(&t, NULL, server_thread, NULL);
+    return t;
+}
+
+static void stop_server(pthread_t t)
+{
+    void *ret;
+    quit_server = true;
+    while (wake_fd < 0)
+        Delay_usec(1000);
+    wake_event_loop();
+    pthread_join(t, &ret);
+    CHECK(ret == NULL);
+    wake_fd = -1;
+}
+
+// Count entries of render cache directory
+static int cache_files(const char *dir)
+{
+    int n = 0;
+    DIR *d = opendir(dir);
+    if (d == NULL)
+        return 0;
+    struct dirent *de;
+    while ((de = readdir(d)) != NULL)
+        if (de->d_name[0] != '.')
+            n++;
+    closedir(d);
+    return n;
+}
+
+
+/*
+ *  Tests
+ */
+
+// Start stream of request line on a client without connection (the server
+// must not be running), returns true if the stream was admitted
+static bool admit_request(const char *request)
+{
+    client_t *c = calloc(1, sizeof(client_t));
+    c->fd = -1;
+    strcpy(c->request, request);
+    c->next = clients;
+    clients = c;
+    c->streaming = true;
+    start_stream(c);
+    return !c->finished;
+}
+
+// Delete all clients and channels created by admit_request()
+static void delete_requests()
+{
+    while (clients) {
+        client_t *c = clients;
+        if (c->channel && --c->channel->listeners == 0) {
+            c->channel->queued = false;
+            close_channel(c->channel);
+        }
+        delete_client(c);
+    }
+    job_head = job_tail = NULL;
+    channel_job_head = channel_job_tail = NULL;
+}
+
+// Streams are admitted until their estimated loads add up to exactly the
+// maximum load
+static void test_admission()
+{
+    max_load = 5 * DEFAULT_LOAD;
+    buf_size = SMALL_BUFFER_SIZE;
+    ring_size = 1;
+
+    // Private streams of unknown tunes
+    char request[64];
+    int i;
+    for (i=0; i<5; i++) {
+        sprintf(request, "tune%d.sid", i);
+        CHECK(admit_request(request));
+    }
+    CHECK(!admit_request("tune5.sid"));
+    CHECK(total_load() <= max_load + 1e-9);
+    delete_requests();
+
+    // Measured streams, new streams get the load of the same tune or the
+    // average of all measured streams
+    CHECK(admit_request("measured.sid"));
+    clients->cost.measured = true;
+    clients->cost.load = DEFAULT_LOAD / 2;
+    for (i=1; i<10; i++)
+        CHECK(admit_request((i & 1) ? "measured.sid" : "other.sid"));
+    CHECK(!admit_request("measured.sid"));
+    CHECK(!admit_request("other.sid"));
+    delete_requests();
+
+    // Channels are admitted once, further listeners need no emulator time
+    for (i=0; i<4; i++) {
+        sprintf(request, "tune%d.sid", i);
+        CHECK(admit_request(request));
+    }
+    CHECK(admit_request("BROADCAST channel.sid"));
+    CHECK(!admit_request("BROADCAST another.sid"));
+    CHECK(admit_request("BROADCAST channel.sid"));
+    CHECK(channels && channels->listeners == 2 && channels->next == NULL);
+    delete_requests();
+    CHECK(channels == NULL);
+
+    max_load = 0;
+}
+
+// Render audio of PSID file or register stream directly, in blocks like the
+// server, returns new buffer of reference_bytes
+static uint8 *render_reference(const char *file)
+{
+    int freq, bits, channels;
+    SIDGetAudioFormat(&freq, &bits, &channels);
+    int block = RENDER_FRAMES * channels * bits / 8;
+    reference_bytes = block * TEST_BLOCKS;
+    uint8 *buf = malloc(reference_bytes);
+
+    regstream *rs = NULL;
+    if (!LoadPSIDFile(file)) {
+        rs = RegStreamLoad(file);
+        CHECK(rs != NULL);
+        SIDPlayRegStream(rs);
+    }
+    SIDAdjustSpeed(PrefsFindInt32("speed"));
+    int i;
+    for (i=0; i<TEST_BLOCKS; i++)
+        SIDCalcBuffer(buf + i * block, block);
+    SIDPlayRegStream(NULL);
+    RegStreamDelete(rs);
+    return buf;
+}
+
+// Start private stream of file, returns socket after the WAV header
+static int open_stream(const char *file)
+{
+    char request[512];
+    snprintf(request, sizeof(request), "%s 1 wav", file);
+    int fd = connect_request(request);
+    CHECK(fd >= 0);
+    if (fd < 0)
+        return -1;
+
+    uint8 header[WAV_HEADER_LENGTH];
+    CHECK(receive(fd, header, WAV_HEADER_LENGTH) == WAV_HEADER_LENGTH);
+    CHECK(memcmp(header, "RIFF", 4) == 0 && memcmp(header + 8, "WAVEfmt ", 8) == 0);
+    return fd;
+}
+
+// Receive audio of streams in turns and compare it with the direct
+// renderings, so the server switches between their contexts
+static void compare_streams(int n, const int *fds, uint8 *const *refs, const char *what)
+{
+    int part = reference_bytes / TEST_BLOCKS / 4;
+    uint8 *audio = malloc(part);
+    int i, pos;
+    bool same = true;
+    for (pos = 0; pos < reference_bytes; pos += part)
+        for (i=0; i<n; i++) {
+            if (fds[i] < 0)
+                continue;
+            CHECK(receive(fds[i], audio, part) == part);
+            if (memcmp(audio, refs[i] + pos, part) != 0)
+                same = false;
+        }
+    if (!same) {
+        fprintf(stderr, "%s: streamed audio differs from direct rendering\n", what);
+        test_failures++;
+    }
+    free(audio);
+    for (i=0; i<n; i++)
+        if (fds[i] >= 0)
+            close(fds[i]);
+}
+
+// Stream the tune twice: the second stream must be played from the cache
+// entry written by the first one, which is finished after disconnecting
+static void test_cached_stream(const char *cache_dir)
+{
+    int fd = open_stream(tune_file);
+    compare_streams(1, &fd, &reference, "first stream");
+
+    uint64 start = GetTicks_usec();
+    while (cache_files(cache_dir) == 0 && GetTicks_usec() - start < 5000000)
+        Delay_usec(10000);
+    CHECK(cache_files(cache_dir) > 0);
+
+    fd = open_stream(tune_file);
+    compare_streams(1, &fd, &reference, "cached stream");
+}
+
+// Streams of register streams and a PSID file rendered side by side each
+// continue with their own register stream after a context switch
+static void test_regstream_streams()
+{
+    int fds[3];
+    uint8 *refs[3] = {reg_reference, reference, reg_reference};
+    fds[0] = open_stream(reg_file);
+    fds[1] = open_stream(tune_file);
+    fds[2] = open_stream(reg_file);
+    compare_streams(3, fds, refs, "register streams");
+}
+
+// Two listeners of a broadcast channel both get the stream
+static void test_broadcast()
+{
+    char request[512];
+    snprintf(request, sizeof(request), "BROADCAST %s", tune_file);
+    int fd1 = connect_request(request);
+    int fd2 = connect_request(request);
+    CHECK(fd1 >= 0 && fd2 >= 0);
+
+    uint8 buf[WAV_HEADER_LENGTH + 4096];
+    CHECK(receive(fd1, buf, sizeof(buf)) == sizeof(buf));
+    CHECK(memcmp(buf, "RIFF", 4) == 0);
+    CHECK(receive(fd2, buf, sizeof(buf)) == sizeof(buf));
+    CHECK(memcmp(buf, "RIFF", 4) == 0);
+    close(fd1);
+    close(fd2);
+}
+
+// Listeners of a channel whose tune can't be loaded get an error and are
+// disconnected, and the failed channel doesn't block later requests
+static void test_broadcast_error(const char *dir)
+{
+    char request[512];
+    snprintf(request, sizeof(request), "BROADCAST %s/missing.sid", dir);
+    int i;
+    for (i=0; i<2; i++) {
+        int fd = connect_request(request);
+        CHECK(fd >= 0);
+        char buf[1024];
+        int actual = receive(fd, (uint8 *)buf, sizeof(buf) - 1);
+        CHECK(actual < (int)sizeof(buf) - 1);        // Connection closed
+        buf[actual > 0 ? actual : 0] = 0;
+        CHECK(strncmp(buf, "ERROR", 5) == 0);
+        close(fd);
+    }
+    pthread_mutex_lock(&server_lock);
+    CHECK(channels == NULL);
+    pthread_mutex_unlock(&server_lock);
+}
+
+int main(int argc, char **argv)
+{
+    TestInit(argv[0]);
+    test_admission();
+
+    const char *dir = TestTempDir();
+    char cache_dir[256];
+    snprintf(tune_file, sizeof(tune_file), "%s/sweep.sid", dir);
+    snprintf(cache_dir, sizeof(cache_dir), "%s/cache", dir);
+    mkdir(cache_dir, 0755);
+    CHECK(TestWriteSweepPSID(tune_file));
+    reference = render_reference(tune_file);
+    snprintf(reg_file, sizeof(reg_file), "%s/sweep.rs", dir);
+    CHECK(LoadPSIDFile(tune_file));
+    CHECK(RegStreamExport(reg_file, 0, 2, false));
+    reg_reference = render_reference(reg_file);
+
+    server_port = 20000 + getpid() % 20000;
+    snprintf(server_address, sizeof(server_address), "127.0.0.1:%d", server_port);
+    PrefsReplaceString("cachedir", cache_dir, 0);
+    PrefsReplaceInt32("renderthreads", 2);
+
+    pthread_t t = start_server();
+    test_cached_stream(cache_dir);
+    test_regstream_streams();
+    test_broadcast();
+    test_broadcast_error(dir);
+    stop_server(t);
+
+    free(reference);
+    free(reg_reference);
+    TestRemoveDir(dir);
+    return TestExit(argv[0]);
+}
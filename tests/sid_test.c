@@ -0,0 +1,213 @@
+/*
+ *  sid_test.c - Test of the SID emulation
+ *
+ *  SIDPlayer (C) Copyright 1996-2004 Christian Bauer
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#include "../sys.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "test.h"
+#include "../main.h"
+#include "../mem.h"
+#include "../prefs.h"
+#include "../sid.h"
+
+
+// Length of rendered audio (seconds)
+#define TEST_SECONDS 5
+
+// Tune with notes separated by silence: filtered noise on voice 1, and
+// pulse wave on voice 3 synced to voice 2
+static const uint8 gap_tune[] = {
+    // Init at $1000
+    0xa9, 0x1f, 0x8d, 0x18, 0xd4,    // lda #$1f, sta $d418 (lowpass, volume 15)
+    0xa9, 0xf1, 0x8d, 0x17, 0xd4,    // lda #$f1, sta $d417 (resonance, filter voice 1)
+    0xa9, 0x40, 0x8d, 0x16, 0xd4,    // lda #$40, sta $d416
+    0xa9, 0x40, 0x8d, 0x01, 0xd4,    // lda #$40, sta $d401
+    0xa9, 0xf0, 0x8d, 0x06, 0xd4,    // lda #$f0, sta $d406
+    0xa9, 0x07, 0x8d, 0x08, 0xd4,    // lda #$07, sta $d408
+    0xa9, 0x20, 0x8d, 0x0b, 0xd4,    // lda #$20, sta $d40b
+    0xa9, 0x11, 0x8d, 0x0f, 0xd4,    // lda #$11, sta $d40f
+    0xa9, 0x08, 0x8d, 0x11, 0xd4,    // lda #$08, sta $d411
+    0xa9, 0xf0, 0x8d, 0x14, 0xd4,    // lda #$f0, sta $d414
+    0x60,                            // rts
+
+    // Play at $1033: notes on in frame 0, off in frame 4 of every 16
+    0xe6, 0xfb,                        // inc $fb
+    0xa5, 0xfb,                        // lda $fb
+    0x29, 0x0f,                        // and #$0f
+    0xd0, 0x0b,                        // bne off
+    0xa9, 0x81, 0x8d, 0x04, 0xd4,    // lda #$81, sta $d404
+    0xa9, 0x43, 0x8d, 0x12, 0xd4,    // lda #$43, sta $d412
+    0x60,                            // rts
+    0xc9, 0x04,                        // off: cmp #$04
+    0xd0, 0x0a,                        // bne done
+    0xa9, 0x80, 0x8d, 0x04, 0xd4,    // lda #$80, sta $d404
+    0xa9, 0x42, 0x8d, 0x12, 0xd4,    // lda #$42, sta $d412
+    0x60                            // done: rts
+};
+
+// Tune with a note that decays to zero sustain level, then sustain level
+// raised in frame 16 (the envelope jumps to it without a new gate)
+static const uint8 sustain_tune[] = {
+    // Init at $1000
+    0xa9, 0x0f, 0x8d, 0x18, 0xd4,    // lda #$0f, sta $d418
+    0xa9, 0x00, 0x8d, 0x05, 0xd4,    // lda #$00, sta $d405
+    0xa9, 0x00, 0x8d, 0x06, 0xd4,    // lda #$00, sta $d406
+    0xa9, 0x20, 0x8d, 0x01, 0xd4,    // lda #$20, sta $d401
+    0xa9, 0x21, 0x8d, 0x04, 0xd4,    // lda #$21, sta $d404
+    0x60,                            // rts
+
+    // Play at $101a
+    0xe6, 0xfb,                        // inc $fb
+    0xa5, 0xfb,                        // lda $fb
+    0xc9, 0x10,                        // cmp #$10
+    0xd0, 0x05,                        // bne done
+    0xa9, 0xf0, 0x8d, 0x06, 0xd4,    // lda #$f0, sta $d406
+    0x60                            // done: rts
+};
+
+static int silence_starts;
+
+static void count_silence(void *arg, int event, int frame)
+{
+    if (event == SID_SILENCE_START)
+        silence_starts++;
+}
+
+// Render tune, returns new buffer of length bytes
+static uint8 *render(const char *file, int length)
+{
+    uint8 *buf = malloc(length);
+    CHECK(LoadPSIDFile(file));
+    SIDSetSilenceHook(count_silence, NULL, 0);
+    SIDCalcBuffer(buf, length);
+    SIDSetSilenceHook(NULL, NULL, 0);
+    return buf;
+}
+
+// Render tune with and without skipping silence, returns number of
+// silence starts
+static int compare_skip(const char *file, const uint8 *tune, size_t size, uint16 play_adr)
+{
+    CHECK(TestWritePSID(file, 0x1000, 0x1000, play_adr, 1, tune, size));
+
+    int freq, bits, channels;
+    SIDGetAudioFormat(&freq, &bits, &channels);
+    int length = TEST_SECONDS * freq * channels * bits / 8;
+
+    PrefsReplaceBool("skipsilence", false);
+    uint8 *full = render(file, length);
+    silence_starts = 0;
+    PrefsReplaceBool("skipsilence", true);
+    uint8 *skipped = render(file, length);
+    PrefsReplaceBool("skipsilence", false);
+
+    CHECK(memcmp(full, skipped, length) == 0);
+    free(full);
+    free(skipped);
+    return silence_starts;
+}
+
+// Skipping the synthesis of silent SIDs doesn't change the output: the
+// voices keep running, and the filter decays
+static void test_skip_silence(const char *dir)
+{
+    char file[256];
+    snprintf(file, sizeof(file), "%s/gaps.sid", dir);
+    CHECK(compare_skip(file, gap_tune, sizeof(gap_tune), 0x1033) >= TEST_SECONDS * 50 / 16 - 1);
+
+    // Silence ends by raising the sustain level
+    snprintf(file, sizeof(file), "%s/sustain.sid", dir);
+    CHECK(compare_skip(file, sustain_tune, sizeof(sustain_tune), 0x101a) == 1);
+}
+
+// Tune reading the voice 3 oscillator twice per call, 15440 cycles apart:
+// sawtooth at $0333 on voice 3 (with the control register value patched
+// in at V3_CTRL), and voice 2 at $1a00 to sync it to
+#define V3_CTRL 21
+static uint8 v3_tune[] = {
+    // Init at $1000
+    0xa9, 0x33, 0x8d, 0x0e, 0xd4,    // lda #$33, sta $d40e
+    0xa9, 0x03, 0x8d, 0x0f, 0xd4,    // lda #$03, sta $d40f
+    0xa9, 0x00, 0x8d, 0x07, 0xd4,    // lda #$00, sta $d407
+    0xa9, 0x1a, 0x8d, 0x08, 0xd4,    // lda #$1a, sta $d408
+    0xa9, 0x20, 0x8d, 0x12, 0xd4,    // lda #ctrl, sta $d412
+    0x60,                            // rts
+
+    // Play at $101a
+    0xad, 0x1b, 0xd4, 0x85, 0xfc,    // lda $d41b, sta $fc
+    0xa2, 0x0c,                        // ldx #$0c
+    0xa0, 0x00,                        // outer: ldy #$00
+    0x88, 0xd0, 0xfd,                // inner: dey, bne inner
+    0xca, 0xd0, 0xf8,                // dex, bne outer
+    0xad, 0x1b, 0xd4, 0x85, 0xfd,    // lda $d41b, sta $fd
+    0x60                            // rts
+};
+
+// Play tune with voice 3 control register value ctrl for a few frames,
+// returns the two readouts of the last call
+static void read_v3(const char *dir, uint8 ctrl, uint8 *first, uint8 *second)
+{
+    char file[256];
+    snprintf(file, sizeof(file), "%s/v3.sid", dir);
+    v3_tune[V3_CTRL] = ctrl;
+    CHECK(TestWritePSID(file, 0x1000, 0x1000, 0x101a, 1, v3_tune, sizeof(v3_tune)));
+
+    int freq, bits, channels;
+    SIDGetAudioFormat(&freq, &bits, &channels);
+    int length = freq / 10 * channels * bits / 8;
+    uint8 *buf = malloc(length);
+    CHECK(LoadPSIDFile(file));
+    SIDCalcBuffer(buf, length);
+    free(buf);
+
+    *first = ram[0xfc];
+    *second = ram[0xfd];
+}
+
+// Voice 3 readout follows the oscillator within a replay call: it advances
+// by the frequency times the elapsed cycles, and is reset by hard sync
+static void test_v3_readout(const char *dir)
+{
+    uint8 first, second;
+    read_v3(dir, 0x20, &first, &second);
+    int expected = (0x333 * 15440) >> 16;
+    int delta = (uint8)(second - first);
+    CHECK(delta >= expected - 1 && delta <= expected + 1);
+
+    // Voice 2 wraps every 2520 cycles and restarts voice 3 each time
+    read_v3(dir, 0x22, &first, &second);
+    CHECK(first <= (0x333 * 2520) >> 16);
+    CHECK(second <= (0x333 * 2520) >> 16);
+}
+
+int main(int argc, char **argv)
+{
+    TestInit(argv[0]);
+
+    const char *dir = TestTempDir();
+    test_skip_silence(dir);
+    test_v3_readout(dir);
+
+    TestRemoveDir(dir);
+    return TestExit(argv[0]);
+}
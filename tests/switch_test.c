@@ -0,0 +1,131 @@
+/*
+ *  switch_test.c - Test of switching songs
+ *
+ *  SIDPlayer (C) Copyright 1996-2004 Christian Bauer
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#include "../sys.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/wait.h>
+
+#include "test.h"
+#include "../main.h"
+#include "../sid.h"
+
+
+// Number of songs of test tune
+#define TEST_SONGS 4
+
+// Tune with a different note in every song; the replay routine counts
+// frames in $fc, which the init routine doesn't reset, so a song selected
+// after playing another one sounds different than right after loading
+static const uint8 song_tune[] = {
+    // Init at $1000
+    0x0a, 0x0a, 0x0a,                // asl, asl, asl
+    0x18, 0x69, 0x08,                // clc, adc #$08
+    0x85, 0xfb,                        // sta $fb
+    0x8d, 0x01, 0xd4,                // sta $d401
+    0xa9, 0x0f, 0x8d, 0x18, 0xd4,    // lda #$0f, sta $d418
+    0xa9, 0x09, 0x8d, 0x05, 0xd4,    // lda #$09, sta $d405
+    0xa9, 0xf0, 0x8d, 0x06, 0xd4,    // lda #$f0, sta $d406
+    0xa9, 0x21, 0x8d, 0x04, 0xd4,    // lda #$21, sta $d404
+    0x60,                            // rts
+
+    // Play at $101e
+    0xe6, 0xfc,                        // inc $fc
+    0xa5, 0xfc,                        // lda $fc
+    0x18,                            // clc
+    0x65, 0xfb,                        // adc $fb
+    0x8d, 0x00, 0xd4,                // sta $d400
+    0x60                            // rts
+};
+
+// Render one second of the current song, returns new buffer of length bytes
+static uint8 *render(int *length)
+{
+    int freq, bits, channels;
+    SIDGetAudioFormat(&freq, &bits, &channels);
+    *length = freq * channels * bits / 8;
+    uint8 *buf = malloc(*length);
+    SIDCalcBuffer(buf, *length);
+    return buf;
+}
+
+// Switching to a song prepared in the background gives the same audio as
+// selecting it right after loading the file, whatever was played before
+static void test_prepared(const char *file)
+{
+    uint8 *reference[TEST_SONGS];
+    int song, length;
+    for (song=0; song<TEST_SONGS; song++) {
+        CHECK(LoadPSIDFile(file));
+        SelectSong(song);
+        reference[song] = render(&length);
+    }
+
+    CHECK(LoadPSIDFile(file));
+    CHECK(number_of_songs == TEST_SONGS);
+    PrepareSongs(file);
+
+    // Wait until all background processes are done (without reaping them,
+    // SwitchSong() does that)
+    siginfo_t info;
+    while (waitid(P_ALL, 0, &info, WEXITED | WNOWAIT) == 0)
+        SwitchSong(0);
+
+    // Play the songs in an order different from the preparation
+    static const int order[] = {2, 0, 3, 1, 2};
+    int i;
+    for (i=0; i<5; i++) {
+        song = order[i];
+        SwitchSong(song);
+        CHECK(current_song == song);
+        uint8 *buf = render(&length);
+        CHECK(memcmp(buf, reference[song], length) == 0);
+        free(buf);
+    }
+
+    // Without prepared states, switching runs the init routine in the
+    // current state, which differs
+    CHECK(LoadPSIDFile(file));
+    uint8 *buf = render(&length);
+    free(buf);
+    SwitchSong(1);
+    buf = render(&length);
+    CHECK(memcmp(buf, reference[1], length) != 0);
+    free(buf);
+
+    for (song=0; song<TEST_SONGS; song++)
+        free(reference[song]);
+}
+
+int main(int argc, char **argv)
+{
+    TestInit(argv[0]);
+
+    const char *dir = TestTempDir();
+    char file[256];
+    snprintf(file, sizeof(file), "%s/songs.sid", dir);
+    CHECK(TestWritePSID(file, 0x1000, 0x1000, 0x101e, TEST_SONGS, song_tune, sizeof(song_tune)));
+    test_prepared(file);
+
+    TestRemoveDir(dir);
+    return TestExit(argv[0]);
+}
@@ -0,0 +1,220 @@
+/*
+ *  test.c - Helpers for the test programs
+ *
+ *  SIDPlayer (C) Copyright 1996-2004 Christian Bauer
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#include "../sys.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <sys/time.h>
+
+#include "test.h"
+#include "../main.h"
+
+int test_failures = 0;
+
+
+/*
+ *  Timing functions (main_sdl.c is not linked into the test programs)
+ */
+
+uint64 GetTicks_usec()
+{
+    struct timeval t;
+    gettimeofday(&t, NULL);
+    return t.tv_sec * 1000000 + t.tv_usec;
+}
+
+void Delay_usec(uint32 usec)
+{
+    usleep(usec);
+}
+
+
+/*
+ *  Init/exit emulator
+ */
+
+void TestInit(const char *prg_name)
+{
+    int argc = 1;
+    char *argv[] = {(char *)prg_name, NULL};
+    InitAll(&argc, argv);
+}
+
+int TestExit(const char *prg_name)
+{
+    ExitAll();
+    if (test_failures) {
+        fprintf(stderr, "%s: %d check(s) failed\n", prg_name, test_failures);
+        return 1;
+    }
+    printf("%s: all checks passed\n", prg_name);
+    return 0;
+}
+
+
+/*
+ *  Temporary files
+ */
+
+const char *TestTempDir()
+{
+    static char dir[64];
+    strcpy(dir, "/tmp/tinysid-test-XXXXXX");
+    if (mkdtemp(dir) == NULL) {
+        perror("mkdtemp");
+        exit(1);
+    }
+    return dir;
+}
+
+void TestRemoveDir(const char *dir)
+{
+    DIR *d = opendir(dir);
+    if (d == NULL)
+        return;
+    struct dirent *de;
+    while ((de = readdir(d)) != NULL) {
+        if (strcmp(de->d_name, ".") == 0 || strcmp(de->d_name, "..") == 0)
+            continue;
+        char path[1024];
+        snprintf(path, sizeof(path), "%s/%s", dir, de->d_name);
+        if (unlink(path) < 0)
+            TestRemoveDir(path);
+    }
+    closedir(d);
+    rmdir(dir);
+}
+
+
+/*
+ *  Write PSID files
+ */
+
+bool TestWritePSID(const char *file, uint16 load_adr, uint16 init_adr, uint16 play_adr, int songs, const uint8 *code, size_t length)
+{
+    uint8 h[0x7c];
+    memset(h, 0, sizeof(h));
+    memcpy(h, "PSID", 4);
+    h[5] = 2;                        // Version
+    h[7] = sizeof(h);                // Header length
+    h[8] = load_adr >> 8; h[9] = load_adr;
+    h[10] = init_adr >> 8; h[11] = init_adr;
+    h[12] = play_adr >> 8; h[13] = play_adr;
+    h[15] = songs;
+    h[17] = 1;                        // Default song
+    strcpy((char *)h + 22, "Test");
+
+    FILE *f = fopen(file, "wb");
+    if (f == NULL)
+        return false;
+    bool ok = fwrite(h, 1, sizeof(h), f) == sizeof(h) && fwrite(code, 1, length, f) == length;
+    return fclose(f) == 0 && ok;
+}
+
+bool TestWriteSweepPSID(const char *file)
+{
+    static const uint8 code[] = {
+        // Init at $1000: volume, envelope, frequency and sawtooth of voice 1
+        0xa9, 0x0f, 0x8d, 0x18, 0xd4,    // lda #$0f, sta $d418
+        0xa9, 0x09, 0x8d, 0x05, 0xd4,    // lda #$09, sta $d405
+        0xa9, 0xf0, 0x8d, 0x06, 0xd4,    // lda #$f0, sta $d406
+        0xa9, 0x11, 0x8d, 0x00, 0xd4,    // lda #$11, sta $d400
+        0xa9, 0x25, 0x8d, 0x01, 0xd4,    // lda #$25, sta $d401
+        0xa9, 0x21, 0x8d, 0x04, 0xd4,    // lda #$21, sta $d404
+        0x60,                            // rts
+
+        // Play at $101f: sweep frequency
+        0xe6, 0xfb,                        // inc $fb
+        0xa5, 0xfb,                        // lda $fb
+        0x8d, 0x01, 0xd4,                // sta $d401
+        0x60                            // rts
+    };
+    return TestWritePSID(file, 0x1000, 0x1000, 0x101f, 1, code, sizeof(code));
+}
+
+
+/*
+ *  Write zip archive
+ */
+
+static uint32 test_crc32(const uint8 *p, size_t len)
+{
+    uint32 crc = 0xffffffff;
+    while (len--) {
+        int i;
+        crc ^= *p++;
+        for (i=0; i<8; i++)
+            crc = (crc >> 1) ^ (0xedb88320 & -(crc & 1));
+    }
+    return crc ^ 0xffffffff;
+}
+
+static void put_le(uint8 *p, uint32 x, int bytes)
+{
+    while (bytes--) {
+        *p++ = x;
+        x >>= 8;
+    }
+}
+
+bool TestWriteZip(const char *file, const char *member, const uint8 *data, size_t length)
+{
+    uint32 name_length = strlen(member), crc = test_crc32(data, length);
+    uint8 local[30], central[46], end[22];
+    memset(local, 0, sizeof(local));
+    memset(central, 0, sizeof(central));
+    memset(end, 0, sizeof(end));
+
+    put_le(local, 0x04034b50, 4);
+    put_le(local + 4, 20, 2);            // Version needed
+    put_le(local + 14, crc, 4);
+    put_le(local + 18, length, 4);        // Stored
+    put_le(local + 22, length, 4);
+    put_le(local + 26, name_length, 2);
+
+    put_le(central, 0x02014b50, 4);
+    put_le(central + 4, 20, 2);
+    put_le(central + 6, 20, 2);
+    put_le(central + 16, crc, 4);
+    put_le(central + 20, length, 4);
+    put_le(central + 24, length, 4);
+    put_le(central + 28, name_length, 2);
+
+    put_le(end, 0x06054b50, 4);
+    put_le(end + 8, 1, 2);
+    put_le(end + 10, 1, 2);
+    put_le(end + 12, sizeof(central) + name_length, 4);
+    put_le(end + 16, sizeof(local) + name_length + length, 4);
+
+    FILE *f = fopen(file, "wb");
+    if (f == NULL)
+        return false;
+    bool ok = fwrite(local, 1, sizeof(local), f) == sizeof(local)
+           && fwrite(member, 1, name_length, f) == name_length
+           && fwrite(data, 1, length, f) == length
+           && fwrite(central, 1, sizeof(central), f) == sizeof(central)
+           && fwrite(member, 1, name_length, f) == name_length
+           && fwrite(end, 1, sizeof(end), f) == sizeof(end);
+    return fclose(f) == 0 && ok;
+}
@@ -0,0 +1,72 @@
+/*
+ *  test.h - Helpers for the test programs
+ *
+ *  SIDPlayer (C) Copyright 1996-2004 Christian Bauer
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#ifndef TEST_H
+#define TEST_H
+
+#include "../types.h"
+
+#include <stdio.h>
+#include <stddef.h>
+
+
+/*
+ *  Definitions
+ */
+
+// Number of failed checks
+extern int test_failures;
+
+// Check condition, report failure with source position
+#define CHECK(cond) do { \
+    if (!(cond)) { \
+        fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #cond); \
+        test_failures++; \
+    } \
+} while (0)
+
+
+/*
+ *  Functions
+ */
+
+// Init emulator and preferences with default values
+extern void TestInit(const char *prg_name);
+
+// Exit emulator, returns exit code of test program (0 = all checks passed)
+extern int TestExit(const char *prg_name);
+
+// Create temporary directory, returns its path (static buffer)
+extern const char *TestTempDir();
+
+// Remove temporary directory and all files in it
+extern void TestRemoveDir(const char *dir);
+
+// Write PSID file with code loaded at load_adr, returns false on error
+extern bool TestWritePSID(const char *file, uint16 load_adr, uint16 init_adr, uint16 play_adr, int songs, const uint8 *code, size_t length);
+
+// Write PSID file of a small tune (one voice sweeping its frequency),
+// returns false on error
+extern bool TestWriteSweepPSID(const char *file);
+
+// Write zip archive holding one stored file, returns false on error
+extern bool TestWriteZip(const char *file, const char *member, const uint8 *data, size_t length);
+
+#endif
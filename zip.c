@@ -0,0 +1,537 @@
+/*
+ *  zip.c - Reading files from zip archives
+ *
+ *  SIDPlayer (C) Copyright 1996-2004 Christian Bauer
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+
+/*
+ *  The archive is mapped read-only and its central directory is read once
+ *  into an index sorted by the hash of the path, so finding a file doesn't
+ *  scan the directory. Files are extracted on demand, either stored or
+ *  compressed with deflate (RFC 1951), and checked against their CRC.
+ *  Zip64 archives and encrypted files are not supported.
+ */
+
+#include "sys.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+
+#include "zip.h"
+
+
+// Signatures of zip structures
+#define LOCAL_HEADER_SIG 0x04034b50
+#define CENTRAL_HEADER_SIG 0x02014b50
+#define END_HEADER_SIG 0x06054b50
+
+// Sizes of fixed parts of zip structures
+#define LOCAL_HEADER_SIZE 30
+#define CENTRAL_HEADER_SIZE 46
+#define END_HEADER_SIZE 22
+
+// Compression methods
+enum {
+    METHOD_STORED = 0,
+    METHOD_DEFLATE = 8
+};
+
+// File of archive
+typedef struct zip_entry zip_entry;
+struct zip_entry {
+    uint64 hash;                // Hash of path
+    const char *name;            // Path (in mapped central directory, not 0-terminated)
+    uint32 name_length;
+    uint32 offset;                // Position of local header
+    uint32 compressed_size;
+    uint32 size;
+    uint32 crc;
+    uint16 method;
+};
+
+struct zip_archive {
+    const uint8 *map;            // Mapped file
+    size_t map_size;
+    zip_entry *entries;            // Sorted by hash
+    int num_entries;
+};
+
+// Decompressor state
+typedef struct inflate_state inflate_state;
+struct inflate_state {
+    const uint8 *src, *src_end;
+    uint32 bits;                // Bit buffer
+    int num_bits;
+    uint8 *dst;
+    uint32 dst_pos, dst_size;
+    bool error;                    // Flag: input exhausted or corrupt
+};
+
+// Canonical Huffman code
+#define MAX_CODE_BITS 15
+typedef struct huffman huffman;
+struct huffman {
+    uint16 count[MAX_CODE_BITS + 1];    // Number of codes of each length
+    uint16 symbol[288];                    // Symbols ordered by code
+};
+
+static const uint16 length_base[29] = {
+    3, 4, 5, 6, 7, 8, 9, 10, 11, 13, 15, 17, 19, 23, 27, 31,
+    35, 43, 51, 59, 67, 83, 99, 115, 131, 163, 195, 227, 258
+};
+static const uint8 length_extra[29] = {
+    0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2,
+    3, 3, 3, 3, 4, 4, 4, 4, 5, 5, 5, 5, 0
+};
+static const uint16 dist_base[30] = {
+    1, 2, 3, 4, 5, 7, 9, 13, 17, 25, 33, 49, 65, 97, 129, 193,
+    257, 385, 513, 769, 1025, 1537, 2049, 3073, 4097, 6145, 8193, 12289, 16385, 24577
+};
+static const uint8 dist_extra[30] = {
+    0, 0, 0, 0, 1, 1, 2, 2, 3, 3, 4, 4, 5, 5, 6, 6,
+    7, 7, 8, 8, 9, 9, 10, 10, 11, 11, 12, 12, 13, 13
+};
+
+static uint32 crc_table[256];
+static bool crc_table_done = false;
+
+
+/*
+ *  Little-endian values of zip structures
+ */
+
+static inline uint16 get16(const uint8 *p)
+{
+    return p[0] | (p[1] << 8);
+}
+
+static inline uint32 get32(const uint8 *p)
+{
+    return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32)p[3] << 24);
+}
+
+
+/*
+ *  64-bit FNV-1a hash of path
+ */
+
+static uint64 hash_path(const char *path, size_t length)
+{
+    uint64 h = 0xcbf29ce484222325ULL;
+    while (length--) {
+        h ^= (uint8)*path++;
+        h *= 0x100000001b3ULL;
+    }
+    return h;
+}
+
+
+/*
+ *  Open/close archive
+ */
+
+static int compare_entries(const void *a, const void *b)
+{
+    const zip_entry *x = a, *y = b;
+    if (x->hash != y->hash)
+        return x->hash < y->hash ? -1 : 1;
+    return 0;
+}
+
+zip_archive *ZipOpen(const char *file)
+{
+    int fd = open(file, O_RDONLY);
+    if (fd < 0)
+        return NULL;
+    zip_archive *z = calloc(1, sizeof(zip_archive));
+    struct stat st;
+    if (z == NULL || fstat(fd, &st) < 0 || st.st_size < END_HEADER_SIZE) {
+        close(fd);
+        free(z);
+        return NULL;
+    }
+    void *map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        free(z);
+        return NULL;
+    }
+    z->map = map;
+    z->map_size = st.st_size;
+
+    // Find end of central directory record (followed by a comment of up to 64K)
+    const uint8 *end = NULL, *p;
+    size_t pos = z->map_size - END_HEADER_SIZE, comment;
+    for (comment=0; comment<=0xffff; comment++, pos--) {
+        p = z->map + pos;
+        if (get32(p) == END_HEADER_SIG && get16(p + 20) == comment) {
+            end = p;
+            break;
+        }
+        if (pos == 0)
+            break;
+    }
+    if (end == NULL)
+        goto error;
+    int num = get16(end + 10);
+    uint32 dir_size = get32(end + 12), dir_offset = get32(end + 16);
+    if ((uint64)dir_offset + dir_size > z->map_size)
+        goto error;
+
+    // Read central directory
+    z->entries = malloc((num ? num : 1) * sizeof(zip_entry));
+    if (z->entries == NULL)
+        goto error;
+    const uint8 *dir_end = z->map + dir_offset + dir_size;
+    p = z->map + dir_offset;
+    int i;
+    for (i=0; i<num; i++) {
+        if (p + CENTRAL_HEADER_SIZE > dir_end || get32(p) != CENTRAL_HEADER_SIG)
+            goto error;
+        uint32 name_length = get16(p + 28);
+        const uint8 *next = p + CENTRAL_HEADER_SIZE + name_length + get16(p + 30) + get16(p + 32);
+        if (next > dir_end)
+            goto error;
+
+        // Skip directories and encrypted files
+        const char *name = (const char *)p + CENTRAL_HEADER_SIZE;
+        if (name_length && name[name_length - 1] != '/' && !(get16(p + 8) & 1)) {
+            zip_entry *e = z->entries + z->num_entries++;
+            e->name = name;
+            e->name_length = name_length;
+            e->hash = hash_path(name, name_length);
+            e->method = get16(p + 10);
+            e->crc = get32(p + 16);
+            e->compressed_size = get32(p + 20);
+            e->size = get32(p + 24);
+            e->offset = get32(p + 42);
+        }
+        p = next;
+    }
+    qsort(z->entries, z->num_entries, sizeof(zip_entry), compare_entries);
+    return z;
+
+error:
+    ZipClose(z);
+    return NULL;
+}
+
+void ZipClose(zip_archive *z)
+{
+    if (z == NULL)
+        return;
+    munmap((void *)z->map, z->map_size);
+    free(z->entries);
+    free(z);
+}
+
+
+/*
+ *  Find file
+ */
+
+int ZipFind(const zip_archive *z, const char *path)
+{
+    size_t length = strlen(path);
+    uint64 hash = hash_path(path, length);
+    int lo = 0, hi = z->num_entries;
+    while (lo < hi) {
+        int mid = (lo + hi) / 2;
+        if (z->entries[mid].hash < hash)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    for (; lo < z->num_entries && z->entries[lo].hash == hash; lo++) {
+        const zip_entry *e = z->entries + lo;
+        if (e->name_length == length && memcmp(e->name, path, length) == 0)
+            return lo;
+    }
+    return -1;
+}
+
+uint32 ZipEntrySize(const zip_archive *z, int n)
+{
+    return z->entries[n].size;
+}
+
+
+/*
+ *  Decompress deflate stream
+ */
+
+static uint32 get_bits(inflate_state *s, int n)
+{
+    while (s->num_bits < n) {
+        if (s->src == s->src_end) {
+            s->error = true;
+            return 0;
+        }
+        s->bits |= (uint32)*s->src++ << s->num_bits;
+        s->num_bits += 8;
+    }
+    uint32 v = s->bits & ((1 << n) - 1);
+    s->bits >>= n;
+    s->num_bits -= n;
+    return v;
+}
+
+// Set up Huffman code from code lengths of symbols, returns false if the
+// lengths are invalid
+static bool build_huffman(huffman *h, const uint8 *lengths, int n)
+{
+    uint16 offset[MAX_CODE_BITS + 1];
+    int i, len, left = 1;
+    memset(h->count, 0, sizeof(h->count));
+    for (i=0; i<n; i++)
+        h->count[lengths[i]]++;
+    for (len=1; len<=MAX_CODE_BITS; len++) {
+        left = (left << 1) - h->count[len];
+        if (left < 0)
+            return false;        // Over-subscribed
+    }
+    offset[1] = 0;
+    for (len=1; len<MAX_CODE_BITS; len++)
+        offset[len + 1] = offset[len] + h->count[len];
+    for (i=0; i<n; i++)
+        if (lengths[i])
+            h->symbol[offset[lengths[i]]++] = i;
+    return true;
+}
+
+static int decode_symbol(inflate_state *s, const huffman *h)
+{
+    int code = 0, first = 0, index = 0, len;
+    for (len=1; len<=MAX_CODE_BITS; len++) {
+        code |= get_bits(s, 1);
+        int count = h->count[len];
+        if (code - count < first)
+            return h->symbol[index + (code - first)];
+        index += count;
+        first = (first + count) << 1;
+        code <<= 1;
+        if (s->error)
+            break;
+    }
+    s->error = true;
+    return 0;
+}
+
+static void inflate_codes(inflate_state *s, const huffman *lit, const huffman *dist)
+{
+    while (!s->error) {
+        int sym = decode_symbol(s, lit);
+        if (sym < 256) {
+            if (s->dst_pos == s->dst_size)
+                break;
+            s->dst[s->dst_pos++] = sym;
+        } else if (sym == 256)
+            return;
+        else {
+            sym -= 257;
+            if (sym >= 29)
+                break;
+            uint32 len = length_base[sym] + get_bits(s, length_extra[sym]);
+            int d = decode_symbol(s, dist);
+            if (d >= 30)
+                break;
+            uint32 offset = dist_base[d] + get_bits(s, dist_extra[d]);
+            if (offset > s->dst_pos || len > s->dst_size - s->dst_pos)
+                break;
+            while (len--) {
+                s->dst[s->dst_pos] = s->dst[s->dst_pos - offset];
+                s->dst_pos++;
+            }
+        }
+    }
+    s->error = true;
+}
+
+static void inflate_stored(inflate_state *s)
+{
+    s->bits = 0;
+    s->num_bits = 0;
+    if (s->src_end - s->src < 4) {
+        s->error = true;
+        return;
+    }
+    uint32 len = get16(s->src);
+    if ((len ^ 0xffff) != get16(s->src + 2) || len > s->src_end - s->src - 4 || len > s->dst_size - s->dst_pos) {
+        s->error = true;
+        return;
+    }
+    memcpy(s->dst + s->dst_pos, s->src + 4, len);
+    s->src += 4 + len;
+    s->dst_pos += len;
+}
+
+static void inflate_fixed(inflate_state *s)
+{
+    static huffman lit, dist;
+    static bool done = false;
+    if (!done) {
+        uint8 lengths[288];
+        int i;
+        for (i=0; i<288; i++)
+            lengths[i] = i < 144 ? 8 : (i < 256 ? 9 : (i < 280 ? 7 : 8));
+        build_huffman(&lit, lengths, 288);
+        for (i=0; i<30; i++)
+            lengths[i] = 5;
+        build_huffman(&dist, lengths, 30);
+        done = true;
+    }
+    inflate_codes(s, &lit, &dist);
+}
+
+static void inflate_dynamic(inflate_state *s)
+{
+    static const uint8 order[19] = {16, 17, 18, 0, 8, 7, 9, 6, 10, 5, 11, 4, 12, 3, 13, 2, 14, 1, 15};
+    uint8 lengths[288 + 32];
+    huffman lit, dist;
+    int i;
+
+    int num_lit = get_bits(s, 5) + 257;
+    int num_dist = get_bits(s, 5) + 1;
+    int num_len = get_bits(s, 4) + 4;
+    if (num_lit > 286 || num_dist > 30) {
+        s->error = true;
+        return;
+    }
+
+    // Code length code
+    memset(lengths, 0, 19);
+    for (i=0; i<num_len; i++)
+        lengths[order[i]] = get_bits(s, 3);
+    if (!build_huffman(&lit, lengths, 19)) {
+        s->error = true;
+        return;
+    }
+
+    // Code lengths of literal/length and distance codes
+    for (i=0; i<num_lit+num_dist && !s->error; ) {
+        int sym = decode_symbol(s, &lit);
+        if (sym < 16) {
+            lengths[i++] = sym;
+            continue;
+        }
+        int len = 0, repeat;
+        if (sym == 16) {
+            if (i == 0)
+                break;
+            len = lengths[i - 1];
+            repeat = 3 + get_bits(s, 2);
+        } else if (sym == 17)
+            repeat = 3 + get_bits(s, 3);
+        else
+            repeat = 11 + get_bits(s, 7);
+        if (i + repeat > num_lit + num_dist)
+            break;
+        while (repeat--)
+            lengths[i++] = len;
+    }
+    if (i < num_lit + num_dist || s->error || lengths[256] == 0
+     || !build_huffman(&lit, lengths, num_lit) || !build_huffman(&dist, lengths + num_lit, num_dist)) {
+        s->error = true;
+        return;
+    }
+    inflate_codes(s, &lit, &dist);
+}
+
+static bool inflate_data(const uint8 *src, size_t src_size, uint8 *dst, uint32 dst_size)
+{
+    inflate_state s;
+    memset(&s, 0, sizeof(s));
+    s.src = src;
+    s.src_end = src + src_size;
+    s.dst = dst;
+    s.dst_size = dst_size;
+
+    bool last;
+    do {
+        last = get_bits(&s, 1);
+        switch (get_bits(&s, 2)) {
+            case 0:
+                inflate_stored(&s);
+                break;
+            case 1:
+                inflate_fixed(&s);
+                break;
+            case 2:
+                inflate_dynamic(&s);
+                break;
+            default:
+                s.error = true;
+                break;
+        }
+    } while (!last && !s.error);
+    return !s.error && s.dst_pos == dst_size;
+}
+
+
+/*
+ *  Extract file
+ */
+
+static uint32 crc32(const uint8 *p, size_t len)
+{
+    if (!crc_table_done) {
+        uint32 i, j;
+        for (i=0; i<256; i++) {
+            uint32 c = i;
+            for (j=0; j<8; j++)
+                c = (c & 1) ? (c >> 1) ^ 0xedb88320 : c >> 1;
+            crc_table[i] = c;
+        }
+        crc_table_done = true;
+    }
+    uint32 crc = 0xffffffff;
+    while (len--)
+        crc = (crc >> 8) ^ crc_table[(crc ^ *p++) & 0xff];
+    return crc ^ 0xffffffff;
+}
+
+bool ZipExtract(const zip_archive *z, int n, uint8 *buf)
+{
+    const zip_entry *e = z->entries + n;
+    const uint8 *p = z->map + e->offset;
+    if ((uint64)e->offset + LOCAL_HEADER_SIZE > z->map_size || get32(p) != LOCAL_HEADER_SIG)
+        return false;
+    uint64 data_offset = (uint64)e->offset + LOCAL_HEADER_SIZE + get16(p + 26) + get16(p + 28);
+    if (data_offset + e->compressed_size > z->map_size)
+        return false;
+    const uint8 *data = z->map + data_offset;
+
+    switch (e->method) {
+        case METHOD_STORED:
+            if (e->compressed_size != e->size)
+                return false;
+            memcpy(buf, data, e->size);
+            break;
+        case METHOD_DEFLATE:
+            if (!inflate_data(data, e->compressed_size, buf, e->size))
+                return false;
+            break;
+        default:
+            return false;
+    }
+    return crc32(buf, e->size) == e->crc;
+}
@@ -0,0 +1,56 @@
+/*
+ *  zip.h - Reading files from zip archives
+ *
+ *  SIDPlayer (C) Copyright 1996-2004 Christian Bauer
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+
+#ifndef ZIP_H
+#define ZIP_H
+
+#include "types.h"
+
+
+/*
+ *  Definitions
+ */
+
+// Opened zip archive
+typedef struct zip_archive zip_archive;
+
+
+/*
+ *  Functions
+ */
+
+// Open zip archive and read its central directory, returns NULL on error
+extern zip_archive *ZipOpen(const char *file);
+
+// Close zip archive
+extern void ZipClose(zip_archive *z);
+
+// Find file in archive by path, returns entry number or -1 if not found
+extern int ZipFind(const zip_archive *z, const char *path);
+
+// Get uncompressed size of file
+extern uint32 ZipEntrySize(const zip_archive *z, int n);
+
+// Extract file to buffer of ZipEntrySize() bytes, returns false if the
+// compression method is not supported or the data is corrupt
+extern bool ZipExtract(const zip_archive *z, int n, uint8 *buf);
+
+#endif